@@ -99,6 +99,14 @@ extern "C" {
         uint64_t purge_seq;         /**< Last Purge sequence number */
     } DbInfo;
 
+    /** Space usage of one fixed-size region of a database file. */
+    typedef struct {
+        cs_off_t offset;            /**< File offset of the start of the region */
+        uint64_t size;              /**< Number of bytes of the file in this region */
+        uint64_t live_bytes;        /**< Bytes used by docs and B-tree nodes of the current header */
+        uint64_t dead_bytes;        /**< Stale bytes that a compaction would reclaim */
+    } DbRegionInfo;
+
 
     /** Opaque reference to an open database. */
     typedef struct _db Db;
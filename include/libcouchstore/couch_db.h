@@ -124,6 +124,49 @@ extern "C" {
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_rewind_db_header(Db *db);
 
+    /**
+     * Open a read-only snapshot of a database as of its last commit.
+     *
+     * The snapshot shares the file of the handle it was opened from, and
+     * reads through a block cache shared by all snapshots of that handle.
+     * Unlike ordinary Db handles, a snapshot may be read from several
+     * threads at once, concurrently with writes and commits made on the
+     * original handle; changes committed after the snapshot was opened are
+     * not visible through it. Any attempt to write through it fails.
+     *
+     * The snapshot must be opened from the thread that owns db, and must be
+     * closed with couchstore_close_db() before db is closed.
+     *
+     * @param db Pointer to the database handle to snapshot.
+     * @param snapshot Pointer to where you want the snapshot handle stored.
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_reader_snapshot(Db *db, Db **snapshot);
+
+    /**
+     * Open a read-only snapshot of a database as of an earlier commit.
+     *
+     * This behaves like couchstore_open_reader_snapshot(), but views the
+     * database as it was when the header at header_pos was written, without
+     * opening the file again or scanning it for headers. Every commit leaves
+     * its header in place, so any position previously returned by
+     * couchstore_get_header_position() remains valid until the file is
+     * compacted.
+     *
+     * @param db Pointer to the database handle to snapshot.
+     * @param header_pos The file position of the header to open.
+     * @param snapshot Pointer to where you want the snapshot handle stored.
+     * @return COUCHSTORE_SUCCESS upon success,
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if header_pos lies beyond the
+     *         handle's current header, or COUCHSTORE_ERROR_NO_HEADER if there
+     *         is no header at header_pos.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_snapshot(Db *db,
+                                                uint64_t header_pos,
+                                                Db **snapshot);
+
     /**
      * Get the default couch_file_ops object
      */
@@ -140,6 +183,41 @@ extern "C" {
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_db_info(Db *db, DbInfo* info);
 
+    /**
+     * Get a breakdown of live and stale bytes across the database file, split
+     * into fixed-size regions, to help decide when and where to compact.
+     *
+     * Only the interior B-tree nodes and the leaves of the by-sequence tree are
+     * read, one path at a time, so memory use doesn't depend on the size of the
+     * database. If sample_every is greater than 1, only every sample_every'th
+     * by-sequence leaf is read and the document bodies it references are
+     * weighted accordingly, which gives a much cheaper estimate.
+     *
+     * The array should be freed with couchstore_free_db_region_info().
+     *
+     * @param db Pointer to the database handle.
+     * @param region_size Size in bytes of each region, or 0 for the default (64MB).
+     * @param sample_every Read one out of this many by-sequence leaves; 0 or 1
+     *                     for exact results.
+     * @param regions Where to store the allocated array of regions.
+     * @param num_regions Where to store the number of entries in the array.
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_db_region_info(Db *db,
+                                                 uint64_t region_size,
+                                                 unsigned sample_every,
+                                                 DbRegionInfo **regions,
+                                                 size_t *num_regions);
+
+    /**
+     * Free an array returned by couchstore_db_region_info().
+     *
+     * @param regions the array to free. May be NULL.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_free_db_region_info(DbRegionInfo *regions);
+
 
     /**
      * Returns the filename of the database, as given when it was opened.
@@ -359,6 +437,79 @@ extern "C" {
     void couchstore_free_docinfo(DocInfo *docinfo);
 
 
+    /*////////////////////  ARENA-ALLOCATED RETRIEVAL: */
+
+    /**
+     * An arena allocator. The *_arena variants of the retrieval functions
+     * allocate their results from one instead of the heap, so that everything
+     * a request handler read is released at once by couchstore_arena_free_all(),
+     * without any couchstore_free_docinfo() or couchstore_free_document() calls.
+     *
+     * An arena must not be used by more than one thread at a time; give each
+     * thread its own.
+     */
+    typedef struct arena couchstore_arena;
+
+    /**
+     * Creates an arena.
+     *
+     * @param chunk_size the size of the memory blocks the arena hands out
+     *        allocations from, or 0 for the default (32KB)
+     * @return the arena, or NULL on an allocation failure. Must be freed with
+     *         couchstore_free_arena().
+     */
+    LIBCOUCHSTORE_API
+    couchstore_arena* couchstore_new_arena(size_t chunk_size);
+
+    /**
+     * Frees an arena, and everything allocated from it.
+     *
+     * @param arena the arena to free. May be NULL.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_free_arena(couchstore_arena *arena);
+
+    /**
+     * Frees everything allocated from an arena, keeping the arena for reuse.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_arena_free_all(couchstore_arena *arena);
+
+    /**
+     * Same as couchstore_docinfo_by_id(), but the info is allocated from an
+     * arena, and must not be freed with couchstore_free_docinfo().
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_docinfo_by_id_arena(Db *db,
+                                                      const void *id,
+                                                      size_t idlen,
+                                                      couchstore_arena *arena,
+                                                      DocInfo **pInfo);
+
+    /**
+     * Same as couchstore_open_doc_with_docinfo(), but the doc is allocated
+     * from an arena, and must not be freed with couchstore_free_document().
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_doc_with_docinfo_arena(Db *db,
+                                                              DocInfo *docinfo,
+                                                              couchstore_arena *arena,
+                                                              Doc **pDoc,
+                                                              couchstore_open_options options);
+
+    /**
+     * Same as couchstore_open_document(), but the doc is allocated from an
+     * arena, and must not be freed with couchstore_free_document().
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_document_arena(Db *db,
+                                                      const void *id,
+                                                      size_t idlen,
+                                                      couchstore_arena *arena,
+                                                      Doc **pDoc,
+                                                      couchstore_open_options options);
+
+
     /*////////////////////  ITERATING DOCUMENTS: */
 
     /**
@@ -690,6 +841,32 @@ extern "C" {
                                                 const couch_file_ops *ops);
 
 
+    /**
+     * Replay changes made to a database while it was being compacted.
+     *
+     * The compactor gives the target the update_seq of the source header it
+     * started from, so every by-sequence entry in the source newer than the
+     * target's update_seq is copied over (document bodies included, exactly as
+     * stored) and the target is committed. Local documents are not replayed.
+     *
+     * This is meant to be called repeatedly while the source is still taking
+     * writes, each time with a source handle that sees the latest header, until
+     * remaining is small enough to block writers, do a final unbounded call
+     * and switch over to the target.
+     *
+     * @param source the database that was compacted
+     * @param target the compacted database, opened read/write
+     * @param max_items maximum number of changes to replay, or 0 for all of them
+     * @param remaining if not NULL, set to the number of source changes still
+     *                  not replayed into the target
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_compact_catchup(Db* source, Db* target,
+                                                  uint64_t max_items,
+                                                  uint64_t *remaining);
+
+
     /*////////////////////  MISC: */
 
     /**
@@ -730,6 +907,26 @@ extern "C" {
                                                  uint64_t max_seq,
                                                  uint64_t *count);
 
+     /**
+      * Counts the number of changes in each of several ranges of sequence
+      * numbers at once. The ranges may overlap and need not be sorted; they
+      * are all answered in a single pass down the by-sequence tree, which is
+      * much cheaper than calling couchstore_changes_count for each one.
+      *
+      * @param db The db to count changes in
+      * @param min_seqs Array of num_ranges minimum sequences to count
+      * @param max_seqs Array of num_ranges maximum sequences to count
+      * @param num_ranges The number of ranges
+      * @param counts Array of num_ranges uint64_t to store the counts in
+      * @return COUCHSTORE_SUCCESS on success
+      */
+     LIBCOUCHSTORE_API
+     couchstore_error_t couchstore_changes_count_multi(Db* db,
+                                                       const uint64_t *min_seqs,
+                                                       const uint64_t *max_seqs,
+                                                       size_t num_ranges,
+                                                       uint64_t *counts);
+
 #ifdef __cplusplus
 }
 #endif
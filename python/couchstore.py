@@ -448,6 +448,18 @@ class CouchStore(object):
         _check(err)
         return cstruct.count
 
+    def changesCountMulti(self, ranges):
+        """Returns the number of changes in each of a list of (minimum, maximum)
+        sequence ranges, counted in a single pass."""
+        n = len(ranges)
+        mins = (ctypes.c_uint64 * n)(*[r[0] for r in ranges])
+        maxes = (ctypes.c_uint64 * n)(*[r[1] for r in ranges])
+        counts = (ctypes.c_uint64 * n)()
+        _check(_lib.couchstore_changes_count_multi(self, mins, maxes,
+                                                   ctypes.c_size_t(n),
+                                                   counts))
+        return list(counts)
+
     @property
     def localDocs(self):
         """A simple dictionary-like object that accesses the CouchStore's local
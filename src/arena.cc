@@ -18,9 +18,17 @@
 #define DEFAULT_CHUNK_SIZE 32768    // Used if 0 is passed to new_arena
 #define LOG_STATS 0                 // Set to 1 to log info about allocations when arenas are freed
 
+// The chunk pool keeps freed chunks on a free list per power-of-two size
+// class, from 2^POOL_MIN_CLASS up to 2^(POOL_MIN_CLASS + POOL_NUM_CLASSES)
+// bytes; bigger chunks go straight back to malloc.
+#define POOL_MIN_CLASS 12
+#define POOL_NUM_CLASSES 12
+#define POOL_MAX_BYTES (64 * 1024 * 1024)   // Chunks past this are freed rather than pooled
+
 typedef struct arena_chunk {
-    struct arena_chunk* prev_chunk; // Link to previous chunk
+    struct arena_chunk* prev_chunk; // Link to previous chunk (or next free one, in the pool)
     size_t size;                    // Size of available bytes after this header
+    size_t used;                    // Bytes allocated from it, once it's no longer current
 } arena_chunk;
 
 
@@ -28,7 +36,11 @@ struct arena {
     char* next_block;           // Next block to be allocated in cur_chunk (if there's room)
     char* end;                  // End of the current chunk; can't allocate past here
     arena_chunk* cur_chunk;     // The current chunk
-    size_t chunk_size;          // The size of chunks to allocate, as passed to new_arena
+    size_t chunk_size;          // The size of the next chunk to allocate
+    size_t min_chunk_size;      // The size of the first chunk, as passed to new_arena
+    size_t max_chunk_size;      // Chunks double in size up to this
+    size_t prev_chunks_used;    // Bytes allocated from the chunks before cur_chunk
+    arena_stats stats;          // bytes_allocated is only brought up to date on demand
 #ifdef DEBUG
     int blocks_allocated;       // Number of blocks allocated
     size_t bytes_allocated;     // Number of bytes allocated
@@ -48,6 +60,132 @@ static inline void* chunk_end(arena_chunk* chunk)
     return (char*)chunk_start(chunk) + chunk->size;
 }
 
+//////// CHUNK POOL:
+
+
+// Freed chunks, shared by all arenas
+class ChunkPool {
+public:
+    ChunkPool() : bytes(0), destroyed(false) {
+        memset(free_chunks, 0, sizeof(free_chunks));
+        cb_mutex_initialize(&mutex);
+    }
+    ~ChunkPool() {
+        cb_mutex_enter(&mutex);
+        for (int i = 0; i < POOL_NUM_CLASSES; ++i) {
+            free_list(free_chunks[i]);
+            free_chunks[i] = NULL;
+        }
+        bytes = 0;
+        destroyed = true;   // arenas deleted after this just free their chunks
+        cb_mutex_exit(&mutex);
+    }
+
+    // Returns a chunk of at least 'size' bytes, or NULL if there's none.
+    arena_chunk* take(size_t size) {
+        int cls = size_class(sizeof(arena_chunk) + size);
+        arena_chunk* chunk = NULL;
+        if (cls < 0) {
+            return NULL;
+        }
+        cb_mutex_enter(&mutex);
+        // First fit in the chunk's own class, else any from the next one
+        for (arena_chunk** p = &free_chunks[cls]; *p; p = &(*p)->prev_chunk) {
+            if ((*p)->size >= size) {
+                chunk = *p;
+                *p = chunk->prev_chunk;
+                break;
+            }
+        }
+        if (!chunk && cls + 1 < POOL_NUM_CLASSES && free_chunks[cls + 1]) {
+            chunk = free_chunks[cls + 1];
+            free_chunks[cls + 1] = chunk->prev_chunk;
+        }
+        if (chunk) {
+            bytes -= sizeof(arena_chunk) + chunk->size;
+        }
+        cb_mutex_exit(&mutex);
+        return chunk;
+    }
+
+    // Keeps a chunk for reuse, or frees it if the pool is full.
+    void put(arena_chunk* chunk) {
+        size_t total = sizeof(arena_chunk) + chunk->size;
+        int cls = size_class(total);
+        if (cls >= 0) {
+            cb_mutex_enter(&mutex);
+            if (!destroyed && bytes + total <= POOL_MAX_BYTES) {
+                chunk->prev_chunk = free_chunks[cls];
+                free_chunks[cls] = chunk;
+                bytes += total;
+                chunk = NULL;
+            }
+            cb_mutex_exit(&mutex);
+        }
+        free(chunk);
+    }
+
+private:
+    // Index of the free list for chunks of 'total' bytes, header included,
+    // or -1 if they aren't pooled
+    static int size_class(size_t total) {
+        int log2 = 0;
+        while (total >>= 1) {
+            ++log2;
+        }
+        if (log2 < POOL_MIN_CLASS || log2 >= POOL_MIN_CLASS + POOL_NUM_CLASSES) {
+            return -1;
+        }
+        return log2 - POOL_MIN_CLASS;
+    }
+
+    static void free_list(arena_chunk* chunk) {
+        while (chunk) {
+            arena_chunk* next = chunk->prev_chunk;
+            free(chunk);
+            chunk = next;
+        }
+    }
+
+    cb_mutex_t mutex;
+    arena_chunk* free_chunks[POOL_NUM_CLASSES];
+    size_t bytes;
+    bool destroyed;
+};
+
+static ChunkPool chunk_pool;
+
+
+//////// ARENAS:
+
+
+// Returns the number of bytes currently allocated from an arena.
+static size_t bytes_in_use(const arena* a)
+{
+    if (!a->cur_chunk) {
+        return 0;
+    }
+    // next_block may have been bumped past the end by a failed allocation
+    char* next = a->next_block < a->end ? a->next_block : a->end;
+    return a->prev_chunks_used + (next - (char*)chunk_start(a->cur_chunk));
+}
+
+static void update_peak(arena* a)
+{
+    size_t used = bytes_in_use(a);
+    if (used > a->stats.peak_bytes_allocated) {
+        a->stats.peak_bytes_allocated = used;
+    }
+}
+
+// Hands a chunk the arena is done with to the pool.
+static void release_chunk(arena* a, arena_chunk* chunk)
+{
+    a->stats.chunk_bytes -= chunk->size;
+    --a->stats.chunks;
+    chunk_pool.put(chunk);
+}
+
 // Allocates a new chunk, attaches it to the arena, and allocates 'size' bytes from it.
 static void* add_chunk(arena* a, size_t size)
 {
@@ -55,33 +193,69 @@ static void* add_chunk(arena* a, size_t size)
     if (size > chunk_size) {
         chunk_size = size;  // make sure the new chunk is big enough to fit 'size' bytes
     }
-    arena_chunk* chunk;
-    chunk = static_cast<arena_chunk*>(malloc(sizeof(arena_chunk) + chunk_size));
-    if (!chunk) {
-        return NULL;
+    arena_chunk* chunk = chunk_pool.take(chunk_size);
+    if (chunk) {
+        ++a->stats.chunks_recycled;
+    } else {
+        chunk = static_cast<arena_chunk*>(malloc(sizeof(arena_chunk) + chunk_size));
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+    }
+    if (a->cur_chunk) {
+        // The block that didn't fit was counted into next_block
+        a->cur_chunk->used = (a->next_block - size) - (char*)chunk_start(a->cur_chunk);
+        a->prev_chunks_used += a->cur_chunk->used;
     }
     chunk->prev_chunk = a->cur_chunk;
-    chunk->size = chunk_size;
+    ++a->stats.chunks;
+    ++a->stats.chunks_added;
+    a->stats.chunk_bytes += chunk->size;
+    if (a->chunk_size < a->max_chunk_size) {
+        // Double the chunk, header included, so it stays a multiple of pages
+        a->chunk_size = 2 * (a->chunk_size + sizeof(arena_chunk)) - sizeof(arena_chunk);
+        if (a->chunk_size > a->max_chunk_size) {
+            a->chunk_size = a->max_chunk_size;
+        }
+    }
 
     void* result = chunk_start(chunk);
     a->next_block = (char*)result + size;
     a->end = static_cast<char*>(chunk_end(chunk));
     a->cur_chunk = chunk;
+    update_peak(a);
     return result;
 }
 
 
+// Size of the contents of a chunk of the given size (0 for the default).
+static size_t chunk_contents_size(size_t chunk_size)
+{
+    if (chunk_size == 0) {
+        chunk_size = DEFAULT_CHUNK_SIZE;
+    } else {
+        chunk_size += sizeof(arena_chunk);
+        chunk_size = (chunk_size + PAGE_SIZE) & ~(PAGE_SIZE - 1);   // round up to multiple
+    }
+    return chunk_size - sizeof(arena_chunk);
+}
+
 arena* new_arena(size_t chunk_size)
+{
+    return new_arena_ex(chunk_size, 0);
+}
+
+arena* new_arena_ex(size_t chunk_size, size_t max_chunk_size)
 {
     arena* a = static_cast<arena*>(calloc(1, sizeof(arena)));
     if (a) {
-        if (chunk_size == 0) {
-            chunk_size = DEFAULT_CHUNK_SIZE;
-        } else {
-            chunk_size += sizeof(arena_chunk);
-            chunk_size = (chunk_size + PAGE_SIZE) & ~(PAGE_SIZE - 1);   // round up to multiple
+        a->chunk_size = chunk_contents_size(chunk_size);
+        a->min_chunk_size = a->chunk_size;
+        a->max_chunk_size = a->chunk_size;
+        if (max_chunk_size > chunk_size) {
+            a->max_chunk_size = chunk_contents_size(max_chunk_size);
         }
-        a->chunk_size = chunk_size - sizeof(arena_chunk);
     }
     return a;
 }
@@ -97,9 +271,9 @@ void delete_arena(arena* a)
 #ifdef DEBUG
         total_allocated += chunk->size;
 #endif
-        void* to_free = chunk;
+        arena_chunk* to_free = chunk;
         chunk = chunk->prev_chunk;
-        free(to_free);
+        release_chunk(a, to_free);
     }
 #if LOG_STATS
     fprintf(stderr, "delete_arena: %zd bytes malloced for %zd bytes of data in %d blocks (%.0f%%)\n",
@@ -135,6 +309,23 @@ void* arena_alloc(arena* a, size_t size)
     return (char*)arena_alloc_unaligned(a, size + padding) + padding;
 }
 
+void* arena_alloc_aligned(arena* a, size_t size, size_t alignment)
+{
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    size_t padding = (size_t)(-(intptr_t)a->next_block & (alignment - 1));
+    if (a->next_block && a->next_block <= a->end &&
+            size + padding <= (size_t)(a->end - a->next_block) &&
+            size + padding <= a->chunk_size) {
+        return (char*)arena_alloc_unaligned(a, size + padding) + padding;
+    }
+    // The block goes in a new chunk, whose contents are only word-aligned
+    char* block = static_cast<char*>(arena_alloc_unaligned(a, size + alignment - 1));
+    if (!block) {
+        return NULL;
+    }
+    return block + (-(intptr_t)block & (alignment - 1));
+}
+
 void arena_free(arena* a, void* block)
 {
 #ifdef DEBUG
@@ -162,13 +353,20 @@ const arena_position* arena_mark(arena *a)
 
 void arena_free_from_mark(arena *a, const arena_position *mark)
 {
+    update_peak(a);
     arena_chunk* chunk = a->cur_chunk;
     while (chunk && ((void*)mark < chunk_start(chunk) || (void*)mark > chunk_end(chunk))) {
         a->cur_chunk = chunk->prev_chunk;
-        free(chunk);
+        release_chunk(a, chunk);
         chunk = a->cur_chunk;
+        if (chunk) {
+            a->prev_chunks_used -= chunk->used;
+        }
     }
     assert(chunk != NULL || mark == NULL);   // If this fails, mark was bogus
+    if (!chunk) {
+        a->chunk_size = a->min_chunk_size;   // start growing all over again
+    }
 
     a->next_block = static_cast<char*>((void*)mark);
     a->end = static_cast<char*>(chunk ? chunk_end(chunk) : NULL);
@@ -182,3 +380,10 @@ void arena_free_all(arena *a)
 {
     arena_free_from_mark(a, NULL);
 }
+
+void arena_get_stats(arena *a, arena_stats *stats)
+{
+    update_peak(a);
+    a->stats.bytes_allocated = bytes_in_use(a);
+    *stats = a->stats;
+}
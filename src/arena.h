@@ -21,6 +21,16 @@ typedef struct arena arena;
 /** Saved position/state of an arena. */
 typedef struct arena_position arena_position;
 
+/** Memory usage counters of an arena. */
+typedef struct arena_stats {
+    size_t bytes_allocated;         /**< Bytes allocated and not yet freed, padding included */
+    size_t peak_bytes_allocated;    /**< Highest bytes_allocated has been */
+    size_t chunk_bytes;             /**< Bytes of the chunks currently held */
+    size_t chunks;                  /**< Number of chunks currently held */
+    size_t chunks_added;            /**< Chunks taken on over the arena's lifetime... */
+    size_t chunks_recycled;         /**< ...of which were reused rather than malloced */
+} arena_stats;
+
 /**
  * Creates a new arena allocator.
  * @param chunk_size The size of the memory blocks the allocator sub-allocates from malloc. Pass 0 for the default (32kbytes).
@@ -28,8 +38,20 @@ typedef struct arena_position arena_position;
  */
 arena* new_arena(size_t chunk_size);
 
+/**
+ * Creates a new arena allocator whose chunks grow: each chunk is twice the size of the
+ * previous one, up to max_chunk_size, and they start over from chunk_size once the arena
+ * is emptied. Suits arenas that are used for anything from a handful of blocks to lots.
+ * @param chunk_size The size of the first chunk. Pass 0 for the default (32kbytes).
+ * @param max_chunk_size The size chunks stop growing at.
+ * @return The new arena object.
+ */
+arena* new_arena_ex(size_t chunk_size, size_t max_chunk_size);
+
 /**
  * Deletes an arena and all of its memory allocations.
+ * Chunks freed by this, arena_free_from_mark or arena_free_all go to a pool shared by all
+ * arenas, which new chunks are taken from before resorting to malloc.
  */
 void delete_arena(arena*);
 
@@ -41,6 +63,19 @@ void delete_arena(arena*);
  */
 void* arena_alloc(arena*, size_t size);
 
+/** The alignment malloc gives blocks, which suits any struct. */
+#define ARENA_MALLOC_ALIGNMENT (2 * sizeof(void*))
+
+/**
+ * Allocates memory from an arena with a stricter alignment than arena_alloc's, such as
+ * ARENA_MALLOC_ALIGNMENT for structs that are handed out in place of malloced ones.
+ * @param arena The arena to allocate from
+ * @param size The number of bytes to allocate
+ * @param alignment The byte alignment of the block; must be a power of 2
+ * @return A pointer to the allocated block, or NULL on failure.
+ */
+void* arena_alloc_aligned(arena*, size_t size, size_t alignment);
+
 /**
  * Allocates unaligned memory from an arena.
  * Saves a couple of bytes if your block doesn't need to be word-aligned.
@@ -72,6 +107,11 @@ void arena_free_from_mark(arena *a, const arena_position *mark);
  */
 void arena_free_all(arena *a);
 
+/**
+ * Gets an arena's memory usage counters.
+ */
+void arena_get_stats(arena *a, arena_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,730 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for fopencookie and O_DIRECT
+#endif
+#include "config.h"
+#include "buffered_file.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <snappy.h>
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Uncompressed size of a block. Each block is stored as its compressed
+// length (32 bit, big endian) followed by its snappy compressed data.
+#define COMPRESSED_BLOCK_SIZE (64 * 1024)
+
+enum {
+    MODE_NONE,
+    MODE_READ,
+    MODE_WRITE
+};
+
+// State of the read-ahead buffer
+enum {
+    SPARE_EMPTY,
+    SPARE_FULL,
+    SPARE_EOF,
+    SPARE_ERROR
+};
+
+typedef struct {
+    int fd;
+    int direct;             // fd was opened with O_DIRECT
+    int writable;
+    int flags;
+    size_t buffer_size;
+    char *buf;              // the buffer being read from, or filled
+    size_t buf_used;        // bytes of data in buf
+    size_t buf_pos;         // next byte of buf to read
+    int mode;
+    int truncate;           // the next write replaces the file's contents
+    int eof;                // nothing left to read after buf
+    int64_t offset;         // file offset of the next read or write
+
+    // Read-ahead: the thread fills spare from spare_offset while buf is
+    // being read from, and the two are swapped when buf runs out.
+    char *spare;
+    size_t spare_used;
+    int spare_state;
+    int spare_last;         // spare ends at the end of the file
+    int64_t spare_offset;
+    int sync_initialized;   // mutex and cond
+    int thread_running;
+    int stop;
+    cb_thread_t thread;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+
+    // Compression
+    char *block;            // the block being filled, or read from
+    size_t block_used;      // bytes of data in block
+    size_t block_pos;       // next byte of block to read
+    char *compressed;       // compressed form of a block
+    size_t compressed_size; // capacity of compressed
+
+    int64_t pos;            // position in the (uncompressed) stream
+} buffered_file;
+
+static ssize_t pread_full(buffered_file *bf, char *buf, size_t size, int64_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(bf->fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+        // A short read is the end of the file, and reading on from an
+        // unaligned offset would fail rather than return 0
+        if (bf->direct && done % BUFFERED_FILE_ALIGNMENT != 0) {
+            break;
+        }
+    }
+
+    return (ssize_t) done;
+}
+
+static int pwrite_full(buffered_file *bf, const char *buf, size_t size, int64_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pwrite(bf->fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+// O_DIRECT needs aligned offsets, so it's given up on once the file is to be
+// written at an unaligned one.
+static void disable_direct(buffered_file *bf)
+{
+#ifdef O_DIRECT
+    if (bf->direct) {
+        int fl = fcntl(bf->fd, F_GETFL);
+        if (fl != -1) {
+            fcntl(bf->fd, F_SETFL, fl & ~O_DIRECT);
+        }
+        bf->direct = 0;
+    }
+#endif
+}
+
+static void readahead_thread(void *arg)
+{
+    buffered_file *bf = (buffered_file *) arg;
+
+    cb_mutex_enter(&bf->mutex);
+    while (!bf->stop) {
+        int64_t offset;
+        ssize_t n;
+
+        if (bf->spare_state != SPARE_EMPTY) {
+            cb_cond_wait(&bf->cond, &bf->mutex);
+            continue;
+        }
+        offset = bf->spare_offset;
+        cb_mutex_exit(&bf->mutex);
+        n = pread_full(bf, bf->spare, bf->buffer_size, offset);
+        cb_mutex_enter(&bf->mutex);
+        if (n < 0) {
+            bf->spare_state = SPARE_ERROR;
+        } else if (n == 0) {
+            bf->spare_state = SPARE_EOF;
+        } else {
+            bf->spare_used = (size_t) n;
+            bf->spare_offset += n;
+            bf->spare_last = (size_t) n < bf->buffer_size;
+            bf->spare_state = SPARE_FULL;
+        }
+        cb_cond_broadcast(&bf->cond);
+        if (bf->spare_state != SPARE_FULL || bf->spare_last) {
+            break;
+        }
+    }
+    cb_mutex_exit(&bf->mutex);
+}
+
+static void stop_readahead(buffered_file *bf)
+{
+    if (!bf->thread_running) {
+        return;
+    }
+    cb_mutex_enter(&bf->mutex);
+    bf->stop = 1;
+    cb_cond_broadcast(&bf->cond);
+    cb_mutex_exit(&bf->mutex);
+    cb_join_thread(bf->thread);
+    bf->thread_running = 0;
+    bf->stop = 0;
+    bf->spare_state = SPARE_EMPTY;
+}
+
+// Reads the next buffer in. Returns 1, 0 at the end of the file, or -1.
+static int fill_buffer(buffered_file *bf)
+{
+    ssize_t n;
+
+    if (bf->eof) {
+        return 0;
+    }
+
+    if (bf->flags & BUFFERED_FILE_READAHEAD) {
+        char *tmp;
+
+        if (!bf->thread_running) {
+            bf->spare_offset = bf->offset;
+            bf->spare_state = SPARE_EMPTY;
+            if (cb_create_thread(&bf->thread, readahead_thread, bf, 0) < 0) {
+                // Just do without
+                bf->flags &= ~BUFFERED_FILE_READAHEAD;
+                return fill_buffer(bf);
+            }
+            bf->thread_running = 1;
+        }
+        cb_mutex_enter(&bf->mutex);
+        while (bf->spare_state == SPARE_EMPTY) {
+            cb_cond_wait(&bf->cond, &bf->mutex);
+        }
+        if (bf->spare_state != SPARE_FULL) {
+            int ret = bf->spare_state == SPARE_EOF ? 0 : -1;
+            bf->eof = 1;
+            cb_mutex_exit(&bf->mutex);
+            return ret;
+        }
+        tmp = bf->buf;
+        bf->buf = bf->spare;
+        bf->spare = tmp;
+        bf->buf_used = bf->spare_used;
+        bf->buf_pos = 0;
+        bf->offset = bf->spare_offset;
+        bf->eof = bf->spare_last;
+        bf->spare_state = bf->spare_last ? SPARE_EOF : SPARE_EMPTY;
+        cb_cond_broadcast(&bf->cond);
+        cb_mutex_exit(&bf->mutex);
+        return 1;
+    }
+
+    n = pread_full(bf, bf->buf, bf->buffer_size, bf->offset);
+    if (n < 0) {
+        return -1;
+    }
+    if (n == 0) {
+        bf->eof = 1;
+        return 0;
+    }
+    bf->offset += n;
+    bf->buf_used = (size_t) n;
+    bf->buf_pos = 0;
+    bf->eof = (size_t) n < bf->buffer_size;
+
+    return 1;
+}
+
+static int flush_buffer(buffered_file *bf)
+{
+    size_t len = bf->buf_used;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (bf->direct && len % BUFFERED_FILE_ALIGNMENT != 0) {
+        // Only the last buffer is partial; write it padded and cut the
+        // padding off afterwards
+        size_t padded = len + BUFFERED_FILE_ALIGNMENT - len % BUFFERED_FILE_ALIGNMENT;
+        memset(bf->buf + len, 0, padded - len);
+        if (pwrite_full(bf, bf->buf, padded, bf->offset) < 0 ||
+                ftruncate(bf->fd, bf->offset + len) < 0) {
+            return -1;
+        }
+        disable_direct(bf);
+    } else if (pwrite_full(bf, bf->buf, len, bf->offset) < 0) {
+        return -1;
+    }
+    bf->offset += len;
+    bf->buf_used = 0;
+
+    return 0;
+}
+
+static int64_t raw_read(buffered_file *bf, char *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (bf->mode == MODE_WRITE) {
+        return -1;
+    }
+    bf->mode = MODE_READ;
+    while (done < size) {
+        size_t n;
+        if (bf->buf_pos == bf->buf_used) {
+            int ret = fill_buffer(bf);
+            if (ret < 0) {
+                return -1;
+            } else if (ret == 0) {
+                break;
+            }
+        }
+        n = bf->buf_used - bf->buf_pos;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(buf + done, bf->buf + bf->buf_pos, n);
+        bf->buf_pos += n;
+        done += n;
+    }
+
+    return (int64_t) done;
+}
+
+static int64_t raw_write(buffered_file *bf, const char *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (bf->mode == MODE_READ || !bf->writable) {
+        return -1;
+    }
+    if (bf->mode == MODE_NONE) {
+        if (bf->truncate) {
+            if (ftruncate(bf->fd, 0) < 0) {
+                return -1;
+            }
+            bf->truncate = 0;
+        }
+        bf->mode = MODE_WRITE;
+    }
+    while (done < size) {
+        size_t n = bf->buffer_size - bf->buf_used;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(bf->buf + bf->buf_used, buf + done, n);
+        bf->buf_used += n;
+        done += n;
+        if (bf->buf_used == bf->buffer_size && flush_buffer(bf) < 0) {
+            return -1;
+        }
+    }
+
+    return (int64_t) done;
+}
+
+static int flush_block(buffered_file *bf)
+{
+    size_t len;
+    uint32_t header;
+
+    if (bf->block_used == 0) {
+        return 0;
+    }
+    snappy::RawCompress(bf->block, bf->block_used, bf->compressed, &len);
+    header = htonl((uint32_t) len);
+    if (raw_write(bf, (const char *) &header, sizeof(header)) != sizeof(header) ||
+            raw_write(bf, bf->compressed, len) != (int64_t) len) {
+        return -1;
+    }
+    bf->block_used = 0;
+
+    return 0;
+}
+
+// Reads the next block in. Returns 1, 0 at the end of the file, or -1.
+static int fill_block(buffered_file *bf)
+{
+    uint32_t header;
+    size_t len, uncompressed_len;
+    int64_t n;
+
+    n = raw_read(bf, (char *) &header, sizeof(header));
+    if (n != sizeof(header)) {
+        return n == 0 ? 0 : -1;
+    }
+    len = ntohl(header);
+    if (len > bf->compressed_size ||
+            raw_read(bf, bf->compressed, len) != (int64_t) len) {
+        return -1;
+    }
+    if (!snappy::GetUncompressedLength(bf->compressed, len, &uncompressed_len) ||
+            uncompressed_len > COMPRESSED_BLOCK_SIZE ||
+            !snappy::RawUncompress(bf->compressed, len, bf->block)) {
+        return -1;
+    }
+    bf->block_used = uncompressed_len;
+    bf->block_pos = 0;
+
+    return 1;
+}
+
+static int64_t bf_read(buffered_file *bf, char *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (!(bf->flags & BUFFERED_FILE_COMPRESSED)) {
+        int64_t n = raw_read(bf, buf, size);
+        if (n > 0) {
+            bf->pos += n;
+        }
+        return n;
+    }
+
+    while (done < size) {
+        size_t n;
+        if (bf->block_pos == bf->block_used) {
+            int ret = fill_block(bf);
+            if (ret < 0) {
+                return -1;
+            } else if (ret == 0) {
+                break;
+            }
+        }
+        n = bf->block_used - bf->block_pos;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(buf + done, bf->block + bf->block_pos, n);
+        bf->block_pos += n;
+        done += n;
+    }
+    bf->pos += done;
+
+    return (int64_t) done;
+}
+
+static int64_t bf_write(buffered_file *bf, const char *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (!(bf->flags & BUFFERED_FILE_COMPRESSED)) {
+        int64_t n = raw_write(bf, buf, size);
+        if (n > 0) {
+            bf->pos += n;
+        }
+        return n;
+    }
+
+    if (bf->mode == MODE_READ || !bf->writable) {
+        return -1;
+    }
+    while (done < size) {
+        size_t n = COMPRESSED_BLOCK_SIZE - bf->block_used;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(bf->block + bf->block_used, buf + done, n);
+        bf->block_used += n;
+        done += n;
+        if (bf->block_used == COMPRESSED_BLOCK_SIZE && flush_block(bf) < 0) {
+            return -1;
+        }
+    }
+    bf->pos += done;
+
+    return (int64_t) done;
+}
+
+// Writes out whatever is still buffered
+static int bf_flush(buffered_file *bf)
+{
+    if ((bf->flags & BUFFERED_FILE_COMPRESSED) && bf->mode != MODE_READ &&
+            flush_block(bf) < 0) {
+        return -1;
+    }
+    if (bf->mode == MODE_WRITE && flush_buffer(bf) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Only reports the position, rewinds, or moves to the end for appending
+static int bf_seek(buffered_file *bf, int64_t *offset, int whence)
+{
+    if (*offset != 0) {
+        return -1;
+    }
+
+    switch (whence) {
+    case SEEK_CUR:
+        *offset = bf->pos;
+        return 0;
+    case SEEK_SET:
+        if (bf_flush(bf) < 0) {
+            return -1;
+        }
+        stop_readahead(bf);
+        bf->offset = 0;
+        bf->truncate = bf->writable;
+        bf->pos = 0;
+        break;
+    case SEEK_END: {
+        struct stat st;
+        if (bf->mode == MODE_READ || !bf->writable || bf_flush(bf) < 0 ||
+                fstat(bf->fd, &st) < 0) {
+            return -1;
+        }
+        bf->offset = st.st_size;
+        bf->truncate = 0;
+        bf->pos = st.st_size;
+        if (st.st_size % BUFFERED_FILE_ALIGNMENT != 0) {
+            disable_direct(bf);
+        }
+        *offset = st.st_size;
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    bf->mode = MODE_NONE;
+    bf->buf_used = 0;
+    bf->buf_pos = 0;
+    bf->eof = 0;
+    bf->block_used = 0;
+    bf->block_pos = 0;
+
+    return 0;
+}
+
+static void bf_free(buffered_file *bf)
+{
+    if (bf->sync_initialized) {
+        cb_mutex_destroy(&bf->mutex);
+        cb_cond_destroy(&bf->cond);
+    }
+    free(bf->buf);
+    free(bf->spare);
+    free(bf->block);
+    free(bf->compressed);
+    free(bf);
+}
+
+static int bf_close(buffered_file *bf)
+{
+    int ret = 0;
+
+    if (bf_flush(bf) < 0) {
+        ret = -1;
+    }
+    stop_readahead(bf);
+    if (close(bf->fd) != 0) {
+        ret = -1;
+    }
+    bf_free(bf);
+
+    return ret;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+
+static ssize_t cookie_read(void *cookie, char *buf, size_t size)
+{
+    return (ssize_t) bf_read((buffered_file *) cookie, buf, size);
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+    int64_t ret = bf_write((buffered_file *) cookie, buf, size);
+    return ret < 0 ? 0 : (ssize_t) ret;
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+    int64_t off = *offset;
+    int ret = bf_seek((buffered_file *) cookie, &off, whence);
+    *offset = off;
+    return ret;
+}
+
+static int cookie_close(void *cookie)
+{
+    return bf_close((buffered_file *) cookie);
+}
+
+#else
+
+static int funopen_read(void *cookie, char *buf, int size)
+{
+    return (int) bf_read((buffered_file *) cookie, buf, size);
+}
+
+static int funopen_write(void *cookie, const char *buf, int size)
+{
+    return (int) bf_write((buffered_file *) cookie, buf, size);
+}
+
+static fpos_t funopen_seek(void *cookie, fpos_t offset, int whence)
+{
+    int64_t off = offset;
+    if (bf_seek((buffered_file *) cookie, &off, whence) < 0) {
+        return -1;
+    }
+    return (fpos_t) off;
+}
+
+static int funopen_close(void *cookie)
+{
+    return bf_close((buffered_file *) cookie);
+}
+
+#endif
+
+static char *alloc_aligned(size_t size)
+{
+    void *p;
+
+    if (posix_memalign(&p, BUFFERED_FILE_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    return (char *) p;
+}
+
+FILE *buffered_fopen(const char *path, const char *mode,
+                     size_t buffer_size, int flags)
+{
+    buffered_file *bf;
+    struct stat st;
+    int oflags;
+    int readable;
+    FILE *f;
+
+    readable = mode[0] == 'r' || strchr(mode, '+') != NULL;
+    switch (mode[0]) {
+    case 'r':
+        oflags = readable && strchr(mode, '+') ? O_RDWR : O_RDONLY;
+        break;
+    case 'w':
+        oflags = (readable ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        oflags = (readable ? O_RDWR : O_WRONLY) | O_CREAT;
+        break;
+    default:
+        return NULL;
+    }
+    if (!readable) {
+        flags &= ~BUFFERED_FILE_READAHEAD;
+    }
+    if (buffer_size == 0) {
+        buffer_size = BUFFERED_FILE_DEFAULT_BUFFER_SIZE;
+    }
+
+    bf = (buffered_file *) calloc(1, sizeof(buffered_file));
+    if (bf == NULL) {
+        return NULL;
+    }
+    bf->fd = -1;
+    bf->writable = oflags != O_RDONLY;
+#ifdef O_DIRECT
+    if (flags & BUFFERED_FILE_DIRECT) {
+        // Not every file system supports it
+        bf->fd = open(path, oflags | O_DIRECT, 0666);
+        bf->direct = bf->fd != -1;
+    }
+#endif
+    if (bf->fd == -1) {
+        bf->fd = open(path, oflags, 0666);
+    }
+    if (bf->fd == -1 || fstat(bf->fd, &st) < 0) {
+        goto failure;
+    }
+    if (mode[0] == 'a') {
+        bf->offset = st.st_size;
+        bf->pos = st.st_size;
+        if (st.st_size % BUFFERED_FILE_ALIGNMENT != 0) {
+            disable_direct(bf);
+        }
+    } else if (!bf->writable && (uint64_t) st.st_size < buffer_size) {
+        // Everything fits in one buffer, and read-ahead has nothing to do
+        buffer_size = st.st_size;
+        flags &= ~BUFFERED_FILE_READAHEAD;
+    }
+    buffer_size += BUFFERED_FILE_ALIGNMENT - 1;
+    buffer_size -= buffer_size % BUFFERED_FILE_ALIGNMENT;
+    if (buffer_size == 0) {
+        buffer_size = BUFFERED_FILE_ALIGNMENT;
+    }
+    bf->buffer_size = buffer_size;
+    bf->flags = flags;
+
+    bf->buf = alloc_aligned(buffer_size);
+    if (bf->buf == NULL) {
+        goto failure;
+    }
+    if (flags & BUFFERED_FILE_READAHEAD) {
+        bf->spare = alloc_aligned(buffer_size);
+        if (bf->spare == NULL) {
+            goto failure;
+        }
+        cb_mutex_initialize(&bf->mutex);
+        cb_cond_initialize(&bf->cond);
+        bf->sync_initialized = 1;
+    }
+    if (flags & BUFFERED_FILE_COMPRESSED) {
+        bf->compressed_size = snappy::MaxCompressedLength(COMPRESSED_BLOCK_SIZE);
+        bf->block = (char *) malloc(COMPRESSED_BLOCK_SIZE);
+        bf->compressed = (char *) malloc(bf->compressed_size);
+        if (bf->block == NULL || bf->compressed == NULL) {
+            goto failure;
+        }
+    }
+
+#ifdef HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t funcs;
+        funcs.read = cookie_read;
+        funcs.write = cookie_write;
+        funcs.seek = cookie_seek;
+        funcs.close = cookie_close;
+        // Appending is handled here, through the offset
+        f = fopencookie(bf, !bf->writable ? "r" : (readable ? "w+" : "w"), funcs);
+    }
+#else
+    f = funopen(bf, funopen_read, funopen_write, funopen_seek, funopen_close);
+#endif
+    if (f == NULL) {
+        goto failure;
+    }
+
+    return f;
+
+failure:
+    if (bf->fd != -1) {
+        close(bf->fd);
+    }
+    bf_free(bf);
+    return NULL;
+}
+
+#else
+
+FILE *buffered_fopen(const char *path, const char *mode,
+                     size_t buffer_size, int flags)
+{
+    (void) buffer_size;
+    (void) flags;
+    return fopen(path, mode);
+}
+
+#endif
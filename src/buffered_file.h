@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef COUCHSTORE_BUFFERED_FILE_H
+#define COUCHSTORE_BUFFERED_FILE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of each buffer of a stream, unless told otherwise */
+#define BUFFERED_FILE_DEFAULT_BUFFER_SIZE (4 * 1024 * 1024)
+/* Buffers are aligned to, and sized in multiples of, this */
+#define BUFFERED_FILE_ALIGNMENT 4096
+
+/* The file holds a stream of snappy compressed blocks */
+#define BUFFERED_FILE_COMPRESSED 0x1
+/* Bypass the page cache (O_DIRECT), where the platform and file system allow */
+#define BUFFERED_FILE_DIRECT     0x2
+/* While one buffer is being read from, fill the next on a background thread */
+#define BUFFERED_FILE_READAHEAD  0x4
+
+/**
+ * Opens a file for use with the regular stdio read and write functions,
+ * doing the actual I/O in buffer_size chunks (rounded up to a multiple of
+ * BUFFERED_FILE_ALIGNMENT) at explicit offsets. This is meant for temporary
+ * and intermediate files that are written and read sequentially, like sort
+ * runs, where the default stdio buffers turn a merge of many files into
+ * lots of small interleaved reads. A file opened "rb" gets no bigger buffer
+ * than it needs to be read in one go.
+ *
+ * mode is one of "rb", "wb", "ab" or "w+b". With BUFFERED_FILE_COMPRESSED
+ * blocks are self-contained, so "ab" appends a new stream to whatever the
+ * file holds; ftell starts off at the existing file's size then. Seeking is
+ * limited to rewind() and to fseek(f, 0, SEEK_END). A rewind ends any writing
+ * and starts reading from the beginning; writing after a rewind replaces the
+ * whole file.
+ *
+ * On platforms with no way to create custom stdio streams, the file is simply
+ * opened with fopen (and is uncompressed).
+ *
+ * @param path file to open
+ * @param mode see above
+ * @param buffer_size size of the I/O buffer, 0 for the default. Read-ahead
+ *                    uses a second buffer of this size
+ * @param flags BUFFERED_FILE_* flags
+ * @return The stream, or NULL on failure.
+ */
+FILE *buffered_fopen(const char *path, const char *mode,
+                     size_t buffer_size, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,9 +12,12 @@
 #include "bitfield.h"
 #include "reduces.h"
 #include "util.h"
+#include "iobuffer.h"
+#include "arena.h"
 
 #define ROOT_BASE_SIZE 12
 #define HEADER_BASE_SIZE 25
+#define DEFAULT_REGION_SIZE (64 * 1024 * 1024)
 
 // Initializes one of the db's root node pointers from data in the file header
 static couchstore_error_t read_db_root(Db *db, node_pointer **root,
@@ -337,6 +340,46 @@ cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_snapshot(Db *db, uint64_t header_pos, Db **pSnapshot)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *snapshot = NULL;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    // Headers past the current one may belong to an uncommitted or abandoned write
+    error_unless(header_pos <= db->header.position &&
+                 header_pos % COUCH_BLOCK_SIZE == 0,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    snapshot = static_cast<Db*>(calloc(1, sizeof(Db)));
+    error_unless(snapshot, COUCHSTORE_ERROR_ALLOC_FAIL);
+    snapshot->file.path = (const char *) strdup(db->file.path);
+    error_unless(snapshot->file.path, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(couch_get_snapshot_file_ops(&db->file.lastError,
+                                           db->file.ops,
+                                           db->file.handle,
+                                           &snapshot->file.ops,
+                                           &snapshot->file.handle));
+    snapshot->file.pos = db->file.pos;
+
+    error_pass(find_header_at_pos(snapshot, header_pos));
+    *pSnapshot = snapshot;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && snapshot) {
+        couchstore_close_db(snapshot);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_reader_snapshot(Db *db, Db **pSnapshot)
+{
+    // Re-read the last committed header rather than copying db->header, whose
+    // roots may point at nodes that haven't been committed yet.
+    return couchstore_open_snapshot(db, db->header.position, pSnapshot);
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_close_db(Db *db)
 {
@@ -366,7 +409,8 @@ const char* couchstore_get_db_filename(Db *db) {
     return db->file.path;
 }
 
-DocInfo* couchstore_alloc_docinfo(const sized_buf *id, const sized_buf *rev_meta) {
+// Allocates a DocInfo with copies of id and rev_meta, from 'a' or (if it's NULL) the heap
+static DocInfo* alloc_docinfo(arena *a, const sized_buf *id, const sized_buf *rev_meta) {
     size_t size = sizeof(DocInfo);
     if (id) {
         size += id->size;
@@ -374,7 +418,8 @@ DocInfo* couchstore_alloc_docinfo(const sized_buf *id, const sized_buf *rev_meta
     if (rev_meta) {
         size += rev_meta->size;
     }
-    DocInfo* docInfo = static_cast<DocInfo*>(malloc(size));
+    DocInfo* docInfo = static_cast<DocInfo*>(a ? arena_alloc_aligned(a, size, ARENA_MALLOC_ALIGNMENT)
+                                                 : malloc(size));
     if (!docInfo) {
         return NULL;
     }
@@ -394,6 +439,10 @@ DocInfo* couchstore_alloc_docinfo(const sized_buf *id, const sized_buf *rev_meta
     return docInfo;
 }
 
+DocInfo* couchstore_alloc_docinfo(const sized_buf *id, const sized_buf *rev_meta) {
+    return alloc_docinfo(NULL, id, rev_meta);
+}
+
 LIBCOUCHSTORE_API
 void couchstore_free_docinfo(DocInfo *docinfo)
 {
@@ -446,6 +495,7 @@ couchstore_error_t by_seq_read_docinfo(DocInfo **pInfo,
 }
 
 static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
+                                             arena *a,
                                              const sized_buf *k,
                                              const sized_buf *v)
 {
@@ -468,7 +518,7 @@ static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
     revnum = decode_raw48(raw->rev_seq);
 
     sized_buf rev_meta = {v->buf + sizeof(*raw), static_cast<size_t>(revMetaSize)};
-    DocInfo* docInfo = couchstore_alloc_docinfo(k, &rev_meta);
+    DocInfo* docInfo = alloc_docinfo(a, k, &rev_meta);
     if (!docInfo) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -483,16 +533,28 @@ static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
     return COUCHSTORE_SUCCESS;
 }
 
-//Fill in doc from reading file.
-static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_open_options options)
+//Fill in doc from reading file. The doc is allocated from 'a', with the body read straight
+//into it, or from the heap if it's NULL.
+static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_open_options options,
+                                    arena *a)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     int bodylen = 0;
     char *docbody = NULL;
     fatbuf *docbuf = NULL;
+    const arena_position *mark = a ? arena_mark(a) : NULL;
+    Doc *doc;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
 
-    if (options & DECOMPRESS_DOC_BODIES) {
+    if (a) {
+        error_unless(doc = (Doc *) arena_alloc_aligned(a, sizeof(Doc), ARENA_MALLOC_ALIGNMENT),
+                     COUCHSTORE_ERROR_ALLOC_FAIL);
+        if (options & DECOMPRESS_DOC_BODIES) {
+            bodylen = pread_compressed_arena(&db->file, bp, a, &docbody);
+        } else {
+            bodylen = pread_bin_arena(&db->file, bp, a, &docbody);
+        }
+    } else if (options & DECOMPRESS_DOC_BODIES) {
         bodylen = pread_compressed(&db->file, bp, &docbody);
     } else {
         bodylen = pread_bin(&db->file, bp, &docbody);
@@ -501,36 +563,53 @@ static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_
     error_unless(bodylen >= 0, static_cast<couchstore_error_t>(bodylen));    // if bodylen is negative it's an error code
     error_unless(docbody || bodylen == 0, COUCHSTORE_ERROR_READ);
 
-    error_unless(docbuf = fatbuf_alloc(sizeof(Doc) + bodylen), COUCHSTORE_ERROR_ALLOC_FAIL);
-    *pDoc = (Doc *) fatbuf_get(docbuf, sizeof(Doc));
+    if (a) {
+        doc->data.buf = docbody;
+        docbody = NULL;
+    } else {
+        error_unless(docbuf = fatbuf_alloc(sizeof(Doc) + bodylen), COUCHSTORE_ERROR_ALLOC_FAIL);
+        doc = (Doc *) fatbuf_get(docbuf, sizeof(Doc));
+        doc->data.buf = (char *) fatbuf_get(docbuf, bodylen);
+    }
+    *pDoc = doc;
 
     if (bodylen == 0) { //Empty doc
-        (*pDoc)->data.buf = NULL;
-        (*pDoc)->data.size = 0;
-        return COUCHSTORE_SUCCESS;
+        doc->data.buf = NULL;
+        doc->data.size = 0;
+        goto cleanup;
     }
 
-    (*pDoc)->data.buf = (char *) fatbuf_get(docbuf, bodylen);
-    (*pDoc)->data.size = bodylen;
-    memcpy((*pDoc)->data.buf, docbody, bodylen);
+    doc->data.size = bodylen;
+    if (!a) {
+        memcpy(doc->data.buf, docbody, bodylen);
+    }
 
 cleanup:
     free(docbody);
     if (errcode < 0) {
         fatbuf_free(docbuf);
+        if (a) {
+            arena_free_from_mark(a, mark);
+        }
     }
     return errcode;
 }
 
+// context info passed to docinfo_fetch_by_id via btree_lookup
+typedef struct {
+    DocInfo **pInfo;
+    arena *a;
+} docinfo_fetch_context;
+
 static couchstore_error_t docinfo_fetch_by_id(couchfile_lookup_request *rq,
                                               const sized_buf *k,
                                               const sized_buf *v)
 {
-    DocInfo **pInfo = (DocInfo **) rq->callback_ctx;
+    docinfo_fetch_context *ctx = (docinfo_fetch_context *) rq->callback_ctx;
     if (v == NULL) {
         return COUCHSTORE_ERROR_DOC_NOT_FOUND;
     }
-    return by_id_read_docinfo(pInfo, k, v);
+    return by_id_read_docinfo(ctx->pInfo, ctx->a, k, v);
 }
 
 static couchstore_error_t docinfo_fetch_by_seq(couchfile_lookup_request *rq,
@@ -544,15 +623,16 @@ static couchstore_error_t docinfo_fetch_by_seq(couchfile_lookup_request *rq,
     return by_seq_read_docinfo(pInfo, k, v);
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_docinfo_by_id(Db *db,
-                                            const void *id,
-                                            size_t idlen,
-                                            DocInfo **pInfo)
+static couchstore_error_t docinfo_by_id(Db *db,
+                                        const void *id,
+                                        size_t idlen,
+                                        arena *a,
+                                        DocInfo **pInfo)
 {
     sized_buf key;
     sized_buf *keylist = &key;
     couchfile_lookup_request rq;
+    docinfo_fetch_context ctx = {pInfo, a};
     couchstore_error_t errcode;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
 
@@ -567,7 +647,7 @@ couchstore_error_t couchstore_docinfo_by_id(Db *db,
     rq.file = &db->file;
     rq.num_keys = 1;
     rq.keys = &keylist;
-    rq.callback_ctx = pInfo;
+    rq.callback_ctx = &ctx;
     rq.fetch_callback = docinfo_fetch_by_id;
     rq.node_callback = NULL;
     rq.fold = 0;
@@ -582,6 +662,25 @@ cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_docinfo_by_id(Db *db,
+                                            const void *id,
+                                            size_t idlen,
+                                            DocInfo **pInfo)
+{
+    return docinfo_by_id(db, id, idlen, NULL, pInfo);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_docinfo_by_id_arena(Db *db,
+                                                  const void *id,
+                                                  size_t idlen,
+                                                  couchstore_arena *arena,
+                                                  DocInfo **pInfo)
+{
+    return docinfo_by_id(db, id, idlen, arena, pInfo);
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_docinfo_by_sequence(Db *db,
                                                   uint64_t sequence,
@@ -620,11 +719,11 @@ cleanup:
     return errcode;
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
-                                                    DocInfo *docinfo,
-                                                    Doc **pDoc,
-                                                    couchstore_open_options options)
+static couchstore_error_t open_doc_with_docinfo(Db *db,
+                                                DocInfo *docinfo,
+                                                arena *a,
+                                                Doc **pDoc,
+                                                couchstore_open_options options)
 {
     couchstore_error_t errcode;
 
@@ -637,7 +736,7 @@ couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
         options &= ~DECOMPRESS_DOC_BODIES;
     }
 
-    errcode = bp_to_doc(pDoc, db, docinfo->bp, options);
+    errcode = bp_to_doc(pDoc, db, docinfo->bp, options, a);
     if (errcode == COUCHSTORE_SUCCESS) {
         (*pDoc)->id.buf = docinfo->id.buf;
         (*pDoc)->id.size = docinfo->id.size;
@@ -647,30 +746,92 @@ couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
 }
 
 LIBCOUCHSTORE_API
-couchstore_error_t couchstore_open_document(Db *db,
-                                            const void *id,
-                                            size_t idlen,
-                                            Doc **pDoc,
-                                            couchstore_open_options options)
+couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
+                                                    DocInfo *docinfo,
+                                                    Doc **pDoc,
+                                                    couchstore_open_options options)
+{
+    return open_doc_with_docinfo(db, docinfo, NULL, pDoc, options);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_doc_with_docinfo_arena(Db *db,
+                                                          DocInfo *docinfo,
+                                                          couchstore_arena *arena,
+                                                          Doc **pDoc,
+                                                          couchstore_open_options options)
+{
+    return open_doc_with_docinfo(db, docinfo, arena, pDoc, options);
+}
+
+static couchstore_error_t open_document(Db *db,
+                                        const void *id,
+                                        size_t idlen,
+                                        arena *a,
+                                        Doc **pDoc,
+                                        couchstore_open_options options)
 {
     couchstore_error_t errcode;
     DocInfo *info;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     *pDoc = NULL;
-    errcode = couchstore_docinfo_by_id(db, id, idlen, &info);
+    errcode = docinfo_by_id(db, id, idlen, a, &info);
     if (errcode == COUCHSTORE_SUCCESS) {
-        errcode = couchstore_open_doc_with_docinfo(db, info, pDoc, options);
+        errcode = open_doc_with_docinfo(db, info, a, pDoc, options);
         if (errcode == COUCHSTORE_SUCCESS) {
             (*pDoc)->id.buf = (char *) id;
             (*pDoc)->id.size = idlen;
         }
 
-        couchstore_free_docinfo(info);
+        if (!a) {
+            couchstore_free_docinfo(info);
+        }
     }
 cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_document(Db *db,
+                                            const void *id,
+                                            size_t idlen,
+                                            Doc **pDoc,
+                                            couchstore_open_options options)
+{
+    return open_document(db, id, idlen, NULL, pDoc, options);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_document_arena(Db *db,
+                                                  const void *id,
+                                                  size_t idlen,
+                                                  couchstore_arena *arena,
+                                                  Doc **pDoc,
+                                                  couchstore_open_options options)
+{
+    return open_document(db, id, idlen, arena, pDoc, options);
+}
+
+LIBCOUCHSTORE_API
+couchstore_arena* couchstore_new_arena(size_t chunk_size)
+{
+    return new_arena(chunk_size);
+}
+
+LIBCOUCHSTORE_API
+void couchstore_free_arena(couchstore_arena *arena)
+{
+    if (arena) {
+        delete_arena(arena);
+    }
+}
+
+LIBCOUCHSTORE_API
+void couchstore_arena_free_all(couchstore_arena *arena)
+{
+    arena_free_all(arena);
+}
+
 // context info passed to lookup_callback via btree_lookup
 typedef struct {
     Db *db;
@@ -695,7 +856,7 @@ static couchstore_error_t lookup_callback(couchfile_lookup_request *rq,
     DocInfo *docinfo = NULL;
     couchstore_error_t errcode;
     if (context->by_id) {
-        errcode = by_id_read_docinfo(&docinfo, k, v);
+        errcode = by_id_read_docinfo(&docinfo, NULL, k, v);
     } else {
         errcode = by_seq_read_docinfo(&docinfo, k, v);
     }
@@ -1059,6 +1220,195 @@ couchstore_error_t couchstore_db_info(Db *db, DbInfo* dbinfo) {
     return COUCHSTORE_SUCCESS;
 }
 
+typedef struct {
+    DbRegionInfo *regions;
+    size_t num_regions;
+    uint64_t region_size;
+    unsigned sample_every;
+    uint64_t leaves_seen;
+} region_info_ctx;
+
+// Adds size * weight live bytes starting at file offset pos, split across the
+// regions the range spans.
+static void region_add_live(region_info_ctx *ctx, uint64_t pos, uint64_t size,
+                            uint64_t weight)
+{
+    while (size > 0) {
+        uint64_t region = pos / ctx->region_size;
+        if (region >= ctx->num_regions) {
+            return;
+        }
+        uint64_t len = (region + 1) * ctx->region_size - pos;
+        if (len > size) {
+            len = size;
+        }
+        ctx->regions[region].live_bytes += len * weight;
+        pos += len;
+        size -= len;
+    }
+}
+
+// Finds the height of a B-tree by following its leftmost edge. All leaves of a
+// couchstore B-tree are at the same depth.
+static couchstore_error_t btree_height(Db *db, uint64_t pointer, int *height)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *nodebuf = NULL;
+    *height = 1;
+    for (;;) {
+        int nodebuflen = pread_compressed(&db->file, pointer, &nodebuf);
+        error_unless(nodebuflen >= 0, static_cast<couchstore_error_t>(nodebuflen));
+        if (nodebuf[0] == KV_NODE) {
+            break;
+        }
+        error_unless(nodebuflen > 1, COUCHSTORE_ERROR_CORRUPT);
+        sized_buf k, v;
+        read_kv(nodebuf + 1, &k, &v);
+        pointer = decode_raw48(((const raw_node_pointer*)v.buf)->pointer);
+        free(nodebuf);
+        nodebuf = NULL;
+        ++*height;
+    }
+cleanup:
+    free(nodebuf);
+    return errcode;
+}
+
+static couchstore_error_t region_info_leaf(Db *db, region_info_ctx *ctx,
+                                           uint64_t pointer, uint64_t subtreesize,
+                                           bool by_seq)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *nodebuf = NULL;
+    int bufpos = 1;
+    int nodebuflen;
+
+    region_add_live(ctx, pointer, subtreesize, 1);
+    // Only by-seq leaves need reading, for the document bodies.
+    if (!by_seq || ctx->leaves_seen++ % ctx->sample_every != 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    nodebuflen = pread_compressed(&db->file, pointer, &nodebuf);
+    error_unless(nodebuflen >= 0, static_cast<couchstore_error_t>(nodebuflen));
+    error_unless(nodebuf[0] == KV_NODE, COUCHSTORE_ERROR_CORRUPT);
+    while (bufpos < nodebuflen) {
+        sized_buf k, v;
+        uint32_t idsize, datasize;
+        bufpos += read_kv(nodebuf + bufpos, &k, &v);
+        const raw_seq_index_value *raw = (const raw_seq_index_value*)v.buf;
+        uint64_t bp = decode_raw48(raw->bp) & ~BP_DELETED_FLAG;
+        decode_kv_length(&raw->sizes, &idsize, &datasize);
+        if (bp != 0) {
+            region_add_live(ctx, bp, datasize, ctx->sample_every);
+        }
+    }
+cleanup:
+    free(nodebuf);
+    return errcode;
+}
+
+static couchstore_error_t region_info_node(Db *db, region_info_ctx *ctx,
+                                           uint64_t pointer, uint64_t subtreesize,
+                                           int height, bool by_seq)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *nodebuf = NULL;
+    int bufpos = 1;
+    int nodebuflen;
+    uint64_t children_size = 0;
+
+    if (height == 1) {
+        return region_info_leaf(db, ctx, pointer, subtreesize, by_seq);
+    }
+
+    nodebuflen = pread_compressed(&db->file, pointer, &nodebuf);
+    error_unless(nodebuflen >= 0, static_cast<couchstore_error_t>(nodebuflen));
+    error_unless(nodebuf[0] == KP_NODE, COUCHSTORE_ERROR_CORRUPT);
+    while (bufpos < nodebuflen) {
+        sized_buf k, v;
+        bufpos += read_kv(nodebuf + bufpos, &k, &v);
+        const raw_node_pointer *raw = (const raw_node_pointer*)v.buf;
+        uint64_t child_size = decode_raw48(raw->subtreesize);
+        children_size += child_size;
+        error_pass(region_info_node(db, ctx, decode_raw48(raw->pointer), child_size,
+                                    height - 1, by_seq));
+    }
+    // A KP node's subtree size is its own size on disk plus its children's.
+    if (subtreesize > children_size) {
+        region_add_live(ctx, pointer, subtreesize - children_size, 1);
+    }
+cleanup:
+    free(nodebuf);
+    return errcode;
+}
+
+static couchstore_error_t region_info_tree(Db *db, region_info_ctx *ctx,
+                                           const node_pointer *root, bool by_seq)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    int height;
+    if (root == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    error_pass(btree_height(db, root->pointer, &height));
+    error_pass(region_info_node(db, ctx, root->pointer, root->subtreesize, height, by_seq));
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_db_region_info(Db *db,
+                                             uint64_t region_size,
+                                             unsigned sample_every,
+                                             DbRegionInfo **pRegions,
+                                             size_t *num_regions)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    region_info_ctx ctx;
+    uint64_t file_size = db->file.pos;
+    size_t i;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.region_size = region_size ? region_size : DEFAULT_REGION_SIZE;
+    ctx.sample_every = sample_every ? sample_every : 1;
+    ctx.num_regions = (size_t)((file_size + ctx.region_size - 1) / ctx.region_size);
+    ctx.regions = static_cast<DbRegionInfo*>(calloc(ctx.num_regions + 1, sizeof(DbRegionInfo)));
+    error_unless(ctx.regions, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    error_pass(region_info_tree(db, &ctx, db->header.by_seq_root, true));
+    error_pass(region_info_tree(db, &ctx, db->header.by_id_root, false));
+    error_pass(region_info_tree(db, &ctx, db->header.local_docs_root, false));
+
+    for (i = 0; i < ctx.num_regions; ++i) {
+        DbRegionInfo *region = &ctx.regions[i];
+        region->offset = i * ctx.region_size;
+        region->size = file_size - region->offset;
+        if (region->size > ctx.region_size) {
+            region->size = ctx.region_size;
+        }
+        // Sampling can overshoot
+        if (region->live_bytes > region->size) {
+            region->live_bytes = region->size;
+        }
+        region->dead_bytes = region->size - region->live_bytes;
+    }
+
+    *pRegions = ctx.regions;
+    *num_regions = ctx.num_regions;
+    ctx.regions = NULL;
+cleanup:
+    free(ctx.regions);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_free_db_region_info(DbRegionInfo *regions)
+{
+    free(regions);
+}
+
 static couchstore_error_t local_doc_fetch(couchfile_lookup_request *rq,
                                           const sized_buf *k,
                                           const sized_buf *v)
@@ -1205,56 +1555,156 @@ couchstore_error_t couchstore_last_os_error(const Db *db,
     return COUCHSTORE_SUCCESS;
 }
 
-static couchstore_error_t btree_eval_seq_reduce(Db *db,
-                                                uint64_t *accum,
-                                                sized_buf *left,
-                                                sized_buf *right,
-                                                bool past_left_edge,
-                                                uint64_t diskpos) {
+// The number of sequence numbers in the by-sequence tree lower than seq,
+// filled in by seq_rank_node.
+typedef struct {
+    uint64_t seq;
+    uint64_t rank;
+    size_t slot;
+} seq_rank;
+
+static int seq_rank_cmp(const void *a, const void *b)
+{
+    uint64_t sa = ((const seq_rank*)a)->seq;
+    uint64_t sb = ((const seq_rank*)b)->seq;
+    return (sa < sb) ? -1 : (sa > sb);
+}
+
+// Adds to each rank the number of sequences below its seq in the subtree at
+// diskpos. The ranks must be sorted by seq; each node is read only once, no
+// matter how many of them pass through it, and the entry each one stops at is
+// found by binary search.
+static couchstore_error_t seq_rank_node(Db *db,
+                                        uint64_t diskpos,
+                                        seq_rank *ranks,
+                                        size_t num_ranks)
+{
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    int bufpos = 1, nodebuflen = 0;
+    int bufpos, nodebuflen;
     int node_type;
     char *nodebuf = NULL;
+    uint64_t *keys = NULL;
+    uint64_t *counts = NULL;
+    uint64_t *pointers = NULL;
+    size_t nentries = 0, entry = 0, r, group;
+    uint64_t below = 0;
+
     nodebuflen = pread_compressed(&db->file, diskpos, &nodebuf);
     error_unless(nodebuflen >= 0, (static_cast<couchstore_error_t>(nodebuflen)));  // if negative, it's an error code
-
     node_type = nodebuf[0];
-    while(bufpos < nodebuflen) {
+
+    for (bufpos = 1; bufpos < nodebuflen; ++nentries) {
         sized_buf k, v;
         bufpos += read_kv(nodebuf + bufpos, &k, &v);
-        int left_cmp = seq_cmp(&k, left);
-        int right_cmp = seq_cmp(&k, right);
-        if(left_cmp < 0) {
-            continue;
-        }
-        if(node_type == KP_NODE) {
-            // In-range Item in a KP Node
+    }
+    keys = static_cast<uint64_t*>(malloc(nentries * sizeof(uint64_t)));
+    counts = static_cast<uint64_t*>(malloc(nentries * sizeof(uint64_t)));
+    pointers = static_cast<uint64_t*>(malloc(nentries * sizeof(uint64_t)));
+    error_unless(nentries == 0 || (keys && counts && pointers), COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (bufpos = 1, entry = 0; bufpos < nodebuflen; ++entry) {
+        sized_buf k, v;
+        bufpos += read_kv(nodebuf + bufpos, &k, &v);
+        keys[entry] = decode_sequence_key(&k);
+        if (node_type == KP_NODE) {
             const raw_node_pointer *raw = (const raw_node_pointer*)v.buf;
             const raw_by_seq_reduce *rawreduce = (const raw_by_seq_reduce*) (v.buf + sizeof(raw_node_pointer));
-            uint64_t subcount = decode_raw40(rawreduce->count);
-            uint64_t pointer = decode_raw48(raw->pointer);
-            if((left_cmp >= 0 && !past_left_edge) || right_cmp >= 0) {
-                error_pass(btree_eval_seq_reduce(db, accum, left, right, past_left_edge, pointer));
-                if(right_cmp >= 0) {
+            counts[entry] = decode_raw40(rawreduce->count);
+            pointers[entry] = decode_raw48(raw->pointer);
+        } else {
+            counts[entry] = 1;
+        }
+    }
+
+    // A KP entry's key is the highest sequence in its subtree, so every entry
+    // before the first one whose key is >= seq lies entirely below seq.
+    entry = 0;
+    for (r = 0; r < num_ranks; ++r) {
+        size_t lo = entry, hi = nentries;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (keys[mid] < ranks[r].seq) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; entry < lo; ++entry) {
+            below += counts[entry];
+        }
+        ranks[r].rank += below;
+    }
+
+    if (node_type == KP_NODE) {
+        // Descend once into each child that some of the ranks stop inside of
+        for (r = 0, entry = 0; r < num_ranks; r = group) {
+            while (entry < nentries && keys[entry] < ranks[r].seq) {
+                ++entry;
+            }
+            for (group = r + 1; group < num_ranks; ++group) {
+                if (entry < nentries && keys[entry] < ranks[group].seq) {
                     break;
-                } else {
-                    past_left_edge = true;
                 }
-            } else {
-                *accum += subcount;
             }
-        } else {
-            if(right_cmp > 0) {
-                break;
+            if (entry < nentries) {
+                error_pass(seq_rank_node(db, pointers[entry], ranks + r, group - r));
             }
-            // In-range Item in a KV Node
-            *accum += 1;
         }
     }
+
 cleanup:
-    if (nodebuf) {
-        free(nodebuf);
+    free(keys);
+    free(counts);
+    free(pointers);
+    free(nodebuf);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_changes_count_multi(Db* db,
+                                                  const uint64_t *min_seqs,
+                                                  const uint64_t *max_seqs,
+                                                  size_t num_ranges,
+                                                  uint64_t *counts) {
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const uint64_t max_key = (1ULL << 48) - 1;
+    seq_rank *ranks = NULL;
+    uint64_t *by_slot = NULL;
+    size_t i;
+
+    memset(counts, 0, num_ranges * sizeof(uint64_t));
+    if (!db->header.by_seq_root || num_ranges == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    // Each range is counted as rank(max_seq + 1) - rank(min_seq)
+    ranks = static_cast<seq_rank*>(malloc(2 * num_ranges * sizeof(seq_rank)));
+    by_slot = static_cast<uint64_t*>(malloc(2 * num_ranges * sizeof(uint64_t)));
+    error_unless(ranks && by_slot, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (i = 0; i < num_ranges; ++i) {
+        uint64_t min_seq = min_seqs[i] > max_key ? max_key + 1 : min_seqs[i];
+        uint64_t max_seq = max_seqs[i] > max_key ? max_key : max_seqs[i];
+        ranks[2 * i].seq = min_seq;
+        ranks[2 * i].rank = 0;
+        ranks[2 * i].slot = 2 * i;
+        ranks[2 * i + 1].seq = max_seq + 1;
+        ranks[2 * i + 1].rank = 0;
+        ranks[2 * i + 1].slot = 2 * i + 1;
+    }
+    qsort(ranks, 2 * num_ranges, sizeof(seq_rank), seq_rank_cmp);
+    error_pass(seq_rank_node(db, db->header.by_seq_root->pointer, ranks, 2 * num_ranges));
+
+    for (i = 0; i < 2 * num_ranges; ++i) {
+        by_slot[ranks[i].slot] = ranks[i].rank;
+    }
+    for (i = 0; i < num_ranges; ++i) {
+        if (by_slot[2 * i + 1] > by_slot[2 * i]) {
+            counts[i] = by_slot[2 * i + 1] - by_slot[2 * i];
+        }
     }
+
+cleanup:
+    free(ranks);
+    free(by_slot);
     return errcode;
 }
 
@@ -1263,21 +1713,5 @@ couchstore_error_t couchstore_changes_count(Db* db,
                                             uint64_t min_seq,
                                             uint64_t max_seq,
                                             uint64_t *count) {
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    raw_48 leftkr, rightkr;
-    sized_buf leftk, rightk;
-    leftk.buf = (char*) &leftkr;
-    rightk.buf = (char*) &rightkr;
-    leftk.size = 6;
-    rightk.size = 6;
-    encode_raw48(min_seq, &leftkr);
-    encode_raw48(max_seq, &rightkr);
-
-    *count = 0;
-    if(db->header.by_seq_root) {
-        error_pass(btree_eval_seq_reduce(db, count, &leftk, &rightk, false,
-                                         db->header.by_seq_root->pointer));
-    }
-cleanup:
-    return errcode;
+    return couchstore_changes_count_multi(db, &min_seq, &max_seq, 1, count);
 }
@@ -8,6 +8,7 @@
 
 #include "internal.h"
 #include "iobuffer.h"
+#include "arena.h"
 #include "bitfield.h"
 #include "crc32.h"
 #include "util.h"
@@ -67,10 +68,10 @@ void tree_file_close(tree_file* file)
 
 /** Read bytes from the database file, skipping over the header-detection bytes at every block
     boundary. */
-static couchstore_error_t read_skipping_prefixes(tree_file *file,
-                                                 cs_off_t *pos,
-                                                 ssize_t len,
-                                                 void *dst) {
+static couchstore_error_t read_skipping_prefixes_unlocked(tree_file *file,
+                                                          cs_off_t *pos,
+                                                          ssize_t len,
+                                                          void *dst) {
     if (*pos % COUCH_BLOCK_SIZE == 0) {
         ++*pos;
     }
@@ -96,16 +97,35 @@ static couchstore_error_t read_skipping_prefixes(tree_file *file,
     return COUCHSTORE_SUCCESS;
 }
 
+static couchstore_error_t read_skipping_prefixes(tree_file *file,
+                                                 cs_off_t *pos,
+                                                 ssize_t len,
+                                                 void *dst) {
+    couchstore_error_t err;
+
+    if (file->io_lock == NULL) {
+        return read_skipping_prefixes_unlocked(file, pos, len, dst);
+    }
+
+    cb_mutex_enter(file->io_lock);
+    err = read_skipping_prefixes_unlocked(file, pos, len, dst);
+    cb_mutex_exit(file->io_lock);
+
+    return err;
+}
+
 /*
  * Common subroutine of pread_bin, pread_compressed and pread_header.
  * Parameters and return value are the same as for pread_bin,
  * except the 'max_header_size' parameter which is greater than 0 if
- * reading a header, 0 otherwise.
+ * reading a header, 0 otherwise, and 'a', the arena to allocate the
+ * chunk from, or NULL for the heap.
  */
 static int pread_bin_internal(tree_file *file,
                               cs_off_t pos,
                               char **ret_ptr,
-                              uint32_t max_header_size)
+                              uint32_t max_header_size,
+                              arena *a)
 {
     struct {
         uint32_t chunk_len;
@@ -125,7 +145,9 @@ static int pread_bin_internal(tree_file *file,
     }
     info.crc32 = ntohl(info.crc32);
 
-    char* buf = static_cast<char*>(malloc(info.chunk_len));
+    const arena_position *mark = a ? arena_mark(a) : NULL;
+    char* buf = static_cast<char*>(a ? arena_alloc_unaligned(a, info.chunk_len)
+                                     : malloc(info.chunk_len));
     if (!buf) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -134,7 +156,11 @@ static int pread_bin_internal(tree_file *file,
         err = COUCHSTORE_ERROR_CHECKSUM_FAIL;
     }
     if (err < 0) {
-        free(buf);
+        if (a) {
+            arena_free_from_mark(a, mark);
+        } else {
+            free(buf);
+        }
         return err;
     }
 
@@ -151,14 +177,17 @@ int pread_header(tree_file *file,
         return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
 
-    return pread_bin_internal(file, pos + 1, ret_ptr, max_header_size);
+    return pread_bin_internal(file, pos + 1, ret_ptr, max_header_size, NULL);
 }
 
-int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
+// Reads a compressed chunk, and decompresses it into memory from 'a', or from
+// the heap if it's NULL. The compressed bytes always go through the heap.
+static int pread_compressed_internal(tree_file *file, cs_off_t pos, char **ret_ptr,
+                                     arena *a)
 {
     char *compressed_buf;
     char *new_buf;
-    int len = pread_bin_internal(file, pos, &compressed_buf, 0);
+    int len = pread_bin_internal(file, pos, &compressed_buf, 0, NULL);
     if (len < 0) {
         return len;
     }
@@ -170,7 +199,9 @@ int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
         return COUCHSTORE_ERROR_CORRUPT;
     }
 
-    new_buf = static_cast<char *>(malloc(uncompressed_len));
+    const arena_position *mark = a ? arena_mark(a) : NULL;
+    new_buf = static_cast<char *>(a ? arena_alloc_unaligned(a, uncompressed_len)
+                                    : malloc(uncompressed_len));
     if (!new_buf) {
         free(compressed_buf);
         return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -178,7 +209,11 @@ int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
 
     if (!snappy::RawUncompress(compressed_buf, len, new_buf)) {
         free(compressed_buf);
-        free(new_buf);
+        if (a) {
+            arena_free_from_mark(a, mark);
+        } else {
+            free(new_buf);
+        }
         return COUCHSTORE_ERROR_CORRUPT;
     }
 
@@ -187,7 +222,22 @@ int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
     return static_cast<int>(uncompressed_len);
 }
 
+int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
+{
+    return pread_compressed_internal(file, pos, ret_ptr, NULL);
+}
+
 int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
-    return pread_bin_internal(file, pos, ret_ptr, 0);
+    return pread_bin_internal(file, pos, ret_ptr, 0, NULL);
+}
+
+int pread_bin_arena(tree_file *file, cs_off_t pos, struct arena *a, char **ret_ptr)
+{
+    return pread_bin_internal(file, pos, ret_ptr, 0, a);
+}
+
+int pread_compressed_arena(tree_file *file, cs_off_t pos, struct arena *a, char **ret_ptr)
+{
+    return pread_compressed_internal(file, pos, ret_ptr, a);
 }
@@ -84,7 +84,7 @@ couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
     return COUCHSTORE_SUCCESS;
 }
 
-int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+static int write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
 {
     cs_off_t write_pos = file->pos;
     cs_off_t end_pos = write_pos;
@@ -123,6 +123,21 @@ int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *d
     return 0;
 }
 
+int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+{
+    int ret;
+
+    if (file->io_lock == NULL) {
+        return write_buf(file, buf, pos, disk_size);
+    }
+
+    cb_mutex_enter(file->io_lock);
+    ret = write_buf(file, buf, pos, disk_size);
+    cb_mutex_exit(file->io_lock);
+
+    return ret;
+}
+
 couchstore_error_t db_write_buf_compressed(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -12,6 +12,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+/* Number of documents replayed per couchstore_save_documents call during catchup */
+#define CATCHUP_BATCH_SIZE 512
+/* The compaction arenas start at the default chunk size and grow up to this */
+#define COMPACT_ARENA_MAX_CHUNK_SIZE (1024 * 1024)
+
 typedef struct compact_ctx {
     TreeWriter* tree_writer;
     /* Using this for stuff that doesn't need to live longer than it takes to write
@@ -40,7 +45,10 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
     Db* target = NULL;
     char tmpFile[PATH_MAX]; // keep this on the stack for duration of the call
     couchstore_error_t errcode;
-    compact_ctx ctx = {NULL, new_arena(0), new_arena(0), NULL, NULL, hook, dhook, hook_ctx, 0};
+    compact_ctx ctx = {NULL,
+                       new_arena_ex(0, COMPACT_ARENA_MAX_CHUNK_SIZE),
+                       new_arena_ex(0, COMPACT_ARENA_MAX_CHUNK_SIZE),
+                       NULL, NULL, hook, dhook, hook_ctx, 0};
     ctx.flags = flags;
     error_unless(!source->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     error_unless(ctx.transient_arena && ctx.persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
@@ -315,3 +323,112 @@ couchstore_error_t couchstore_set_purge_seq(Db* target, uint64_t purge_seq) {
 
 }
 
+
+typedef struct catchup_ctx {
+    Db* target;
+    Doc* docs[CATCHUP_BATCH_SIZE];
+    DocInfo* infos[CATCHUP_BATCH_SIZE];
+    unsigned count;
+    uint64_t max_items;
+    uint64_t replayed;
+} catchup_ctx;
+
+static void catchup_free_batch(catchup_ctx *ctx)
+{
+    unsigned i;
+    for (i = 0; i < ctx->count; ++i) {
+        couchstore_free_document(ctx->docs[i]);
+        couchstore_free_docinfo(ctx->infos[i]);
+    }
+    ctx->count = 0;
+}
+
+static couchstore_error_t catchup_flush(catchup_ctx *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (ctx->count > 0) {
+        // Bodies are copied verbatim (still compressed if they were), and
+        // keep the sequence numbers they were given in the source.
+        errcode = couchstore_save_documents(ctx->target, ctx->docs, ctx->infos,
+                                            ctx->count, COUCHSTORE_SEQUENCE_AS_IS);
+    }
+    catchup_free_batch(ctx);
+    return errcode;
+}
+
+static int catchup_changes_cb(Db* source, DocInfo* info, void* ctx_p)
+{
+    catchup_ctx *ctx = (catchup_ctx *) ctx_p;
+    couchstore_error_t errcode;
+    Doc *doc = NULL;
+
+    if (ctx->max_items != 0 && ctx->replayed >= ctx->max_items) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    if (ctx->count == CATCHUP_BATCH_SIZE) {
+        errcode = catchup_flush(ctx);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+    // Deleted items may or may not have a body; only read one if it exists.
+    if (info->bp != 0) {
+        errcode = couchstore_open_doc_with_docinfo(source, info, &doc, 0);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+
+    ctx->docs[ctx->count] = doc;
+    ctx->infos[ctx->count] = info;
+    ctx->count++;
+    ctx->replayed++;
+    // Keep the DocInfo, it's freed once the batch has been written
+    return 1;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_compact_catchup(Db* source, Db* target,
+                                              uint64_t max_items,
+                                              uint64_t *remaining)
+{
+    couchstore_error_t errcode;
+    catchup_ctx *ctx = NULL;
+    uint64_t since;
+
+    error_unless(!source->dropped && !target->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(target->header.update_seq <= source->header.update_seq,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    ctx = static_cast<catchup_ctx*>(calloc(1, sizeof(catchup_ctx)));
+    error_unless(ctx, COUCHSTORE_ERROR_ALLOC_FAIL);
+    ctx->target = target;
+    ctx->max_items = max_items;
+
+    since = target->header.update_seq + 1;
+    errcode = couchstore_changes_since(source, since, 0, catchup_changes_cb, ctx);
+    if (errcode == COUCHSTORE_ERROR_CANCEL) {
+        // Hit max_items; the rest is left for the next call.
+        errcode = COUCHSTORE_SUCCESS;
+    }
+    error_pass(errcode);
+    error_pass(catchup_flush(ctx));
+    error_pass(couchstore_commit(target));
+
+    if (remaining) {
+        *remaining = 0;
+        if (target->header.update_seq < source->header.update_seq) {
+            error_pass(couchstore_changes_count(source,
+                                                target->header.update_seq + 1,
+                                                source->header.update_seq,
+                                                remaining));
+        }
+    }
+
+cleanup:
+    if (ctx) {
+        catchup_free_batch(ctx);
+        free(ctx);
+    }
+    return errcode;
+}
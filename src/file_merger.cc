@@ -24,25 +24,42 @@
 #include <assert.h>
 #include <string.h>
 
+/* Most memory the buffers of a merge's source files share */
+#define MERGE_SOURCE_BUFFERS_SIZE (64 * 1024 * 1024)
+#define MERGE_MIN_SOURCE_BUFFER_SIZE (64 * 1024)
+/* Past this many source files, a read-ahead thread each costs more than
+ * it saves */
+#define MERGE_MAX_READAHEAD_FILES 64
 
 typedef struct {
     void      *data;
     unsigned  file;
+    uint64_t  order;
 } record_t;
 
-#define FREE_RECORD(ctx, rec)                                \
-    do {                                                     \
-        (*(ctx)->free_record)((rec)->data, (ctx)->user_ctx); \
-        free((rec));                                         \
-    } while (0)
-
 struct file_merger_ctx_t;
 
+/*
+ * Tournament (loser) tree over the current head record of each source file.
+ * tree[0] holds the file with the smallest head, and each of tree[1..k-1]
+ * holds the file that lost the match played at that node, so replacing the
+ * winner's record only needs to replay the log2(k) matches on its path to
+ * the root. Leaf i sits at position k + i of the implicit binary tree.
+ *
+ * Records that compare equal come out in the order they were read, and the
+ * duplicates waiting to be handed to dedup_records are held in a separate
+ * array, so there is no allocation per record.
+ */
 typedef struct {
     struct file_merger_ctx_t  *ctx;
-    record_t                  **data;
-    unsigned                  count;
-} sorted_vector_t;
+    record_t                  *records;
+    unsigned char             *in_play;
+    unsigned                  *tree;
+    uint64_t                  next_order;
+    file_merger_record_t      *held;
+    file_merger_record_t      **held_ptrs;
+    unsigned char             *in_group;
+} loser_tree_t;
 
 typedef struct file_merger_ctx_t {
     unsigned                            num_files;
@@ -55,16 +72,16 @@ typedef struct file_merger_ctx_t {
     file_merger_deduplicate_records_t   dedup_records;
     file_merger_feed_record_t           feed_record;
     void                                *user_ctx;
-    sorted_vector_t                     sorted_vector;
+    loser_tree_t                        loser_tree;
 } file_merger_ctx_t;
 
 
-static int  init_sorted_vector(sorted_vector_t *sorted_vector, unsigned max_elements, file_merger_ctx_t *ctx);
-static void sorted_vector_destroy(sorted_vector_t *sorted_vector);
-static void sorted_vector_pop(sorted_vector_t *sorted_vector,
-                              record_t ***records,
-                              size_t *n);
-static int  sorted_vector_add(sorted_vector_t *sorted_vector, record_t *record);
+static int  init_loser_tree(loser_tree_t *tree, unsigned num_files, file_merger_ctx_t *ctx);
+static void loser_tree_destroy(loser_tree_t *tree);
+static int  loser_tree_build(loser_tree_t *tree);
+static void loser_tree_replay(loser_tree_t *tree, unsigned file);
+static file_merger_error_t loser_tree_advance(loser_tree_t *tree, unsigned file);
+static void loser_tree_free_held(loser_tree_t *tree, size_t n);
 
 static file_merger_error_t do_merge_files(file_merger_ctx_t *ctx);
 
@@ -80,9 +97,42 @@ file_merger_error_t merge_files(const char *source_files[],
                                 file_merger_record_free_t free_record,
                                 int skip_writeback,
                                 void *user_ctx)
+{
+    return merge_files_ex(source_files,
+                          num_files,
+                          dest_file,
+                          read_record,
+                          write_record,
+                          feed_record,
+                          compare_records,
+                          dedup_records,
+                          free_record,
+                          BUFFERED_FILE_READAHEAD,
+                          0,
+                          0,
+                          skip_writeback,
+                          user_ctx);
+}
+
+
+file_merger_error_t merge_files_ex(const char *source_files[],
+                                   unsigned num_files,
+                                   const char *dest_file,
+                                   file_merger_read_record_t read_record,
+                                   file_merger_write_record_t write_record,
+                                   file_merger_feed_record_t feed_record,
+                                   file_merger_compare_records_t compare_records,
+                                   file_merger_deduplicate_records_t dedup_records,
+                                   file_merger_record_free_t free_record,
+                                   int source_flags,
+                                   int dest_flags,
+                                   size_t source_buffers_size,
+                                   int skip_writeback,
+                                   void *user_ctx)
 {
     file_merger_ctx_t ctx;
     file_merger_error_t ret;
+    size_t buffer_size;
     unsigned i, j;
 
     if (num_files == 0) {
@@ -101,28 +151,48 @@ file_merger_error_t merge_files(const char *source_files[],
     if (feed_record && skip_writeback) {
         ctx.dest_file = NULL;
     } else {
-        ctx.dest_file = fopen(dest_file, "ab");
+        ctx.dest_file = buffered_fopen(dest_file, "ab", 0, dest_flags);
     }
 
-    if (!init_sorted_vector(&ctx.sorted_vector, num_files, &ctx)) {
+    if (!init_loser_tree(&ctx.loser_tree, num_files, &ctx)) {
         return FILE_MERGER_ERROR_ALLOC;
     }
 
     if (feed_record == NULL && ctx.dest_file == NULL) {
-        sorted_vector_destroy(&ctx.sorted_vector);
+        loser_tree_destroy(&ctx.loser_tree);
         return FILE_MERGER_ERROR_OPEN_FILE;
     }
 
     ctx.files = (FILE **) malloc(sizeof(FILE *) * num_files);
 
     if (ctx.files == NULL) {
-        sorted_vector_destroy(&ctx.sorted_vector);
+        loser_tree_destroy(&ctx.loser_tree);
         fclose(ctx.dest_file);
         return FILE_MERGER_ERROR_ALLOC;
     }
 
+    /* Reading every source in big chunks keeps a merge of many files from
+     * turning into lots of small reads all over the disk */
+    if (num_files > MERGE_MAX_READAHEAD_FILES) {
+        source_flags &= ~BUFFERED_FILE_READAHEAD;
+    }
+    if (source_buffers_size == 0 ||
+            source_buffers_size > MERGE_SOURCE_BUFFERS_SIZE) {
+        source_buffers_size = MERGE_SOURCE_BUFFERS_SIZE;
+    }
+    buffer_size = source_buffers_size / num_files;
+    if (source_flags & BUFFERED_FILE_READAHEAD) {
+        buffer_size /= 2;
+    }
+    if (buffer_size > BUFFERED_FILE_DEFAULT_BUFFER_SIZE) {
+        buffer_size = BUFFERED_FILE_DEFAULT_BUFFER_SIZE;
+    } else if (buffer_size < MERGE_MIN_SOURCE_BUFFER_SIZE) {
+        buffer_size = MERGE_MIN_SOURCE_BUFFER_SIZE;
+    }
+
     for (i = 0; i < num_files; ++i) {
-        ctx.files[i] = fopen(source_files[i], "rb");
+        ctx.files[i] = buffered_fopen(source_files[i], "rb", buffer_size,
+                                      source_flags);
 
         if (ctx.files[i] == NULL) {
             for (j = 0; j < i; ++j) {
@@ -130,7 +200,7 @@ file_merger_error_t merge_files(const char *source_files[],
             }
             free(ctx.files);
             fclose(ctx.dest_file);
-            sorted_vector_destroy(&ctx.sorted_vector);
+            loser_tree_destroy(&ctx.loser_tree);
 
             return FILE_MERGER_ERROR_OPEN_FILE;
         }
@@ -144,9 +214,11 @@ file_merger_error_t merge_files(const char *source_files[],
         }
     }
     free(ctx.files);
-    sorted_vector_destroy(&ctx.sorted_vector);
-    if (ctx.dest_file) {
-        fclose(ctx.dest_file);
+    loser_tree_destroy(&ctx.loser_tree);
+    /* The destination's last buffer is written out when it's closed */
+    if (ctx.dest_file && fclose(ctx.dest_file) != 0 &&
+            ret == FILE_MERGER_SUCCESS) {
+        ret = FILE_MERGER_ERROR_FILE_WRITE;
     }
 
     return ret;
@@ -155,13 +227,13 @@ file_merger_error_t merge_files(const char *source_files[],
 
 static file_merger_error_t do_merge_files(file_merger_ctx_t *ctx)
 {
+    loser_tree_t *tree = &ctx->loser_tree;
     unsigned i;
 
     for (i = 0; i < ctx->num_files; ++i) {
         FILE *f = ctx->files[i];
         int record_len;
         void *record_data;
-        record_t *record;
 
         record_len = (*ctx->read_record)(f, &record_data, ctx->user_ctx);
 
@@ -171,40 +243,58 @@ static file_merger_error_t do_merge_files(file_merger_ctx_t *ctx)
         } else if (record_len < 0) {
             return (file_merger_error_t) record_len;
         } else {
-            int rv;
-            record = (record_t *) malloc(sizeof(*record));
-            if (record == NULL) {
-                return FILE_MERGER_ERROR_ALLOC;
-            }
-            record->data = record_data;
-            record->file = i;
-            rv = sorted_vector_add(&ctx->sorted_vector, record);
-            assert(rv);
+            tree->records[i].data = record_data;
+            tree->records[i].order = tree->next_order++;
+            tree->in_play[i] = 1;
         }
     }
 
-    while (ctx->sorted_vector.count != 0) {
-        record_t **records;
-        size_t n;
-        size_t i;
-        void *record_data;
-        int record_len;
+    if (!loser_tree_build(tree)) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+
+    while (tree->in_play[tree->tree[0]]) {
+        size_t n = 0;
+        size_t j = 0;
         file_merger_error_t ret;
 
-        /* The head of the list is the required item which needs to be written
-         * to the output destination records file.
-         * For each duplicated item that is eliminated (elements of linked
-         * list), we need to read one record from the same file as the
-         * duplicated record came from and add them to the sort vector.
+        /* The winner is the required item which needs to be written to the
+         * output destination records file. For deduplication, the heads of
+         * the other files that compare equal to it are taken too, and the
+         * callback picks which one of them survives.
+         * Every record taken is replaced straight away by the next record
+         * from the same file; since those are read later, they lose ties
+         * against the heads that were already there.
          */
-        sorted_vector_pop(&ctx->sorted_vector, &records, &n);
-        assert(records != NULL);
-        assert(n != 0);
+        do {
+            unsigned file = tree->tree[0];
+
+            tree->held[n].record = tree->records[file].data;
+            tree->held[n].filenum = file;
+            tree->in_group[file] = 1;
+            tree->records[file].data = NULL;
+            n++;
+
+            ret = loser_tree_advance(tree, file);
+            if (ret != FILE_MERGER_SUCCESS) {
+                loser_tree_free_held(tree, n);
+                return ret;
+            }
+        } while (ctx->dedup_records != NULL &&
+                 tree->in_play[tree->tree[0]] &&
+                 !tree->in_group[tree->tree[0]] &&
+                 (*ctx->compare_records)(tree->held[0].record,
+                                         tree->records[tree->tree[0]].data,
+                                         ctx->user_ctx) == 0);
+
+        if (n > 1) {
+            j = (*ctx->dedup_records)(tree->held_ptrs, n, ctx->user_ctx);
+        }
 
         if (ctx->feed_record) {
-            ret = (*ctx->feed_record)(records[0]->data, ctx->user_ctx);
+            ret = (*ctx->feed_record)(tree->held[j].record, ctx->user_ctx);
             if (ret != FILE_MERGER_SUCCESS) {
-                FREE_RECORD(ctx, records[0]);
+                loser_tree_free_held(tree, n);
                 return ret;
             }
         } else {
@@ -212,155 +302,184 @@ static file_merger_error_t do_merge_files(file_merger_ctx_t *ctx)
         }
 
         if (ctx->dest_file) {
-            ret = (*ctx->write_record)(ctx->dest_file, records[0]->data, ctx->user_ctx);
+            ret = (*ctx->write_record)(ctx->dest_file, tree->held[j].record, ctx->user_ctx);
             if (ret != FILE_MERGER_SUCCESS) {
-                FREE_RECORD(ctx, records[0]);
+                loser_tree_free_held(tree, n);
                 return ret;
             }
         }
 
-        for (i = 0; i < n; i++) {
-            record_len = (*ctx->read_record)(ctx->files[records[i]->file],
-                                             &record_data,
-                                             ctx->user_ctx);
-            if (record_len == 0) {
-                fclose(ctx->files[records[i]->file]);
-                ctx->files[records[i]->file] = NULL;
-                FREE_RECORD(ctx, records[i]);
-
-            } else if (record_len < 0) {
-                FREE_RECORD(ctx, records[i]);
-
-                return (file_merger_error_t) record_len;
-            } else {
-                int rv;
-                (*ctx->free_record)(records[i]->data, ctx->user_ctx);
-                records[i]->data = record_data;
-                rv = sorted_vector_add(&ctx->sorted_vector, records[i]);
-                assert(rv);
-            }
-        }
-
-        free(records);
+        loser_tree_free_held(tree, n);
     }
 
     return FILE_MERGER_SUCCESS;
 }
 
 
-static int init_sorted_vector(sorted_vector_t *sorted_vector,
-                              unsigned max_elements,
-                              file_merger_ctx_t *ctx)
+/* Reads the next record of a file whose head was just taken, and replays its
+ * matches. Must only be called for the current winner. */
+static file_merger_error_t loser_tree_advance(loser_tree_t *tree, unsigned file)
 {
-    sorted_vector->data = (record_t **) malloc(sizeof(record_t *) * max_elements);
-    if (sorted_vector->data == NULL) {
-        return 0;
+    file_merger_ctx_t *ctx = tree->ctx;
+    void *record_data;
+    int record_len;
+
+    record_len = (*ctx->read_record)(ctx->files[file], &record_data, ctx->user_ctx);
+    if (record_len < 0) {
+        return (file_merger_error_t) record_len;
     }
 
-    sorted_vector->count = 0;
-    sorted_vector->ctx = ctx;
+    if (record_len == 0) {
+        fclose(ctx->files[file]);
+        ctx->files[file] = NULL;
+        tree->in_play[file] = 0;
+    } else {
+        tree->records[file].data = record_data;
+        tree->records[file].order = tree->next_order++;
+    }
+    loser_tree_replay(tree, file);
 
-    return 1;
+    return FILE_MERGER_SUCCESS;
 }
 
 
-static void sorted_vector_destroy(sorted_vector_t *sorted_vector)
+static void loser_tree_free_held(loser_tree_t *tree, size_t n)
 {
-    unsigned i;
+    size_t i;
 
-    for (i = 0; i < sorted_vector->count; ++i) {
-        FREE_RECORD(sorted_vector->ctx, sorted_vector->data[i]);
+    for (i = 0; i < n; ++i) {
+        (*tree->ctx->free_record)(tree->held[i].record, tree->ctx->user_ctx);
+        tree->in_group[tree->held[i].filenum] = 0;
     }
-
-    free(sorted_vector->data);
 }
 
 
-#define SORTED_VECTOR_CMP(h, a, b)  \
-    (*(h)->ctx->compare_records)((a)->data, (b)->data, (h)->ctx->user_ctx)
-
-static void sorted_vector_pop(sorted_vector_t *sorted_vector,
-                              record_t ***records,
-                              size_t *n)
+static int init_loser_tree(loser_tree_t *tree,
+                           unsigned num_files,
+                           file_merger_ctx_t *ctx)
 {
-    record_t *head;
-    file_merger_record_t **duplicates;
-    size_t i, j;
-
-    if (sorted_vector->count == 0) {
-        *records = NULL;
-        *n = 0;
-        return;
+    unsigned i;
+
+    tree->ctx = ctx;
+    tree->next_order = 0;
+    tree->records = (record_t *) malloc(sizeof(record_t) * num_files);
+    tree->in_play = (unsigned char *) calloc(num_files, sizeof(unsigned char));
+    tree->tree = (unsigned *) calloc(num_files, sizeof(unsigned));
+    tree->held = (file_merger_record_t *) malloc(sizeof(file_merger_record_t) * num_files);
+    tree->held_ptrs = (file_merger_record_t **) malloc(sizeof(file_merger_record_t *) * num_files);
+    tree->in_group = (unsigned char *) calloc(num_files, sizeof(unsigned char));
+
+    if (tree->records == NULL || tree->in_play == NULL ||
+        tree->tree == NULL || tree->held == NULL ||
+        tree->held_ptrs == NULL || tree->in_group == NULL) {
+        free(tree->records);
+        free(tree->in_play);
+        free(tree->tree);
+        free(tree->held);
+        free(tree->held_ptrs);
+        free(tree->in_group);
+        return 0;
+    }
+
+    for (i = 0; i < num_files; ++i) {
+        tree->records[i].data = NULL;
+        tree->records[i].file = i;
+        tree->held_ptrs[i] = &tree->held[i];
     }
 
-    /* For deduplication, return the list of records whose keys are equal.
-     * Hence they can be eliminated from the sort vector and least element can
-     * be picked for writing out to the output file.
-     * */
-    head = sorted_vector->data[0];
+    return 1;
+}
+
 
-    for (i = 1; sorted_vector->ctx->dedup_records != NULL && i < sorted_vector->count; i++) {
-        if (SORTED_VECTOR_CMP(sorted_vector, head, sorted_vector->data[i]) != 0) {
-            break;
+static void loser_tree_destroy(loser_tree_t *tree)
+{
+    unsigned i;
+
+    for (i = 0; i < tree->ctx->num_files; ++i) {
+        if (tree->records[i].data != NULL) {
+            (*tree->ctx->free_record)(tree->records[i].data, tree->ctx->user_ctx);
         }
     }
 
-    *records = (record_t **) malloc(sizeof(record_t *) * i);
-    memcpy(*records, sorted_vector->data, sizeof(record_t *) * i);
-    *n = i;
+    free(tree->records);
+    free(tree->in_play);
+    free(tree->tree);
+    free(tree->held);
+    free(tree->held_ptrs);
+    free(tree->in_group);
+}
+
 
+/* Returns non-zero if file a's head record must come out before file b's.
+ * Files out of play lose every match, and ties go to the record read first. */
+static int loser_tree_beats(loser_tree_t *tree, unsigned a, unsigned b)
+{
+    int cmp;
 
-    if (i > 1) {
-        record_t *tmp;
-        duplicates = (file_merger_record_t **) *records;
-        j = sorted_vector->ctx->dedup_records(duplicates, i, sorted_vector->ctx->user_ctx);
-        tmp = (*records)[0];
-        (*records)[0] = (*records)[j];
-        (*records)[j] = tmp;
+    if (!tree->in_play[b]) {
+        return 1;
+    }
+    if (!tree->in_play[a]) {
+        return 0;
     }
 
-    sorted_vector->count -= i;
-    memmove(sorted_vector->data + 0, sorted_vector->data + i,
-            sizeof(sorted_vector->data[0]) * (sorted_vector->count));
+    cmp = (*tree->ctx->compare_records)(tree->records[a].data,
+                                        tree->records[b].data,
+                                        tree->ctx->user_ctx);
+    if (cmp != 0) {
+        return cmp < 0;
+    }
+    return tree->records[a].order < tree->records[b].order;
 }
 
 
-static int sorted_vector_add(sorted_vector_t *sorted_vector, record_t *record)
+static int loser_tree_build(loser_tree_t *tree)
 {
-    unsigned l, r;
+    unsigned k = tree->ctx->num_files;
+    unsigned *winners;
+    unsigned node;
 
-    if (sorted_vector->count == sorted_vector->ctx->num_files) {
-        /* sorted_vector full */
+    winners = (unsigned *) malloc(sizeof(unsigned) * 2 * k);
+    if (winners == NULL) {
         return 0;
     }
 
-    l = 0;
-    r = sorted_vector->count;
-    while (r - l > 1) {
-        unsigned pos = (l + r) / 2;
-
-        if (SORTED_VECTOR_CMP(sorted_vector, record, sorted_vector->data[pos]) < 0) {
-            r = pos;
-        } else {
-            l = pos;
-        }
+    for (node = 0; node < k; ++node) {
+        winners[k + node] = node;
     }
+    for (node = k - 1; node >= 1; --node) {
+        unsigned left = winners[2 * node];
+        unsigned right = winners[2 * node + 1];
 
-    if (l == 0 && r != 0) {
-        if (SORTED_VECTOR_CMP(sorted_vector, record, sorted_vector->data[0]) < 0) {
-            r = 0;
+        if (loser_tree_beats(tree, left, right)) {
+            winners[node] = left;
+            tree->tree[node] = right;
+        } else {
+            winners[node] = right;
+            tree->tree[node] = left;
         }
     }
+    tree->tree[0] = winners[1];
 
-    if (r < sorted_vector->count) {
-        memmove(sorted_vector->data + r + 1,
-                sorted_vector->data + r,
-                sizeof(sorted_vector->data[0]) * (sorted_vector->count - r));
-    }
+    free(winners);
 
-    sorted_vector->count += 1;
+    return 1;
+}
 
-    sorted_vector->data[r] = record;
 
-    return 1;
+/* Replays the matches from file's leaf up to the root after the winner's head
+ * record has changed (or it has gone out of play). */
+static void loser_tree_replay(loser_tree_t *tree, unsigned file)
+{
+    unsigned winner = file;
+    unsigned node;
+
+    for (node = (tree->ctx->num_files + file) / 2; node >= 1; node /= 2) {
+        if (loser_tree_beats(tree, tree->tree[node], winner)) {
+            unsigned tmp = tree->tree[node];
+            tree->tree[node] = winner;
+            winner = tmp;
+        }
+    }
+    tree->tree[0] = winner;
 }
@@ -24,6 +24,7 @@
 #include "config.h"
 #include <stdio.h>
 #include <libcouchstore/couch_db.h>
+#include "buffered_file.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -97,6 +98,31 @@ extern "C" {
                                     int skip_writeback,
                                     void *user_ctx);
 
+    /*
+     * Same as merge_files, but with the BUFFERED_FILE_* flags the source
+     * files and the destination file are opened through buffered_fopen().
+     * merge_files reads its sources ahead and writes a plain destination.
+     *
+     * source_buffers_size is the memory the buffers of the source files
+     * share, read-ahead buffers included (0 means 64MB, which is also the
+     * most they use). Each source gets a buffer of at least 64KB, whatever
+     * the size, and past 64 sources none is read ahead.
+     */
+    file_merger_error_t merge_files_ex(const char *source_files[],
+                                       unsigned num_files,
+                                       const char *dest_file,
+                                       file_merger_read_record_t read_record,
+                                       file_merger_write_record_t write_record,
+                                       file_merger_feed_record_t feed_record,
+                                       file_merger_compare_records_t compare_records,
+                                       file_merger_deduplicate_records_t dedup_records,
+                                       file_merger_record_free_t free_record,
+                                       int source_flags,
+                                       int dest_flags,
+                                       size_t source_buffers_size,
+                                       int skip_writeback,
+                                       void *user_ctx);
+
 
 #ifdef __cplusplus
 }
@@ -22,13 +22,25 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#if defined(WIN32) || defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "file_sorter.h"
 #include "file_name_utils.h"
 #include "quicksort.h"
+#include "radix_sort.h"
+#include "buffered_file.h"
 
 #define NSORT_RECORDS_INIT 500000
-#define NSORT_RECORD_INCR  100000
-#define NSORT_THREADS 2
+/* Runs of max_buffer_size that the default memory budget has room for: one
+ * being read plus two being sorted, as with the original two sort threads */
+#define NSORT_DEFAULT_BUDGET_RUNS 3
+/* Read-ahead threads that all the merges a sort runs at once may start */
+#define NSORT_MAX_READAHEAD_FILES 64
+/* Size of the chunks a run's arena hands records out from */
+#define NSORT_ARENA_CHUNK_SIZE (1024 * 1024)
 #define SORTER_TMP_FILE_SUFFIX ".XXXXXX"
 
 typedef struct {
@@ -42,31 +54,59 @@ typedef struct {
     char                         *tmp_file_prefix;
     unsigned                      num_tmp_files;
     unsigned                      max_buffer_size;
+    unsigned                      num_threads;
+    size_t                        memory_budget;
     file_merger_read_record_t     read_record;
+    file_sorter_read_record_arena_t read_record_arena;
     file_merger_write_record_t    write_record;
     file_merger_feed_record_t     feed_record;
     file_merger_compare_records_t compare_records;
+    file_sorter_record_prefix_t   record_prefix;
+    file_sorter_record_key_t      record_key;
     file_merger_record_free_t     free_record;
     void                         *user_ctx;
     FILE                         *f;
     tmp_file_t                   *tmp_files;
     unsigned                      active_tmp_files;
+    int                           tmp_file_flags;
     int                           skip_writeback;
 } file_sort_ctx_t;
 
-// For parallel sorter
+// An intermediate merge of the tmp files [start, end) into dest, reading
+// them with source_flags into buffers of buffers_size bytes in all
+typedef struct {
+    unsigned  start;
+    unsigned  end;
+    unsigned  next_level;
+    char     *dest;
+    int       source_flags;
+    size_t    buffers_size;
+} merge_group_t;
+
+// For parallel sorter. A job either sorts and writes out a run of records,
+// or, if merge is set, runs an intermediate merge. When the run was read
+// into an arena, the records are released along with it.
 typedef struct {
-    void       **records;
-    tmp_file_t *tmp_file;
-    size_t     n;
+    void          **records;
+    tmp_file_t    *tmp_file;
+    size_t        n;
+    arena         *records_arena;
+    merge_group_t *merge;
 } sort_job_t;
 
+// An entry of the array a run is sorted on when the caller gives key prefixes
+typedef struct {
+    uint64_t  prefix;
+    void     *record;
+} prefixed_record_t;
+
 typedef struct {
     size_t              nworkers;
     size_t              free_workers;
     cb_cond_t           cond;
     cb_mutex_t          mutex;
     int                 finished;
+    int                 joined;
     file_sorter_error_t error;
     sort_job_t          *job;
     file_sort_ctx_t     *ctx;
@@ -86,10 +126,14 @@ static file_sorter_error_t write_record_list(void **records,
                                              tmp_file_t *tmp_file,
                                              file_sort_ctx_t *ctx);
 
-static void pick_merge_files(file_sort_ctx_t *ctx,
-                             unsigned *start,
-                             unsigned *end,
-                             unsigned *next_level);
+static unsigned pick_merge_files(file_sort_ctx_t *ctx,
+                                 merge_group_t *groups,
+                                 unsigned max_groups);
+
+static file_sorter_error_t merge_group(file_sort_ctx_t *ctx,
+                                       merge_group_t *group);
+
+static file_sorter_error_t parallel_merge_tmp_files(parallel_sorter_t *s);
 
 static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
                                            unsigned start,
@@ -100,7 +144,8 @@ static file_sorter_error_t iterate_records_file(file_sort_ctx_t *ctx,
                                                 const char *file);
 
 
-static sort_job_t *create_sort_job(void **recs, size_t n, tmp_file_t *t);
+static sort_job_t *create_sort_job(void **recs, size_t n, arena *a,
+                                   tmp_file_t *t);
 
 static void free_sort_job(sort_job_t *job, parallel_sorter_t *sorter);
 
@@ -113,7 +158,11 @@ static void sort_worker(void *args);
 
 static file_sorter_error_t parallel_sorter_add_job(parallel_sorter_t *s,
                                                   void **records,
-                                                  size_t n);
+                                                  size_t n,
+                                                  arena *records_arena);
+
+static file_sorter_error_t parallel_sorter_submit(parallel_sorter_t *s,
+                                                  sort_job_t *job);
 
 static file_sorter_error_t parallel_sorter_wait(parallel_sorter_t *s, size_t n);
 
@@ -123,6 +172,9 @@ static int sorter_random_name(char *tmpl, int totlen, int suffixlen);
 
 static char *sorter_tmp_file_path(const char *tmp_dir, const char *prefix);
 
+static void free_run(void **records, size_t n, arena *records_arena,
+                     file_sort_ctx_t *ctx);
+
 file_sorter_error_t sort_file(const char *source_file,
                               const char *tmp_dir,
                               unsigned num_tmp_files,
@@ -134,6 +186,44 @@ file_sorter_error_t sort_file(const char *source_file,
                               file_merger_record_free_t free_record,
                               int skip_writeback,
                               void *user_ctx)
+{
+    return sort_file_ex(source_file,
+                        tmp_dir,
+                        num_tmp_files,
+                        max_buffer_size,
+                        0,
+                        0,
+                        read_record,
+                        NULL,
+                        write_record,
+                        feed_record,
+                        compare_records,
+                        NULL,
+                        NULL,
+                        free_record,
+                        0,
+                        skip_writeback,
+                        user_ctx);
+}
+
+
+file_sorter_error_t sort_file_ex(const char *source_file,
+                                 const char *tmp_dir,
+                                 unsigned num_tmp_files,
+                                 unsigned max_buffer_size,
+                                 unsigned num_threads,
+                                 size_t memory_budget,
+                                 file_merger_read_record_t read_record,
+                                 file_sorter_read_record_arena_t read_record_arena,
+                                 file_merger_write_record_t write_record,
+                                 file_merger_feed_record_t feed_record,
+                                 file_merger_compare_records_t compare_records,
+                                 file_sorter_record_prefix_t record_prefix,
+                                 file_sorter_record_key_t record_key,
+                                 file_merger_record_free_t free_record,
+                                 int tmp_file_flags,
+                                 int skip_writeback,
+                                 void *user_ctx)
 {
     file_sort_ctx_t ctx;
     unsigned i;
@@ -143,6 +233,31 @@ file_sorter_error_t sort_file(const char *source_file,
         return FILE_SORTER_ERROR_BAD_ARG;
     }
 
+    if (num_threads == 0) {
+        num_threads = sorter_available_cpus();
+        /* The default budget doesn't grow with the CPUs: rather than cutting
+         * it into smaller runs, sort on as many threads as it has room for */
+        if (memory_budget == 0 &&
+                num_threads > NSORT_DEFAULT_BUDGET_RUNS - 1) {
+            num_threads = NSORT_DEFAULT_BUDGET_RUNS - 1;
+        }
+    }
+    /* Every run being sorted holds a temporary file, so leave room for at
+     * least one finished run next to them. */
+    if (num_threads > num_tmp_files - 1) {
+        num_threads = num_tmp_files - 1;
+    }
+    if (memory_budget == 0) {
+        memory_budget = (size_t) max_buffer_size * NSORT_DEFAULT_BUDGET_RUNS;
+    }
+    /* The run being read needs a share of the budget too */
+    if (memory_budget / (num_threads + 1) < max_buffer_size) {
+        max_buffer_size = (unsigned) (memory_budget / (num_threads + 1));
+        if (max_buffer_size == 0) {
+            max_buffer_size = 1;
+        }
+    }
+
     ctx.tmp_file_prefix = file_basename(source_file);
     if (ctx.tmp_file_prefix == NULL) {
         return FILE_SORTER_ERROR_TMP_FILE_BASENAME;
@@ -152,20 +267,26 @@ file_sorter_error_t sort_file(const char *source_file,
     ctx.source_file = source_file;
     ctx.num_tmp_files = num_tmp_files;
     ctx.max_buffer_size = max_buffer_size;
+    ctx.num_threads = num_threads;
+    ctx.memory_budget = memory_budget;
     ctx.read_record = read_record;
+    ctx.read_record_arena = read_record_arena;
     ctx.write_record = write_record;
     ctx.feed_record = feed_record;
     ctx.compare_records = compare_records;
+    ctx.record_prefix = record_prefix;
+    ctx.record_key = record_key;
     ctx.free_record = free_record;
     ctx.user_ctx = user_ctx;
     ctx.active_tmp_files = 0;
+    ctx.tmp_file_flags = tmp_file_flags & ~BUFFERED_FILE_READAHEAD;
     ctx.skip_writeback = skip_writeback;
 
     if (skip_writeback && !feed_record) {
         return FILE_SORTER_ERROR_MISSING_CALLBACK;
     }
 
-    ctx.f = fopen(source_file, "rb");
+    ctx.f = buffered_fopen(source_file, "rb", 0, BUFFERED_FILE_READAHEAD);
     if (ctx.f == NULL) {
         free(ctx.tmp_file_prefix);
         return FILE_SORTER_ERROR_OPEN_FILE;
@@ -202,12 +323,14 @@ file_sorter_error_t sort_file(const char *source_file,
 }
 
 
-static sort_job_t *create_sort_job(void **recs, size_t n, tmp_file_t *t)
+static sort_job_t *create_sort_job(void **recs, size_t n, arena *a,
+                                   tmp_file_t *t)
 {
     sort_job_t *job = (sort_job_t *) calloc(1, sizeof(sort_job_t));
     if (job) {
         job->records = recs;
         job->n = n;
+        job->records_arena = a;
         job->tmp_file = t;
     }
 
@@ -216,17 +339,27 @@ static sort_job_t *create_sort_job(void **recs, size_t n, tmp_file_t *t)
 
 
 static void free_sort_job(sort_job_t *job, parallel_sorter_t *sorter)
+{
+    if (job) {
+        free_run(job->records, job->n, job->records_arena, sorter->ctx);
+        free(job);
+    }
+}
+
+
+static void free_run(void **records, size_t n, arena *records_arena,
+                     file_sort_ctx_t *ctx)
 {
     size_t i;
 
-    if (job) {
-        for (i = 0; i < job->n; i++) {
-            (*sorter->ctx->free_record)(job->records[i], sorter->ctx->user_ctx);
+    if (records_arena != NULL) {
+        delete_arena(records_arena);
+    } else {
+        for (i = 0; i < n; i++) {
+            (*ctx->free_record)(records[i], ctx->user_ctx);
         }
-
-        free(job->records);
-        free(job);
     }
+    free(records);
 }
 
 
@@ -244,6 +377,7 @@ static parallel_sorter_t *create_parallel_sorter(size_t workers,
     cb_mutex_initialize(&s->mutex);
     cb_cond_initialize(&s->cond);
     s->finished = 0;
+    s->joined = 0;
     s->error = FILE_SORTER_SUCCESS;
     s->job = NULL;
     s->ctx = ctx;
@@ -317,7 +451,11 @@ static void sort_worker(void *args)
             cb_mutex_exit(&s->mutex);
             cb_cond_broadcast(&s->cond);
 
-            ret = write_record_list(job->records, job->n, job->tmp_file, s->ctx);
+            if (job->merge) {
+                ret = merge_group(s->ctx, job->merge);
+            } else {
+                ret = write_record_list(job->records, job->n, job->tmp_file, s->ctx);
+            }
             free_sort_job(job, s);
             if (ret != FILE_SORTER_SUCCESS) {
                 cb_mutex_enter(&s->mutex);
@@ -343,9 +481,9 @@ static void sort_worker(void *args)
  // Add a job and block wait until a worker picks up the job
 static file_sorter_error_t parallel_sorter_add_job(parallel_sorter_t *s,
                                                   void **records,
-                                                  size_t n)
+                                                  size_t n,
+                                                  arena *records_arena)
 {
-    file_sorter_error_t ret;
     sort_job_t *job;
     tmp_file_t *tmp_file = create_tmp_file(s->ctx);
 
@@ -353,15 +491,28 @@ static file_sorter_error_t parallel_sorter_add_job(parallel_sorter_t *s,
         return FILE_SORTER_ERROR_MK_TMP_FILE;
     }
 
-    job = create_sort_job(records, n, tmp_file);
+    job = create_sort_job(records, n, records_arena, tmp_file);
     if (!job) {
         return FILE_SORTER_ERROR_ALLOC;
     }
 
+    return parallel_sorter_submit(s, job);
+}
+
+
+// Hand a job over and block wait until a worker picks it up. The job is
+// freed on failure, but not its records, which are still the caller's.
+static file_sorter_error_t parallel_sorter_submit(parallel_sorter_t *s,
+                                                  sort_job_t *job)
+{
+    file_sorter_error_t ret;
+
     cb_mutex_enter(&s->mutex);
     if (s->finished) {
         ret = s->error;
         cb_mutex_exit(&s->mutex);
+        /* The records are still the caller's */
+        free(job);
         return ret;
     }
 
@@ -370,7 +521,7 @@ static file_sorter_error_t parallel_sorter_add_job(parallel_sorter_t *s,
     cb_cond_signal(&s->cond);
 
     cb_mutex_enter(&s->mutex);
-    while (s->job) {
+    while (s->job && !s->finished) {
         cb_cond_wait(&s->cond, &s->mutex);
     }
     cb_mutex_exit(&s->mutex);
@@ -406,6 +557,11 @@ static file_sorter_error_t parallel_sorter_finish(parallel_sorter_t *s)
     file_sorter_error_t ret;
     size_t i;
 
+    if (s->joined) {
+        return FILE_SORTER_SUCCESS;
+    }
+    s->joined = 1;
+
     cb_mutex_enter(&s->mutex);
     s->finished = 1;
     cb_mutex_exit(&s->mutex);
@@ -432,22 +588,45 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
     file_sorter_error_t ret;
     file_merger_feed_record_t feed_record = ctx->feed_record;
     parallel_sorter_t *sorter;
+    arena *run_arena = NULL;
+    size_t arena_chunk_size = NSORT_ARENA_CHUNK_SIZE;
     void **records = (void **) calloc(record_count, sizeof(void *));
 
     if (records == NULL) {
         return FILE_SORTER_ERROR_ALLOC;
     }
 
-    sorter = create_parallel_sorter(NSORT_THREADS, ctx);
+    sorter = create_parallel_sorter(ctx->num_threads, ctx);
     if (sorter == NULL) {
+        free(records);
         return FILE_SORTER_ERROR_ALLOC;
     }
 
     ctx->feed_record = NULL;
+    if (ctx->max_buffer_size < arena_chunk_size) {
+        arena_chunk_size = ctx->max_buffer_size;
+    }
 
+    /*
+     * Runs are handed to the sort workers as soon as they fill up, and the
+     * next run is read while up to num_threads earlier ones are being sorted
+     * and written out.
+     */
     i = 0;
     while (1) {
-        record_size = (*ctx->read_record)(ctx->f, &record, ctx->user_ctx);
+        if (ctx->read_record_arena != NULL) {
+            if (run_arena == NULL) {
+                run_arena = new_arena(arena_chunk_size);
+                if (run_arena == NULL) {
+                    ret = FILE_SORTER_ERROR_ALLOC;
+                    goto failure;
+                }
+            }
+            record_size = (*ctx->read_record_arena)(ctx->f, &record, run_arena,
+                                                    ctx->user_ctx);
+        } else {
+            record_size = (*ctx->read_record)(ctx->f, &record, ctx->user_ctx);
+        }
         if (record_size < 0) {
            ret = (file_sorter_error_t) record_size;
            goto failure;
@@ -458,6 +637,9 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
         if (records == NULL) {
             records = (void **) calloc(record_count, sizeof(void *));
             if (records == NULL) {
+                if (run_arena == NULL) {
+                    (*ctx->free_record)(record, ctx->user_ctx);
+                }
                 ret =  FILE_SORTER_ERROR_ALLOC;
                 goto failure;
             }
@@ -465,44 +647,43 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
 
         records[i++] = record;
         if (i == record_count) {
-            record_count += NSORT_RECORD_INCR;
-            records = (void **) realloc(records, record_count * sizeof(void *));
-            if (records == NULL) {
+            void **new_records;
+
+            new_records = (void **) realloc(records, 2 * record_count * sizeof(void *));
+            if (new_records == NULL) {
                 ret =  FILE_SORTER_ERROR_ALLOC;
                 goto failure;
             }
+            records = new_records;
+            record_count *= 2;
         }
 
         buffer_size += (unsigned) record_size;
 
         if (buffer_size >= ctx->max_buffer_size) {
-            ret = parallel_sorter_add_job(sorter, records, i);
+            ret = parallel_sorter_add_job(sorter, records, i, run_arena);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
 
+            records = NULL;
+            run_arena = NULL;
+            buffer_size = 0;
+            i = 0;
+
             ret = parallel_sorter_wait(sorter, 1);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
-
-            records = NULL;
-            record_count = NSORT_RECORDS_INIT;
-            buffer_size = 0;
-            i = 0;
         }
 
         if (ctx->active_tmp_files >= ctx->num_tmp_files) {
-            unsigned start, end, next_level;
-
-            ret = parallel_sorter_wait(sorter, NSORT_THREADS);
+            ret = parallel_sorter_wait(sorter, ctx->num_threads);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
 
-            pick_merge_files(ctx, &start, &end, &next_level);
-            assert(next_level > 1);
-            ret = merge_tmp_files(ctx, start, end, next_level);
+            ret = parallel_merge_tmp_files(sorter);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
@@ -514,14 +695,18 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
 
     if (ctx->active_tmp_files == 0 && buffer_size == 0) {
         /* empty source file */
-        return FILE_SORTER_SUCCESS;
+        ret = FILE_SORTER_SUCCESS;
+        goto failure;
     }
 
     if (buffer_size > 0) {
-        ret = parallel_sorter_add_job(sorter, records, i);
+        ret = parallel_sorter_add_job(sorter, records, i, run_arena);
         if (ret != FILE_SORTER_SUCCESS) {
             goto failure;
         }
+        records = NULL;
+        run_arena = NULL;
+        i = 0;
     }
 
     ret = parallel_sorter_finish(sorter);
@@ -538,7 +723,8 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
 
     // Restore feed_record callback for final merge */
     ctx->feed_record = feed_record;
-    if (ctx->active_tmp_files == 1) {
+    if (ctx->active_tmp_files == 1 &&
+            !(ctx->tmp_file_flags & BUFFERED_FILE_COMPRESSED)) {
         if (ctx->feed_record) {
             ret = iterate_records_file(ctx, ctx->tmp_files[0].name);
             if (ret != FILE_SORTER_SUCCESS) {
@@ -556,7 +742,9 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
             ret = FILE_SORTER_ERROR_RENAME_FILE;
             goto failure;
         }
-    } else if (ctx->active_tmp_files > 1) {
+    } else {
+        /* A compressed run can't just be renamed, it is decompressed by
+         * a merge of it alone. */
         ret = merge_tmp_files(ctx, 0, ctx->active_tmp_files, 0);
         if (ret != FILE_SORTER_SUCCESS) {
             goto failure;
@@ -566,7 +754,9 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
     ret = FILE_SORTER_SUCCESS;
 
  failure:
+    parallel_sorter_finish(sorter);
     free_parallel_sorter(sorter);
+    free_run(records, records != NULL ? i : 0, run_arena, ctx);
     return ret;
 }
 
@@ -582,7 +772,7 @@ static file_sorter_error_t write_record_list(void **records,
     sort_records(records, n, ctx);
 
     remove(tmp_file->name);
-    f = fopen(tmp_file->name, "ab");
+    f = buffered_fopen(tmp_file->name, "ab", 0, ctx->tmp_file_flags);
     if (f == NULL) {
         return FILE_SORTER_ERROR_MK_TMP_FILE;
     }
@@ -599,8 +789,10 @@ static file_sorter_error_t write_record_list(void **records,
     for (i = 0; i < n; i++) {
         file_sorter_error_t err;
         err = static_cast<file_sorter_error_t>((*ctx->write_record)(f, records[i], ctx->user_ctx));
-        (*ctx->free_record)(records[i], ctx->user_ctx);
-        records[i] = NULL;
+        if (ctx->read_record_arena == NULL) {
+            (*ctx->free_record)(records[i], ctx->user_ctx);
+            records[i] = NULL;
+        }
 
         if (err != FILE_SORTER_SUCCESS) {
             fclose(f);
@@ -608,7 +800,10 @@ static file_sorter_error_t write_record_list(void **records,
         }
     }
 
-    fclose(f);
+    /* The last buffer is written out when the file is closed */
+    if (fclose(f) != 0) {
+        return FILE_SORTER_ERROR_FILE_WRITE;
+    }
 
     return FILE_SORTER_SUCCESS;
 }
@@ -643,9 +838,67 @@ static int qsort_cmp(const void *a, const void *b, void *ctx)
 }
 
 
+static int prefixed_qsort_cmp(const void *a, const void *b, void *ctx)
+{
+    file_sort_ctx_t *sort_ctx = (file_sort_ctx_t *) ctx;
+    const prefixed_record_t *r1 = (const prefixed_record_t *) a;
+    const prefixed_record_t *r2 = (const prefixed_record_t *) b;
+
+    if (r1->prefix != r2->prefix) {
+        return r1->prefix < r2->prefix ? -1 : 1;
+    }
+    return (*sort_ctx->compare_records)(r1->record, r2->record,
+                                        sort_ctx->user_ctx);
+}
+
+
 static void sort_records(void **records, size_t n,
                                          file_sort_ctx_t *ctx)
 {
+    prefixed_record_t *prefixed;
+    radix_sort_entry_t *entries;
+    size_t i;
+
+    if (ctx->record_key != NULL && n > 1) {
+        entries = (radix_sort_entry_t *) malloc(n * sizeof(radix_sort_entry_t));
+        if (entries != NULL) {
+            for (i = 0; i < n; i++) {
+                (*ctx->record_key)(records[i], &entries[i].key, ctx->user_ctx);
+                entries[i].record = records[i];
+            }
+            if (radix_sort(entries, n) == 0) {
+                for (i = 0; i < n; i++) {
+                    records[i] = entries[i].record;
+                }
+                free(entries);
+                return;
+            }
+            free(entries);
+        }
+        /* Not enough memory for the radix sort, compare records instead */
+    }
+
+    if (ctx->record_prefix != NULL && n > 1) {
+        /* Most comparisons are then settled within the array, without
+         * touching the records themselves */
+        prefixed = (prefixed_record_t *) malloc(n * sizeof(prefixed_record_t));
+        if (prefixed != NULL) {
+            for (i = 0; i < n; i++) {
+                prefixed[i].prefix = (*ctx->record_prefix)(records[i],
+                                                           ctx->user_ctx);
+                prefixed[i].record = records[i];
+            }
+            quicksort(prefixed, n, sizeof(prefixed_record_t),
+                      &prefixed_qsort_cmp, ctx);
+            for (i = 0; i < n; i++) {
+                records[i] = prefixed[i].record;
+            }
+            free(prefixed);
+            return;
+        }
+        /* Not enough memory for the prefixes, sort without them */
+    }
+
     quicksort(records, n, sizeof(void *), &qsort_cmp, ctx);
 }
 
@@ -666,16 +919,26 @@ static int tmp_file_cmp(const void *a, const void *b)
 }
 
 
-static void pick_merge_files(file_sort_ctx_t *ctx,
-                             unsigned *start,
-                             unsigned *end,
-                             unsigned *next_level)
+/* Picks up to max_groups disjoint groups of tmp files to merge, preferring
+ * files of the same level, and returns how many it picked. Large groups are
+ * split so that more workers get a merge to run, but only into groups of at
+ * least half the tmp files: every record a merge rewrites should move up as
+ * many levels as with one merge of them all. */
+static unsigned pick_merge_files(file_sort_ctx_t *ctx,
+                                 merge_group_t *groups,
+                                 unsigned max_groups)
 {
     unsigned i, j, level;
+    unsigned ngroups = 0;
+    unsigned min_fan_in = ctx->num_tmp_files / 2;
+
+    if (min_fan_in < 2) {
+        min_fan_in = 2;
+    }
 
     qsort(ctx->tmp_files, ctx->active_tmp_files, sizeof(tmp_file_t), tmp_file_cmp);
 
-    for (i = 0; i < ctx->active_tmp_files; i = j) {
+    for (i = 0; i < ctx->active_tmp_files && ngroups < max_groups; i = j) {
         level = ctx->tmp_files[i].level;
         assert(level > 0);
         j = i + 1;
@@ -689,19 +952,204 @@ static void pick_merge_files(file_sort_ctx_t *ctx,
         }
 
         if ((j - i) > 1) {
-            *start = i;
-            *end = j;
-            *next_level = (j - i) * level;
-            return;
+            groups[ngroups].start = i;
+            groups[ngroups].end = j;
+            groups[ngroups].next_level = (j - i) * level;
+            groups[ngroups].dest = NULL;
+            ngroups++;
+        }
+    }
+
+    while (ngroups > 0 && ngroups < max_groups) {
+        unsigned largest = 0, size, mid;
+
+        for (i = 1; i < ngroups; ++i) {
+            if (groups[i].end - groups[i].start >
+                    groups[largest].end - groups[largest].start) {
+                largest = i;
+            }
         }
+        size = groups[largest].end - groups[largest].start;
+        if (size / 2 < min_fan_in) {
+            break;
+        }
+
+        level = ctx->tmp_files[groups[largest].start].level;
+        mid = groups[largest].start + size / 2;
+        groups[ngroups].start = mid;
+        groups[ngroups].end = groups[largest].end;
+        groups[ngroups].next_level = (groups[ngroups].end - mid) * level;
+        groups[ngroups].dest = NULL;
+        groups[largest].end = mid;
+        groups[largest].next_level = (mid - groups[largest].start) * level;
+        ngroups++;
+    }
+
+    if (ngroups > 0) {
+        return ngroups;
     }
 
     /* All files have a different level. */
     assert(ctx->active_tmp_files == ctx->num_tmp_files);
     assert(ctx->active_tmp_files >= 2);
-    *start = 0;
-    *end = 2;
-    *next_level = ctx->tmp_files[0].level + ctx->tmp_files[1].level;
+    groups[0].start = 0;
+    groups[0].end = 2;
+    groups[0].next_level = ctx->tmp_files[0].level + ctx->tmp_files[1].level;
+    groups[0].dest = NULL;
+
+    return 1;
+}
+
+
+/* Merges one group of tmp files into its dest file. Only reads ctx, so
+ * several groups can be merged at once by the sorter's workers. */
+static file_sorter_error_t merge_group(file_sort_ctx_t *ctx,
+                                       merge_group_t *group)
+{
+    const char **files;
+    unsigned nfiles, i;
+    file_sorter_error_t ret;
+
+    nfiles = group->end - group->start;
+    files = (const char **) malloc(sizeof(char *) * nfiles);
+    if (files == NULL) {
+        return FILE_SORTER_ERROR_ALLOC;
+    }
+    for (i = group->start; i < group->end; ++i) {
+        files[i - group->start] = ctx->tmp_files[i].name;
+        assert(files[i - group->start] != NULL);
+    }
+
+    ret = (file_sorter_error_t) merge_files_ex(files,
+                                               nfiles,
+                                               group->dest,
+                                               ctx->read_record,
+                                               ctx->write_record,
+                                               NULL,
+                                               ctx->compare_records,
+                                               NULL,
+                                               ctx->free_record,
+                                               group->source_flags,
+                                               ctx->tmp_file_flags,
+                                               group->buffers_size,
+                                               0,
+                                               ctx->user_ctx);
+
+    free(files);
+
+    return ret;
+}
+
+
+/*
+ * Runs the intermediate merges needed to free up tmp files. Disjoint groups
+ * of files are merged concurrently, one per worker; all the workers must be
+ * idle when this is called, and the bookkeeping of ctx->tmp_files is only
+ * done once every merge has finished.
+ *
+ * The merges share the memory budget the idle workers' runs would use, and
+ * NSORT_MAX_READAHEAD_FILES read-ahead threads, handed out to the groups in
+ * the order they were picked.
+ */
+static file_sorter_error_t parallel_merge_tmp_files(parallel_sorter_t *s)
+{
+    file_sort_ctx_t *ctx = s->ctx;
+    merge_group_t *groups;
+    unsigned ngroups, g, i, nmerged = 0;
+    unsigned readahead_files = 0;
+    size_t buffers_size;
+    file_sorter_error_t ret = FILE_SORTER_SUCCESS;
+
+    groups = (merge_group_t *) malloc(sizeof(merge_group_t) * s->nworkers);
+    if (groups == NULL) {
+        return FILE_SORTER_ERROR_ALLOC;
+    }
+
+    ngroups = pick_merge_files(ctx, groups, (unsigned) s->nworkers);
+    /* The run being read stays in memory meanwhile. 0 would mean the
+     * merger's default, so a budget that's all taken still gives 1. */
+    buffers_size = 0;
+    if (ngroups > 0 && ctx->memory_budget > ctx->max_buffer_size) {
+        buffers_size = (ctx->memory_budget - ctx->max_buffer_size) / ngroups;
+    }
+    if (buffers_size == 0) {
+        buffers_size = 1;
+    }
+    for (g = 0; g < ngroups; ++g) {
+        unsigned nfiles = groups[g].end - groups[g].start;
+
+        groups[g].source_flags = ctx->tmp_file_flags;
+        if (readahead_files + nfiles <= NSORT_MAX_READAHEAD_FILES) {
+            groups[g].source_flags |= BUFFERED_FILE_READAHEAD;
+            readahead_files += nfiles;
+        }
+        groups[g].buffers_size = buffers_size;
+    }
+
+    for (g = 0; g < ngroups; ++g) {
+        sort_job_t *job;
+
+        assert(groups[g].next_level > 1);
+        groups[g].dest = sorter_tmp_file_path(ctx->tmp_dir, ctx->tmp_file_prefix);
+        if (groups[g].dest == NULL) {
+            ret = FILE_SORTER_ERROR_MK_TMP_FILE;
+            break;
+        }
+
+        job = create_sort_job(NULL, 0, NULL, NULL);
+        if (job == NULL) {
+            ret = FILE_SORTER_ERROR_ALLOC;
+            break;
+        }
+        job->merge = &groups[g];
+        ret = parallel_sorter_submit(s, job);
+        if (ret != FILE_SORTER_SUCCESS) {
+            break;
+        }
+    }
+
+    if (ret == FILE_SORTER_SUCCESS) {
+        ret = parallel_sorter_wait(s, s->nworkers);
+    }
+
+    if (ret != FILE_SORTER_SUCCESS) {
+        /* Let the merges already started finish before cleaning up */
+        parallel_sorter_finish(s);
+        for (g = 0; g < ngroups; ++g) {
+            if (groups[g].dest != NULL) {
+                remove(groups[g].dest);
+                free(groups[g].dest);
+            }
+        }
+        free(groups);
+        return ret;
+    }
+
+    for (g = 0; g < ngroups; ++g) {
+        for (i = groups[g].start; i < groups[g].end; ++i) {
+            if (remove(ctx->tmp_files[i].name) != 0) {
+                ret = FILE_SORTER_ERROR_DELETE_FILE;
+            }
+            free(ctx->tmp_files[i].name);
+            ctx->tmp_files[i].name = NULL;
+            ctx->tmp_files[i].level = 0;
+        }
+        nmerged += groups[g].end - groups[g].start;
+    }
+
+    qsort(ctx->tmp_files, ctx->num_tmp_files, sizeof(tmp_file_t), tmp_file_cmp);
+    ctx->active_tmp_files -= nmerged;
+
+    for (g = 0; g < ngroups; ++g) {
+        i = ctx->active_tmp_files;
+        ctx->tmp_files[i].name = groups[g].dest;
+        ctx->tmp_files[i].level = groups[g].next_level;
+        ctx->active_tmp_files += 1;
+    }
+
+    free(groups);
+
+    return ret;
 }
 
 
@@ -744,17 +1192,27 @@ static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
         }
     }
 
-    ret = (file_sorter_error_t) merge_files(files,
-                                            nfiles,
-                                            dest_tmp_file,
-                                            ctx->read_record,
-                                            ctx->write_record,
-                                            feed_record,
-                                            ctx->compare_records,
-                                            NULL,
-                                            ctx->free_record,
-                                            ctx->skip_writeback,
-                                            ctx->user_ctx);
+    ret = (file_sorter_error_t) merge_files_ex(files,
+                                               nfiles,
+                                               dest_tmp_file,
+                                               ctx->read_record,
+                                               ctx->write_record,
+                                               feed_record,
+                                               ctx->compare_records,
+                                               NULL,
+                                               ctx->free_record,
+                                               ctx->tmp_file_flags |
+                                                   BUFFERED_FILE_READAHEAD,
+                                               /* the final merge writes the
+                                                * source file back */
+                                               next_level != 0 ?
+                                                   ctx->tmp_file_flags :
+                                                   ctx->tmp_file_flags &
+                                                       ~BUFFERED_FILE_COMPRESSED,
+                                               /* no run is held any more */
+                                               ctx->memory_budget,
+                                               ctx->skip_writeback,
+                                               ctx->user_ctx);
 
     free(files);
 
@@ -797,7 +1255,7 @@ static file_sorter_error_t iterate_records_file(file_sort_ctx_t *ctx,
 {
     void *record_data = NULL;
     int record_len;
-    FILE *f = fopen(file, "rb");
+    FILE *f = buffered_fopen(file, "rb", 0, BUFFERED_FILE_READAHEAD);
     int ret = FILE_SORTER_SUCCESS;
 
     if (f == NULL) {
@@ -831,17 +1289,54 @@ cleanup:
     return (file_sorter_error_t) ret;
 }
 
+unsigned sorter_available_cpus(void)
+{
+#if defined(WIN32) || defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (unsigned) info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned) n : 1;
+#endif
+}
+
+/* Several files may be sorted at once (one per view while building a view
+ * group), so the counter making temporary file names unique is shared
+ * under a lock. */
+class TmpNameCounter {
+public:
+    TmpNameCounter() : value(0) {
+        cb_mutex_initialize(&mutex);
+    }
+    ~TmpNameCounter() {
+        cb_mutex_destroy(&mutex);
+    }
+    unsigned int next() {
+        unsigned int ret;
+        cb_mutex_enter(&mutex);
+        ret = value;
+        if (++value > 2 << 18) {
+            value = 0;
+        }
+        cb_mutex_exit(&mutex);
+        return ret;
+    }
+private:
+    cb_mutex_t mutex;
+    unsigned int value;
+};
+
+static TmpNameCounter tmp_name_counter;
+
 int sorter_random_name(char *tmpl, int totlen, int suffixlen) {
-    static unsigned int value = 0;
+    unsigned int value = tmp_name_counter.next();
     tmpl = tmpl + totlen - suffixlen;
 #ifdef WINDOWS
     _snprintf(tmpl, suffixlen, ".%d", value);
 #else
     snprintf(tmpl, suffixlen, ".%d", value);
 #endif
-    if (++value > 2 << 18) {
-        value = 0;
-    }
     return 0;
 }
 
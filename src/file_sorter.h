@@ -24,6 +24,7 @@
 #include "config.h"
 #include <libcouchstore/couch_db.h>
 #include "file_merger.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,6 +47,33 @@ extern "C" {
     } file_sorter_error_t;
 
 
+    /*
+     * Same as file_merger_read_record_t, but the record must be allocated
+     * from the given arena instead of with malloc. It is never passed to
+     * the free record callback.
+     */
+    typedef int (*file_sorter_read_record_arena_t)(FILE *f,
+                                                   void **record_buffer,
+                                                   arena *a,
+                                                   void *user_ctx);
+
+    /*
+     * Returns the first bytes of a record's sort key packed into an integer,
+     * such that whenever the compare records callback orders a record before
+     * another, its prefix is less than or equal to the other's. Records with
+     * different prefixes are ordered by them alone.
+     */
+    typedef uint64_t (*file_sorter_record_prefix_t)(const void *record,
+                                                    void *user_ctx);
+
+    /*
+     * Points key at a record's sort key, for records whose compare callback
+     * orders them by plain byte order of that key, as ebin_cmp does.
+     */
+    typedef void (*file_sorter_record_key_t)(const void *record,
+                                             sized_buf *key,
+                                             void *user_ctx);
+
     file_sorter_error_t sort_file(const char *source_file,
                                   const char *tmp_dir,
                                   unsigned num_tmp_files,
@@ -58,6 +86,66 @@ extern "C" {
                                   int skip_writeback,
                                   void *user_ctx);
 
+    /*
+     * Same as sort_file, but with control over the parallelism and memory use.
+     *
+     * num_threads is the number of threads sorting and writing out runs
+     * while the next run is read (0 means one per available CPU core, or at
+     * most 2 with the default memory budget; it is capped at
+     * num_tmp_files - 1). memory_budget bounds the total size of the runs
+     * held in memory at once, across the one being read and those being
+     * sorted (0 means 3 * max_buffer_size, as sort_file uses); runs are made
+     * smaller than max_buffer_size when needed to fit it. Sorting on more
+     * threads with full-size runs takes a bigger budget. Merges take their
+     * buffers from the same budget: the intermediate merges that run at once
+     * split what the runs being sorted would use (each source file still
+     * gets at least 64KB), and between them read at most 64 of their source
+     * files ahead.
+     *
+     * If read_record_arena is not NULL, it is used instead of read_record
+     * when reading the source file: each run is read into an arena of its
+     * own, which is released as a whole once the run is written out rather
+     * than freeing its records one by one. Merges still use read_record and
+     * free_record.
+     *
+     * If record_prefix is not NULL, runs are sorted on an array holding each
+     * record's key prefix next to its pointer, and compare_records is only
+     * called for records whose prefixes are equal.
+     *
+     * If record_key is not NULL, runs are instead radix sorted on the keys it
+     * returns, without calling compare_records.
+     *
+     * The temporary files holding sorted runs and intermediate merges are
+     * opened through buffered_fopen() with tmp_file_flags: with
+     * BUFFERED_FILE_COMPRESSED they are written compressed, trading some CPU
+     * for less temporary disk traffic, and with BUFFERED_FILE_DIRECT they
+     * bypass the page cache. Merge inputs, and the source file, are always
+     * read ahead.
+     */
+    file_sorter_error_t sort_file_ex(const char *source_file,
+                                     const char *tmp_dir,
+                                     unsigned num_tmp_files,
+                                     unsigned max_buffer_size,
+                                     unsigned num_threads,
+                                     size_t memory_budget,
+                                     file_merger_read_record_t read_record,
+                                     file_sorter_read_record_arena_t read_record_arena,
+                                     file_merger_write_record_t write_record,
+                                     file_merger_feed_record_t feed_record,
+                                     file_merger_compare_records_t compare_records,
+                                     file_sorter_record_prefix_t record_prefix,
+                                     file_sorter_record_key_t record_key,
+                                     file_merger_record_free_t free_record,
+                                     int tmp_file_flags,
+                                     int skip_writeback,
+                                     void *user_ctx);
+
+    /*
+     * Number of CPU cores available to this process, as used for the
+     * default number of sort threads.
+     */
+    unsigned sorter_available_cpus(void);
+
 #ifdef __cplusplus
 }
 #endif
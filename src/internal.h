@@ -41,6 +41,9 @@ extern "C" {
         couch_file_handle handle;
         const char* path;
         couchstore_error_info_t lastError;
+        /* When set, reads and appends hold this lock while doing I/O, so
+         * that several threads can read and write nodes of the file at once. */
+        cb_mutex_t *io_lock;
     } tree_file;
 
     typedef struct _nodepointer {
@@ -96,6 +99,14 @@ extern "C" {
         Parameters and return value are the same as for pread_bin. */
     int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr);
 
+    /** Same as pread_bin, but the chunk is allocated from the arena 'a' instead of the heap,
+        and must not be freed. On failure nothing is left allocated from the arena. */
+    int pread_bin_arena(tree_file *file, cs_off_t pos, struct arena *a, char **ret_ptr);
+
+    /** Same as pread_compressed, but the decompressed chunk is allocated from the arena 'a'.
+        Parameters and return value are the same as for pread_bin_arena. */
+    int pread_compressed_arena(tree_file *file, cs_off_t pos, struct arena *a, char **ret_ptr);
+
     /** Reads a file header from the file at a given position.
         Parameters and return value are the same as for pread_bin. */
     int pread_header(tree_file *file,
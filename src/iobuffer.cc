@@ -23,6 +23,11 @@
 #define WRITE_BUFFER_CAPACITY (128*1024)
 #define READ_BUFFER_CAPACITY (8*1024)
 
+// The read cache shared by snapshot handles is split into independently locked
+// shards, so concurrent readers only contend when they hit the same shard.
+#define SHARED_CACHE_SHARDS 16
+#define SHARED_CACHE_BUFFERS_PER_SHARD 16
+
 #ifdef min
 #undef min
 #endif
@@ -42,6 +47,19 @@ typedef struct file_buffer {
 } file_buffer;
 
 
+typedef struct shared_cache_shard {
+    cb_mutex_t mutex;
+    unsigned nbuffers;
+    file_buffer* first_buffer;
+} shared_cache_shard;
+
+// Block cache shared by all the snapshot handles of one buffered file handle.
+typedef struct shared_read_cache {
+    const couch_file_ops* raw_ops;
+    couch_file_handle raw_ops_handle;
+    shared_cache_shard shards[SHARED_CACHE_SHARDS];
+} shared_read_cache;
+
 // How I interpret a couch_file_handle:
 typedef struct buffered_file_handle {
     const couch_file_ops* raw_ops;
@@ -49,8 +67,15 @@ typedef struct buffered_file_handle {
     unsigned nbuffers;
     file_buffer* write_buffer;
     file_buffer* first_buffer;
+    shared_read_cache* shared_cache;
 } buffered_file_handle;
 
+// How I interpret a snapshot couch_file_handle:
+typedef struct snapshot_file_handle {
+    shared_read_cache* cache;
+    cs_off_t stable_end;    // Everything before this was on disk when the snapshot opened
+} snapshot_file_handle;
+
 
 static file_buffer* new_buffer(buffered_file_handle* owner, size_t capacity) {
     file_buffer *buf = static_cast<file_buffer*>(malloc(sizeof(file_buffer) + capacity));
@@ -212,6 +237,229 @@ static file_buffer* find_buffer(buffered_file_handle* h, cs_off_t offset) {
 }
 
 
+//////// SHARED READ CACHE:
+
+
+static shared_read_cache* new_shared_cache(const couch_file_ops* raw_ops,
+                                           couch_file_handle raw_ops_handle) {
+    shared_read_cache *cache = static_cast<shared_read_cache*>(calloc(1, sizeof(shared_read_cache)));
+    if (cache) {
+        cache->raw_ops = raw_ops;
+        cache->raw_ops_handle = raw_ops_handle;
+        for (int i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+            cb_mutex_initialize(&cache->shards[i].mutex);
+        }
+    }
+    return cache;
+}
+
+static void free_shared_cache(shared_read_cache* cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+        file_buffer* buffer, *next;
+        for (buffer = cache->shards[i].first_buffer; buffer; buffer = next) {
+            next = buffer->next;
+            free_buffer(buffer);
+        }
+        cb_mutex_destroy(&cache->shards[i].mutex);
+    }
+    free(cache);
+}
+
+// Finds (or recycles) the shard's buffer for a block and moves it to the front
+// of the shard's LRU list. Must be called with the shard locked.
+static file_buffer* find_shared_buffer(shared_cache_shard* shard, cs_off_t block_start) {
+    file_buffer* buffer = shard->first_buffer;
+    while (buffer && buffer->offset != block_start && buffer->next != NULL)
+        buffer = buffer->next;
+    if (!buffer || buffer->offset != block_start) {
+        if (shard->nbuffers < SHARED_CACHE_BUFFERS_PER_SHARD) {
+            file_buffer* buffer2 = new_buffer(NULL, READ_BUFFER_CAPACITY);
+            if (buffer2) {
+                buffer = buffer2;
+                ++shard->nbuffers;
+            }
+        }
+        if (!buffer) {
+            return NULL;
+        }
+        buffer->offset = block_start;
+        buffer->length = 0;
+    }
+    if (buffer != shard->first_buffer) {
+        if (buffer->prev) buffer->prev->next = buffer->next;
+        if (buffer->next) buffer->next->prev = buffer->prev;
+        buffer->prev = NULL;
+        buffer->next = shard->first_buffer;
+        if (shard->first_buffer) shard->first_buffer->prev = buffer;
+        shard->first_buffer = buffer;
+    }
+    return buffer;
+}
+
+// Reads from a single block through the cache. The file is append-only, so
+// bytes that were on disk when a snapshot opened never change; only those get
+// cached, since the writer may be in the middle of writing the ones after. A
+// block cached for an older snapshot is topped up when a newer one needs more.
+static ssize_t shared_cache_read_block(couchstore_error_info_t *errinfo,
+                                       shared_read_cache* cache,
+                                       cs_off_t stable_end,
+                                       void *buf,
+                                       size_t nbyte,
+                                       cs_off_t offset) {
+    if (offset >= stable_end) {
+        return cache->raw_ops->pread(errinfo, cache->raw_ops_handle, buf, nbyte, offset);
+    }
+    cs_off_t block_start = offset - (offset % READ_BUFFER_CAPACITY);
+    shared_cache_shard* shard =
+        &cache->shards[(block_start / READ_BUFFER_CAPACITY) % SHARED_CACHE_SHARDS];
+    ssize_t nbyte_read;
+
+    cb_mutex_enter(&shard->mutex);
+    file_buffer* buffer = find_shared_buffer(shard, block_start);
+    if (!buffer) {
+        cb_mutex_exit(&shard->mutex);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    cs_off_t buffer_end = buffer->offset + buffer->length;
+    if (offset + (cs_off_t)nbyte > buffer_end && buffer_end < stable_end &&
+        buffer->length < buffer->capacity) {
+        size_t load_size = min(buffer->capacity - buffer->length,
+                               stable_end - buffer_end);
+        ssize_t bytes_read = cache->raw_ops->pread(errinfo, cache->raw_ops_handle,
+                                                   buffer->bytes + buffer->length,
+                                                   load_size,
+                                                   buffer_end);
+        if (bytes_read < 0) {
+            cb_mutex_exit(&shard->mutex);
+            return bytes_read;
+        }
+        buffer->length += bytes_read;
+    }
+    nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+    cb_mutex_exit(&shard->mutex);
+    return nbyte_read;
+}
+
+
+//////// SNAPSHOT FILE API:
+
+
+static couch_file_handle snapshot_constructor(couchstore_error_info_t *errinfo,
+                                              void* cookie)
+{
+    (void) errinfo;
+    (void) cookie;
+    return NULL;
+}
+
+static couchstore_error_t snapshot_open(couchstore_error_info_t *errinfo,
+                                        couch_file_handle* handle,
+                                        const char *path,
+                                        int oflag)
+{
+    (void) errinfo;
+    (void) handle;
+    (void) path;
+    (void) oflag;
+    return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+}
+
+static void snapshot_close(couchstore_error_info_t *errinfo,
+                           couch_file_handle handle)
+{
+    // The underlying file belongs to the parent handle
+    (void) errinfo;
+    (void) handle;
+}
+
+static ssize_t snapshot_pread(couchstore_error_info_t *errinfo,
+                              couch_file_handle handle,
+                              void *buf,
+                              size_t nbyte,
+                              cs_off_t offset)
+{
+    snapshot_file_handle *h = (snapshot_file_handle*)handle;
+    ssize_t total_read = 0;
+    while (nbyte > 0) {
+        ssize_t nbyte_read = shared_cache_read_block(errinfo, h->cache, h->stable_end,
+                                                     buf, nbyte, offset);
+        if (nbyte_read < 0) {
+            return nbyte_read;
+        } else if (nbyte_read == 0) {
+            break;  // must be at EOF
+        }
+        buf = (char*)buf + nbyte_read;
+        nbyte -= nbyte_read;
+        offset += nbyte_read;
+        total_read += nbyte_read;
+    }
+    return total_read;
+}
+
+static ssize_t snapshot_pwrite(couchstore_error_info_t *errinfo,
+                               couch_file_handle handle,
+                               const void *buf,
+                               size_t nbyte,
+                               cs_off_t offset)
+{
+    (void) errinfo;
+    (void) handle;
+    (void) buf;
+    (void) nbyte;
+    (void) offset;
+    return COUCHSTORE_ERROR_WRITE;
+}
+
+static cs_off_t snapshot_goto_eof(couchstore_error_info_t *errinfo,
+                                  couch_file_handle handle)
+{
+    snapshot_file_handle *h = (snapshot_file_handle*)handle;
+    return h->cache->raw_ops->goto_eof(errinfo, h->cache->raw_ops_handle);
+}
+
+static couchstore_error_t snapshot_sync(couchstore_error_info_t *errinfo,
+                                        couch_file_handle handle)
+{
+    (void) errinfo;
+    (void) handle;
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t snapshot_advise(couchstore_error_info_t *errinfo,
+                                          couch_file_handle handle,
+                                          cs_off_t offs,
+                                          cs_off_t len,
+                                          couchstore_file_advice_t adv)
+{
+    snapshot_file_handle *h = (snapshot_file_handle*)handle;
+    return h->cache->raw_ops->advise(errinfo, h->cache->raw_ops_handle, offs, len, adv);
+}
+
+static void snapshot_destructor(couchstore_error_info_t *errinfo,
+                                couch_file_handle handle)
+{
+    (void) errinfo;
+    free(handle);
+}
+
+static const couch_file_ops snapshot_ops = {
+    (uint64_t)5,
+    snapshot_constructor,
+    snapshot_open,
+    snapshot_close,
+    snapshot_pread,
+    snapshot_pwrite,
+    snapshot_goto_eof,
+    snapshot_sync,
+    snapshot_advise,
+    snapshot_destructor,
+    NULL
+};
+
+
 //////// FILE API:
 
 
@@ -230,6 +478,7 @@ static void buffered_destructor(couchstore_error_info_t *errinfo,
         next = buffer->next;
         free_buffer(buffer);
     }
+    free_shared_cache(h->shared_cache);
     free(h);
 }
 
@@ -242,6 +491,7 @@ static couch_file_handle buffered_constructor_with_raw_ops(couchstore_error_info
         h->raw_ops = raw_ops;
         h->raw_ops_handle = raw_ops->constructor(errinfo, raw_ops->cookie);
         h->nbuffers = 1;
+        h->shared_cache = NULL;
         h->write_buffer = new_buffer(h, readOnly ? 0 : WRITE_BUFFER_CAPACITY);
         h->first_buffer = new_buffer(h, READ_BUFFER_CAPACITY);
 
@@ -437,3 +687,55 @@ const couch_file_ops *couch_get_buffered_file_ops(couchstore_error_info_t *errin
         return NULL;
     }
 }
+
+static bool is_snapshot_file_ops(const couch_file_ops *file_ops)
+{
+    return file_ops == &snapshot_ops;
+}
+
+couchstore_error_t couch_get_snapshot_file_ops(couchstore_error_info_t *errinfo,
+                                               const couch_file_ops *file_ops,
+                                               couch_file_handle file_handle,
+                                               const couch_file_ops **snapshot_file_ops,
+                                               couch_file_handle* handle)
+{
+    shared_read_cache *cache;
+    cs_off_t stable_end;
+
+    if (is_snapshot_file_ops(file_ops)) {
+        // A snapshot of a snapshot sees no more of the file than its parent does
+        snapshot_file_handle *parent = (snapshot_file_handle*)file_handle;
+        cache = parent->cache;
+        stable_end = parent->stable_end;
+    } else if (file_ops == &ops) {
+        buffered_file_handle *h = (buffered_file_handle*)file_handle;
+        // Make sure everything written so far is visible to the raw reads:
+        couchstore_error_t err = flush_buffer(errinfo, h->write_buffer);
+        if (err < 0) {
+            return err;
+        }
+        if (!h->shared_cache) {
+            h->shared_cache = new_shared_cache(h->raw_ops, h->raw_ops_handle);
+            if (!h->shared_cache) {
+                return COUCHSTORE_ERROR_ALLOC_FAIL;
+            }
+        }
+        cache = h->shared_cache;
+        stable_end = h->raw_ops->goto_eof(errinfo, h->raw_ops_handle);
+        if (stable_end < 0) {
+            return COUCHSTORE_ERROR_READ;
+        }
+    } else {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    snapshot_file_handle *sh = static_cast<snapshot_file_handle*>(malloc(sizeof(snapshot_file_handle)));
+    if (!sh) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    sh->cache = cache;
+    sh->stable_end = stable_end;
+    *handle = (couch_file_handle) sh;
+    *snapshot_file_ops = &snapshot_ops;
+    return COUCHSTORE_SUCCESS;
+}
@@ -24,4 +24,25 @@ const couch_file_ops *couch_get_buffered_file_ops(couchstore_error_info_t *errin
                                                   couch_file_handle* handle,
                                                   bool readOnly);
 
+/**
+ * Constructs a read-only handle onto the same file as a buffered file handle, for use
+ * by snapshots. Reads go straight to the underlying raw handle through a block cache
+ * that is shared by, and safe to use concurrently from, all snapshots of the file.
+ * The snapshot handles must be destroyed before the buffered handle is.
+ * @param file_ops the ops of file_handle, from couch_get_buffered_file_ops or from an
+ *        earlier call of this function; a snapshot of a snapshot shares its cache and
+ *        sees no more of the file than it does
+ * @param file_handle the buffered or snapshot handle to take the snapshot of
+ * @param snapshot_file_ops on output, the couch_file_ops to use with the handle
+ * @param handle on output, the snapshot couch_file_handle (already "open")
+ * @return COUCHSTORE_SUCCESS, or COUCHSTORE_ERROR_INVALID_ARGUMENTS if file_ops are
+ *         neither buffered nor snapshot ops, or the error that flushing the buffered
+ *         handle or finding the end of the file failed with
+ */
+couchstore_error_t couch_get_snapshot_file_ops(couchstore_error_info_t *errinfo,
+                                               const couch_file_ops *file_ops,
+                                               couch_file_handle file_handle,
+                                               const couch_file_ops **snapshot_file_ops,
+                                               couch_file_handle* handle);
+
 #endif // LIBCOUCHSTORE_IOBUFFER_H
@@ -7,6 +7,9 @@
 #include "config.h"
 #include "internal.h"
 #include "mergesort.h"
+#include "arena.h"
+#include "radix_sort.h"
+#include "buffered_file.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -26,15 +29,23 @@ struct tape {
     char path[PATH_MAX];
 };
 
+/* Size of the chunks a block's records are copied into */
+#define BLOCK_ARENA_CHUNK_SIZE (1024 * 1024)
+
+/* The list nodes always live in block_arena; so do the records, unless they
+ * were copied by a record_duplicate callback */
 static void free_memory_blocks(struct record_in_memory *first,
-                               mergesort_record_free_t record_free)
+                               mergesort_record_duplicate_t record_duplicate,
+                               mergesort_record_free_t record_free,
+                               arena *block_arena)
 {
-    while (first != NULL) {
-        struct record_in_memory *next = first->next;
-        (*record_free)(first->record);
-        free(first);
-        first = next;
+    if (record_duplicate != NULL) {
+        while (first != NULL) {
+            (*record_free)(first->record);
+            first = first->next;
+        }
     }
+    arena_free_all(block_arena);
 }
 
 static int compare_records(void *p, void *q, void *pointer)
@@ -45,8 +56,41 @@ static int compare_records(void *p, void *q, void *pointer)
     return (*point->compare)(pp->record, qq->record, point->pointer);
 }
 
-FILE *openTmpFile(char *path) {
-    FILE *tempFile = NULL;
+/* Radix sorts a block of block_count records on their keys and relinks the
+ * list in the sorted order. Returns NULL if there wasn't enough memory. */
+static struct record_in_memory *radix_sort_block(struct record_in_memory *first,
+                                                 unsigned long block_count,
+                                                 mergesort_record_key_t record_key,
+                                                 void *pointer)
+{
+    radix_sort_entry_t *entries;
+    struct record_in_memory *p;
+    unsigned long i;
+
+    entries = (radix_sort_entry_t *) malloc(block_count * sizeof(*entries));
+    if (entries == NULL) {
+        return NULL;
+    }
+    for (i = 0, p = first; p != NULL; p = p->next, i++) {
+        (*record_key)(p->record, &entries[i].key, pointer);
+        entries[i].record = p;
+    }
+    if (radix_sort(entries, block_count) != 0) {
+        free(entries);
+        return NULL;
+    }
+    for (i = 0; i < block_count; i++) {
+        p = (struct record_in_memory *) entries[i].record;
+        p->next = i + 1 < block_count ?
+            (struct record_in_memory *) entries[i + 1].record : NULL;
+    }
+    first = (struct record_in_memory *) entries[0].record;
+    free(entries);
+
+    return first;
+}
+
+static void nextTmpFileName(char *path) {
     int pos = strlen(path);
     // If file name is 4.couch.2.compact.btree-tmp_356
     // pull out suffix as int in reverse i.e 653
@@ -66,10 +110,20 @@ FILE *openTmpFile(char *path) {
         suffix = suffix / 10;
     }
     path[++pos] = '\0';
+}
 
-    tempFile = fopen(path, "w+b");
+FILE *openTmpFile(char *path) {
+    nextTmpFileName(path);
+    return fopen(path, "w+b");
+}
+
+FILE *openBufferedTmpFile(char *path, int flags) {
+    nextTmpFileName(path);
+    return buffered_fopen(path, "w+b", 0, flags);
+}
 
-    return tempFile;
+static FILE *openTape(char *path, int flags) {
+    return openBufferedTmpFile(path, flags | BUFFERED_FILE_READAHEAD);
 }
 
 void releaseTmpFile(struct tape *tmp_file) {
@@ -90,15 +144,18 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
                mergesort_read_record_t read,
                mergesort_write_record_t write,
                mergesort_compare_records_t compare,
+               mergesort_record_key_t record_key,
                mergesort_record_alloc_t record_alloc,
                mergesort_record_duplicate_t record_duplicate,
                mergesort_record_free_t record_free,
+               int tmp_file_flags,
                void *pointer,
                unsigned long block_size,
                unsigned long *pcount)
 {
     struct tape source_tape[2];
     char *record[2];
+    arena *block_arena;
     /* allocate memory */
     if ((record[0] = (*record_alloc)()) == NULL) {
         return INSUFFICIENT_MEMORY;
@@ -107,21 +164,28 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
         (*record_free)(record[0]);
         return INSUFFICIENT_MEMORY;
     }
+    if ((block_arena = new_arena(BLOCK_ARENA_CHUNK_SIZE)) == NULL) {
+        (*record_free)(record[0]);
+        (*record_free)(record[1]);
+        return INSUFFICIENT_MEMORY;
+    }
     /* create temporary files source_tape[0] and source_tape[1] */
-    source_tape[0].fp = openTmpFile(tmp_path);
+    source_tape[0].fp = openTape(tmp_path, tmp_file_flags);
     source_tape[0].count = 0L;
     if (source_tape[0].fp == NULL) {
         (*record_free)(record[0]);
         (*record_free)(record[1]);
+        delete_arena(block_arena);
         return FILE_CREATION_ERROR;
     }
     strncpy(source_tape[0].path, tmp_path, PATH_MAX);
-    source_tape[1].fp = openTmpFile(tmp_path);
+    source_tape[1].fp = openTape(tmp_path, tmp_file_flags);
     source_tape[1].count = 0L;
     if (source_tape[1].fp == NULL) {
         releaseTmpFile(&source_tape[0]);
         (*record_free)(record[0]);
         (*record_free)(record[1]);
+        delete_arena(block_arena);
         return FILE_CREATION_ERROR;
     }
     strncpy(source_tape[1].path, tmp_path, PATH_MAX);
@@ -137,23 +201,35 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
         while (1) {
             int record_size = (*read)(unsorted_file, record[0], pointer);
             if (record_size > 0) {
-                struct record_in_memory *p = (struct record_in_memory *) malloc(sizeof(*p));
+                struct record_in_memory *p = (struct record_in_memory *)
+                    arena_alloc(block_arena, sizeof(*p));
                 if (p == NULL) {
                     releaseTmpFile(&source_tape[0]);
                     releaseTmpFile(&source_tape[1]);
                     (*record_free)(record[0]);
                     (*record_free)(record[1]);
-                    free_memory_blocks(first, record_free);
+                    free_memory_blocks(first, record_duplicate, record_free,
+                                       block_arena);
+                    delete_arena(block_arena);
                     return INSUFFICIENT_MEMORY;
                 }
-                p->record = (*record_duplicate)(record[0]);
+                if (record_duplicate != NULL) {
+                    p->record = (*record_duplicate)(record[0]);
+                } else {
+                    /* Flat record: copy it into the block's arena */
+                    p->record = (char *) arena_alloc(block_arena, record_size);
+                    if (p->record != NULL) {
+                        memcpy(p->record, record[0], record_size);
+                    }
+                }
                 if (p->record == NULL) {
                     releaseTmpFile(&source_tape[0]);
                     releaseTmpFile(&source_tape[1]);
-                    free(p);
                     (*record_free)(record[0]);
                     (*record_free)(record[1]);
-                    free_memory_blocks(first, record_free);
+                    free_memory_blocks(first, record_duplicate, record_free,
+                                       block_arena);
+                    delete_arena(block_arena);
                     return INSUFFICIENT_MEMORY;
                 }
                 p->next = first;
@@ -164,11 +240,21 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
                 releaseTmpFile(&source_tape[1]);
                 (*record_free)(record[0]);
                 (*record_free)(record[1]);
-                free_memory_blocks(first, record_free);
+                free_memory_blocks(first, record_duplicate, record_free,
+                                   block_arena);
+                delete_arena(block_arena);
                 return FILE_READ_ERROR;
             }
             if (block_count == block_size || (record_size == 0 && block_count != 0)) {
-                first = static_cast<record_in_memory*>(sort_linked_list(first, 0, compare_records, &comp, NULL));
+                struct record_in_memory *sorted = NULL;
+                if (record_key != NULL) {
+                    sorted = radix_sort_block(first, block_count, record_key, pointer);
+                }
+                if (sorted != NULL) {
+                    first = sorted;
+                } else {
+                    first = static_cast<record_in_memory*>(sort_linked_list(first, 0, compare_records, &comp, NULL));
+                }
                 while (first != NULL) {
                     struct record_in_memory *next = first->next;
                     if ((*write)(source_tape[destination].fp, first->record,
@@ -177,14 +263,19 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
                         releaseTmpFile(&source_tape[1]);
                         (*record_free)(record[0]);
                         (*record_free)(record[1]);
-                        free_memory_blocks(first, record_free);
+                        free_memory_blocks(first, record_duplicate, record_free,
+                                           block_arena);
+                        delete_arena(block_arena);
                         return FILE_WRITE_ERROR;
                     }
                     source_tape[destination].count++;
-                    (*record_free)(first->record);
-                    free(first);
+                    if (record_duplicate != NULL) {
+                        (*record_free)(first->record);
+                    }
                     first = next;
                 }
+                /* The whole block is written out, release it at once */
+                arena_free_all(block_arena);
                 destination ^= 1;
                 block_count = 0;
             }
@@ -193,6 +284,7 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
             }
         }
     }
+    delete_arena(block_arena);
     if (sorted_file == unsorted_file) {
         rewind(unsorted_file);
     }
@@ -225,7 +317,7 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
             struct tape destination_tape[2];
             int record1_size, record2_size;
             destination_tape[0].fp = source_tape[0].count <= block_size ?
-                                     sorted_file : openTmpFile(tmp_path);
+                                     sorted_file : openTape(tmp_path, tmp_file_flags);
             destination_tape[0].count = 0L;
 
             if (destination_tape[0].fp == NULL) {
@@ -240,7 +332,7 @@ int merge_sort(FILE *unsorted_file, FILE *sorted_file,
                 strncpy(destination_tape[0].path, tmp_path, PATH_MAX);
             }
 
-            destination_tape[1].fp = openTmpFile(tmp_path);
+            destination_tape[1].fp = openTape(tmp_path, tmp_file_flags);
             destination_tape[1].count = 0L;
             if (destination_tape[1].fp == NULL) {
                 if (destination_tape[0].fp != sorted_file) {
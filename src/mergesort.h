@@ -2,6 +2,7 @@
 #define MERGESORT_H
 
 #include <stdio.h>
+#include <libcouchstore/couch_common.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,22 +34,46 @@ typedef int (*mergesort_compare_records_t)(const void *record_buffer1,
                                            const void *record_buffer2,
                                            void *pointer);
 
+/*
+ * record_duplicate may be NULL if records are flat, i.e. their length as
+ * returned by the read callback covers all of their data. Records are then
+ * copied into large slabs, released a whole block at a time, instead of
+ * being allocated one by one.
+ */
 typedef char *(*mergesort_record_alloc_t)(void);
 typedef char *(*mergesort_record_duplicate_t)(char *record);
 typedef void  (*mergesort_record_free_t)(char *record);
 
+/*
+ * Points key at a record's sort key, for records the compare callback orders
+ * by plain byte order of that key. Blocks are then radix sorted on it.
+ */
+typedef void (*mergesort_record_key_t)(const void *record_buffer,
+                                       sized_buf *key,
+                                       void *pointer);
+
 void *sort_linked_list(void *, unsigned, int (*)(void *, void *, void *), void *, unsigned long *);
 
 FILE *openTmpFile(char *path);
 
+/* Same as openTmpFile, but opens the file with buffered_fopen() */
+FILE *openBufferedTmpFile(char *path, int flags);
+
+/*
+ * The tapes merge_sort works with are opened through buffered_fopen() with
+ * tmp_file_flags (see buffered_file.h), and are read ahead. The sorted file
+ * is left as it is.
+ */
 int merge_sort(FILE *unsorted_file, FILE *sorted_file,
                char *tmp_path,
                mergesort_read_record_t read,
                mergesort_write_record_t write,
                mergesort_compare_records_t compare,
+               mergesort_record_key_t record_key,
                mergesort_record_alloc_t record_alloc,
                mergesort_record_duplicate_t record_duplicate,
                mergesort_record_free_t record_free,
+               int tmp_file_flags,
                void *pointer,
                unsigned long block_size,
                unsigned long *pcount);
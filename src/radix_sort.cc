@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include "radix_sort.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Below this many entries a bucket is finished off with an insertion sort
+#define RADIX_SORT_CUTOFF 32
+// One bucket per byte value, plus one in front for keys that have ended
+#define RADIX_SORT_BUCKETS 257
+
+static inline unsigned bucket_of(const radix_sort_entry_t *e, size_t depth)
+{
+    return depth < e->key.size ? (unsigned char) e->key.buf[depth] + 1 : 0;
+}
+
+// Compares two keys known to share their first depth bytes
+static int compare_from(const radix_sort_entry_t *a,
+                        const radix_sort_entry_t *b,
+                        size_t depth)
+{
+    size_t size = a->key.size < b->key.size ? a->key.size : b->key.size;
+    int cmp = memcmp(a->key.buf + depth, b->key.buf + depth, size - depth);
+    if (cmp == 0 && a->key.size != b->key.size) {
+        return a->key.size < b->key.size ? -1 : 1;
+    }
+    return cmp;
+}
+
+static void insertion_sort(radix_sort_entry_t *entries, size_t n, size_t depth)
+{
+    size_t i, j;
+
+    for (i = 1; i < n; ++i) {
+        radix_sort_entry_t e = entries[i];
+        for (j = i; j > 0 && compare_from(&entries[j - 1], &e, depth) > 0; --j) {
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = e;
+    }
+}
+
+/*
+ * Distributes the entries on their byte at depth, then sorts each bucket on
+ * the following bytes. Only the buckets smaller than the largest one are
+ * recursed into, the largest is carried on with in this frame, so that the
+ * recursion is no deeper than log2(n) however long the keys are.
+ */
+static void msd_sort(radix_sort_entry_t *entries,
+                     radix_sort_entry_t *tmp,
+                     size_t n,
+                     size_t depth)
+{
+    size_t counts[RADIX_SORT_BUCKETS];
+    size_t starts[RADIX_SORT_BUCKETS];
+    size_t i, largest;
+
+    while (n > RADIX_SORT_CUTOFF) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < n; ++i) {
+            counts[bucket_of(&entries[i], depth)]++;
+        }
+
+        if (counts[0] == n) {
+            // Every key ended here, they are all equal
+            return;
+        }
+
+        starts[0] = 0;
+        for (i = 1; i < RADIX_SORT_BUCKETS; ++i) {
+            starts[i] = starts[i - 1] + counts[i - 1];
+        }
+        for (i = 0; i < n; ++i) {
+            tmp[starts[bucket_of(&entries[i], depth)]++] = entries[i];
+        }
+        memcpy(entries, tmp, n * sizeof(radix_sort_entry_t));
+
+        // starts[b] is now the end of bucket b; keys that ended (bucket 0)
+        // are equal and already in place.
+        largest = 1;
+        for (i = 2; i < RADIX_SORT_BUCKETS; ++i) {
+            if (counts[i] > counts[largest]) {
+                largest = i;
+            }
+        }
+        for (i = 1; i < RADIX_SORT_BUCKETS; ++i) {
+            if (i != largest && counts[i] > 1) {
+                msd_sort(entries + starts[i] - counts[i], tmp, counts[i],
+                         depth + 1);
+            }
+        }
+
+        entries += starts[largest] - counts[largest];
+        n = counts[largest];
+        depth++;
+    }
+
+    insertion_sort(entries, n, depth);
+}
+
+int radix_sort(radix_sort_entry_t *entries, size_t n)
+{
+    radix_sort_entry_t *tmp;
+
+    if (n <= RADIX_SORT_CUTOFF) {
+        insertion_sort(entries, n, 0);
+        return 0;
+    }
+
+    tmp = (radix_sort_entry_t *) malloc(n * sizeof(radix_sort_entry_t));
+    if (tmp == NULL) {
+        return -1;
+    }
+    msd_sort(entries, tmp, n, 0);
+    free(tmp);
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <libcouchstore/couch_common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A record to sort along with its key */
+typedef struct {
+    sized_buf key;
+    void *record;
+} radix_sort_entry_t;
+
+/*
+ * Sorts entries by key in plain lexicographic byte order, the order of
+ * ebin_cmp, with an MSD radix sort. Entries with equal keys keep their
+ * relative order. Returns 0, or -1 if it could not allocate its scratch
+ * space, in which case the entries are left as they were.
+ */
+int radix_sort(radix_sort_entry_t *entries, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
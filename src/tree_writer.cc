@@ -3,6 +3,7 @@
 
 #include "arena.h"
 #include "bitfield.h"
+#include "buffered_file.h"
 #include "couch_btree.h"
 #include "internal.h"
 #include "mergesort.h"
@@ -15,14 +16,15 @@
 
 #define ID_SORT_CHUNK_SIZE (100 * 1024 * 1024) // 100MB. Make tuneable?
 #define ID_SORT_MAX_RECORD_SIZE 4196
+#define ID_SORT_TMP_FILE_FLAGS BUFFERED_FILE_COMPRESSED
 
 
 static char *alloc_record(void);
-static char *duplicate_record(char *rec);
 static void free_record(char *rec);
 static int read_id_record(FILE *in, void *buf, void *ctx);
 static int write_id_record(FILE *out, void *ptr, void *ctx);
 static int compare_id_record(const void *r1, const void *r2, void *ctx);
+static void id_record_key(const void *r, sized_buf *key, void *ctx);
 
 
 struct TreeWriter {
@@ -49,7 +51,7 @@ couchstore_error_t TreeWriterOpen(char* unsortedFilePath,
     if (unsortedFilePath) {
         // stash the temp file path into context for uniq tempfile construction
         writer->tmp_path = unsortedFilePath;
-        writer->file = openTmpFile(writer->tmp_path);
+        writer->file = openBufferedTmpFile(writer->tmp_path, BUFFERED_FILE_READAHEAD);
     }
 
     if (!writer->file) {
@@ -106,9 +108,13 @@ couchstore_error_t TreeWriterSort(TreeWriter* writer)
                                                       read_id_record,
                                                       write_id_record,
                                                       compare_id_record,
+                                                      // keys in ebin_cmp order can be radix sorted
+                                                      writer->key_compare == ebin_cmp ?
+                                                          id_record_key : NULL,
                                                       alloc_record,
-                                                      duplicate_record,
+                                                      NULL,  // records are flat, copied in slabs
                                                       free_record,
+                                                      ID_SORT_TMP_FILE_FLAGS,
                                                       writer,  // 'context' parameter to the above callbacks
                                                       ID_SORT_CHUNK_SIZE,
                                                       NULL));
@@ -257,22 +263,17 @@ static int compare_id_record(const void *r1, const void *r2, void *ctx)
     return writer->key_compare(&e1->k, &e2->k);
 }
 
-static char *alloc_record(void)
+static void id_record_key(const void *r, sized_buf *key, void *ctx)
 {
-    return static_cast<char*>(malloc(ID_SORT_MAX_RECORD_SIZE));
+    (void) ctx;
+    const extsort_record *e = (const extsort_record *) r;
+    key->buf = (char *) e->buf;
+    key->size = e->k.size;
 }
 
-static char *duplicate_record(char *rec)
+static char *alloc_record(void)
 {
-    extsort_record *record = (extsort_record *) rec;
-    size_t record_size = sizeof(extsort_record) + record->k.size + record->v.size;
-    extsort_record *new_record = (extsort_record *) malloc(record_size);
-
-    if (new_record != NULL) {
-        memcpy(new_record, record, record_size);
-    }
-
-    return (char *) new_record;
+    return static_cast<char*>(malloc(ID_SORT_MAX_RECORD_SIZE));
 }
 
 static void free_record(char *rec)
@@ -28,6 +28,19 @@ int ebin_cmp(const sized_buf *e1, const sized_buf *e2)
     return cmp;
 }
 
+uint64_t ebin_prefix(const sized_buf *e)
+{
+    uint64_t prefix = 0;
+    size_t i;
+    for (i = 0; i < sizeof(prefix); ++i) {
+        prefix <<= 8;
+        if (i < e->size) {
+            prefix |= (uint8_t) e->buf[i];
+        }
+    }
+    return prefix;
+}
+
 int seq_cmp(const sized_buf *k1, const sized_buf *k2)
 {
     uint64_t e1val = decode_sequence_key(k1);
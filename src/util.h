@@ -16,6 +16,10 @@ extern "C" {
 /** Plain lexicographic comparison of the contents of two sized_bufs. */
 int ebin_cmp(const sized_buf *e1, const sized_buf *e2);
 
+/** The first 8 bytes of a sized_buf as a big-endian integer, zero padded, so that
+    ebin_cmp(e1, e2) < 0 implies ebin_prefix(e1) <= ebin_prefix(e2). */
+uint64_t ebin_prefix(const sized_buf *e);
+
 /** Compares sequence numbers (48-bit big-endian unsigned ints) stored in sized_bufs. */
 int seq_cmp(const sized_buf *k1, const sized_buf *k2);
 
@@ -13,7 +13,10 @@
 #include <string.h>
 #include <unicode/ucol.h>
 #include <unicode/ucasemap.h>
-#include <unicode/ucnv.h>
+#include <unicode/ustring.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#endif
 
 
 static int cmp(int n1, int n2)
@@ -192,20 +195,193 @@ static const char* createStringFromJSON(const char** in, size_t *length, bool *f
 }
 
 
+/* Atomically replaces *ptr with new_val if it equals old_val, and returns
+ * what *ptr held. Keys may be compared from several threads at once. */
+#ifdef _MSC_VER
+#define compare_and_swap_ptr(ptr, old_val, new_val) \
+    InterlockedCompareExchangePointer((PVOID volatile *) (ptr), (new_val), (old_val))
+#else
+#define compare_and_swap_ptr(ptr, old_val, new_val) \
+    __sync_val_compare_and_swap((ptr), (old_val), (new_val))
+#endif
+
+static UCollator* getCollator(void)
+{
+    static UCollator* coll = NULL;
+    UCollator* current;
+    UCollator* created;
+    UErrorCode status = U_ZERO_ERROR;
+
+    current = (UCollator*) compare_and_swap_ptr(&coll, NULL, NULL);
+    if (current) {
+        return current;
+    }
+
+    created = ucol_open("", &status);
+    if (U_FAILURE(status)) {
+        fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
+        return NULL;
+    }
+
+    /* Another thread may have got there first */
+    current = (UCollator*) compare_and_swap_ptr(&coll, NULL, created);
+    if (current) {
+        ucol_close(created);
+        return current;
+    }
+    return created;
+}
+
+
+/* Collation weights of the printable ASCII characters under the ICU root
+   collator, so that strings made only of them (most view keys) can be
+   compared without converting them to UTF-16. Each of these characters
+   maps to a single, non-ignorable collation element: two such strings
+   first compare by their sequences of primary weights, which ignore case,
+   and only if those are equal by their tertiary weights, which don't.
+   The weights are ranks computed from the collator itself, so they always
+   agree with it. */
+typedef struct {
+    bool valid;
+    uint8_t primary[128];
+    uint8_t tertiary[128];
+} ASCIIWeights;
+
+#define kFirstPlainASCII 0x20
+#define kLastPlainASCII  0x7E
+
+static void computeASCIIWeights(UCollator* coll, ASCIIWeights* weights)
+{
+    UCollator* primary;
+    UCollator* secondary;
+    UErrorCode status = U_ZERO_ERROR;
+    UChar c1, c2;
+    int p, s, t;
+
+    weights->valid = false;
+    primary = ucol_open("", &status);
+    secondary = ucol_open("", &status);
+    if (U_FAILURE(status)) {
+        goto done;
+    }
+    ucol_setStrength(primary, UCOL_PRIMARY);
+    ucol_setStrength(secondary, UCOL_SECONDARY);
+
+    for (c1 = kFirstPlainASCII; c1 <= kLastPlainASCII; ++c1) {
+        if (ucol_strcoll(primary, &c1, 1, NULL, 0) <= 0) {
+            /* Ignorable, can't be compared one character at a time */
+            goto done;
+        }
+        for (c2 = kFirstPlainASCII; c2 <= kLastPlainASCII; ++c2) {
+            p = ucol_strcoll(primary, &c2, 1, &c1, 1);
+            s = ucol_strcoll(secondary, &c2, 1, &c1, 1);
+            t = ucol_strcoll(coll, &c2, 1, &c1, 1);
+            if ((p == 0 && s != 0) || (c1 != c2 && t == 0)) {
+                goto done;
+            }
+            weights->primary[c1] += (p < 0);
+            weights->tertiary[c1] += (t < 0);
+        }
+    }
+    weights->valid = true;
+
+done:
+    if (primary) {
+        ucol_close(primary);
+    }
+    if (secondary) {
+        ucol_close(secondary);
+    }
+}
+
+static const ASCIIWeights* getASCIIWeights(void)
+{
+    static ASCIIWeights* weights = NULL;
+    ASCIIWeights* current;
+    ASCIIWeights* created;
+    UCollator* coll;
+
+    current = (ASCIIWeights*) compare_and_swap_ptr(&weights, NULL, NULL);
+    if (!current) {
+        coll = getCollator();
+        if (!coll) {
+            return NULL;
+        }
+        created = calloc(1, sizeof(ASCIIWeights));
+        if (!created) {
+            return NULL;
+        }
+        computeASCIIWeights(coll, created);
+
+        /* Another thread may have got there first */
+        current = (ASCIIWeights*) compare_and_swap_ptr(&weights, NULL, created);
+        if (current) {
+            free(created);
+        } else {
+            current = created;
+        }
+    }
+
+    return current->valid ? current : NULL;
+}
+
+
+#define kNotPlainASCII 2
+
+/* Compares two JSON strings the way ICU would, if both are made only of
+   printable ASCII characters and have no escapes. Otherwise returns
+   kNotPlainASCII. */
+static int compareStringsPlainASCII(const ASCIIWeights* weights,
+                                    const char** in1, const char** in2)
+{
+    const unsigned char* str1 = (const unsigned char*)*in1 + 1;
+    const unsigned char* str2 = (const unsigned char*)*in2 + 1;
+    size_t len1, len2, len, i;
+    int s;
+
+    for (len1 = 0; str1[len1] != '"'; ++len1) {
+        if (str1[len1] < kFirstPlainASCII || str1[len1] > kLastPlainASCII ||
+            str1[len1] == '\\') {
+            return kNotPlainASCII;
+        }
+    }
+    for (len2 = 0; str2[len2] != '"'; ++len2) {
+        if (str2[len2] < kFirstPlainASCII || str2[len2] > kLastPlainASCII ||
+            str2[len2] == '\\') {
+            return kNotPlainASCII;
+        }
+    }
+
+    len = len1 < len2 ? len1 : len2;
+    for (i = 0; i < len; ++i) {
+        s = cmp(weights->primary[str1[i]], weights->primary[str2[i]]);
+        if (s)
+            return s;
+    }
+    if (len1 != len2)
+        return len1 < len2 ? -1 : 1;
+    for (i = 0; i < len; ++i) {
+        s = cmp(weights->tertiary[str1[i]], weights->tertiary[str2[i]]);
+        if (s)
+            return s;
+    }
+
+    *in1 = (const char*)str1 + len1 + 1;
+    *in2 = (const char*)str2 + len2 + 1;
+    return 0;
+}
+
+
 static int compareUnicodeSlow(const char* str1, size_t len1,
                               const char* str2, size_t len2)
 {
-    static UCollator* coll = NULL;
+    UCollator* coll = getCollator();
     UCharIterator iterA, iterB;
     int result;
 
     UErrorCode status = U_ZERO_ERROR;
     if (!coll) {
-        coll = ucol_open("", &status);
-        if (U_FAILURE(status)) {
-            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
-            return -1;
-        }
+        return -1;
     }
 
     uiter_setUTF8(&iterA, str1, (int)len1);
@@ -230,87 +406,51 @@ static int compareUnicodeSlow(const char* str1, size_t len1,
 
 static int convertUTF8toUChar(const char *src, UChar *dst, int len)
 {
-    static UConverter *c;
-    UErrorCode status;
-    UChar *p = dst;
-    const char *s = src;
-
-    if (!c) {
-        status = U_ZERO_ERROR;
-        c = ucnv_open("UTF-8", &status);
-        if (!c) {
-            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
-            abort();
-        }
-    }
-
-    while (len) {
-        unsigned char ch = (unsigned char)(*s);
-        if ((ch & 0x80)) {
-            goto icu_conv;
-        }
-        *p++ = (UChar)(ch);
-        s++;
-        len--;
-    }
-
-    return p - dst;
+    UErrorCode status = U_ZERO_ERROR;
+    int32_t dst_len = 0;
 
-icu_conv:
-    status = U_ZERO_ERROR;
-    ucnv_toUnicode(c, &p, p + len, &s, s + len, NULL, TRUE, &status);
+    /* A UTF-8 string never has more UTF-16 code units than bytes. This
+     * conversion keeps no state, unlike a UConverter, so it can be done
+     * from several threads at once. Bad sequences become U+FFFD, as with
+     * the UTF-8 converter. */
+    u_strFromUTF8WithSub(dst, len, &dst_len, src, len, 0xFFFD, NULL, &status);
 
     if (U_FAILURE(status)) {
         return -1;
     }
 
-    return p - dst;
+    return dst_len;
 }
 
+/* Strings up to this many bytes are converted to UTF-16 on the stack */
+#define kMaxStackStringLength 256
+
 static int compareUnicode(const char* str1, size_t len1,
                           const char* str2, size_t len2)
 {
-    static UCollator* coll = NULL;
-    UChar *b1;
-    UChar *b2;
+    UCollator* coll = getCollator();
+    UChar b1[kMaxStackStringLength];
+    UChar b2[kMaxStackStringLength];
     int ret1, ret2;
     int result;
 
-    UErrorCode status = U_ZERO_ERROR;
     if (!coll) {
-        coll = ucol_open("", &status);
-        if (U_FAILURE(status)) {
-            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
-            return -1;
-        }
+        return -1;
     }
 
-    if (len1 > 256 || len2 > 256) {
+    if (len1 > kMaxStackStringLength || len2 > kMaxStackStringLength) {
         return compareUnicodeSlow(str1, len1, str2, len2);
     }
 
-    b1 = malloc(len1 * sizeof(UChar));
-    b2 = malloc(len2 * sizeof(UChar));
-    if (b1 == NULL || b2 == NULL) {
-        free(b1);
-        free(b2);
-        fprintf(stderr, "CouchStore CollateJSON: Couldn't allocate memory\n");
-        return -2;
-    }
-
     ret1 = convertUTF8toUChar(str1, b1, len1);
     ret2 = convertUTF8toUChar(str2, b2, len2);
 
     if (ret1 < 0 || ret2 < 0) {
         /* something went wrong with utf8->utf32 conversion */
-        free(b1);
-        free(b2);
         return compareUnicodeSlow(str1, len1, str2, len2);
     }
 
     result = ucol_strcoll(coll, b1, ret1, b2, ret2);
-    free(b1);
-    free(b2);
 
     if (result < 0) {
         return -1;
@@ -325,12 +465,23 @@ static int compareUnicode(const char* str1, size_t len1,
 
 static int compareStringsUnicode(const char** in1, const char** in2)
 {
+    const ASCIIWeights* weights = getASCIIWeights();
     size_t len1, len2;
     bool free1, free2;
-    const char* str1 = createStringFromJSON(in1, &len1, &free1);
-    const char* str2 = createStringFromJSON(in2, &len2, &free2);
+    const char* str1;
+    const char* str2;
+    int result;
 
-    int result = compareUnicode(str1, len1, str2, len2);
+    if (weights) {
+        result = compareStringsPlainASCII(weights, in1, in2);
+        if (result != kNotPlainASCII) {
+            return result;
+        }
+    }
+
+    str1 = createStringFromJSON(in1, &len1, &free1);
+    str2 = createStringFromJSON(in2, &len2, &free2);
+    result = compareUnicode(str1, len1, str2, len2);
 
     if (free1) {
         free((char*)str1);
@@ -342,6 +493,85 @@ static int compareStringsUnicode(const char** in1, const char** in2)
 }
 
 
+/* Parses the most common form of numbers, -?[0-9]+(.[0-9]+)?([eE][+-]?[0-9]+)?
+   with at most 19 significant digits, without copying them. When the digits
+   fit in 53 bits and the decimal exponent is at most 22, both are exact
+   doubles and a single multiplication or division by the power of ten is
+   correctly rounded, giving the same result as strtod. Returns 0 for anything
+   else, which is then left to strtod. */
+int ParseJSONNumber(const char *str, size_t len, double *out_num)
+{
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *end = str + len;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    int negative = 0;
+    double n;
+
+    if (str < end && *str == '-') {
+        negative = 1;
+        ++str;
+    }
+    if (str == end || *str < '0' || *str > '9') {
+        return 0;
+    }
+    while (str < end && *str >= '0' && *str <= '9') {
+        mantissa = mantissa * 10 + (*str++ - '0');
+        ++digits;
+    }
+    if (str < end && *str == '.') {
+        ++str;
+        if (str == end || *str < '0' || *str > '9') {
+            return 0;
+        }
+        while (str < end && *str >= '0' && *str <= '9') {
+            mantissa = mantissa * 10 + (*str++ - '0');
+            ++digits;
+            --exponent;
+        }
+    }
+    if (str < end && (*str == 'e' || *str == 'E')) {
+        int exp_negative = 0;
+        int exp = 0;
+        int exp_digits = 0;
+
+        ++str;
+        if (str < end && (*str == '+' || *str == '-')) {
+            exp_negative = (*str++ == '-');
+        }
+        while (str < end && *str >= '0' && *str <= '9' && exp_digits < 4) {
+            exp = exp * 10 + (*str++ - '0');
+            ++exp_digits;
+        }
+        if (exp_digits == 0 || exp_digits == 4) {
+            return 0;
+        }
+        exponent += exp_negative ? -exp : exp;
+    }
+    if (str != end || digits > 19) {
+        return 0;
+    }
+
+    if (mantissa == 0) {
+        n = 0.0;
+    } else if (mantissa > ((uint64_t) 1 << 53) ||
+               exponent < -22 || exponent > 22) {
+        return 0;
+    } else if (exponent < 0) {
+        n = (double) mantissa / powers_of_ten[-exponent];
+    } else {
+        n = (double) mantissa * powers_of_ten[exponent];
+    }
+    *out_num = negative ? -n : n;
+
+    return 1;
+}
+
+
 static double readNumber(const char* start, const char* end, char** endOfNumber) {
     /* First copy the string into a zero-terminated buffer so we can safely
        call strtod: */
@@ -367,6 +597,33 @@ static double readNumber(const char* start, const char* end, char** endOfNumber)
 }
 
 
+static bool isNumberChar(char c)
+{
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+}
+
+/* Reads the number at start without copying it when it's a simple one. The
+   number can't extend past end, if given; without it, it must be followed
+   by a delimiter, as inside arrays and objects. */
+static double readNumberFast(const char* start, const char* end, char** endOfNumber)
+{
+    const char* str = start;
+    double result;
+
+    while ((end == NULL || str < end) && isNumberChar(*str))
+        ++str;
+    if (ParseJSONNumber(start, str - start, &result)) {
+        *endOfNumber = (char*)str;
+        return result;
+    }
+
+    if (end != NULL)
+        return readNumber(start, end, endOfNumber);
+    return strtod(start, endOfNumber);
+}
+
+
 int CollateJSON(const sized_buf *buf1,
                 const sized_buf *buf2,
                 CollateJSONMode mode)
@@ -404,10 +661,11 @@ int CollateJSON(const sized_buf *buf1,
                     /* At depth 0, be careful not to fall off the end of the
                        input, because there won't be any delimiters (']' or
                        '}') after the number! */
-                    diff = dcmp( readNumber(str1, buf1->buf + buf1->size, &next1),
-                                 readNumber(str2, buf2->buf + buf2->size, &next2) );
+                    diff = dcmp( readNumberFast(str1, buf1->buf + buf1->size, &next1),
+                                 readNumberFast(str2, buf2->buf + buf2->size, &next2) );
                 } else {
-                    diff = dcmp( strtod(str1, &next1), strtod(str2, &next2) );
+                    diff = dcmp( readNumberFast(str1, NULL, &next1),
+                                 readNumberFast(str2, NULL, &next2) );
                 }
                 if (diff)
                     return diff; /* Numbers don't match */
@@ -449,3 +707,172 @@ int CollateJSON(const sized_buf *buf1,
     } while (depth > 0);
     return 0;
 }
+
+
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t capacity;
+} KeyBuffer;
+
+static bool reserveKey(KeyBuffer* key, size_t extra)
+{
+    size_t capacity = key->capacity ? key->capacity : 64;
+    char* buf;
+
+    if (key->size + extra <= key->capacity)
+        return true;
+    while (capacity < key->size + extra)
+        capacity *= 2;
+    buf = realloc(key->buf, capacity);
+    if (!buf)
+        return false;
+    key->buf = buf;
+    key->capacity = capacity;
+    return true;
+}
+
+static bool appendKeyByte(KeyBuffer* key, uint8_t b)
+{
+    if (!reserveKey(key, 1))
+        return false;
+    key->buf[key->size++] = (char)b;
+    return true;
+}
+
+static bool appendNumberKey(KeyBuffer* key, double n)
+{
+    uint64_t bits;
+    int i;
+
+    if (n == 0.0)
+        n = 0.0;  /* -0 collates equal to 0 */
+    memcpy(&bits, &n, sizeof(bits));
+    /* Flip the sign bit of positive numbers and all bits of negative ones,
+       so that the bytes, most significant first, sort like the numbers */
+    if (bits & 0x8000000000000000ULL)
+        bits = ~bits;
+    else
+        bits |= 0x8000000000000000ULL;
+
+    if (!reserveKey(key, sizeof(bits)))
+        return false;
+    for (i = 0; i < (int)sizeof(bits); ++i)
+        key->buf[key->size++] = (char)(bits >> (56 - 8 * i));
+    return true;
+}
+
+/* Appends the ICU sort key of the string, which ends with the only zero
+   byte in it, so it's never a prefix of a different string's sort key */
+static bool appendStringKey(KeyBuffer* key, const char* str, size_t len)
+{
+    UCollator* coll = getCollator();
+    UChar stackBuf[kMaxStackStringLength];
+    UChar* ustr = stackBuf;
+    int32_t ulen, keyLen;
+    bool ok = false;
+
+    if (!coll)
+        return false;
+    if (len > kMaxStackStringLength) {
+        ustr = malloc(len * sizeof(UChar));
+        if (!ustr)
+            return false;
+    }
+
+    ulen = convertUTF8toUChar(str, ustr, (int)len);
+    if (ulen >= 0) {
+        keyLen = ucol_getSortKey(coll, ustr, ulen,
+                                 (uint8_t*)key->buf + key->size,
+                                 (int32_t)(key->capacity - key->size));
+        if (keyLen > 0 && (size_t)keyLen > key->capacity - key->size &&
+            reserveKey(key, keyLen)) {
+            keyLen = ucol_getSortKey(coll, ustr, ulen,
+                                     (uint8_t*)key->buf + key->size,
+                                     (int32_t)(key->capacity - key->size));
+        }
+        if (keyLen > 0 && (size_t)keyLen <= key->capacity - key->size) {
+            key->size += keyLen;
+            ok = true;
+        }
+    }
+
+    if (ustr != stackBuf)
+        free(ustr);
+    return ok;
+}
+
+
+int CollateJSONEncodeKey(const sized_buf *json, sized_buf *out)
+{
+    const char* str = json->buf;
+    const char* end = json->buf + json->size;
+    KeyBuffer key = { NULL, 0, 0 };
+    int depth = 0;
+    bool ok = true;
+
+    do {
+        ValueType type;
+        if (str >= end) {
+            ok = false;
+            break;
+        }
+        type = valueTypeOf(*str);
+        switch (type) {
+            case kNull:
+            case kTrue:
+                str += 4;
+                ok = appendKeyByte(&key, type);
+                break;
+            case kFalse:
+                str += 5;
+                ok = appendKeyByte(&key, type);
+                break;
+            case kNumber: {
+                char* next;
+                double n = readNumberFast(str, end, &next);
+                ok = (next > str) && appendKeyByte(&key, type) &&
+                     appendNumberKey(&key, n);
+                str = next;
+                break;
+            }
+            case kString: {
+                size_t len;
+                bool freeStr;
+                const char* s = createStringFromJSON(&str, &len, &freeStr);
+                ok = appendKeyByte(&key, type) && appendStringKey(&key, s, len);
+                if (freeStr)
+                    free((char*)s);
+                break;
+            }
+            case kArray:
+            case kObject:
+                ++str;
+                ++depth;
+                ok = appendKeyByte(&key, type);
+                break;
+            case kEndArray:
+            case kEndObject:
+                /* Both sort before anything else at the same position */
+                ++str;
+                --depth;
+                ok = appendKeyByte(&key, kEndArray);
+                break;
+            case kComma:
+            case kColon:
+                ++str;
+                break;
+            case kIllegal:
+                ok = false;
+                break;
+        }
+    } while (ok && depth > 0);
+
+    if (!ok) {
+        free(key.buf);
+        return -1;
+    }
+    out->buf = key.buf;
+    out->size = key.size;
+    return 0;
+}
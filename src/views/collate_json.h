@@ -30,7 +30,22 @@ int CollateJSON(const sized_buf *buf1,
                 const sized_buf *buf2,
                 CollateJSONMode mode);
 
+/**
+ * Encodes a UTF-8 JSON value into a binary key, such that comparing two
+ * encoded keys with memcmp, the shorter one first if one is a prefix of the
+ * other, orders them like CollateJSON in kCollateJSON_Unicode mode does
+ * (keys which collate as equal encode to the same bytes). Strings are
+ * encoded as ICU sort keys, so the JSON can't be decoded back from the key.
+ * The input has the same requirements as for CollateJSON.
+ * On success returns 0 and sets out->buf to a buffer the caller must free,
+ * returns -1 on failure.
+ */
+int CollateJSONEncodeKey(const sized_buf *json, sized_buf *out);
+
 /* not part of the API -- exposed for testing only (see collate_json_test.c) */
 char ConvertJSONEscape(const char **in);
 
+/* not part of the API -- the numeric fast path, also used by reducers.c */
+int ParseJSONNumber(const char *str, size_t len, double *out_num);
+
 #endif
@@ -38,6 +38,7 @@ file_merger_error_t merge_view_kvs_ops_files(const char *source_files[],
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_prefix_fun = NULL;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     return merge_view_files(source_files, num_source_files, dest_path, &ctx);
@@ -52,6 +53,7 @@ file_merger_error_t merge_view_ids_ops_files(const char *source_files[],
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_id_cmp;
+    ctx.key_prefix_fun = view_id_prefix;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     return merge_view_files(source_files, num_source_files, dest_path, &ctx);
@@ -69,6 +71,7 @@ file_merger_error_t merge_spatial_kvs_ops_files(const char *source_files[],
     int i;
 
     ctx.key_cmp_fun = spatial_merger_key_cmp;
+    ctx.key_prefix_fun = spatial_merger_key_prefix;
     ctx.type = INCREMENTAL_UPDATE_SPATIAL_RECORD;
 
     /* The spatial kv files are not sorted, hence sort them before merge
@@ -24,97 +24,198 @@
 
 #define SORT_MAX_BUFFER_SIZE       (64 * 1024 * 1024)
 #define SORT_MAX_NUM_TMP_FILES     16
+#define SORT_TMP_FILE_FLAGS        BUFFERED_FILE_COMPRESSED
 
 
 static file_sorter_error_t do_sort_file(const char *file_path,
                                         const char *tmp_dir,
                                         file_merger_feed_record_t callback,
                                         int skip_writeback,
+                                        unsigned num_threads,
+                                        size_t memory_budget,
                                         view_file_merge_ctx_t *ctx);
 
 LIBCOUCHSTORE_API
-file_sorter_error_t sort_view_kvs_ops_file(const char *file_path,
-                                           const char *tmp_dir)
+file_sorter_error_t sort_view_kvs_ops_file_ex(const char *file_path,
+                                              const char *tmp_dir,
+                                              unsigned num_threads,
+                                              size_t memory_budget)
 {
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_prefix_fun = NULL;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
-    return do_sort_file(file_path, tmp_dir, NULL, 0, &ctx);
+    return do_sort_file(file_path, tmp_dir, NULL, 0, num_threads,
+                        memory_budget, &ctx);
 }
 
 
 LIBCOUCHSTORE_API
-file_sorter_error_t sort_view_kvs_file(const char *file_path,
-                                       const char *tmp_dir,
-                                       file_merger_feed_record_t callback,
-                                       void *user_ctx)
+file_sorter_error_t sort_view_kvs_file_ex(const char *file_path,
+                                          const char *tmp_dir,
+                                          file_merger_feed_record_t callback,
+                                          void *user_ctx,
+                                          unsigned num_threads,
+                                          size_t memory_budget)
 {
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_prefix_fun = NULL;
     ctx.type = INITIAL_BUILD_VIEW_RECORD;
     ctx.user_ctx = user_ctx;
 
-    return do_sort_file(file_path, tmp_dir, callback, 1, &ctx);
+    return do_sort_file(file_path, tmp_dir, callback, 1, num_threads,
+                        memory_budget, &ctx);
 }
 
 
 LIBCOUCHSTORE_API
-file_sorter_error_t sort_view_ids_ops_file(const char *file_path,
-                                           const char *tmp_dir)
+file_sorter_error_t sort_view_ids_ops_file_ex(const char *file_path,
+                                              const char *tmp_dir,
+                                              unsigned num_threads,
+                                              size_t memory_budget)
 {
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_id_cmp;
+    ctx.key_prefix_fun = view_id_prefix;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
-    return do_sort_file(file_path, tmp_dir, NULL, 0, &ctx);
+    return do_sort_file(file_path, tmp_dir, NULL, 0, num_threads,
+                        memory_budget, &ctx);
 }
 
 
 LIBCOUCHSTORE_API
-file_sorter_error_t sort_view_ids_file(const char *file_path,
-                                       const char *tmp_dir,
-                                       file_merger_feed_record_t callback,
-                                       void *user_ctx)
+file_sorter_error_t sort_view_ids_file_ex(const char *file_path,
+                                          const char *tmp_dir,
+                                          file_merger_feed_record_t callback,
+                                          void *user_ctx,
+                                          unsigned num_threads,
+                                          size_t memory_budget)
 {
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_id_cmp;
+    ctx.key_prefix_fun = view_id_prefix;
     ctx.type = INITIAL_BUILD_VIEW_RECORD;
     ctx.user_ctx = user_ctx;
 
-    return do_sort_file(file_path, tmp_dir, callback, 1, &ctx);
+    return do_sort_file(file_path, tmp_dir, callback, 1, num_threads,
+                        memory_budget, &ctx);
 }
 
 
 LIBCOUCHSTORE_API
-file_sorter_error_t sort_spatial_kvs_file(const char *file_path,
-                                          const char *tmp_dir,
-                                          file_merger_feed_record_t callback,
-                                          void *user_ctx)
+file_sorter_error_t sort_spatial_kvs_file_ex(const char *file_path,
+                                             const char *tmp_dir,
+                                             file_merger_feed_record_t callback,
+                                             void *user_ctx,
+                                             unsigned num_threads,
+                                             size_t memory_budget)
 {
     file_sorter_error_t ret;
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = spatial_key_cmp;
+    ctx.key_prefix_fun = spatial_key_prefix;
     ctx.type = INITIAL_BUILD_SPATIAL_RECORD;
     ctx.user_ctx = user_ctx;
 
-    ret = do_sort_file(file_path, tmp_dir, callback, 1, &ctx);
+    ret = do_sort_file(file_path, tmp_dir, callback, 1, num_threads,
+                       memory_budget, &ctx);
 
     return ret;
 }
 
 
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_view_kvs_ops_file(const char *file_path,
+                                           const char *tmp_dir)
+{
+    return sort_view_kvs_ops_file_ex(file_path, tmp_dir, 0, 0);
+}
+
+
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_view_kvs_file(const char *file_path,
+                                       const char *tmp_dir,
+                                       file_merger_feed_record_t callback,
+                                       void *user_ctx)
+{
+    return sort_view_kvs_file_ex(file_path, tmp_dir, callback, user_ctx, 0, 0);
+}
+
+
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_view_ids_ops_file(const char *file_path,
+                                           const char *tmp_dir)
+{
+    return sort_view_ids_ops_file_ex(file_path, tmp_dir, 0, 0);
+}
+
+
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_view_ids_file(const char *file_path,
+                                       const char *tmp_dir,
+                                       file_merger_feed_record_t callback,
+                                       void *user_ctx)
+{
+    return sort_view_ids_file_ex(file_path, tmp_dir, callback, user_ctx, 0, 0);
+}
+
+
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_spatial_kvs_file(const char *file_path,
+                                          const char *tmp_dir,
+                                          file_merger_feed_record_t callback,
+                                          void *user_ctx)
+{
+    return sort_spatial_kvs_file_ex(file_path, tmp_dir, callback, user_ctx, 0, 0);
+}
+
+
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_view_records_file(const char *file_path,
+                                           const char *tmp_dir,
+                                           file_merger_feed_record_t callback,
+                                           view_file_merge_ctx_t *ctx,
+                                           unsigned num_threads,
+                                           size_t memory_budget)
+{
+    return do_sort_file(file_path, tmp_dir, callback, 1, num_threads,
+                        memory_budget, ctx);
+}
+
+
 LIBCOUCHSTORE_API
 file_sorter_error_t sort_spatial_kvs_ops_file(const char *file_path,
                                               const char *tmp_dir,
                                               view_file_merge_ctx_t *ctx)
 {
-    return do_sort_file(file_path, tmp_dir, NULL, 0, ctx);
+    return do_sort_file(file_path, tmp_dir, NULL, 0, 0, 0, ctx);
+}
+
+
+void view_sort_share(unsigned num_sorts,
+                     unsigned *num_threads,
+                     size_t *memory_budget)
+{
+    unsigned cpus = sorter_available_cpus();
+
+    /* Together they get what sort_file_ex() gives one sort by default: up
+     * to 2 sort threads, and room for 3 runs */
+    if (cpus > 2) {
+        cpus = 2;
+    }
+    *num_threads = cpus / num_sorts;
+    if (*num_threads == 0) {
+        *num_threads = 1;
+    }
+    *memory_budget = (size_t) SORT_MAX_BUFFER_SIZE * 3 / num_sorts;
 }
 
 
@@ -122,17 +223,29 @@ static file_sorter_error_t do_sort_file(const char *file_path,
                                         const char *tmp_dir,
                                         file_merger_feed_record_t callback,
                                         int skip_writeback,
+                                        unsigned num_threads,
+                                        size_t memory_budget,
                                         view_file_merge_ctx_t *ctx)
 {
-    return sort_file(file_path,
-                     tmp_dir,
-                     SORT_MAX_NUM_TMP_FILES,
-                     SORT_MAX_BUFFER_SIZE,
-                     read_view_record,
-                     write_view_record,
-                     callback,
-                     compare_view_records,
-                     free_view_record,
-                     skip_writeback,
-                     ctx);
+    return sort_file_ex(file_path,
+                        tmp_dir,
+                        SORT_MAX_NUM_TMP_FILES,
+                        SORT_MAX_BUFFER_SIZE,
+                        num_threads,
+                        memory_budget,
+                        read_view_record,
+                        read_view_record_arena,
+                        write_view_record,
+                        callback,
+                        compare_view_records,
+                        ctx->key_prefix_fun ? view_record_prefix : NULL,
+                        /* id btree keys, and the sort keys of view btree
+                           records, are in plain byte order */
+                        (ctx->key_cmp_fun == view_id_cmp ||
+                         ctx->key_cmp_fun == view_key_cmp) ?
+                            view_record_key : NULL,
+                        free_view_record,
+                        SORT_TMP_FILE_FLAGS,
+                        skip_writeback,
+                        ctx);
 }
@@ -73,6 +73,59 @@ extern "C" {
                                               file_merger_feed_record_t callback,
                                               void *user_ctx);
 
+    /*
+     * The _ex variants of the functions above, and the functions below that
+     * take num_threads and memory_budget, use that many sort threads and
+     * that much memory, as sort_file_ex() does (0 for its defaults).
+     */
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_view_kvs_ops_file_ex(const char *file_path,
+                                                  const char *tmp_dir,
+                                                  unsigned num_threads,
+                                                  size_t memory_budget);
+
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_view_kvs_file_ex(const char *file_path,
+                                              const char *tmp_dir,
+                                              file_merger_feed_record_t callback,
+                                              void *user_ctx,
+                                              unsigned num_threads,
+                                              size_t memory_budget);
+
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_view_ids_ops_file_ex(const char *file_path,
+                                                  const char *tmp_dir,
+                                                  unsigned num_threads,
+                                                  size_t memory_budget);
+
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_view_ids_file_ex(const char *file_path,
+                                              const char *tmp_dir,
+                                              file_merger_feed_record_t callback,
+                                              void *user_ctx,
+                                              unsigned num_threads,
+                                              size_t memory_budget);
+
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_spatial_kvs_file_ex(const char *file_path,
+                                                 const char *tmp_dir,
+                                                 file_merger_feed_record_t callback,
+                                                 void *user_ctx,
+                                                 unsigned num_threads,
+                                                 size_t memory_budget);
+
+    /*
+     * Sort a file containing view records by the key comparison of ctx,
+     * feeding them to callback in order, with ctx as its context.
+     */
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_view_records_file(const char *file_path,
+                                               const char *tmp_dir,
+                                               file_merger_feed_record_t callback,
+                                               view_file_merge_ctx_t *ctx,
+                                               unsigned num_threads,
+                                               size_t memory_budget);
+
     /*
      * Sort a file containing records of spatial index operations for a
      * spatial view.
@@ -82,12 +135,28 @@ extern "C" {
                                                   const char *tmp_dir,
                                                   view_file_merge_ctx_t *ctx);
 
+    /*
+     * Splits the sort threads and the memory budget that one sort gets by
+     * default between num_sorts sorts running at the same time.
+     */
+    void view_sort_share(unsigned num_sorts,
+                         unsigned *num_threads,
+                         size_t *memory_budget);
+
     /* Record file sorter */
     typedef file_sorter_error_t (*sort_record_fn)(const char *file_path,
                                                   const char *tmp_dir,
                                                   file_merger_feed_record_t callback,
                                                   void *user_ctx);
 
+    /* Record file sorter, taking the sort threads and memory budget */
+    typedef file_sorter_error_t (*sort_record_ex_fn)(const char *file_path,
+                                                     const char *tmp_dir,
+                                                     file_merger_feed_record_t callback,
+                                                     void *user_ctx,
+                                                     unsigned num_threads,
+                                                     size_t memory_budget);
+
 #ifdef __cplusplus
 }
 #endif
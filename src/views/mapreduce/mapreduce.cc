@@ -102,7 +102,23 @@ static Persistent<Context> createJsContext();
 static Handle<Value> emit(const Arguments &args);
 #endif
 
+typedef void (*map_doc_fun_t)(mapreduce_ctx_t *ctx,
+                              const mapreduce_json_t &doc,
+                              const mapreduce_json_t &meta,
+                              mapreduce_map_result_list_t *results);
+
 static void doInitContext(mapreduce_ctx_t *ctx);
+static void mapDocInContext(mapreduce_ctx_t *ctx,
+                            const mapreduce_json_t &doc,
+                            const mapreduce_json_t &meta,
+                            mapreduce_map_result_list_t *results);
+static int mapDocsWith(map_doc_fun_t mapFun,
+                       mapreduce_ctx_t *ctx,
+                       const mapreduce_json_t *docs,
+                       const mapreduce_json_t *metas,
+                       int numDocs,
+                       mapreduce_map_result_list_t *results,
+                       mapreduce_error_t *errors);
 static Handle<Function> compileFunction(const std::string &function);
 static std::string exceptionString(const TryCatch &tryCatch);
 static void loadFunctions(mapreduce_ctx_t *ctx,
@@ -179,6 +195,11 @@ void destroyContext(mapreduce_ctx_t *ctx)
     }
 
     ctx->isolate->Dispose();
+
+    if (ctx->nativeMapper != NULL) {
+        deleteNativeMapper(ctx->nativeMapper);
+        ctx->nativeMapper = NULL;
+    }
 }
 
 
@@ -263,6 +284,11 @@ void mapDoc(mapreduce_ctx_t *ctx,
             const mapreduce_json_t &meta,
             mapreduce_map_result_list_t *results)
 {
+    if (ctx->nativeMapper != NULL &&
+        nativeMapDoc(ctx->nativeMapper, doc, meta, results)) {
+        return;
+    }
+
     Locker locker(ctx->isolate);
     Isolate::Scope isolateScope(ctx->isolate);
 #ifdef V8_POST_3_19_API
@@ -272,6 +298,77 @@ void mapDoc(mapreduce_ctx_t *ctx,
     HandleScope handleScope;
     Context::Scope contextScope(ctx->jsContext);
 #endif
+
+    mapDocInContext(ctx, doc, meta, results);
+}
+
+
+int mapDocs(mapreduce_ctx_t *ctx,
+            const mapreduce_json_t *docs,
+            const mapreduce_json_t *metas,
+            int numDocs,
+            mapreduce_map_result_list_t *results,
+            mapreduce_error_t *errors)
+{
+    if (ctx->nativeMapper != NULL) {
+        // Most documents won't need the isolate, mapDoc() enters it for
+        // the ones that do
+        return mapDocsWith(mapDoc, ctx, docs, metas, numDocs, results, errors);
+    }
+
+    Locker locker(ctx->isolate);
+    Isolate::Scope isolateScope(ctx->isolate);
+#ifdef V8_POST_3_19_API
+    HandleScope handleScope(ctx->isolate);
+    Context::Scope contextScope(ctx->isolate, ctx->jsContext);
+#else
+    HandleScope handleScope;
+    Context::Scope contextScope(ctx->jsContext);
+#endif
+
+    return mapDocsWith(mapDocInContext, ctx, docs, metas, numDocs, results, errors);
+}
+
+
+static int mapDocsWith(map_doc_fun_t mapFun,
+                       mapreduce_ctx_t *ctx,
+                       const mapreduce_json_t *docs,
+                       const mapreduce_json_t *metas,
+                       int numDocs,
+                       mapreduce_map_result_list_t *results,
+                       mapreduce_error_t *errors)
+{
+    for (int i = 0; i < numDocs; ++i) {
+        errors[i] = MAPREDUCE_SUCCESS;
+        try {
+            mapFun(ctx, docs[i], metas[i], &results[i]);
+        } catch (MapReduceError &e) {
+            taskFinished(ctx);
+            errors[i] = e.getError();
+            if (errors[i] == MAPREDUCE_TIMEOUT) {
+                // The isolate must be left for the termination to end
+                return i + 1;
+            }
+        } catch (std::bad_alloc &) {
+            taskFinished(ctx);
+            errors[i] = MAPREDUCE_ALLOC_ERROR;
+        }
+    }
+
+    return numDocs;
+}
+
+
+static void mapDocInContext(mapreduce_ctx_t *ctx,
+                            const mapreduce_json_t &doc,
+                            const mapreduce_json_t &meta,
+                            mapreduce_map_result_list_t *results)
+{
+#ifdef V8_POST_3_19_API
+    HandleScope handleScope(ctx->isolate);
+#else
+    HandleScope handleScope;
+#endif
     Handle<Value> docObject = jsonParse(doc);
     Handle<Value> metaObject = jsonParse(meta);
 
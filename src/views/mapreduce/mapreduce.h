@@ -75,6 +75,18 @@ extern "C" {
         int                    length;
     } mapreduce_map_result_list_t;
 
+    typedef struct {
+        /* one per document, results[i] is valid if errors[i] is
+           MAPREDUCE_SUCCESS */
+        mapreduce_map_result_list_t *results;
+        mapreduce_error_t           *errors;
+        int                         length;
+        /* private, buffers kept for the next batch */
+        mapreduce_map_result_t      *lists;
+        int                         capacity;
+        int                         lists_capacity;
+    } mapreduce_map_batch_result_t;
+
 
 
     /**
@@ -99,6 +111,100 @@ extern "C" {
                                     const mapreduce_json_t *meta,
                                     mapreduce_map_result_list_t **result);
 
+    /**
+     * Maps a batch of documents with a single entry into the context, which
+     * costs less than a mapreduce_map() call per document. For every
+     * document i, (*result)->errors[i] is set to what mapreduce_map() would
+     * return for docs[i] and metas[i] and, if that's MAPREDUCE_SUCCESS,
+     * (*result)->results[i] holds its results.
+     *
+     * If *result is NULL, it is allocated. Otherwise it must come from a
+     * previous call, and its contents are replaced, reusing its buffers.
+     * Either way the caller is responsible for free'ing it with a call to
+     * mapreduce_free_map_batch_result().
+     **/
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_map_batch(void *context,
+                                          const mapreduce_json_t *docs,
+                                          const mapreduce_json_t *metas,
+                                          int num_docs,
+                                          mapreduce_map_batch_result_t **result);
+
+    /**
+     * Starts a pool of num_contexts map contexts, each one with its own
+     * isolate and compiled with the same map functions, so that documents
+     * can be mapped by several threads at once with mapreduce_pool_map().
+     *
+     * If return value other than MAPREDUCE_SUCCESS, error_msg might be
+     * assigned an error message, for which the caller is responsible to
+     * deallocate via mapreduce_free_error_msg().
+     **/
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_start_map_pool(const char *map_functions[],
+                                               int num_functions,
+                                               int num_contexts,
+                                               void **pool,
+                                               char **error_msg);
+
+    /**
+     * Maps a batch of documents with all the contexts of a pool, each one
+     * used by a thread of its own. For every document i, errors[i] and
+     * results[i] are set to what mapreduce_map() returns for docs[i] and
+     * metas[i], so results are in the same order as the documents. The
+     * caller is responsible for free'ing every results[i] that isn't NULL
+     * with a call to mapreduce_free_map_result_list().
+     *
+     * Returns MAPREDUCE_SUCCESS unless the batch couldn't be mapped at all.
+     **/
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_pool_map(void *pool,
+                                         const mapreduce_json_t *docs,
+                                         const mapreduce_json_t *metas,
+                                         int num_docs,
+                                         mapreduce_map_result_list_t **results,
+                                         mapreduce_error_t *errors);
+
+    LIBMAPREDUCE_API
+    void mapreduce_free_map_pool(void *pool);
+
+    /**
+     * Starts a single map context for the map functions of num_groups
+     * groups (design documents), the first group_sizes[0] functions being
+     * the ones of group 0, the next group_sizes[1] the ones of group 1 and
+     * so on. Mapping a document with mapreduce_map_group() parses it once
+     * for all the groups, instead of once per context of each group.
+     *
+     * All the functions are given the same document object, so one
+     * modifying it affects the functions after it, from other groups too,
+     * and a timeout of any function fails the document for every group.
+     *
+     * If return value other than MAPREDUCE_SUCCESS, error_msg might be
+     * assigned an error message, for which the caller is responsible to
+     * deallocate via mapreduce_free_error_msg().
+     **/
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_start_map_group(const char *map_functions[],
+                                                const int group_sizes[],
+                                                int num_groups,
+                                                void **group,
+                                                char **error_msg);
+
+    /**
+     * Maps a document with the functions of every group of a map group.
+     * If return value is MAPREDUCE_SUCCESS, results[i] is set to the results
+     * of the functions of group i, like mapreduce_map() with a context of
+     * those functions would, and the caller is responsible for free'ing each
+     * of them with a call to mapreduce_free_map_result_list().
+     **/
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_map_group(void *group,
+                                          const mapreduce_json_t *doc,
+                                          const mapreduce_json_t *meta,
+                                          mapreduce_map_result_list_t **results);
+
+    LIBMAPREDUCE_API
+    void mapreduce_free_map_group(void *group);
+
     LIBMAPREDUCE_API
     void mapreduce_free_json_list(mapreduce_json_list_t *list);
 
@@ -108,6 +214,9 @@ extern "C" {
     LIBMAPREDUCE_API
     void mapreduce_free_map_result_list(mapreduce_map_result_list_t *list);
 
+    LIBMAPREDUCE_API
+    void mapreduce_free_map_batch_result(mapreduce_map_batch_result_t *result);
+
     LIBMAPREDUCE_API
     void mapreduce_free_error_msg(char *error_msg);
 
@@ -177,6 +286,17 @@ extern "C" {
     LIBMAPREDUCE_API
     void mapreduce_set_timeout(unsigned int seconds);
 
+    /**
+     * Enables (the default) or disables mapping documents without V8 in
+     * the map contexts started afterwards whose functions are all simple:
+     * emits of document or meta fields and literals, possibly under if
+     * statements comparing fields with literals. Documents with something
+     * only V8 evaluates exactly (escaped strings, fields of anything but
+     * objects, type conversions...) are still mapped by V8.
+     **/
+    LIBMAPREDUCE_API
+    void mapreduce_set_native_maps(int enabled);
+
 
 #ifdef __cplusplus
 }
@@ -21,6 +21,7 @@
  **/
 #include "mapreduce.h"
 #include "mapreduce_internal.h"
+#include "mapreduce_testing.h"
 #include <iostream>
 #include <map>
 #include <cstring>
@@ -38,6 +39,7 @@ static const char *MEM_ALLOC_ERROR_MSG = "memory allocation failure";
 static cb_thread_t terminator_thread;
 static bool terminator_thread_created = false;
 static volatile unsigned int terminator_timeout = 5;
+static volatile bool native_maps = true;
 
 static std::map<uintptr_t, mapreduce_ctx_t *> ctx_registry;
 
@@ -61,9 +63,36 @@ private:
 
 static RegistryMutex registryMutex;
 
+typedef struct {
+    std::vector<mapreduce_ctx_t *> contexts;
+} mapreduce_pool_t;
+
+/* The map functions of several groups (design documents) in one context */
+typedef struct {
+    mapreduce_ctx_t   *ctx;
+    std::vector<int>  group_sizes;
+} mapreduce_group_t;
+
+/* A batch of documents mapped by a pool, handed out one at a time */
+typedef struct {
+    const mapreduce_json_t       *docs;
+    const mapreduce_json_t       *metas;
+    int                          num_docs;
+    mapreduce_map_result_list_t  **results;
+    mapreduce_error_t            *errors;
+    int                          next_doc;
+    cb_mutex_t                   mutex;
+} map_batch_t;
+
+typedef struct {
+    map_batch_t      *batch;
+    mapreduce_ctx_t  *ctx;
+} map_worker_t;
+
 
 static mapreduce_error_t start_context(const char *functions[],
                                        int num_functions,
+                                       bool map_functions,
                                        void **context,
                                        char **error_msg);
 
@@ -73,9 +102,13 @@ static void make_function_list(const char *sources[],
 
 static void copy_error_msg(const std::string &msg, char **to);
 
+static void free_map_results(mapreduce_map_result_t *list, int length);
+static void clear_map_batch_result(mapreduce_map_batch_result_t *batch);
+
 static void register_ctx(mapreduce_ctx_t *ctx);
 static void unregister_ctx(mapreduce_ctx_t *ctx);
 static void terminator_loop(void *);
+static void map_worker(void *args);
 
 
 LIBMAPREDUCE_API
@@ -84,7 +117,7 @@ mapreduce_error_t mapreduce_start_map_context(const char *map_functions[],
                                               void **context,
                                               char **error_msg)
 {
-    return start_context(map_functions, num_functions, context, error_msg);
+    return start_context(map_functions, num_functions, true, context, error_msg);
 }
 
 
@@ -129,13 +162,336 @@ mapreduce_error_t mapreduce_map(void *context,
 }
 
 
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_map_batch(void *context,
+                                      const mapreduce_json_t *docs,
+                                      const mapreduce_json_t *metas,
+                                      int num_docs,
+                                      mapreduce_map_batch_result_t **result)
+{
+    mapreduce_ctx_t *ctx = (mapreduce_ctx_t *) context;
+    mapreduce_map_batch_result_t *batch = *result;
+    int num_funs = ctx->functions->size();
+    int done = 0;
+
+    if (batch == NULL) {
+        batch = (mapreduce_map_batch_result_t *) calloc(1, sizeof(*batch));
+        if (batch == NULL) {
+            return MAPREDUCE_ALLOC_ERROR;
+        }
+        *result = batch;
+    } else {
+        clear_map_batch_result(batch);
+    }
+
+    if (num_docs > batch->capacity) {
+        size_t sz = sizeof(mapreduce_map_result_list_t) * num_docs;
+        mapreduce_map_result_list_t *results;
+        mapreduce_error_t *errors;
+
+        results = (mapreduce_map_result_list_t *) realloc(batch->results, sz);
+        if (results == NULL) {
+            return MAPREDUCE_ALLOC_ERROR;
+        }
+        batch->results = results;
+        errors = (mapreduce_error_t *) realloc(batch->errors,
+                                               sizeof(mapreduce_error_t) * num_docs);
+        if (errors == NULL) {
+            return MAPREDUCE_ALLOC_ERROR;
+        }
+        batch->errors = errors;
+        batch->capacity = num_docs;
+    }
+    if (num_docs * num_funs > batch->lists_capacity) {
+        size_t sz = sizeof(mapreduce_map_result_t) * num_docs * num_funs;
+        mapreduce_map_result_t *lists;
+
+        lists = (mapreduce_map_result_t *) realloc(batch->lists, sz);
+        if (lists == NULL) {
+            return MAPREDUCE_ALLOC_ERROR;
+        }
+        batch->lists = lists;
+        batch->lists_capacity = num_docs * num_funs;
+    }
+
+    for (int i = 0; i < num_docs; ++i) {
+        batch->results[i].list = batch->lists + i * num_funs;
+        batch->results[i].length = 0;
+    }
+
+    /* A timeout ends the entry into the context, the documents after it
+     * are mapped with another one */
+    while (done < num_docs) {
+        done += mapDocs(ctx, docs + done, metas + done, num_docs - done,
+                        batch->results + done, batch->errors + done);
+    }
+
+    for (int i = 0; i < num_docs; ++i) {
+        if (batch->errors[i] != MAPREDUCE_SUCCESS) {
+            free_map_results(batch->results[i].list, batch->results[i].length);
+            batch->results[i].length = 0;
+        } else {
+            assert(batch->results[i].length == num_funs);
+        }
+    }
+    batch->length = num_docs;
+
+    return MAPREDUCE_SUCCESS;
+}
+
+
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_start_map_pool(const char *map_functions[],
+                                           int num_functions,
+                                           int num_contexts,
+                                           void **pool,
+                                           char **error_msg)
+{
+    mapreduce_pool_t *p;
+    mapreduce_error_t ret;
+
+    if (num_contexts <= 0) {
+        copy_error_msg("invalid number of contexts", error_msg);
+        return MAPREDUCE_INVALID_ARG;
+    }
+
+    try {
+        p = new mapreduce_pool_t();
+    } catch (std::bad_alloc &) {
+        copy_error_msg(MEM_ALLOC_ERROR_MSG, error_msg);
+        return MAPREDUCE_ALLOC_ERROR;
+    }
+
+    for (int i = 0; i < num_contexts; ++i) {
+        void *ctx = NULL;
+
+        ret = start_context(map_functions, num_functions, true, &ctx, error_msg);
+        if (ret != MAPREDUCE_SUCCESS) {
+            mapreduce_free_map_pool(p);
+            return ret;
+        }
+        try {
+            p->contexts.push_back((mapreduce_ctx_t *) ctx);
+        } catch (std::bad_alloc &) {
+            mapreduce_free_context(ctx);
+            mapreduce_free_map_pool(p);
+            copy_error_msg(MEM_ALLOC_ERROR_MSG, error_msg);
+            return MAPREDUCE_ALLOC_ERROR;
+        }
+    }
+
+    *pool = (void *) p;
+    *error_msg = NULL;
+    return MAPREDUCE_SUCCESS;
+}
+
+
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_pool_map(void *pool,
+                                     const mapreduce_json_t *docs,
+                                     const mapreduce_json_t *metas,
+                                     int num_docs,
+                                     mapreduce_map_result_list_t **results,
+                                     mapreduce_error_t *errors)
+{
+    mapreduce_pool_t *p = (mapreduce_pool_t *) pool;
+    int num_workers = p->contexts.size();
+    int num_threads = 0;
+    map_batch_t batch;
+    map_worker_t *workers;
+    cb_thread_t *threads;
+
+    for (int i = 0; i < num_docs; ++i) {
+        results[i] = NULL;
+        errors[i] = MAPREDUCE_SUCCESS;
+    }
+    if (num_docs < num_workers) {
+        num_workers = num_docs;
+    }
+    if (num_workers == 0) {
+        return MAPREDUCE_SUCCESS;
+    }
+
+    workers = (map_worker_t *) malloc(sizeof(map_worker_t) * num_workers);
+    threads = (cb_thread_t *) malloc(sizeof(cb_thread_t) * num_workers);
+    if (workers == NULL || threads == NULL) {
+        free(workers);
+        free(threads);
+        return MAPREDUCE_ALLOC_ERROR;
+    }
+
+    batch.docs = docs;
+    batch.metas = metas;
+    batch.num_docs = num_docs;
+    batch.results = results;
+    batch.errors = errors;
+    batch.next_doc = 0;
+    cb_mutex_initialize(&batch.mutex);
+
+    for (int i = 0; i < num_workers; ++i) {
+        workers[i].batch = &batch;
+        workers[i].ctx = p->contexts[i];
+    }
+
+    /* The calling thread is a worker too. If some threads can't be
+     * created, the others just map more documents. */
+    for (int i = 1; i < num_workers; ++i) {
+        if (cb_create_thread(&threads[num_threads], map_worker,
+                             &workers[i], 0) != 0) {
+            break;
+        }
+        ++num_threads;
+    }
+    map_worker(&workers[0]);
+
+    for (int i = 0; i < num_threads; ++i) {
+        cb_join_thread(threads[i]);
+    }
+
+    cb_mutex_destroy(&batch.mutex);
+    free(workers);
+    free(threads);
+
+    return MAPREDUCE_SUCCESS;
+}
+
+
+LIBMAPREDUCE_API
+void mapreduce_free_map_pool(void *pool)
+{
+    if (pool != NULL) {
+        mapreduce_pool_t *p = (mapreduce_pool_t *) pool;
+
+        for (size_t i = 0; i < p->contexts.size(); ++i) {
+            mapreduce_free_context(p->contexts[i]);
+        }
+        delete p;
+    }
+}
+
+
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_start_map_group(const char *map_functions[],
+                                            const int group_sizes[],
+                                            int num_groups,
+                                            void **group,
+                                            char **error_msg)
+{
+    mapreduce_group_t *g;
+    mapreduce_error_t ret;
+    void *ctx = NULL;
+    int num_functions = 0;
+
+    if (num_groups <= 0) {
+        copy_error_msg("invalid number of groups", error_msg);
+        return MAPREDUCE_INVALID_ARG;
+    }
+    for (int i = 0; i < num_groups; ++i) {
+        if (group_sizes[i] <= 0) {
+            copy_error_msg("invalid number of functions in a group", error_msg);
+            return MAPREDUCE_INVALID_ARG;
+        }
+        num_functions += group_sizes[i];
+    }
+
+    ret = start_context(map_functions, num_functions, true, &ctx, error_msg);
+    if (ret != MAPREDUCE_SUCCESS) {
+        return ret;
+    }
+
+    try {
+        g = new mapreduce_group_t();
+        g->group_sizes.assign(group_sizes, group_sizes + num_groups);
+    } catch (std::bad_alloc &) {
+        mapreduce_free_context(ctx);
+        copy_error_msg(MEM_ALLOC_ERROR_MSG, error_msg);
+        return MAPREDUCE_ALLOC_ERROR;
+    }
+    g->ctx = (mapreduce_ctx_t *) ctx;
+
+    *group = (void *) g;
+    *error_msg = NULL;
+    return MAPREDUCE_SUCCESS;
+}
+
+
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_map_group(void *group,
+                                      const mapreduce_json_t *doc,
+                                      const mapreduce_json_t *meta,
+                                      mapreduce_map_result_list_t **results)
+{
+    mapreduce_group_t *g = (mapreduce_group_t *) group;
+    int num_groups = g->group_sizes.size();
+    mapreduce_map_result_list_t *all = NULL;
+    mapreduce_error_t ret;
+    int offset = 0;
+
+    for (int i = 0; i < num_groups; ++i) {
+        results[i] = NULL;
+    }
+
+    /* A single parse of the document for the functions of all groups */
+    ret = mapreduce_map(g->ctx, doc, meta, &all);
+    if (ret != MAPREDUCE_SUCCESS) {
+        return ret;
+    }
+
+    for (int i = 0; i < num_groups; ++i) {
+        int n = g->group_sizes[i];
+        mapreduce_map_result_list_t *r;
+
+        r = (mapreduce_map_result_list_t *) malloc(sizeof(*r));
+        if (r != NULL) {
+            r->list = (mapreduce_map_result_t *) malloc(sizeof(mapreduce_map_result_t) * n);
+            if (r->list == NULL) {
+                free(r);
+                r = NULL;
+            }
+        }
+        if (r == NULL) {
+            for (int j = 0; j < i; ++j) {
+                mapreduce_free_map_result_list(results[j]);
+                results[j] = NULL;
+            }
+            free_map_results(all->list + offset, all->length - offset);
+            free(all->list);
+            free(all);
+            return MAPREDUCE_ALLOC_ERROR;
+        }
+
+        memcpy(r->list, all->list + offset, sizeof(mapreduce_map_result_t) * n);
+        r->length = n;
+        results[i] = r;
+        offset += n;
+    }
+
+    free(all->list);
+    free(all);
+
+    return MAPREDUCE_SUCCESS;
+}
+
+
+LIBMAPREDUCE_API
+void mapreduce_free_map_group(void *group)
+{
+    if (group != NULL) {
+        mapreduce_group_t *g = (mapreduce_group_t *) group;
+
+        mapreduce_free_context(g->ctx);
+        delete g;
+    }
+}
+
+
 LIBMAPREDUCE_API
 mapreduce_error_t mapreduce_start_reduce_context(const char *reduce_functions[],
                                                  int num_functions,
                                                  void **context,
                                                  char **error_msg)
 {
-    return start_context(reduce_functions, num_functions, context, error_msg);
+    return start_context(reduce_functions, num_functions, false, context, error_msg);
 }
 
 
@@ -300,30 +656,24 @@ void mapreduce_free_map_result_list(mapreduce_map_result_list_t *list)
         return;
     }
 
-    for (int i = 0; i < list->length; ++i) {
-        mapreduce_map_result_t mr = list->list[i];
+    free_map_results(list->list, list->length);
+    free(list->list);
+    free(list);
+}
 
-        switch (mr.error) {
-        case MAPREDUCE_SUCCESS:
-            {
-                mapreduce_kv_list_t kvs = mr.result.kvs;
 
-                for (int j = 0; j < kvs.length; ++j) {
-                    mapreduce_kv_t kv = kvs.kvs[j];
-                    free(kv.key.json);
-                    free(kv.value.json);
-                }
-                free(kvs.kvs);
-            }
-            break;
-        default:
-            free(mr.result.error_msg);
-            break;
-        }
+LIBMAPREDUCE_API
+void mapreduce_free_map_batch_result(mapreduce_map_batch_result_t *result)
+{
+    if (result == NULL) {
+        return;
     }
 
-    free(list->list);
-    free(list);
+    clear_map_batch_result(result);
+    free(result->results);
+    free(result->errors);
+    free(result->lists);
+    free(result);
 }
 
 
@@ -341,8 +691,28 @@ void mapreduce_set_timeout(unsigned int seconds)
 }
 
 
+LIBMAPREDUCE_API
+void mapreduce_set_native_maps(int enabled)
+{
+    native_maps = (enabled != 0);
+}
+
+
+LIBMAPREDUCE_API
+int64_t mapreduce_native_mapped_docs(void *context)
+{
+    mapreduce_ctx_t *ctx = (mapreduce_ctx_t *) context;
+
+    if (ctx->nativeMapper == NULL) {
+        return -1;
+    }
+    return (int64_t) nativeMappedDocs(ctx->nativeMapper);
+}
+
+
 static mapreduce_error_t start_context(const char *functions[],
                                        int num_functions,
+                                       bool map_functions,
                                        void **context,
                                        char **error_msg)
 {
@@ -355,6 +725,9 @@ static mapreduce_error_t start_context(const char *functions[],
 
         make_function_list(functions, num_functions, functions_list);
         initContext(ctx, functions_list);
+        if (map_functions && native_maps) {
+            ctx->nativeMapper = newNativeMapper(functions_list);
+        }
     } catch (MapReduceError &e) {
         copy_error_msg(e.getMsg(), error_msg);
         ret = e.getError();
@@ -406,6 +779,41 @@ static void copy_error_msg(const std::string &msg, char **to)
 }
 
 
+static void free_map_results(mapreduce_map_result_t *list, int length)
+{
+    for (int i = 0; i < length; ++i) {
+        mapreduce_map_result_t mr = list[i];
+
+        switch (mr.error) {
+        case MAPREDUCE_SUCCESS:
+            {
+                mapreduce_kv_list_t kvs = mr.result.kvs;
+
+                for (int j = 0; j < kvs.length; ++j) {
+                    mapreduce_kv_t kv = kvs.kvs[j];
+                    free(kv.key.json);
+                    free(kv.value.json);
+                }
+                free(kvs.kvs);
+            }
+            break;
+        default:
+            free(mr.result.error_msg);
+            break;
+        }
+    }
+}
+
+
+static void clear_map_batch_result(mapreduce_map_batch_result_t *batch)
+{
+    for (int i = 0; i < batch->length; ++i) {
+        free_map_results(batch->results[i].list, batch->results[i].length);
+    }
+    batch->length = 0;
+}
+
+
 static void register_ctx(mapreduce_ctx_t *ctx)
 {
     uintptr_t key = reinterpret_cast<uintptr_t>(ctx);
@@ -457,3 +865,25 @@ static void terminator_loop(void *)
         doSleep(terminator_timeout);
     }
 }
+
+
+static void map_worker(void *args)
+{
+    map_worker_t *worker = (map_worker_t *) args;
+    map_batch_t *batch = worker->batch;
+    int i;
+
+    while (true) {
+        cb_mutex_enter(&batch->mutex);
+        i = batch->next_doc++;
+        cb_mutex_exit(&batch->mutex);
+
+        if (i >= batch->num_docs) {
+            break;
+        }
+        batch->errors[i] = mapreduce_map(worker->ctx,
+                                         &batch->docs[i],
+                                         &batch->metas[i],
+                                         &batch->results[i]);
+    }
+}
@@ -35,6 +35,7 @@
 
 
 class MapReduceError;
+class NativeMapper;
 
 typedef std::list<mapreduce_json_t>                    json_results_list_t;
 typedef std::list<mapreduce_kv_t>                      kv_list_int_t;
@@ -50,6 +51,7 @@ typedef struct {
     function_vector_t           *functions;
     kv_list_int_t               *kvs;
     volatile time_t             taskStartTime;
+    NativeMapper                *nativeMapper;
 } mapreduce_ctx_t;
 
 
@@ -63,6 +65,31 @@ void mapDoc(mapreduce_ctx_t *ctx,
             const mapreduce_json_t &meta,
             mapreduce_map_result_list_t *result);
 
+/* Maps docs in a single entry into the context. Stops after a document
+   that timed out, returning the number of documents mapped. */
+int mapDocs(mapreduce_ctx_t *ctx,
+            const mapreduce_json_t *docs,
+            const mapreduce_json_t *metas,
+            int numDocs,
+            mapreduce_map_result_list_t *results,
+            mapreduce_error_t *errors);
+
+/* Returns a mapper evaluating the map functions without V8, or NULL if
+   any of them is more than emits of fields guarded by simple conditions. */
+NativeMapper *newNativeMapper(const std::list<std::string> &function_sources);
+
+void deleteNativeMapper(NativeMapper *mapper);
+
+/* Returns false, leaving results untouched, if the document needs V8 to
+   be mapped exactly like the functions' JavaScript would. */
+bool nativeMapDoc(NativeMapper *mapper,
+                  const mapreduce_json_t &doc,
+                  const mapreduce_json_t &meta,
+                  mapreduce_map_result_list_t *results);
+
+/* Returns the number of documents the mapper mapped */
+uint64_t nativeMappedDocs(const NativeMapper *mapper);
+
 json_results_list_t runReduce(mapreduce_ctx_t *ctx,
                               const mapreduce_json_list_t &keys,
                               const mapreduce_json_list_t &values);
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * @copyright 2013 Couchbase, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+/**
+ * Not part of the API -- exposed for testing only (see tests/mapreduce/map.c).
+ * Do not include it in other applications/libraries.
+ **/
+
+#ifndef _MAPREDUCE_TESTING_H
+#define _MAPREDUCE_TESTING_H
+
+#include "mapreduce.h"
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Returns the number of documents the map context mapped without V8,
+     * or -1 if it maps them all with V8.
+     **/
+    LIBMAPREDUCE_API
+    int64_t mapreduce_native_mapped_docs(void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
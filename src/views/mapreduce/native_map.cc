@@ -0,0 +1,1472 @@
+/**
+ * @copyright 2013 Couchbase, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+/**
+ * Native evaluation of simple map functions, the ones made only of emit()
+ * calls of document/meta fields and literals, optionally guarded by if
+ * statements testing fields against literals, such as:
+ *
+ *   function(doc, meta) {
+ *     if (doc.type == "user" && meta.type === "json") {
+ *       emit(doc.name, null);
+ *     }
+ *   }
+ *
+ * A document is evaluated with a single validating pass over its JSON, which
+ * records the values of the fields the functions use. Whenever the result
+ * could differ from what V8 would produce (a field that is an object, a
+ * string with escapes, a comparison needing a type conversion, an invalid
+ * document, ...), the document is left for V8 to map.
+ **/
+
+#include "mapreduce_internal.h"
+#include <cstring>
+#include <ctype.h>
+#include <new>
+
+
+namespace {
+
+enum valueKind {
+    VAL_BAD,         /* can't be evaluated natively */
+    VAL_UNDEFINED,
+    VAL_NULL,
+    VAL_BOOL,
+    VAL_NUMBER,
+    VAL_STRING,
+    VAL_OBJECT,
+    VAL_ARRAY
+};
+
+/* A JSON value, either from a document or a literal of a function. For
+   strings, the text is the JSON string including its quotes. */
+struct value_t {
+    valueKind  kind;
+    const char *text;
+    size_t     length;
+    bool       escaped;
+};
+
+enum tristate_t {
+    TS_FALSE,
+    TS_TRUE,
+    TS_UNKNOWN
+};
+
+/* A field used by a function, node of the tree of fields of a document
+   or meta. Node 0 of a tree is the document itself. */
+struct path_node_t {
+    int                 parent;
+    std::string         name;
+    std::vector<int>    children;
+};
+
+/* What a scan of a document found for a field */
+struct path_slot_t {
+    bool        found;
+    bool        ambiguous;     /* the object has keys with escapes */
+    value_t     value;
+};
+
+enum operandKind {
+    OPERAND_LITERAL,
+    OPERAND_DOC,
+    OPERAND_META
+};
+
+/* A literal, kept as its JSON text, or a field of the document or meta */
+struct operand_t {
+    operandKind  kind;
+    valueKind    literalKind;
+    std::string  literal;
+    int          node;
+};
+
+enum exprKind {
+    EXPR_OPERAND,
+    EXPR_NOT,
+    EXPR_AND,
+    EXPR_OR,
+    EXPR_EQ,
+    EXPR_STRICT_EQ,
+    EXPR_NE,
+    EXPR_STRICT_NE
+};
+
+struct expr_t {
+    exprKind     kind;
+    operand_t    operand;
+    expr_t       *left;
+    expr_t       *right;
+};
+
+struct stmt_t {
+    bool                  isEmit;
+    operand_t             key;
+    operand_t             value;
+    expr_t                *cond;
+    std::vector<stmt_t*>  thenStmts;
+    std::vector<stmt_t*>  elseStmts;
+};
+
+struct emitted_t {
+    value_t     key;
+    value_t     value;
+};
+
+const int MAX_JSON_DEPTH = 512;
+
+/* Properties every object has through its prototype, the recognizer
+   doesn't accept fields named after them */
+const char *const PROTOTYPE_PROPERTIES[] = {
+    "constructor", "hasOwnProperty", "isPrototypeOf", "propertyIsEnumerable",
+    "toLocaleString", "toString", "valueOf", "__proto__", "__defineGetter__",
+    "__defineSetter__", "__lookupGetter__", "__lookupSetter__"
+};
+
+}
+
+
+class NativeMapper {
+public:
+    NativeMapper() : mappedDocs(0) {
+        docTree.push_back(path_node_t());
+        docTree[0].parent = -1;
+        metaTree.push_back(path_node_t());
+        metaTree[0].parent = -1;
+    }
+
+    ~NativeMapper();
+
+    bool addFunction(const std::string &source);
+
+    bool map(const mapreduce_json_t &doc,
+             const mapreduce_json_t &meta,
+             mapreduce_map_result_list_t *results);
+
+    uint64_t getMappedDocs() const {
+        return mappedDocs;
+    }
+
+private:
+    /* recognizer */
+    enum tokenKind {
+        TOK_END,
+        TOK_IDENT,
+        TOK_STRING,
+        TOK_NUMBER,
+        TOK_PUNCT
+    };
+
+    struct token_t {
+        tokenKind    kind;
+        std::string  text;
+    };
+
+    bool tokenize(const std::string &source);
+    bool peek(const char *punct) const;
+    bool accept(const char *punct);
+    bool acceptIdent(const char *ident);
+    bool parseStatements(std::vector<stmt_t*> &stmts);
+    stmt_t *parseStatement();
+    expr_t *parseOr();
+    expr_t *parseAnd();
+    expr_t *parseComparison();
+    expr_t *parseUnary();
+    bool parseOperand(operand_t &operand);
+    bool parsePath(std::vector<std::string> &path);
+    static int addPath(std::vector<path_node_t> &tree,
+                       const std::vector<std::string> &path);
+
+    /* evaluator */
+    static bool scan(const mapreduce_json_t &json,
+                     const std::vector<path_node_t> &tree,
+                     std::vector<path_slot_t> &slots);
+    static bool scanValue(const char *&p, const char *end,
+                          const std::vector<path_node_t> &tree,
+                          std::vector<path_slot_t> &slots,
+                          int node, int depth);
+    static void clearSlots(const std::vector<path_node_t> &tree,
+                           std::vector<path_slot_t> &slots,
+                           int node);
+    value_t lookup(const operand_t &operand) const;
+    tristate_t eval(const expr_t *expr) const;
+    bool run(const std::vector<stmt_t*> &stmts,
+             std::vector<emitted_t> &emitted) const;
+
+    static void freeExpr(expr_t *expr);
+    static void freeStatements(std::vector<stmt_t*> &stmts);
+
+    std::vector<token_t>                   tokens;
+    size_t                                 pos;
+    std::string                            docParam;
+    std::string                            metaParam;
+
+    std::vector<path_node_t>               docTree;
+    std::vector<path_node_t>               metaTree;
+    std::vector< std::vector<stmt_t*> >    functions;
+
+    /* Scratch state of map(), a context maps one document at a time */
+    std::vector<path_slot_t>               docSlots;
+    std::vector<path_slot_t>               metaSlots;
+    std::vector< std::vector<emitted_t> >  emitted;
+    /* Documents map() mapped */
+    uint64_t                               mappedDocs;
+};
+
+
+static inline bool isIdentStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        c == '_' || c == '$';
+}
+
+
+static inline bool isIdentChar(char c)
+{
+    return isIdentStart(c) || (c >= '0' && c <= '9');
+}
+
+
+static inline bool isJsonSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+static bool isReserved(const std::string &ident)
+{
+    static const char *const words[] = {
+        "break", "case", "catch", "continue", "debugger", "default",
+        "delete", "do", "else", "finally", "for", "function", "if", "in",
+        "instanceof", "new", "return", "switch", "this", "throw", "try",
+        "typeof", "var", "void", "while", "with", "class", "const", "enum",
+        "export", "extends", "import", "super", "null", "true", "false",
+        "let", "yield", "arguments", "eval", "undefined", "emit"
+    };
+
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+        if (ident == words[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool isPrototypeProperty(const std::string &name)
+{
+    for (size_t i = 0; i < sizeof(PROTOTYPE_PROPERTIES) / sizeof(PROTOTYPE_PROPERTIES[0]); ++i) {
+        if (name == PROTOTYPE_PROPERTIES[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool isValidUtf8(const char *s, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    const unsigned char *end = p + len;
+
+    while (p < end) {
+        unsigned char c = *p;
+        size_t n;
+        uint32_t cp;
+
+        if (c < 0x80) {
+            ++p;
+            continue;
+        } else if ((c & 0xE0) == 0xC0) {
+            n = 1;
+            cp = c & 0x1F;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 2;
+            cp = c & 0x0F;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 3;
+            cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if ((size_t) (end - p) <= n) {
+            return false;
+        }
+        for (size_t i = 1; i <= n; ++i) {
+            if ((p[i] & 0xC0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (p[i] & 0x3F);
+        }
+        if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) ||
+            (n == 3 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+            (cp >= 0xD800 && cp <= 0xDFFF)) {
+            return false;
+        }
+        p += n + 1;
+    }
+    return true;
+}
+
+
+/* Whether a JSON number is written the way JSON.stringify() prints its
+   value: at most 15 significant digits (no other decimal of that many
+   digits is the same double, so it's the shortest form), no exponent,
+   no trailing zeros and not below 1e-6, printed with an exponent. */
+static bool isCanonicalNumber(const value_t &v)
+{
+    const char *p = v.text;
+    const char *end = v.text + v.length;
+    bool negative = false;
+    size_t digits;
+
+    if (p < end && *p == '-') {
+        negative = true;
+        ++p;
+    }
+    const char *intPart = p;
+    while (p < end && isdigit((unsigned char) *p)) {
+        ++p;
+    }
+    if (p == intPart || (*intPart == '0' && p - intPart > 1)) {
+        return false;
+    }
+    digits = (*intPart == '0') ? 0 : p - intPart;
+
+    if (p < end && *p == '.') {
+        const char *fraction = ++p;
+        while (p < end && isdigit((unsigned char) *p)) {
+            ++p;
+        }
+        if (p == fraction || p[-1] == '0') {
+            return false;
+        }
+        if (digits == 0) {
+            while (*fraction == '0') {
+                ++fraction;
+            }
+            if (fraction - intPart > 7) {
+                return false;
+            }
+        }
+        digits += p - fraction;
+    }
+
+    if (p != end || digits > 15) {
+        return false;
+    }
+    /* -0 is printed as 0 */
+    return digits > 0 || !negative;
+}
+
+
+static value_t makeValue(valueKind kind, const char *text, size_t length)
+{
+    value_t v;
+
+    v.kind = kind;
+    v.text = text;
+    v.length = length;
+    v.escaped = false;
+    return v;
+}
+
+
+NativeMapper::~NativeMapper()
+{
+    for (size_t i = 0; i < functions.size(); ++i) {
+        freeStatements(functions[i]);
+    }
+}
+
+
+void NativeMapper::freeExpr(expr_t *expr)
+{
+    if (expr != NULL) {
+        freeExpr(expr->left);
+        freeExpr(expr->right);
+        delete expr;
+    }
+}
+
+
+void NativeMapper::freeStatements(std::vector<stmt_t*> &stmts)
+{
+    for (size_t i = 0; i < stmts.size(); ++i) {
+        freeExpr(stmts[i]->cond);
+        freeStatements(stmts[i]->thenStmts);
+        freeStatements(stmts[i]->elseStmts);
+        delete stmts[i];
+    }
+    stmts.clear();
+}
+
+
+bool NativeMapper::tokenize(const std::string &source)
+{
+    const char *p = source.data();
+    const char *end = p + source.length();
+    static const char *const puncts[] = {
+        "===", "!==", "==", "!=", "&&", "||",
+        "(", ")", "{", "}", "[", "]", ".", ",", ";", "!"
+    };
+
+    tokens.clear();
+    pos = 0;
+
+    while (p < end) {
+        token_t tok;
+
+        if (isJsonSpace(*p) || *p == '\f' || *p == '\v') {
+            ++p;
+            continue;
+        }
+        if (end - p >= 2 && p[0] == '/' && p[1] == '/') {
+            while (p < end && *p != '\n' && *p != '\r') {
+                ++p;
+            }
+            continue;
+        }
+        if (end - p >= 2 && p[0] == '/' && p[1] == '*') {
+            const char *close = NULL;
+            for (const char *q = p + 2; q + 1 < end; ++q) {
+                if (q[0] == '*' && q[1] == '/') {
+                    close = q;
+                    break;
+                }
+            }
+            if (close == NULL) {
+                return false;
+            }
+            p = close + 2;
+            continue;
+        }
+
+        if (isIdentStart(*p)) {
+            const char *start = p;
+            while (p < end && isIdentChar(*p)) {
+                ++p;
+            }
+            tok.kind = TOK_IDENT;
+            tok.text.assign(start, p - start);
+        } else if (*p >= '0' && *p <= '9') {
+            const char *start = p;
+            while (p < end && isdigit((unsigned char) *p)) {
+                ++p;
+            }
+            if (p < end && *p == '.') {
+                ++p;
+                while (p < end && isdigit((unsigned char) *p)) {
+                    ++p;
+                }
+            }
+            if (p < end && (isIdentChar(*p) || *p == '.')) {
+                return false;
+            }
+            tok.kind = TOK_NUMBER;
+            tok.text.assign(start, p - start);
+        } else if (*p == '"' || *p == '\'') {
+            /* Plain printable ASCII only, so the literal is its own JSON */
+            char quote = *p++;
+            const char *start = p;
+            while (p < end && *p != quote) {
+                if (*p < 0x20 || *p > 0x7E || *p == '\\' || *p == '"' || *p == '\'') {
+                    return false;
+                }
+                ++p;
+            }
+            if (p == end) {
+                return false;
+            }
+            tok.kind = TOK_STRING;
+            tok.text.assign(start, p - start);
+            ++p;
+        } else {
+            size_t i;
+            for (i = 0; i < sizeof(puncts) / sizeof(puncts[0]); ++i) {
+                size_t len = strlen(puncts[i]);
+                if ((size_t) (end - p) >= len && memcmp(p, puncts[i], len) == 0) {
+                    break;
+                }
+            }
+            if (i == sizeof(puncts) / sizeof(puncts[0])) {
+                return false;
+            }
+            tok.kind = TOK_PUNCT;
+            tok.text = puncts[i];
+            p += tok.text.length();
+        }
+        tokens.push_back(tok);
+    }
+
+    token_t tok;
+    tok.kind = TOK_END;
+    tokens.push_back(tok);
+    return true;
+}
+
+
+bool NativeMapper::peek(const char *punct) const
+{
+    return tokens[pos].kind == TOK_PUNCT && tokens[pos].text == punct;
+}
+
+
+bool NativeMapper::accept(const char *punct)
+{
+    if (peek(punct)) {
+        ++pos;
+        return true;
+    }
+    return false;
+}
+
+
+bool NativeMapper::acceptIdent(const char *ident)
+{
+    if (tokens[pos].kind == TOK_IDENT && tokens[pos].text == ident) {
+        ++pos;
+        return true;
+    }
+    return false;
+}
+
+
+
+
+bool NativeMapper::addFunction(const std::string &source)
+{
+    std::vector<stmt_t*> stmts;
+
+    if (!tokenize(source)) {
+        return false;
+    }
+
+    /* Sources come wrapped in parentheses, see make_function_list() */
+    if (!accept("(") || !acceptIdent("function")) {
+        return false;
+    }
+    /* The name of a named function is visible in its body */
+    if (tokens[pos].kind == TOK_IDENT) {
+        if (isReserved(tokens[pos].text)) {
+            return false;
+        }
+        ++pos;
+    }
+
+    docParam.clear();
+    metaParam.clear();
+    if (!accept("(")) {
+        return false;
+    }
+    if (tokens[pos].kind == TOK_IDENT) {
+        docParam = tokens[pos++].text;
+        if (accept(",")) {
+            if (tokens[pos].kind != TOK_IDENT) {
+                return false;
+            }
+            metaParam = tokens[pos++].text;
+        }
+    }
+    if (isReserved(docParam) || isReserved(metaParam) ||
+        (!docParam.empty() && docParam == metaParam)) {
+        return false;
+    }
+    if (!accept(")") || !accept("{")) {
+        return false;
+    }
+
+    if (!parseStatements(stmts) || !accept("}") || !accept(")") ||
+        tokens[pos].kind != TOK_END) {
+        freeStatements(stmts);
+        return false;
+    }
+
+    functions.push_back(stmts);
+    return true;
+}
+
+
+bool NativeMapper::parseStatements(std::vector<stmt_t*> &stmts)
+{
+    while (!peek("}") && tokens[pos].kind != TOK_END) {
+        if (accept(";")) {
+            continue;
+        }
+        stmt_t *stmt = parseStatement();
+        if (stmt == NULL) {
+            return false;
+        }
+        stmts.push_back(stmt);
+    }
+    return true;
+}
+
+
+stmt_t *NativeMapper::parseStatement()
+{
+    stmt_t *stmt = new stmt_t();
+    std::vector<stmt_t*> *branch = &stmt->thenStmts;
+    stmt_t *body;
+
+    stmt->cond = NULL;
+
+    if (acceptIdent("emit")) {
+        stmt->isEmit = true;
+        if (!accept("(") || !parseOperand(stmt->key)) {
+            goto fail;
+        }
+        if (accept(",")) {
+            if (!parseOperand(stmt->value)) {
+                goto fail;
+            }
+        } else {
+            stmt->value.kind = OPERAND_LITERAL;
+            stmt->value.literalKind = VAL_UNDEFINED;
+        }
+        if (!accept(")")) {
+            goto fail;
+        }
+        /* Anything else following would use the value returned by emit(),
+           a new line between statements is fine (semicolon insertion) */
+        if (!accept(";") && !peek("}") &&
+            !(tokens[pos].kind == TOK_IDENT &&
+              (tokens[pos].text == "emit" || tokens[pos].text == "if" ||
+               tokens[pos].text == "else"))) {
+            goto fail;
+        }
+        return stmt;
+    }
+
+    if (!acceptIdent("if")) {
+        goto fail;
+    }
+    stmt->isEmit = false;
+    if (!accept("(") || (stmt->cond = parseOr()) == NULL || !accept(")")) {
+        goto fail;
+    }
+    while (true) {
+        if (accept("{")) {
+            if (!parseStatements(*branch) || !accept("}")) {
+                goto fail;
+            }
+        } else if (!accept(";")) {
+            if ((body = parseStatement()) == NULL) {
+                goto fail;
+            }
+            branch->push_back(body);
+        }
+        if (branch == &stmt->elseStmts || !acceptIdent("else")) {
+            break;
+        }
+        branch = &stmt->elseStmts;
+    }
+    return stmt;
+
+fail:
+    std::vector<stmt_t*> stmts(1, stmt);
+    freeStatements(stmts);
+    return NULL;
+}
+
+
+expr_t *NativeMapper::parseOr()
+{
+    expr_t *left = parseAnd();
+
+    while (left != NULL && accept("||")) {
+        expr_t *expr = new expr_t();
+        expr->kind = EXPR_OR;
+        expr->left = left;
+        expr->right = parseAnd();
+        if (expr->right == NULL) {
+            freeExpr(expr);
+            return NULL;
+        }
+        left = expr;
+    }
+    return left;
+}
+
+
+expr_t *NativeMapper::parseAnd()
+{
+    expr_t *left = parseComparison();
+
+    while (left != NULL && accept("&&")) {
+        expr_t *expr = new expr_t();
+        expr->kind = EXPR_AND;
+        expr->left = left;
+        expr->right = parseComparison();
+        if (expr->right == NULL) {
+            freeExpr(expr);
+            return NULL;
+        }
+        left = expr;
+    }
+    return left;
+}
+
+
+expr_t *NativeMapper::parseComparison()
+{
+    exprKind kind;
+    expr_t *left = parseUnary();
+
+    if (left == NULL) {
+        return NULL;
+    }
+    if (accept("==")) {
+        kind = EXPR_EQ;
+    } else if (accept("===")) {
+        kind = EXPR_STRICT_EQ;
+    } else if (accept("!=")) {
+        kind = EXPR_NE;
+    } else if (accept("!==")) {
+        kind = EXPR_STRICT_NE;
+    } else {
+        return left;
+    }
+
+    expr_t *expr = new expr_t();
+    expr->kind = kind;
+    expr->left = left;
+    expr->right = parseUnary();
+
+    /* Only a field against a literal, not booleans computed by ! or by
+       a nested comparison nor chained comparisons */
+    if (expr->right == NULL ||
+        left->kind != EXPR_OPERAND || expr->right->kind != EXPR_OPERAND ||
+        (left->operand.kind != OPERAND_LITERAL &&
+         expr->right->operand.kind != OPERAND_LITERAL) ||
+        peek("==") || peek("===") || peek("!=") || peek("!==")) {
+        freeExpr(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+
+expr_t *NativeMapper::parseUnary()
+{
+    expr_t *expr;
+
+    if (accept("!")) {
+        expr = new expr_t();
+        expr->kind = EXPR_NOT;
+        expr->right = NULL;
+        expr->left = parseUnary();
+        if (expr->left == NULL) {
+            freeExpr(expr);
+            return NULL;
+        }
+        return expr;
+    }
+    if (accept("(")) {
+        expr = parseOr();
+        if (expr != NULL && !accept(")")) {
+            freeExpr(expr);
+            return NULL;
+        }
+        return expr;
+    }
+
+    expr = new expr_t();
+    expr->kind = EXPR_OPERAND;
+    expr->left = NULL;
+    expr->right = NULL;
+    if (!parseOperand(expr->operand)) {
+        freeExpr(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+
+bool NativeMapper::parseOperand(operand_t &operand)
+{
+    const token_t &tok = tokens[pos];
+
+    operand.kind = OPERAND_LITERAL;
+    operand.node = 0;
+
+    if (tok.kind == TOK_STRING) {
+        operand.literalKind = VAL_STRING;
+        operand.literal = "\"" + tok.text + "\"";
+    } else if (tok.kind == TOK_NUMBER) {
+        operand.literalKind = VAL_NUMBER;
+        operand.literal = tok.text;
+        if (!isCanonicalNumber(makeValue(VAL_NUMBER, tok.text.data(),
+                                         tok.text.length()))) {
+            return false;
+        }
+    } else if (tok.kind == TOK_IDENT && tok.text == "null") {
+        operand.literalKind = VAL_NULL;
+        operand.literal = tok.text;
+    } else if (tok.kind == TOK_IDENT && (tok.text == "true" || tok.text == "false")) {
+        operand.literalKind = VAL_BOOL;
+        operand.literal = tok.text;
+    } else if (tok.kind == TOK_IDENT && !tok.text.empty() &&
+               (tok.text == docParam || tok.text == metaParam)) {
+        std::vector<std::string> path;
+
+        operand.kind = tok.text == docParam ? OPERAND_DOC : OPERAND_META;
+        ++pos;
+        if (!parsePath(path)) {
+            return false;
+        }
+        operand.node = addPath(operand.kind == OPERAND_DOC ? docTree : metaTree,
+                               path);
+        return true;
+    } else {
+        return false;
+    }
+
+    ++pos;
+    return true;
+}
+
+
+bool NativeMapper::parsePath(std::vector<std::string> &path)
+{
+    while (true) {
+        if (accept(".")) {
+            if (tokens[pos].kind != TOK_IDENT) {
+                return false;
+            }
+            path.push_back(tokens[pos++].text);
+        } else if (accept("[")) {
+            if (tokens[pos].kind != TOK_STRING) {
+                return false;
+            }
+            path.push_back(tokens[pos++].text);
+            if (!accept("]")) {
+                return false;
+            }
+        } else {
+            return true;
+        }
+        if (isPrototypeProperty(path.back())) {
+            return false;
+        }
+    }
+}
+
+
+int NativeMapper::addPath(std::vector<path_node_t> &tree,
+                          const std::vector<std::string> &path)
+{
+    int node = 0;
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        int next = -1;
+
+        for (size_t j = 0; j < tree[node].children.size(); ++j) {
+            if (tree[tree[node].children[j]].name == path[i]) {
+                next = tree[node].children[j];
+                break;
+            }
+        }
+        if (next == -1) {
+            next = (int) tree.size();
+            tree.push_back(path_node_t());
+            tree[next].parent = node;
+            tree[next].name = path[i];
+            tree[node].children.push_back(next);
+        }
+        node = next;
+    }
+
+    return node;
+}
+
+
+static bool scanString(const char *&p, const char *end, bool *escaped)
+{
+    ++p;
+    while (p < end) {
+        unsigned char c = (unsigned char) *p;
+
+        if (c == '"') {
+            ++p;
+            return true;
+        } else if (c < 0x20) {
+            return false;
+        } else if (c == '\\') {
+            *escaped = true;
+            if (++p == end) {
+                return false;
+            }
+            if (*p == 'u') {
+                for (int i = 0; i < 4; ++i) {
+                    if (++p == end || !isxdigit((unsigned char) *p)) {
+                        return false;
+                    }
+                }
+            } else if (strchr("\"\\/bfnrt", *p) == NULL || *p == '\0') {
+                return false;
+            }
+        }
+        ++p;
+    }
+    return false;
+}
+
+
+static bool scanNumber(const char *&p, const char *end)
+{
+    if (*p == '-') {
+        ++p;
+    }
+    if (p == end || !isdigit((unsigned char) *p)) {
+        return false;
+    }
+    if (*p == '0') {
+        ++p;
+    } else {
+        while (p < end && isdigit((unsigned char) *p)) {
+            ++p;
+        }
+    }
+    if (p < end && *p == '.') {
+        if (++p == end || !isdigit((unsigned char) *p)) {
+            return false;
+        }
+        while (p < end && isdigit((unsigned char) *p)) {
+            ++p;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if (p < end && (*p == '+' || *p == '-')) {
+            ++p;
+        }
+        if (p == end || !isdigit((unsigned char) *p)) {
+            return false;
+        }
+        while (p < end && isdigit((unsigned char) *p)) {
+            ++p;
+        }
+    }
+    return true;
+}
+
+
+static inline void skipSpaces(const char *&p, const char *end)
+{
+    while (p < end && isJsonSpace(*p)) {
+        ++p;
+    }
+}
+
+
+static bool scanLiteral(const char *&p, const char *end, const char *literal)
+{
+    size_t len = strlen(literal);
+
+    if ((size_t) (end - p) < len || memcmp(p, literal, len) != 0) {
+        return false;
+    }
+    p += len;
+    return true;
+}
+
+
+bool NativeMapper::scan(const mapreduce_json_t &json,
+                        const std::vector<path_node_t> &tree,
+                        std::vector<path_slot_t> &slots)
+{
+    const char *p = json.json;
+    const char *end = json.json + json.length;
+
+    slots.resize(tree.size());
+    clearSlots(tree, slots, 0);
+
+    skipSpaces(p, end);
+    if (!scanValue(p, end, tree, slots, 0, 0)) {
+        return false;
+    }
+    skipSpaces(p, end);
+
+    return p == end;
+}
+
+
+/* Validates a JSON value like JSON.parse() would, recording it in the slot
+   of node, if it's a field used by the functions, or -1 */
+bool NativeMapper::scanValue(const char *&p, const char *end,
+                             const std::vector<path_node_t> &tree,
+                             std::vector<path_slot_t> &slots,
+                             int node, int depth)
+{
+    const char *start = p;
+    valueKind kind;
+    bool escaped = false;
+
+    if (p == end || depth > MAX_JSON_DEPTH) {
+        return false;
+    }
+
+    switch (*p) {
+    case '{':
+        kind = VAL_OBJECT;
+        ++p;
+        skipSpaces(p, end);
+        if (p < end && *p == '}') {
+            ++p;
+            break;
+        }
+        while (true) {
+            const char *key;
+            bool keyEscaped = false;
+            int child = -1;
+
+            if (p == end || *p != '"') {
+                return false;
+            }
+            key = p + 1;
+            if (!scanString(p, end, &keyEscaped)) {
+                return false;
+            }
+            if (node >= 0 && !tree[node].children.empty()) {
+                if (keyEscaped) {
+                    slots[node].ambiguous = true;
+                } else {
+                    size_t keyLen = p - key - 1;
+                    for (size_t i = 0; i < tree[node].children.size(); ++i) {
+                        const std::string &name = tree[tree[node].children[i]].name;
+                        if (name.length() == keyLen &&
+                            memcmp(name.data(), key, keyLen) == 0) {
+                            child = tree[node].children[i];
+                            break;
+                        }
+                    }
+                }
+            }
+            /* For repeated keys the last value is the one parsed */
+            if (child >= 0) {
+                clearSlots(tree, slots, child);
+            }
+
+            skipSpaces(p, end);
+            if (p == end || *p++ != ':') {
+                return false;
+            }
+            skipSpaces(p, end);
+            if (!scanValue(p, end, tree, slots, child, depth + 1)) {
+                return false;
+            }
+            skipSpaces(p, end);
+            if (p == end) {
+                return false;
+            }
+            if (*p == '}') {
+                ++p;
+                break;
+            }
+            if (*p++ != ',') {
+                return false;
+            }
+            skipSpaces(p, end);
+        }
+        break;
+    case '[':
+        kind = VAL_ARRAY;
+        ++p;
+        skipSpaces(p, end);
+        if (p < end && *p == ']') {
+            ++p;
+            break;
+        }
+        while (true) {
+            if (!scanValue(p, end, tree, slots, -1, depth + 1)) {
+                return false;
+            }
+            skipSpaces(p, end);
+            if (p == end) {
+                return false;
+            }
+            if (*p == ']') {
+                ++p;
+                break;
+            }
+            if (*p++ != ',') {
+                return false;
+            }
+            skipSpaces(p, end);
+        }
+        break;
+    case '"':
+        kind = VAL_STRING;
+        if (!scanString(p, end, &escaped)) {
+            return false;
+        }
+        break;
+    case 't':
+    case 'f':
+        kind = VAL_BOOL;
+        if (!scanLiteral(p, end, *p == 't' ? "true" : "false")) {
+            return false;
+        }
+        break;
+    case 'n':
+        kind = VAL_NULL;
+        if (!scanLiteral(p, end, "null")) {
+            return false;
+        }
+        break;
+    default:
+        kind = VAL_NUMBER;
+        if (!scanNumber(p, end)) {
+            return false;
+        }
+        break;
+    }
+
+    if (node >= 0) {
+        slots[node].found = true;
+        slots[node].value = makeValue(kind, start, p - start);
+        slots[node].value.escaped = escaped;
+    }
+    return true;
+}
+
+
+void NativeMapper::clearSlots(const std::vector<path_node_t> &tree,
+                              std::vector<path_slot_t> &slots,
+                              int node)
+{
+    slots[node].found = false;
+    slots[node].ambiguous = false;
+    for (size_t i = 0; i < tree[node].children.size(); ++i) {
+        clearSlots(tree, slots, tree[node].children[i]);
+    }
+}
+
+
+value_t NativeMapper::lookup(const operand_t &operand) const
+{
+    if (operand.kind == OPERAND_LITERAL) {
+        return makeValue(operand.literalKind, operand.literal.data(),
+                         operand.literal.length());
+    }
+
+    const std::vector<path_node_t> &tree =
+        operand.kind == OPERAND_DOC ? docTree : metaTree;
+    const std::vector<path_slot_t> &slots =
+        operand.kind == OPERAND_DOC ? docSlots : metaSlots;
+
+    /* Fields of anything but a plain object (a missing one throws, strings
+       have a length, ...) are left to V8 */
+    for (int n = tree[operand.node].parent; n >= 0; n = tree[n].parent) {
+        if (!slots[n].found || slots[n].value.kind != VAL_OBJECT ||
+            slots[n].ambiguous) {
+            return makeValue(VAL_BAD, NULL, 0);
+        }
+    }
+    if (!slots[operand.node].found) {
+        return makeValue(VAL_UNDEFINED, NULL, 0);
+    }
+    return slots[operand.node].value;
+}
+
+
+static tristate_t truthy(const value_t &v)
+{
+    switch (v.kind) {
+    case VAL_UNDEFINED:
+    case VAL_NULL:
+        return TS_FALSE;
+    case VAL_BOOL:
+        return v.text[0] == 't' ? TS_TRUE : TS_FALSE;
+    case VAL_STRING:
+        return v.length > 2 ? TS_TRUE : TS_FALSE;
+    case VAL_OBJECT:
+    case VAL_ARRAY:
+        return TS_TRUE;
+    case VAL_NUMBER:
+        {
+            const char *p = v.text;
+            const char *end = v.text + v.length;
+            bool intNonZero = false;
+            bool fracNonZero = false;
+
+            if (*p == '-') {
+                ++p;
+            }
+            for ( ; p < end && isdigit((unsigned char) *p); ++p) {
+                intNonZero = intNonZero || *p != '0';
+            }
+            if (p < end && *p == '.') {
+                for (++p; p < end && isdigit((unsigned char) *p); ++p) {
+                    fracNonZero = fracNonZero || *p != '0';
+                }
+            }
+            if (!intNonZero && !fracNonZero) {
+                return TS_FALSE;
+            }
+            /* With a fraction or an exponent, it could round to 0 */
+            return (intNonZero && p == end) ? TS_TRUE : TS_UNKNOWN;
+        }
+    default:
+        return TS_UNKNOWN;
+    }
+}
+
+
+static tristate_t equals(const value_t &a, const value_t &b, bool strict)
+{
+    if (a.kind == VAL_BAD || b.kind == VAL_BAD) {
+        return TS_UNKNOWN;
+    }
+
+    if (a.kind != b.kind) {
+        bool aNullish = a.kind == VAL_UNDEFINED || a.kind == VAL_NULL;
+        bool bNullish = b.kind == VAL_UNDEFINED || b.kind == VAL_NULL;
+
+        if (strict) {
+            return TS_FALSE;
+        }
+        if (aNullish || bNullish) {
+            return (aNullish && bNullish) ? TS_TRUE : TS_FALSE;
+        }
+        /* type conversions */
+        return TS_UNKNOWN;
+    }
+
+    switch (a.kind) {
+    case VAL_UNDEFINED:
+    case VAL_NULL:
+        return TS_TRUE;
+    case VAL_BOOL:
+        return a.text[0] == b.text[0] ? TS_TRUE : TS_FALSE;
+    case VAL_STRING:
+        if (a.length == b.length && memcmp(a.text, b.text, a.length) == 0) {
+            return TS_TRUE;
+        }
+        /* Invalid UTF-8 sequences all decode to U+FFFD */
+        if (a.escaped || b.escaped ||
+            !isValidUtf8(a.text, a.length) || !isValidUtf8(b.text, b.length)) {
+            return TS_UNKNOWN;
+        }
+        return TS_FALSE;
+    case VAL_NUMBER:
+        /* Numbers have a single canonical form */
+        if (isCanonicalNumber(a) && isCanonicalNumber(b)) {
+            return (a.length == b.length && memcmp(a.text, b.text, a.length) == 0) ?
+                TS_TRUE : TS_FALSE;
+        }
+        return TS_UNKNOWN;
+    default:
+        return TS_UNKNOWN;
+    }
+}
+
+
+tristate_t NativeMapper::eval(const expr_t *expr) const
+{
+    tristate_t left;
+
+    switch (expr->kind) {
+    case EXPR_OPERAND:
+        return truthy(lookup(expr->operand));
+    case EXPR_NOT:
+        left = eval(expr->left);
+        if (left == TS_UNKNOWN) {
+            return TS_UNKNOWN;
+        }
+        return left == TS_TRUE ? TS_FALSE : TS_TRUE;
+    case EXPR_AND:
+        left = eval(expr->left);
+        return left == TS_TRUE ? eval(expr->right) : left;
+    case EXPR_OR:
+        left = eval(expr->left);
+        return left == TS_FALSE ? eval(expr->right) : left;
+    case EXPR_EQ:
+    case EXPR_STRICT_EQ:
+    case EXPR_NE:
+    case EXPR_STRICT_NE:
+        {
+            bool strict = expr->kind == EXPR_STRICT_EQ || expr->kind == EXPR_STRICT_NE;
+            bool negate = expr->kind == EXPR_NE || expr->kind == EXPR_STRICT_NE;
+            tristate_t eq = equals(lookup(expr->left->operand),
+                                   lookup(expr->right->operand),
+                                   strict);
+            if (eq == TS_UNKNOWN || !negate) {
+                return eq;
+            }
+            return eq == TS_TRUE ? TS_FALSE : TS_TRUE;
+        }
+    }
+
+    return TS_UNKNOWN;
+}
+
+
+/* Whether JSON.stringify() of the value is the value's own text */
+static bool isOwnJson(value_t &v)
+{
+    switch (v.kind) {
+    case VAL_UNDEFINED:
+        v = makeValue(VAL_NULL, "null", sizeof("null") - 1);
+        return true;
+    case VAL_NULL:
+    case VAL_BOOL:
+        return true;
+    case VAL_STRING:
+        return !v.escaped && isValidUtf8(v.text, v.length);
+    case VAL_NUMBER:
+        return isCanonicalNumber(v);
+    default:
+        return false;
+    }
+}
+
+
+bool NativeMapper::run(const std::vector<stmt_t*> &stmts,
+                       std::vector<emitted_t> &emits) const
+{
+    for (size_t i = 0; i < stmts.size(); ++i) {
+        const stmt_t *stmt = stmts[i];
+
+        if (stmt->isEmit) {
+            emitted_t e;
+            e.key = lookup(stmt->key);
+            e.value = lookup(stmt->value);
+            if (!isOwnJson(e.key) || !isOwnJson(e.value)) {
+                return false;
+            }
+            emits.push_back(e);
+        } else {
+            tristate_t cond = eval(stmt->cond);
+            if (cond == TS_UNKNOWN) {
+                return false;
+            }
+            if (!run(cond == TS_TRUE ? stmt->thenStmts : stmt->elseStmts, emits)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+static bool copyJson(const value_t &v, mapreduce_json_t &json)
+{
+    json.length = (int) v.length;
+    json.json = (char *) malloc(v.length);
+    if (json.json == NULL) {
+        return false;
+    }
+    memcpy(json.json, v.text, v.length);
+    return true;
+}
+
+
+bool NativeMapper::map(const mapreduce_json_t &doc,
+                       const mapreduce_json_t &meta,
+                       mapreduce_map_result_list_t *results)
+{
+    if (!scan(doc, docTree, docSlots) || !scan(meta, metaTree, metaSlots) ||
+        metaSlots[0].value.kind != VAL_OBJECT) {
+        return false;
+    }
+
+    emitted.resize(functions.size());
+    for (size_t i = 0; i < functions.size(); ++i) {
+        emitted[i].clear();
+        if (!run(functions[i], emitted[i])) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < functions.size(); ++i) {
+        mapreduce_map_result_t mapResult;
+        size_t n = emitted[i].size();
+
+        mapResult.error = MAPREDUCE_SUCCESS;
+        mapResult.result.kvs.length = (int) n;
+        mapResult.result.kvs.kvs = (mapreduce_kv_t *) malloc(sizeof(mapreduce_kv_t) * n);
+        if (mapResult.result.kvs.kvs == NULL) {
+            throw std::bad_alloc();
+        }
+        for (size_t j = 0; j < n; ++j) {
+            mapreduce_kv_t &kv = mapResult.result.kvs.kvs[j];
+            if (!copyJson(emitted[i][j].key, kv.key)) {
+                mapResult.result.kvs.length = (int) j;
+                results->list[results->length++] = mapResult;
+                throw std::bad_alloc();
+            }
+            if (!copyJson(emitted[i][j].value, kv.value)) {
+                free(kv.key.json);
+                mapResult.result.kvs.length = (int) j;
+                results->list[results->length++] = mapResult;
+                throw std::bad_alloc();
+            }
+        }
+        results->list[results->length++] = mapResult;
+    }
+    ++mappedDocs;
+
+    return true;
+}
+
+
+NativeMapper *newNativeMapper(const std::list<std::string> &function_sources)
+{
+    NativeMapper *mapper = NULL;
+
+    try {
+        std::list<std::string>::const_iterator it = function_sources.begin();
+
+        mapper = new NativeMapper();
+        for ( ; it != function_sources.end(); ++it) {
+            if (!mapper->addFunction(*it)) {
+                delete mapper;
+                return NULL;
+            }
+        }
+    } catch (std::bad_alloc &) {
+        // V8 can still map the documents
+        delete mapper;
+        return NULL;
+    }
+
+    return mapper;
+}
+
+
+void deleteNativeMapper(NativeMapper *mapper)
+{
+    delete mapper;
+}
+
+
+bool nativeMapDoc(NativeMapper *mapper,
+                  const mapreduce_json_t &doc,
+                  const mapreduce_json_t &meta,
+                  mapreduce_map_result_list_t *results)
+{
+    return mapper->map(doc, meta, results);
+}
+
+
+uint64_t nativeMappedDocs(const NativeMapper *mapper)
+{
+    return mapper->getMappedDocs();
+}
@@ -30,8 +30,18 @@
 #include "reductions.h"
 #include "values.h"
 #include "reducers.h"
+#include "collate_json.h"
 #include "../couch_btree.h"
 
+#define BITMASK_BYTE_SIZE      (1024 / CHAR_BIT)
+
+#define dec_uint16(b) (decode_raw16(*((raw_16 *) b)))
+#define dec_raw24(b)  (decode_raw24(*((raw_24 *) b)))
+#define dec_uint40(b) (decode_raw40(*((raw_40 *) b)))
+
+/* Room for the JSON text of a single builtin reduction */
+#define BUILTIN_REDUCTION_SIZE 128
+
 typedef enum {
     VIEW_REDUCER_SUCCESS                = 0,
     VIEW_REDUCER_ERROR_NOT_A_NUMBER     = 1,
@@ -49,6 +59,13 @@ typedef struct {
     void  *mapreduce_ctx;
 } reducer_ctx_t;
 
+typedef enum {
+    REDUCER_JS,
+    REDUCER_COUNT,
+    REDUCER_SUM,
+    REDUCER_STATS
+} reducer_type_t;
+
 typedef couchstore_error_t (*reducer_fn_t)(const mapreduce_json_list_t *,
                                            const mapreduce_json_list_t *,
                                            reducer_ctx_t *,
@@ -70,7 +87,11 @@ typedef struct {
 
     unsigned                 num_reducers;
     reducer_fn_t             *reducers;
+    reducer_type_t           *reducer_types;
     reducer_ctx_t            *reducer_contexts;
+    /* All reducers are builtin ones, so (re)reductions can be computed
+       straight from the encoded values, see builtin_reduce() */
+    int                      builtin_only;
 } reducer_private_t;
 
 
@@ -104,6 +125,10 @@ static int json_to_double(const mapreduce_json_t *buf, double *out_num)
     char str[32];
     char *end;
 
+    if (buf->length >= 1 && buf->length <= 31 &&
+        ParseJSONNumber(buf->json, buf->length, out_num)) {
+        return 1;
+    }
     if (!json_to_str(buf, str)) {
         return 0;
     }
@@ -117,7 +142,22 @@ static int json_to_uint64(const mapreduce_json_t *buf, uint64_t *out_num)
 {
     char str[32];
     char *end;
+    uint64_t n = 0;
+    int i;
 
+    /* Up to 19 plain digits can't overflow */
+    if (buf->length >= 1 && buf->length <= 19) {
+        for (i = 0; i < buf->length; ++i) {
+            if (buf->json[i] < '0' || buf->json[i] > '9') {
+                break;
+            }
+            n = n * 10 + (buf->json[i] - '0');
+        }
+        if (i == buf->length) {
+            *out_num = n;
+            return 1;
+        }
+    }
     if (!json_to_str(buf, str)) {
         return 0;
     }
@@ -127,6 +167,78 @@ static int json_to_uint64(const mapreduce_json_t *buf, uint64_t *out_num)
 }
 
 
+/*
+ * Matches the literal prefix at *str and parses the number that follows it,
+ * up to the next ',' or '}'.
+ */
+static int parse_stats_field(const char **str, const char *end,
+                             const char *prefix, size_t prefix_len,
+                             double *out_num)
+{
+    const char *p = *str;
+    const char *num;
+
+    if ((size_t) (end - p) < prefix_len || memcmp(p, prefix, prefix_len) != 0) {
+        return 0;
+    }
+    p += prefix_len;
+    num = p;
+    while (p < end && *p != ',' && *p != '}') {
+        ++p;
+    }
+    if (!ParseJSONNumber(num, p - num, out_num)) {
+        return 0;
+    }
+    *str = p;
+
+    return 1;
+}
+
+
+/*
+ * Parses a _stats reduction, as written by sprint_stats. Anything unusual,
+ * like infinities, is left to scan_stats.
+ */
+static int json_to_stats(const mapreduce_json_t *buf, stats_t *s)
+{
+    const char *p = buf->json;
+    const char *end = buf->json + buf->length;
+    mapreduce_json_t count;
+    double n;
+    char *value_buf;
+    int scanned;
+
+    if (parse_stats_field(&p, end, "{\"sum\":", 7, &s->sum) &&
+        (size_t) (end - p) > 9 && memcmp(p, ",\"count\":", 9) == 0) {
+        p += 9;
+        count.json = (char *) p;
+        while (p < end && *p != ',') {
+            ++p;
+        }
+        count.length = (int) (p - count.json);
+        if (count.length <= 19 && json_to_uint64(&count, &s->count) &&
+            parse_stats_field(&p, end, ",\"min\":", 7, &s->min) &&
+            parse_stats_field(&p, end, ",\"max\":", 7, &s->max) &&
+            parse_stats_field(&p, end, ",\"sumsqr\":", 10, &n) &&
+            p < end && *p == '}') {
+            s->sumsqr = n;
+            return 1;
+        }
+    }
+
+    value_buf = (char *) malloc(buf->length + 1);
+    if (value_buf == NULL) {
+        return -1;
+    }
+    memcpy(value_buf, buf->json, buf->length);
+    value_buf[buf->length] = '\0';
+    scanned = scan_stats(value_buf, s->sum, s->count, s->min, s->max, s->sumsqr);
+    free(value_buf);
+
+    return scanned == 5;
+}
+
+
 couchstore_error_t view_id_btree_reduce(char *dst,
                                         size_t *size_r,
                                         const nodelist *leaflist,
@@ -312,19 +424,11 @@ static couchstore_error_t builtin_stats_reducer(const mapreduce_json_list_t *key
 
         if (keys == NULL) {
             /* rereduce */
-            char *value_buf = (char *) malloc(value->length + 1);
-
-            if (value_buf == NULL) {
+            scanned = json_to_stats(value, &reduced);
+            if (scanned < 0) {
                 return COUCHSTORE_ERROR_ALLOC_FAIL;
             }
-
-            memcpy(value_buf, value->json, value->length);
-            value_buf[value->length] = '\0';
-            scanned = scan_stats(value_buf,
-                                 reduced.sum, reduced.count, reduced.min,
-                                 reduced.max, reduced.sumsqr);
-            free(value_buf);
-            if (scanned == 5) {
+            if (scanned) {
                 if (reduced.min < s.min || s.count == 0) {
                     s.min = reduced.min;
                 }
@@ -498,25 +602,36 @@ view_reducer_ctx_t *make_view_reducer_ctx(const char *functions[],
         goto error;
     }
 
+    priv->reducer_types = calloc(num_functions, sizeof(reducer_type_t));
+    if (priv->reducer_types == NULL) {
+        goto error;
+    }
+
     priv->reducer_contexts = calloc(num_functions, sizeof(reducer_ctx_t));
     if (priv->reducer_contexts == NULL) {
         goto error;
     }
 
+    priv->builtin_only = 1;
     for (i = 0; i < num_functions; ++i) {
         priv->reducer_contexts[i].parent_ctx = (void *) priv;
 
         if (strcmp(functions[i], "_count") == 0) {
             priv->reducers[i] = builtin_count_reducer;
+            priv->reducer_types[i] = REDUCER_COUNT;
         } else if (strcmp(functions[i], "_sum") == 0) {
             priv->reducers[i] = builtin_sum_reducer;
+            priv->reducer_types[i] = REDUCER_SUM;
         } else if (strcmp(functions[i], "_stats") == 0) {
             priv->reducers[i] = builtin_stats_reducer;
+            priv->reducer_types[i] = REDUCER_STATS;
         } else {
             mapreduce_error_t mapred_error;
             void *mapred_ctx = NULL;
 
             priv->reducers[i] = js_reducer;
+            priv->reducer_types[i] = REDUCER_JS;
+            priv->builtin_only = 0;
             /* TODO: use single reduce context for all JS functions */
             mapred_error = mapreduce_start_reduce_context(&functions[i], 1,
                                                           &mapred_ctx,
@@ -543,6 +658,7 @@ error:
             }
             free(priv->reducer_contexts);
         }
+        free(priv->reducer_types);
         free(priv->reducers);
         free(priv);
     }
@@ -566,6 +682,7 @@ void free_view_reducer_ctx(view_reducer_ctx_t *ctx)
         mapreduce_free_context(priv->reducer_contexts[i].mapreduce_ctx);
     }
     free(priv->reducer_contexts);
+    free(priv->reducer_types);
     free(priv->reducers);
     free(priv);
     free((void *) ctx->error);
@@ -619,6 +736,283 @@ static void add_error_message(view_reducer_ctx_t *red_ctx, int rereduce)
 }
 
 
+/*
+ * Writes the JSON text of builtin reductions, as the builtin reducers do.
+ */
+static int format_builtin_reduction(reducer_type_t type,
+                                    const stats_t *s,
+                                    char *buf)
+{
+    switch (type) {
+    case REDUCER_COUNT:
+        return snprintf(buf, BUILTIN_REDUCTION_SIZE, "%"PRIu64, s->count);
+    case REDUCER_SUM:
+        return snprintf(buf, BUILTIN_REDUCTION_SIZE, DOUBLE_FMT, s->sum);
+    case REDUCER_STATS:
+        return snprintf(buf, BUILTIN_REDUCTION_SIZE,
+                        "{\"sum\":%g,\"count\":%"PRIu64",\"min\":%g,\"max\":%g,\"sumsqr\":%g}",
+                        s->sum, s->count, s->min, s->max, s->sumsqr);
+    default:
+        return -1;
+    }
+}
+
+
+/*
+ * Encodes the reductions accumulated by builtin_reduce or builtin_rereduce.
+ */
+static couchstore_error_t encode_builtin_reduction(reducer_private_t *priv,
+                                                   view_btree_reduction_t *red,
+                                                   const stats_t *acc,
+                                                   char *dst,
+                                                   size_t *size_r)
+{
+    couchstore_error_t ret;
+    char *text = NULL;
+    unsigned i;
+    int size;
+
+    if (priv->num_reducers > 0) {
+        text = (char *) malloc(priv->num_reducers * BUILTIN_REDUCTION_SIZE);
+        red->reduce_values = (sized_buf *) calloc(priv->num_reducers,
+                                                  sizeof(sized_buf));
+        if (text == NULL || red->reduce_values == NULL) {
+            ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+            goto out;
+        }
+    }
+    red->num_values = priv->num_reducers;
+
+    for (i = 0; i < priv->num_reducers; ++i) {
+        char *buf = text + i * BUILTIN_REDUCTION_SIZE;
+
+        size = format_builtin_reduction(priv->reducer_types[i], &acc[i], buf);
+        assert(size > 0 && size < BUILTIN_REDUCTION_SIZE);
+        red->reduce_values[i].buf = buf;
+        red->reduce_values[i].size = size;
+    }
+
+    ret = encode_view_btree_reduction(red, dst, size_r);
+
+ out:
+    free(red->reduce_values);
+    red->reduce_values = NULL;
+    free(text);
+
+    return ret;
+}
+
+
+/*
+ * Reduce for views with only builtin reducers. Instead of decoding each value
+ * and key into JSON lists for the reducer functions, the values are walked in
+ * their encoded form and fed to running counts, sums and stats, one per
+ * reducer. Returns 0, without setting an error, if a value isn't a number or
+ * anything else is off, so that the general path can deal with it (and report
+ * the same error it always did).
+ */
+static int builtin_reduce(reducer_private_t *priv,
+                          char *dst,
+                          size_t *size_r,
+                          const nodelist *leaflist,
+                          int count,
+                          couchstore_error_t *ret)
+{
+    view_btree_reduction_t red;
+    stats_t *acc = NULL;
+    const nodelist *n;
+    unsigned i;
+    int c;
+    int done = 0;
+
+    memset(&red, 0, sizeof(red));
+    if (priv->num_reducers > 0) {
+        acc = (stats_t *) calloc(priv->num_reducers, sizeof(stats_t));
+        if (acc == NULL) {
+            return 0;
+        }
+    }
+
+    for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
+        const char *bytes = n->data.buf;
+        size_t len = n->data.size;
+
+        if (len < 2) {
+            goto out;
+        }
+        set_bit(&red.partitions_bitmap, dec_uint16(bytes));
+        bytes += 2;
+        len -= 2;
+
+        while (len > 0) {
+            double num = 0.0;
+            int parsed = 0;
+            uint32_t sz;
+
+            if (len < 3) {
+                goto out;
+            }
+            sz = dec_raw24(bytes);
+            bytes += 3;
+            len -= 3;
+            if (len < sz) {
+                goto out;
+            }
+
+            red.kv_count++;
+            for (i = 0; i < priv->num_reducers; ++i) {
+                stats_t *s = &acc[i];
+
+                if (priv->reducer_types[i] == REDUCER_COUNT) {
+                    s->count++;
+                    continue;
+                }
+                /* Parsed once, even with both _sum and _stats */
+                if (!parsed) {
+                    mapreduce_json_t value;
+
+                    value.json = (char *) bytes;
+                    value.length = (int) sz;
+                    if (!json_to_double(&value, &num)) {
+                        goto out;
+                    }
+                    parsed = 1;
+                }
+                s->sum += num;
+                if (priv->reducer_types[i] == REDUCER_STATS) {
+                    s->sumsqr += num * num;
+                    if (s->count++ == 0) {
+                        s->min = s->max = num;
+                    } else if (num > s->max) {
+                        s->max = num;
+                    } else if (num < s->min) {
+                        s->min = num;
+                    }
+                }
+            }
+            bytes += sz;
+            len -= sz;
+        }
+    }
+
+    *ret = encode_builtin_reduction(priv, &red, acc, dst, size_r);
+    done = 1;
+
+ out:
+    free(acc);
+
+    return done;
+}
+
+
+/*
+ * Rereduce counterpart of builtin_reduce, reading the reductions of the child
+ * nodes in their encoded form.
+ */
+static int builtin_rereduce(reducer_private_t *priv,
+                            char *dst,
+                            size_t *size_r,
+                            const nodelist *leaflist,
+                            int count,
+                            couchstore_error_t *ret)
+{
+    view_btree_reduction_t red;
+    stats_t *acc = NULL;
+    const nodelist *n;
+    unsigned i;
+    int c;
+    int done = 0;
+
+    memset(&red, 0, sizeof(red));
+    if (priv->num_reducers > 0) {
+        acc = (stats_t *) calloc(priv->num_reducers, sizeof(stats_t));
+        if (acc == NULL) {
+            return 0;
+        }
+    }
+
+    for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
+        const char *bytes = n->pointer->reduce_value.buf;
+        size_t len = n->pointer->reduce_value.size;
+        bitmap_t partitions;
+
+        if (len < 5 + BITMASK_BYTE_SIZE) {
+            goto out;
+        }
+        red.kv_count += dec_uint40(bytes);
+        memcpy(&partitions, bytes + 5, BITMASK_BYTE_SIZE);
+        union_bitmaps(&red.partitions_bitmap, &partitions);
+        bytes += 5 + BITMASK_BYTE_SIZE;
+        len -= 5 + BITMASK_BYTE_SIZE;
+
+        for (i = 0; i < priv->num_reducers; ++i) {
+            stats_t *s = &acc[i];
+            mapreduce_json_t value;
+            stats_t reduced;
+            uint64_t num_count;
+            double num;
+            uint16_t sz;
+
+            if (len < 2) {
+                goto out;
+            }
+            sz = dec_uint16(bytes);
+            bytes += 2;
+            len -= 2;
+            if (len < sz) {
+                goto out;
+            }
+            value.json = (char *) bytes;
+            value.length = sz;
+            bytes += sz;
+            len -= sz;
+
+            switch (priv->reducer_types[i]) {
+            case REDUCER_COUNT:
+                if (!json_to_uint64(&value, &num_count)) {
+                    goto out;
+                }
+                s->count += num_count;
+                break;
+            case REDUCER_SUM:
+                if (!json_to_double(&value, &num)) {
+                    goto out;
+                }
+                s->sum += num;
+                break;
+            case REDUCER_STATS:
+                if (json_to_stats(&value, &reduced) != 1) {
+                    goto out;
+                }
+                if (reduced.min < s->min || s->count == 0) {
+                    s->min = reduced.min;
+                }
+                if (reduced.max > s->max || s->count == 0) {
+                    s->max = reduced.max;
+                }
+                s->count += reduced.count;
+                s->sum += reduced.sum;
+                s->sumsqr += reduced.sumsqr;
+                break;
+            default:
+                goto out;
+            }
+        }
+        if (len > 0) {
+            goto out;
+        }
+    }
+
+    *ret = encode_builtin_reduction(priv, &red, acc, dst, size_r);
+    done = 1;
+
+ out:
+    free(acc);
+
+    return done;
+}
+
+
 couchstore_error_t view_btree_reduce(char *dst,
                                      size_t *size_r,
                                      const nodelist *leaflist,
@@ -637,6 +1031,11 @@ couchstore_error_t view_btree_reduce(char *dst,
     mapreduce_json_list_t *value_list = NULL;
     view_btree_value_t **values = NULL;
 
+    if (priv->builtin_only &&
+        builtin_reduce(priv, dst, size_r, leaflist, count, &ret)) {
+        return ret;
+    }
+
     values = (view_btree_value_t **) calloc(count, sizeof(view_btree_value_t *));
     red = (view_btree_reduction_t *) calloc(1, sizeof(*red));
     key_list = (mapreduce_json_list_t *) calloc(1, sizeof(*key_list));
@@ -757,6 +1156,11 @@ couchstore_error_t view_btree_rereduce(char *dst,
     mapreduce_json_list_t *value_list = NULL;
     view_btree_reduction_t **reductions = NULL;
 
+    if (priv->builtin_only &&
+        builtin_rereduce(priv, dst, size_r, leaflist, count, &ret)) {
+        return ret;
+    }
+
     reductions = (view_btree_reduction_t **) calloc(count, sizeof(view_btree_reduction_t *));
     red = (view_btree_reduction_t *) calloc(1, sizeof(*red));
 
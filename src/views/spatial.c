@@ -24,6 +24,7 @@
 #include "spatial.h"
 #include "../bitfield.h"
 #include "../couch_btree.h"
+#include "../util.h"
 
 
 #define BYTE_PER_COORD sizeof(uint32_t)
@@ -84,6 +85,34 @@ int spatial_key_cmp(const sized_buf *key1, const sized_buf *key2,
     return res;
 }
 
+uint64_t spatial_key_prefix(const sized_buf *key, const void *user_ctx)
+{
+    scale_factor_t *sf =
+            ((view_spatial_builder_ctx_t *) user_ctx)->scale_factor;
+    const double *mbb = (const double *)(key->buf + sizeof(uint16_t));
+    uint64_t prefix = 0;
+    int zcode_bits = sf->dim * BYTE_PER_COORD * CHAR_BIT;
+    int bit, i;
+
+    /* The most significant bits of the Z-code built by spatial_key_cmp,
+     * worked out without building it. Bit b of the Z-code is bit b / dim of
+     * the scaled center's coordinate dim - 1 - b % dim. */
+    for (i = 0; i < 64; ++i) {
+        bit = zcode_bits - 1 - i;
+        prefix <<= 1;
+        if (bit >= 0) {
+            int coord = sf->dim - 1 - bit % sf->dim;
+            double center = mbb[coord * 2] +
+                ((mbb[coord * 2 + 1] - mbb[coord * 2]) / 2);
+            uint32_t scaled = (uint32_t)((center - sf->offsets[coord]) *
+                                         sf->scales[coord]);
+            prefix |= (scaled >> (bit / sf->dim)) & 1;
+        }
+    }
+
+    return prefix;
+}
+
 int spatial_merger_key_cmp(const sized_buf *key1, const sized_buf *key2,
                            const void *user_ctx)
 {
@@ -100,6 +129,55 @@ int spatial_merger_key_cmp(const sized_buf *key1, const sized_buf *key2,
     return key1->size - key2->size;
 }
 
+uint64_t spatial_merger_key_prefix(const sized_buf *key, const void *user_ctx)
+{
+    (void)user_ctx;
+
+    /* Same order as spatial_merger_key_cmp: by size, then by bytes */
+    return ((uint64_t) key->size << 48) | (ebin_prefix(key) >> 16);
+}
+
+double spatial_key_center(const sized_buf *key, uint16_t dim)
+{
+    double mbb[2];
+
+    memcpy(mbb, key->buf + sizeof(uint16_t) + dim * sizeof(mbb),
+           sizeof(mbb));
+    return mbb[0] + ((mbb[1] - mbb[0]) / 2);
+}
+
+int spatial_str_key_cmp(const sized_buf *key1, const sized_buf *key2,
+                        const void *user_ctx)
+{
+    double center1 = spatial_key_center(key1, 0);
+    double center2 = spatial_key_center(key2, 0);
+    (void)user_ctx;
+
+    if (center1 < center2) {
+        return -1;
+    }
+    return center1 > center2;
+}
+
+uint64_t spatial_str_key_prefix(const sized_buf *key, const void *user_ctx)
+{
+    double center = spatial_key_center(key, 0);
+    uint64_t bits;
+    (void)user_ctx;
+
+    /* -0.0 and 0.0 compare equal, so they need the same prefix */
+    if (center == 0) {
+        center = 0;
+    }
+    /* IEEE 754 doubles order like sign-magnitude integers: flip all bits of
+     * negative ones and just the sign bit of positive ones */
+    memcpy(&bits, &center, sizeof(bits));
+    if (bits >> 63) {
+        return ~bits;
+    }
+    return bits | ((uint64_t) 1 << 63);
+}
+
 
 scale_factor_t *spatial_scale_factor(const double *mbb, uint16_t dim,
                                      uint32_t max)
@@ -24,6 +24,7 @@
 #include "config.h"
 #include <libcouchstore/couch_db.h>
 #include "../file_merger.h"
+#include "../file_sorter.h"
 #include "../couch_btree.h"
 #include "bitmap.h"
 
@@ -63,10 +64,55 @@ extern "C" {
     int spatial_key_cmp(const sized_buf *key1, const sized_buf *key2,
                         const void *user_ctx);
 
+    /* Key prefix consistent with spatial_key_cmp, for the file sorter */
+    uint64_t spatial_key_prefix(const sized_buf *key, const void *user_ctx);
+
     /* Compare keys of a spatial index for the file merger */
     int spatial_merger_key_cmp(const sized_buf *key1, const sized_buf *key2,
                                const void *user_ctx);
 
+    /* Key prefix consistent with spatial_merger_key_cmp */
+    uint64_t spatial_merger_key_prefix(const sized_buf *key,
+                                       const void *user_ctx);
+
+    /* Return the center of the MBB of a key in the given dimension
+     * (starting at 0) */
+    double spatial_key_center(const sized_buf *key, uint16_t dim);
+
+    /* Compare keys of a spatial index by the center of their MBB in the
+     * first dimension, the first pass of a Sort-Tile-Recursive bulk load */
+    int spatial_str_key_cmp(const sized_buf *key1, const sized_buf *key2,
+                            const void *user_ctx);
+
+    /* Key prefix consistent with spatial_str_key_cmp */
+    uint64_t spatial_str_key_prefix(const sized_buf *key,
+                                    const void *user_ctx);
+
+    /* Called after the last record of every tile of an STR order, with the
+     * same context as the record callback */
+    typedef int (*spatial_str_end_tile_fn)(void *ctx);
+
+    /* Sort a file containing records for a spatial index into the order of
+     * a Sort-Tile-Recursive (STR) bulk load. The records are sorted by the
+     * center of their MBB in the first dimension and cut into slabs, every
+     * slab is sorted and cut by the next dimension, and so on, until every
+     * slab is a tile of as many records of the average size as fit into
+     * leaf_size bytes of node items. A tile is ended early rather than let
+     * its records take more than leaf_size bytes. The records are fed to
+     * callback and every tile is ended with a call of end_tile.
+     * num_threads is as for sort_file_ex(). memory_budget (0 means 192MB)
+     * is shared by the sort and the batch of slabs being ordered, which gets
+     * a third of it, up to 64MB. A batch is only cut at the end of a slab,
+     * so it holds at least one, however big. */
+    file_sorter_error_t sort_spatial_kvs_file_str(const char *file_path,
+                                                  const char *tmp_dir,
+                                                  size_t leaf_size,
+                                                  file_merger_feed_record_t callback,
+                                                  spatial_str_end_tile_fn end_tile,
+                                                  void *user_ctx,
+                                                  unsigned num_threads,
+                                                  size_t memory_budget);
+
     /* Return the scale factor for every dimension that would be needed to
      * scale this MBB to the maximum value `max` (when shifted to the
      * origin)
@@ -107,6 +153,11 @@ extern "C" {
     couchstore_error_t spatial_push_item(sized_buf *k, sized_buf *v,
                                          couchfile_modify_result *dst);
 
+    /* Flushes all the items that were put into the results set to disk as
+     * a node of their own. It's used by bulk loaders that decide themselves
+     * where a leaf node ends */
+    couchstore_error_t spatial_flush_items(couchfile_modify_result *dst);
+
     /* Build an r-tree bottom-up from the already stored leaf nodes */
     node_pointer* complete_new_spatial(couchfile_modify_result* mr,
                                        couchstore_error_t *errcode);
@@ -124,6 +124,11 @@ couchstore_error_t spatial_push_item(sized_buf *k,
     return maybe_flush_spatial(dst);
 }
 
+couchstore_error_t spatial_flush_items(couchfile_modify_result *dst)
+{
+    return flush_spatial(dst);
+}
+
 static nodelist *encode_pointer(arena* a, node_pointer *ptr)
 {
     raw_node_pointer *raw;
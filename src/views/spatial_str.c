@@ -0,0 +1,446 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * @copyright 2013 Couchbase, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+/* The order of a Sort-Tile-Recursive (STR) bulk load of an r-tree */
+
+#include <stdlib.h>
+#include <string.h>
+#include "spatial.h"
+#include "file_sorter.h"
+#include "util.h"
+#include "../arena.h"
+#include "../buffered_file.h"
+#include "../node_types.h"
+
+#define STR_MAX_THREADS            16
+/* As big as a run of the view file sorter */
+#define STR_MAX_BATCH_SIZE         (64 * 1024 * 1024)
+/* Shared by the sort and the batch when no budget is given: three runs of
+ * the view file sorter, as it gets by default */
+#define STR_DEFAULT_BUDGET         (3 * (size_t) STR_MAX_BATCH_SIZE)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct {
+    double                    center;
+    view_file_merge_record_t *rec;
+} str_item_t;
+
+/* The state of a Sort-Tile-Recursive ordering. The file sorter hands the
+ * merge context to str_feed_record, so it must be the first member. */
+typedef struct {
+    view_file_merge_ctx_t      merge_ctx;
+    file_merger_feed_record_t  callback;
+    spatial_str_end_tile_fn    end_tile;
+    uint16_t                   dim;
+    /* Tiles are cut for leaf_items records of the average size, and end
+     * early once their records would take more than leaf_size bytes */
+    uint64_t                   leaf_items;
+    size_t                     leaf_size;
+    /* Records in each slab of the first dimension, and the bytes a batch
+     * takes for a slab of records of the average size */
+    uint64_t                   slab_items;
+    size_t                     slab_size;
+    /* Slabs fed to callback so far, the next one's parity picks the
+     * direction its records are ordered in */
+    uint64_t                   slabs_done;
+    /* The batch of slabs read from the sorted file, but not yet fed. It is
+     * only cut at the end of a slab, so it holds at least one, even if
+     * that's bigger than max_batch_size. */
+    str_item_t                *items;
+    size_t                     num_items;
+    size_t                     max_items;
+    size_t                     batch_size;
+    size_t                     max_batch_size;
+    arena                     *records_arena;
+    unsigned                   num_threads;
+    /* Slabs of the batch, and the next one a thread is to order */
+    size_t                     num_slabs;
+    size_t                     next_slab;
+    cb_mutex_t                 mutex;
+} str_ctx_t;
+
+
+static uint64_t str_chunk_items(uint64_t n, uint64_t leaf_items, uint16_t r);
+static int str_feed_record(void *record, void *user_ctx);
+static int str_feed_batch(str_ctx_t *ctx);
+
+
+/* Counts the records of a spatial index file, and adds up their sizes as
+ * items of a node. Every key must have the same number of dimensions. */
+static file_sorter_error_t str_count_records(const char *file_path,
+                                             view_file_merge_ctx_t *ctx,
+                                             uint16_t *dim,
+                                             uint64_t *count,
+                                             uint64_t *size)
+{
+    FILE *f = buffered_fopen(file_path, "rb", 0, BUFFERED_FILE_READAHEAD);
+    view_file_merge_record_t *rec;
+    uint16_t num;
+    int ret;
+
+    if (f == NULL) {
+        return FILE_SORTER_ERROR_OPEN_FILE;
+    }
+
+    while ((ret = read_view_record(f, (void **) &rec, ctx)) > 0) {
+        if (rec->ksize < sizeof(raw_16)) {
+            num = 0;
+        } else {
+            num = decode_raw16(*((raw_16 *) VIEW_RECORD_KEY(rec)));
+        }
+        if (*count == 0) {
+            *dim = num / 2;
+        }
+        if (num == 0 || num != *dim * 2 ||
+                rec->ksize < sizeof(raw_16) + num * sizeof(double)) {
+            free_view_record(rec, ctx);
+            ret = FILE_SORTER_ERROR_BAD_ARG;
+            break;
+        }
+        *count += 1;
+        *size += rec->ksize + rec->vsize + sizeof(raw_kv_length);
+        free_view_record(rec, ctx);
+    }
+    fclose(f);
+
+    return ret < 0 ? (file_sorter_error_t) ret : FILE_SORTER_SUCCESS;
+}
+
+
+file_sorter_error_t sort_spatial_kvs_file_str(const char *file_path,
+                                              const char *tmp_dir,
+                                              size_t leaf_size,
+                                              file_merger_feed_record_t callback,
+                                              spatial_str_end_tile_fn end_tile,
+                                              void *user_ctx,
+                                              unsigned num_threads,
+                                              size_t memory_budget)
+{
+    file_sorter_error_t ret;
+    str_ctx_t ctx;
+    uint64_t count = 0;
+    uint64_t size = 0;
+
+    ctx.merge_ctx.key_cmp_fun = spatial_str_key_cmp;
+    ctx.merge_ctx.key_prefix_fun = spatial_str_key_prefix;
+    ctx.merge_ctx.type = INITIAL_BUILD_SPATIAL_RECORD;
+    ctx.merge_ctx.user_ctx = user_ctx;
+
+    /* The slabs are sized from the number of records, which has to be known
+     * before the first one is fed */
+    ret = str_count_records(file_path, &ctx.merge_ctx, &ctx.dim, &count,
+                            &size);
+    if (ret != FILE_SORTER_SUCCESS || count == 0) {
+        return ret;
+    }
+
+    ctx.callback = callback;
+    ctx.end_tile = end_tile;
+    ctx.leaf_size = leaf_size;
+    ctx.leaf_items = leaf_size / (size / count);
+    if (ctx.leaf_items == 0) {
+        ctx.leaf_items = 1;
+    }
+    ctx.slab_items = str_chunk_items(count, ctx.leaf_items, ctx.dim);
+    ctx.slab_size = ctx.slab_items *
+        (size / count - sizeof(raw_kv_length) +
+         sizeof(view_file_merge_record_t) + sizeof(str_item_t));
+    ctx.slabs_done = 0;
+    ctx.items = NULL;
+    ctx.num_items = 0;
+    ctx.max_items = 0;
+    ctx.batch_size = 0;
+    /* The batch is held while the sort merges, so it takes its share of the
+     * budget out of the sort's: one of three runs, as in the default */
+    if (memory_budget == 0) {
+        memory_budget = STR_DEFAULT_BUDGET;
+    }
+    ctx.max_batch_size = MIN(memory_budget / 3, STR_MAX_BATCH_SIZE);
+    if (ctx.max_batch_size == 0) {
+        ctx.max_batch_size = 1;
+    }
+    ctx.num_threads = num_threads ? num_threads : sorter_available_cpus();
+    if (ctx.num_threads > STR_MAX_THREADS) {
+        ctx.num_threads = STR_MAX_THREADS;
+    }
+    /* With one dimension the file sorter alone puts the slabs in order */
+    if (ctx.dim == 1) {
+        ctx.num_threads = 1;
+    }
+    ctx.records_arena = new_arena(0);
+    if (ctx.records_arena == NULL) {
+        return FILE_SORTER_ERROR_ALLOC;
+    }
+    cb_mutex_initialize(&ctx.mutex);
+
+    ret = sort_view_records_file(file_path, tmp_dir, str_feed_record,
+                                 &ctx.merge_ctx, num_threads,
+                                 memory_budget > ctx.max_batch_size ?
+                                     memory_budget - ctx.max_batch_size : 1);
+    if (ret == FILE_SORTER_SUCCESS && ctx.num_items > 0) {
+        ret = (file_sorter_error_t) str_feed_batch(&ctx);
+    }
+
+    cb_mutex_destroy(&ctx.mutex);
+    delete_arena(ctx.records_arena);
+    free(ctx.items);
+
+    return ret;
+}
+
+
+/*
+ * Returns the number of items of every chunk that n items, ordered by one
+ * dimension, are cut into. Each chunk is a slab of the tiles of leaf_items
+ * items over the r dimensions that are left, this one included.
+ */
+static uint64_t str_chunk_items(uint64_t n, uint64_t leaf_items, uint16_t r)
+{
+    uint64_t leaves = (n + leaf_items - 1) / leaf_items;
+    uint64_t low = 1;
+    uint64_t high = leaves;
+    uint64_t slabs, power;
+    uint16_t i;
+
+    /* The smallest number of slabs whose r-th power covers all leaves */
+    while (low < high) {
+        slabs = low + (high - low) / 2;
+        power = 1;
+        for (i = 0; i < r && power < leaves; ++i) {
+            power = power > leaves / slabs ? leaves : power * slabs;
+        }
+        if (power >= leaves) {
+            high = slabs;
+        } else {
+            low = slabs + 1;
+        }
+    }
+
+    return leaf_items * ((leaves + low - 1) / low);
+}
+
+
+static int str_item_cmp(const void *a, const void *b)
+{
+    double center1 = ((const str_item_t *) a)->center;
+    double center2 = ((const str_item_t *) b)->center;
+
+    if (center1 < center2) {
+        return -1;
+    }
+    return center1 > center2;
+}
+
+
+static int str_item_cmp_reverse(const void *a, const void *b)
+{
+    return str_item_cmp(b, a);
+}
+
+
+/*
+ * Orders the n items of a chunk by the dimension dim and then every chunk
+ * they are cut into by the next dimension, recursively. The direction
+ * alternates between neighbouring chunks, so that the last tile of one and
+ * the first of the next are close to each other.
+ */
+static void str_order_items(const str_ctx_t *ctx,
+                            str_item_t *items,
+                            size_t n,
+                            uint16_t dim,
+                            int reverse)
+{
+    uint64_t chunk;
+    size_t i;
+    sized_buf key;
+
+    if (dim == ctx->dim) {
+        return;
+    }
+
+    for (i = 0; i < n; ++i) {
+        key.buf = VIEW_RECORD_KEY(items[i].rec);
+        key.size = items[i].rec->ksize;
+        items[i].center = spatial_key_center(&key, dim);
+    }
+    qsort(items, n, sizeof(str_item_t),
+          reverse ? str_item_cmp_reverse : str_item_cmp);
+
+    chunk = str_chunk_items(n, ctx->leaf_items, ctx->dim - dim);
+    for (i = 0; i < n; i += chunk) {
+        str_order_items(ctx, items + i, MIN(chunk, n - i), dim + 1,
+                        (i / chunk) & 1);
+    }
+}
+
+
+/*
+ * Feeds the items of a chunk ordered by str_order_items, tile by tile. Tiles
+ * of records bigger than the average are ended early, before they take more
+ * than a leaf, so the builder never has to split a leaf of them itself.
+ */
+static int str_feed_items(str_ctx_t *ctx,
+                          str_item_t *items,
+                          size_t n,
+                          uint16_t dim)
+{
+    uint64_t chunk;
+    size_t i, item_size, tile_size = 0;
+    int ret;
+
+    if (dim == ctx->dim) {
+        for (i = 0; i < n; ++i) {
+            item_size = items[i].rec->ksize + items[i].rec->vsize +
+                sizeof(raw_kv_length);
+            if (tile_size > 0 && tile_size + item_size > ctx->leaf_size) {
+                ret = ctx->end_tile(&ctx->merge_ctx);
+                if (ret != FILE_SORTER_SUCCESS) {
+                    return ret;
+                }
+                tile_size = 0;
+            }
+            ret = ctx->callback(items[i].rec, &ctx->merge_ctx);
+            if (ret != FILE_SORTER_SUCCESS) {
+                return ret;
+            }
+            tile_size += item_size;
+        }
+        return ctx->end_tile(&ctx->merge_ctx);
+    }
+
+    chunk = str_chunk_items(n, ctx->leaf_items, ctx->dim - dim);
+    for (i = 0; i < n; i += chunk) {
+        ret = str_feed_items(ctx, items + i, MIN(chunk, n - i), dim + 1);
+        if (ret != FILE_SORTER_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return FILE_SORTER_SUCCESS;
+}
+
+
+static void str_order_worker(void *arg)
+{
+    str_ctx_t *ctx = (str_ctx_t *) arg;
+    size_t slab, start;
+
+    while (1) {
+        cb_mutex_enter(&ctx->mutex);
+        slab = ctx->next_slab++;
+        cb_mutex_exit(&ctx->mutex);
+
+        if (slab >= ctx->num_slabs) {
+            return;
+        }
+
+        start = slab * ctx->slab_items;
+        str_order_items(ctx, ctx->items + start,
+                        MIN(ctx->slab_items, ctx->num_items - start), 1,
+                        (ctx->slabs_done + slab) & 1);
+    }
+}
+
+
+/*
+ * Orders the slabs of the batch, each on its own thread, and feeds them in
+ * the order they were read.
+ */
+static int str_feed_batch(str_ctx_t *ctx)
+{
+    cb_thread_t threads[STR_MAX_THREADS];
+    size_t num_threads;
+    size_t i, start;
+    int ret = FILE_SORTER_SUCCESS;
+
+    ctx->num_slabs = (ctx->num_items + ctx->slab_items - 1) / ctx->slab_items;
+    ctx->next_slab = 0;
+
+    /* The calling thread is one of them */
+    num_threads = MIN(ctx->num_threads, ctx->num_slabs) - 1;
+    for (i = 0; i < num_threads; ++i) {
+        /* Fewer threads just means the remaining ones do more of the work */
+        if (cb_create_thread(&threads[i], str_order_worker, ctx, 0) != 0) {
+            num_threads = i;
+            break;
+        }
+    }
+    str_order_worker(ctx);
+    for (i = 0; i < num_threads; ++i) {
+        cb_join_thread(threads[i]);
+    }
+
+    for (start = 0; start < ctx->num_items; start += ctx->slab_items) {
+        ret = str_feed_items(ctx, ctx->items + start,
+                             MIN(ctx->slab_items, ctx->num_items - start), 1);
+        if (ret != FILE_SORTER_SUCCESS) {
+            break;
+        }
+    }
+
+    ctx->slabs_done += ctx->num_slabs;
+    ctx->num_items = 0;
+    ctx->batch_size = 0;
+    arena_free_all(ctx->records_arena);
+
+    return ret;
+}
+
+
+/*
+ * Collects the records of the file sorted by the first dimension. Once a
+ * slab completes the batch, with one slab for every thread or as many as
+ * fit into the batch size (counting the next slab at the average size), the
+ * batch is ordered and fed.
+ */
+static int str_feed_record(void *record, void *user_ctx)
+{
+    str_ctx_t *ctx = (str_ctx_t *) user_ctx;
+    view_file_merge_record_t *rec = (view_file_merge_record_t *) record;
+    size_t size = sizeof(*rec) + rec->ksize + rec->vsize;
+    view_file_merge_record_t *copy;
+
+    if (ctx->num_items == ctx->max_items) {
+        size_t max_items = ctx->max_items ? ctx->max_items * 2 : 1024;
+        str_item_t *items = (str_item_t *) realloc(
+            ctx->items, max_items * sizeof(str_item_t));
+        if (items == NULL) {
+            return FILE_SORTER_ERROR_ALLOC;
+        }
+        ctx->items = items;
+        ctx->max_items = max_items;
+    }
+
+    copy = (view_file_merge_record_t *)
+        arena_alloc_unaligned(ctx->records_arena, size);
+    if (copy == NULL) {
+        return FILE_SORTER_ERROR_ALLOC;
+    }
+    memcpy(copy, rec, size);
+    ctx->items[ctx->num_items++].rec = copy;
+    ctx->batch_size += size + sizeof(str_item_t);
+
+    if (ctx->num_items % ctx->slab_items == 0 &&
+            (ctx->num_items / ctx->slab_items >= ctx->num_threads ||
+             ctx->batch_size + ctx->slab_size > ctx->max_batch_size)) {
+        return str_feed_batch(ctx);
+    }
+
+    return FILE_SORTER_SUCCESS;
+}
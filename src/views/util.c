@@ -74,7 +74,103 @@ int view_id_cmp(const sized_buf *key1, const sized_buf *key2,
 }
 
 
-int read_view_record(FILE *in, void **buf, void *ctx)
+uint64_t view_id_prefix(const sized_buf *key, const void *user_ctx)
+{
+    (void)user_ctx;
+    return ebin_prefix(key);
+}
+
+
+static bool has_sort_key(const view_file_merge_ctx_t *ctx)
+{
+    return ctx->key_cmp_fun == view_key_cmp;
+}
+
+
+/* Encodes a key that isn't valid JSON so that it sorts after all others by
+   its bytes. Like the valid keys, it's never a prefix of another one, as
+   the doc id follows it: the bytes 0 and 1 are escaped as 1 1 and 1 2, and
+   a 0 ends the key. */
+static char *encode_raw_sort_key(const sized_buf *key, size_t *size)
+{
+    char *buf = (char *) malloc(2 + 2 * key->size);
+    size_t i, n = 0;
+
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf[n++] = (char) 0xff;
+    for (i = 0; i < key->size; ++i) {
+        uint8_t b = (uint8_t) key->buf[i];
+
+        if (b <= 1) {
+            buf[n++] = 1;
+            buf[n++] = (char) (b + 1);
+        } else {
+            buf[n++] = (char) b;
+        }
+    }
+    buf[n++] = 0;
+    *size = n;
+
+    return buf;
+}
+
+
+/* Sets the sort key of a view btree record, allocating it with malloc, or
+   from a if not NULL */
+static int set_view_sort_key(view_file_merge_record_t *rec, arena *a)
+{
+    sized_buf json_key;
+    sized_buf doc_id;
+    sized_buf enc;
+    char *buf;
+
+    json_key.buf = VIEW_RECORD_KEY(rec) + sizeof(uint16_t);
+    json_key.size = 0;
+    if (rec->ksize >= sizeof(uint16_t)) {
+        json_key.size = decode_raw16(*((raw_16 *) VIEW_RECORD_KEY(rec)));
+    }
+    if (json_key.size + sizeof(uint16_t) > rec->ksize) {
+        json_key.buf = VIEW_RECORD_KEY(rec);
+        json_key.size = rec->ksize;
+    }
+    doc_id.buf = json_key.buf + json_key.size;
+    doc_id.size = rec->ksize - (doc_id.buf - VIEW_RECORD_KEY(rec));
+
+    if (CollateJSONEncodeKey(&json_key, &enc) != 0) {
+        enc.buf = encode_raw_sort_key(&json_key, &enc.size);
+        if (enc.buf == NULL) {
+            return FILE_MERGER_ERROR_ALLOC;
+        }
+    }
+
+    if (a != NULL) {
+        buf = (char *) arena_alloc_unaligned(a, enc.size + doc_id.size);
+        if (buf != NULL) {
+            memcpy(buf, enc.buf, enc.size);
+        }
+        free(enc.buf);
+    } else {
+        buf = (char *) realloc(enc.buf, enc.size + doc_id.size);
+        if (buf == NULL) {
+            free(enc.buf);
+        }
+    }
+    if (buf == NULL) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+    memcpy(buf + enc.size, doc_id.buf, doc_id.size);
+
+    rec->sort_key = buf;
+    rec->sksize = (uint32_t) (enc.size + doc_id.size);
+
+    return FILE_MERGER_SUCCESS;
+}
+
+
+/* Reads a view record, allocating it with malloc, or from a if not NULL */
+static int read_view_record_from(FILE *in, void **buf, arena *a, void *ctx)
 {
     uint32_t len, vlen;
     uint16_t klen;
@@ -107,7 +203,12 @@ int read_view_record(FILE *in, void **buf, void *ctx)
         vlen -= sizeof(op);
     }
 
-    rec = (view_file_merge_record_t *) malloc(sizeof(*rec) + klen + vlen);
+    if (a != NULL) {
+        rec = (view_file_merge_record_t *)
+            arena_alloc_unaligned(a, sizeof(*rec) + klen + vlen);
+    } else {
+        rec = (view_file_merge_record_t *) malloc(sizeof(*rec) + klen + vlen);
+    }
     if (rec == NULL) {
         return FILE_MERGER_ERROR_ALLOC;
     }
@@ -115,15 +216,41 @@ int read_view_record(FILE *in, void **buf, void *ctx)
     rec->op = op;
     rec->ksize = klen;
     rec->vsize = vlen;
+    rec->sksize = 0;
+    rec->sort_key = NULL;
 
     if (fread(VIEW_RECORD_KEY(rec), klen + vlen, 1, in) != 1) {
-        free(rec);
+        if (a == NULL) {
+            free(rec);
+        }
         return FILE_MERGER_ERROR_FILE_READ;
     }
 
+    if (has_sort_key(merge_ctx)) {
+        int ret = set_view_sort_key(rec, a);
+        if (ret != FILE_MERGER_SUCCESS) {
+            if (a == NULL) {
+                free(rec);
+            }
+            return ret;
+        }
+    }
+
     *buf = (void *) rec;
 
-    return klen + vlen;
+    return klen + vlen + rec->sksize;
+}
+
+
+int read_view_record(FILE *in, void **buf, void *ctx)
+{
+    return read_view_record_from(in, buf, NULL, ctx);
+}
+
+
+int read_view_record_arena(FILE *in, void **buf, arena *a, void *ctx)
+{
+    return read_view_record_from(in, buf, a, ctx);
 }
 
 
@@ -165,6 +292,15 @@ int compare_view_records(const void *r1, const void *r2, void *ctx)
     view_file_merge_record_t *rec2 = (view_file_merge_record_t *) r2;
     sized_buf k1, k2;
 
+    if (has_sort_key(merge_ctx)) {
+        k1.size = rec1->sksize;
+        k1.buf = rec1->sort_key;
+        k2.size = rec2->sksize;
+        k2.buf = rec2->sort_key;
+
+        return ebin_cmp(&k1, &k2);
+    }
+
     k1.size = rec1->ksize;
     k1.buf = VIEW_RECORD_KEY(rec1);
 
@@ -175,6 +311,34 @@ int compare_view_records(const void *r1, const void *r2, void *ctx)
 }
 
 
+uint64_t view_record_prefix(const void *record, void *ctx)
+{
+    view_file_merge_ctx_t *merge_ctx = (view_file_merge_ctx_t *) ctx;
+    view_file_merge_record_t *rec = (view_file_merge_record_t *) record;
+    sized_buf k;
+
+    k.size = rec->ksize;
+    k.buf = VIEW_RECORD_KEY(rec);
+
+    return merge_ctx->key_prefix_fun(&k, merge_ctx->user_ctx);
+}
+
+
+void view_record_key(const void *record, sized_buf *key, void *ctx)
+{
+    view_file_merge_record_t *rec = (view_file_merge_record_t *) record;
+    (void) ctx;
+
+    if (rec->sort_key != NULL) {
+        key->size = rec->sksize;
+        key->buf = rec->sort_key;
+    } else {
+        key->size = rec->ksize;
+        key->buf = VIEW_RECORD_KEY(rec);
+    }
+}
+
+
 size_t dedup_view_records_merger(file_merger_record_t **records, size_t len, void *ctx)
 {
     size_t i;
@@ -193,7 +357,12 @@ size_t dedup_view_records_merger(file_merger_record_t **records, size_t len, voi
 
 void free_view_record(void *record, void *ctx)
 {
+    view_file_merge_record_t *rec = (view_file_merge_record_t *) record;
     (void) ctx;
+
+    if (rec != NULL) {
+        free(rec->sort_key);
+    }
     free(record);
 }
 
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <libcouchstore/couch_db.h>
 #include "../file_merger.h"
+#include "../arena.h"
 #include "view_group.h"
 
 #ifdef __cplusplus
@@ -36,6 +37,10 @@ extern "C" {
         uint8_t   op;
         uint16_t  ksize;
         uint32_t  vsize;
+        /* for view btree records, the key in a form ordered by plain byte
+           comparison, NULL for other records (see read_view_record) */
+        uint32_t  sksize;
+        char     *sort_key;
     } view_file_merge_record_t;
 #pragma pack(pop)
 
@@ -55,6 +60,9 @@ extern "C" {
         enum view_record_type type;
         int (*key_cmp_fun)(const sized_buf *key1, const sized_buf *key2,
                            const void *user_ctx);
+        /* optional, key prefix consistent with key_cmp_fun (see
+           file_sorter_record_prefix_t in src/file_sorter.h) */
+        uint64_t (*key_prefix_fun)(const sized_buf *key, const void *user_ctx);
         const void *user_ctx;
     } view_file_merge_ctx_t;
 
@@ -66,10 +74,21 @@ extern "C" {
     int view_id_cmp(const sized_buf *key1, const sized_buf *key2,
                     const void *user_ctx);
 
+    /* key prefix of the id btree of an index, consistent with view_id_cmp */
+    uint64_t view_id_prefix(const sized_buf *key, const void *user_ctx);
+
     /* read view index record from a file, obbeys the read record function
-       prototype defined in src/file_merger.h */
+       prototype defined in src/file_merger.h. Records of view btrees (those
+       ordered by view_key_cmp) also get a sort key, the JSON key encoded by
+       CollateJSONEncodeKey followed by the document ID, which compares like
+       view_key_cmp with plain byte order */
     int read_view_record(FILE *in, void **buf, void *ctx);
 
+    /* same as read_view_record, but allocates the record from an arena,
+       obbeys the arena read record function prototype defined in
+       src/file_sorter.h */
+    int read_view_record_arena(FILE *in, void **buf, arena *a, void *ctx);
+
     /* write view index record from a file, obbeys the write record function
        prototype defined in src/file_merger.h */
     file_merger_error_t write_view_record(FILE *out, void *buf, void *ctx);
@@ -78,6 +97,14 @@ extern "C" {
        prototype defined in src/file_merger.h */
     int compare_view_records(const void *r1, const void *r2, void *ctx);
 
+    /* key prefix of a view index record, obbeys the record prefix function
+       prototype defined in src/file_sorter.h */
+    uint64_t view_record_prefix(const void *record, void *ctx);
+
+    /* key of a view index record, obbeys the record key function prototype
+       defined in src/file_sorter.h */
+    void view_record_key(const void *record, sized_buf *key, void *ctx);
+
     /* Pick the winner from the duplicate entries */
     size_t dedup_view_records_merger(file_merger_record_t **records, size_t len, void *ctx);
 
@@ -39,6 +39,61 @@
 #define VIEW_KP_CHUNK_THRESHOLD (6 * 1024)
 #define MAX_HEADER_SIZE         (64 * 1024)
 #define MAX_ACTIONS_SIZE        (2 * 1024 * 1024)
+/* Upper bound on the B-trees of a view group built or updated at once. Each
+ * one sorts a file of its own, with its share of the sort threads and memory
+ * budget. */
+#define VIEW_JOB_MAX_THREADS    4
+
+/* One of the B-trees built by couchstore_build_view_group() */
+typedef struct {
+    const view_group_info_t *info;
+    const char              *source_file;
+    tree_file               *dest_file;
+    const char              *tmpdir;
+    /* Index of the view, or -1 for the id B-tree */
+    int                      view;
+    unsigned                 sort_threads;
+    size_t                   sort_budget;
+    node_pointer            *root;
+    couchstore_error_t       ret;
+    view_error_t             error_info;
+} view_build_job_t;
+
+/* One of the B-trees updated by couchstore_update_view_group() */
+typedef struct {
+    const view_group_info_t *info;
+    const char              *source_file;
+    tree_file               *dest_file;
+    const char              *tmp_dir;
+    int                      is_sorted;
+    size_t                   batch_size;
+    /* Index of the view, or -1 for the id B-tree */
+    int                      view;
+    unsigned                 sort_threads;
+    size_t                   sort_budget;
+    const node_pointer      *root;
+    node_pointer            *new_root;
+    view_purger_ctx_t        purge_ctx;
+    uint64_t                 inserted;
+    uint64_t                 removed;
+    couchstore_error_t       ret;
+    view_error_t             error_info;
+} view_update_job_t;
+
+typedef couchstore_error_t (*view_job_fn)(void *job);
+
+/* Threads the jobs are run on, 0 for one per available CPU */
+static int view_job_num_threads = 0;
+
+typedef struct {
+    char        *jobs;
+    size_t       job_size;
+    int          num_jobs;
+    view_job_fn  run_job;
+    int          next_job;
+    int          failed;
+    cb_mutex_t   mutex;
+} view_job_pool_t;
 
 static couchstore_error_t read_btree_info(view_group_info_t *info,
                                           FILE *in_stream,
@@ -58,22 +113,43 @@ static couchstore_error_t build_btree(const char *source_file,
                                       reduce_fn reduce_fun,
                                       reduce_fn rereduce_fun,
                                       const char *tmpdir,
-                                      sort_record_fn sort_fun,
+                                      sort_record_ex_fn sort_fun,
+                                      unsigned sort_threads,
+                                      size_t sort_budget,
                                       void *reduce_ctx,
                                       node_pointer **out_root);
 
 static couchstore_error_t build_id_btree(const char *source_file,
                                          tree_file *dest_file,
                                          const char *tmpdir,
+                                         unsigned sort_threads,
+                                         size_t sort_budget,
                                          node_pointer **out_root);
 
 static couchstore_error_t build_view_btree(const char *source_file,
                                            const view_btree_info_t *info,
                                            tree_file *dest_file,
                                            const char *tmpdir,
+                                           unsigned sort_threads,
+                                           size_t sort_budget,
                                            node_pointer **out_root,
                                            view_error_t *error_info);
 
+static int view_job_threads(int num_jobs);
+
+static void run_view_jobs(void *jobs,
+                          size_t job_size,
+                          int num_jobs,
+                          int num_threads,
+                          view_job_fn run_job,
+                          tree_file *file);
+
+static void view_job_worker(void *arg);
+
+static couchstore_error_t run_build_job(void *job);
+
+static couchstore_error_t run_update_job(void *job);
+
 static void close_view_group_file(view_group_info_t *info);
 
 static int read_record(FILE *f, arena *a, sized_buf *k, sized_buf *v,
@@ -151,6 +227,8 @@ static couchstore_error_t build_view_spatial(const char *source_file,
                                              const view_spatial_info_t *info,
                                              tree_file *dest_file,
                                              const char *tmpdir,
+                                             unsigned sort_threads,
+                                             size_t sort_budget,
                                              node_pointer **out_root,
                                              view_error_t *error_info);
 
@@ -163,7 +241,9 @@ static couchstore_error_t build_spatial(const char *source_file,
                                         const uint16_t dimension,
                                         const double *mbb,
                                         const char *tmpdir,
-                                        sort_record_fn sort_fun,
+                                        view_spatial_load_t load,
+                                        unsigned sort_threads,
+                                        size_t sort_budget,
                                         node_pointer **out_root);
 
 /* Callback for every item that got fetched from the original view */
@@ -515,8 +595,11 @@ couchstore_error_t couchstore_build_view_group(view_group_info_t *info,
     couchstore_error_t ret;
     tree_file index_file;
     index_header_t *header = NULL;
-    node_pointer *id_root = NULL;
-    node_pointer **view_roots = NULL;
+    view_build_job_t *jobs;
+    int num_jobs = info->num_btrees + 1;
+    int num_threads = view_job_threads(num_jobs);
+    unsigned sort_threads;
+    size_t sort_budget;
     int i;
 
     error_info->view_name = NULL;
@@ -525,9 +608,9 @@ couchstore_error_t couchstore_build_view_group(view_group_info_t *info,
     index_file.ops = NULL;
     index_file.path = NULL;
 
-    view_roots = (node_pointer **) calloc(
-        info->num_btrees, sizeof(node_pointer *));
-    if (view_roots == NULL) {
+    /* Job 0 builds the id btree, job i + 1 the btree of view i */
+    jobs = (view_build_job_t *) calloc(num_jobs, sizeof(view_build_job_t));
+    if (jobs == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
 
@@ -551,41 +634,43 @@ couchstore_error_t couchstore_build_view_group(view_group_info_t *info,
         goto out;
     }
 
-    ret = build_id_btree(id_records_file, &index_file, tmpdir, &id_root);
-    if (ret != COUCHSTORE_SUCCESS) {
-        goto out;
+    view_sort_share(num_threads, &sort_threads, &sort_budget);
+    for (i = 0; i < num_jobs; ++i) {
+        jobs[i].info = info;
+        jobs[i].source_file = (i == 0) ? id_records_file :
+                                         kv_records_files[i - 1];
+        jobs[i].dest_file = &index_file;
+        jobs[i].tmpdir = tmpdir;
+        jobs[i].view = i - 1;
+        jobs[i].sort_threads = sort_threads;
+        jobs[i].sort_budget = sort_budget;
+        jobs[i].ret = COUCHSTORE_SUCCESS;
+    }
+
+    /* The btrees are independent of each other, so they are built at the
+     * same time, all appending their nodes to the index file. */
+    run_view_jobs(jobs, sizeof(*jobs), num_jobs, num_threads, run_build_job,
+                  &index_file);
+
+    /* Report the failure of the first btree that failed. Those not built
+     * because of it come after it. */
+    for (i = 0; i < num_jobs; ++i) {
+        if (jobs[i].ret != COUCHSTORE_SUCCESS) {
+            ret = jobs[i].ret;
+            *error_info = jobs[i].error_info;
+            jobs[i].error_info.view_name = NULL;
+            jobs[i].error_info.error_msg = NULL;
+            goto out;
+        }
     }
 
     free(header->id_btree_state);
-    header->id_btree_state = id_root;
-    id_root = NULL;
-
+    header->id_btree_state = jobs[0].root;
+    jobs[0].root = NULL;
     for (i = 0; i < info->num_btrees; ++i) {
-        switch(info->type) {
-        case VIEW_INDEX_TYPE_MAPREDUCE:
-            ret = build_view_btree(kv_records_files[i],
-                                   &info->view_infos.btree[i],
-                                   &index_file,
-                                   tmpdir,
-                                   &view_roots[i],
-                                   error_info);
-            break;
-        case VIEW_INDEX_TYPE_SPATIAL:
-            ret = build_view_spatial(kv_records_files[i],
-                                     &info->view_infos.spatial[i],
-                                     &index_file,
-                                     tmpdir,
-                                     &view_roots[i],
-                                     error_info);
-            break;
-        }
-        if (ret != COUCHSTORE_SUCCESS) {
-            goto out;
-        }
-
         free(header->view_states[i]);
-        header->view_states[i] = view_roots[i];
-        view_roots[i] = NULL;
+        header->view_states[i] = jobs[i + 1].root;
+        jobs[i + 1].root = NULL;
     }
 
     ret = write_view_group_header(&index_file, header_pos, header);
@@ -599,18 +684,156 @@ out:
     free_index_header(header);
     close_view_group_file(info);
     tree_file_close(&index_file);
-    free(id_root);
-    if (view_roots != NULL) {
-        for (i = 0; i < info->num_btrees; ++i) {
-            free(view_roots[i]);
-        }
-        free(view_roots);
+    for (i = 0; i < num_jobs; ++i) {
+        free(jobs[i].root);
+        free((void *) jobs[i].error_info.view_name);
+        free((void *) jobs[i].error_info.error_msg);
     }
+    free(jobs);
 
     return ret;
 }
 
 
+void view_group_set_job_threads(int num_threads)
+{
+    view_job_num_threads = num_threads;
+}
+
+
+/* Returns the number of threads that num_jobs jobs are run on */
+static int view_job_threads(int num_jobs)
+{
+    int num_threads = view_job_num_threads;
+
+    if (num_threads == 0) {
+        num_threads = (int) sorter_available_cpus();
+    }
+
+    if (num_threads > VIEW_JOB_MAX_THREADS) {
+        num_threads = VIEW_JOB_MAX_THREADS;
+    }
+    if (num_threads > num_jobs) {
+        num_threads = num_jobs;
+    }
+
+    return num_threads;
+}
+
+
+/*
+ * Runs run_job on each of the num_jobs jobs, of job_size bytes each, on
+ * num_threads threads (see view_job_threads()), the calling one included.
+ * The jobs share file, which is locked around each read and append while
+ * they run. Once a job fails, no new ones are started; each job records its
+ * own result.
+ */
+static void run_view_jobs(void *jobs,
+                          size_t job_size,
+                          int num_jobs,
+                          int num_threads,
+                          view_job_fn run_job,
+                          tree_file *file)
+{
+    view_job_pool_t pool;
+    cb_thread_t threads[VIEW_JOB_MAX_THREADS];
+    cb_mutex_t io_lock;
+    int i;
+
+    pool.jobs = (char *) jobs;
+    pool.job_size = job_size;
+    pool.num_jobs = num_jobs;
+    pool.run_job = run_job;
+    pool.next_job = 0;
+    pool.failed = 0;
+    cb_mutex_initialize(&pool.mutex);
+    cb_mutex_initialize(&io_lock);
+
+    /* The calling thread is one of them */
+    num_threads--;
+    if (num_threads > 0) {
+        file->io_lock = &io_lock;
+    }
+    for (i = 0; i < num_threads; ++i) {
+        /* Fewer threads just means the remaining ones do more of the work */
+        if (cb_create_thread(&threads[i], view_job_worker, &pool, 0) != 0) {
+            num_threads = i;
+            break;
+        }
+    }
+    view_job_worker(&pool);
+    for (i = 0; i < num_threads; ++i) {
+        cb_join_thread(threads[i]);
+    }
+    file->io_lock = NULL;
+
+    cb_mutex_destroy(&io_lock);
+    cb_mutex_destroy(&pool.mutex);
+}
+
+
+static void view_job_worker(void *arg)
+{
+    view_job_pool_t *pool = (view_job_pool_t *) arg;
+    void *job;
+
+    while (1) {
+        job = NULL;
+        cb_mutex_enter(&pool->mutex);
+        if (!pool->failed && pool->next_job < pool->num_jobs) {
+            job = pool->jobs + pool->job_size * pool->next_job++;
+        }
+        cb_mutex_exit(&pool->mutex);
+
+        if (job == NULL) {
+            return;
+        }
+
+        if (pool->run_job(job) != COUCHSTORE_SUCCESS) {
+            cb_mutex_enter(&pool->mutex);
+            pool->failed = 1;
+            cb_mutex_exit(&pool->mutex);
+        }
+    }
+}
+
+
+static couchstore_error_t run_build_job(void *arg)
+{
+    view_build_job_t *job = (view_build_job_t *) arg;
+    const view_group_info_t *info = job->info;
+
+    if (job->view < 0) {
+        job->ret = build_id_btree(job->source_file,
+                                  job->dest_file,
+                                  job->tmpdir,
+                                  job->sort_threads,
+                                  job->sort_budget,
+                                  &job->root);
+    } else if (info->type == VIEW_INDEX_TYPE_MAPREDUCE) {
+        job->ret = build_view_btree(job->source_file,
+                                    &info->view_infos.btree[job->view],
+                                    job->dest_file,
+                                    job->tmpdir,
+                                    job->sort_threads,
+                                    job->sort_budget,
+                                    &job->root,
+                                    &job->error_info);
+    } else {
+        job->ret = build_view_spatial(job->source_file,
+                                      &info->view_infos.spatial[job->view],
+                                      job->dest_file,
+                                      job->tmpdir,
+                                      job->sort_threads,
+                                      job->sort_budget,
+                                      &job->root,
+                                      &job->error_info);
+    }
+
+    return job->ret;
+}
+
+
 /*
  * Similar to util.c:read_view_record(), but it uses arena allocator, which is
  * required for the existing semantics/api of btree bottom-up build in
@@ -729,7 +952,9 @@ static couchstore_error_t build_btree(const char *source_file,
                                       reduce_fn reduce_fun,
                                       reduce_fn rereduce_fun,
                                       const char *tmpdir,
-                                      sort_record_fn sort_fun,
+                                      sort_record_ex_fn sort_fun,
+                                      unsigned sort_threads,
+                                      size_t sort_budget,
                                       void *reduce_ctx,
                                       node_pointer **out_root)
 {
@@ -763,7 +988,8 @@ static couchstore_error_t build_btree(const char *source_file,
 
     ret = (couchstore_error_t) sort_fun(source_file,
                                         tmpdir,
-                                        build_btree_record_callback, &build_ctx);
+                                        build_btree_record_callback, &build_ctx,
+                                        sort_threads, sort_budget);
     if (ret != COUCHSTORE_SUCCESS) {
         goto out;
     }
@@ -791,6 +1017,8 @@ out:
 static couchstore_error_t build_id_btree(const char *source_file,
                                          tree_file *dest_file,
                                          const char *tmpdir,
+                                         unsigned sort_threads,
+                                         size_t sort_budget,
                                          node_pointer **out_root)
 {
     couchstore_error_t ret;
@@ -804,7 +1032,9 @@ static couchstore_error_t build_id_btree(const char *source_file,
                       view_id_btree_reduce,
                       view_id_btree_rereduce,
                       tmpdir,
-                      sort_view_ids_file,
+                      sort_view_ids_file_ex,
+                      sort_threads,
+                      sort_budget,
                       NULL,
                       out_root);
 
@@ -816,6 +1046,8 @@ static couchstore_error_t build_view_btree(const char *source_file,
                                            const view_btree_info_t *info,
                                            tree_file *dest_file,
                                            const char *tmpdir,
+                                           unsigned sort_threads,
+                                           size_t sort_budget,
                                            node_pointer **out_root,
                                            view_error_t *error_info)
 {
@@ -839,7 +1071,9 @@ static couchstore_error_t build_view_btree(const char *source_file,
                       view_btree_reduce,
                       view_btree_rereduce,
                       tmpdir,
-                      sort_view_kvs_file,
+                      sort_view_kvs_file_ex,
+                      sort_threads,
+                      sort_budget,
                       red_ctx,
                       out_root);
 
@@ -1439,8 +1673,11 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
     couchstore_error_t ret;
     tree_file index_file;
     index_header_t *header = NULL;
-    node_pointer *id_root = NULL;
-    node_pointer **view_roots = NULL;
+    view_update_job_t *jobs = NULL;
+    int num_jobs = info->num_btrees + 1;
+    int num_threads = view_job_threads(num_jobs);
+    unsigned sort_threads;
+    size_t sort_budget;
     view_purger_ctx_t purge_ctx;
     bitmap_t bm_cleanup;
     int i;
@@ -1458,9 +1695,9 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
     index_file.ops = NULL;
     index_file.path = NULL;
 
-    view_roots = (node_pointer **) calloc(info->num_btrees,
-                                          sizeof(node_pointer *));
-    if (view_roots == NULL) {
+    /* Job 0 updates the id btree, job i + 1 the btree of view i */
+    jobs = (view_update_job_t *) calloc(num_jobs, sizeof(view_update_job_t));
+    if (jobs == NULL) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto cleanup;
     }
@@ -1488,72 +1725,62 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
     index_file.pos = index_file.ops->goto_eof(&index_file.lastError,
                                               index_file.handle);
 
-    if (!is_sorted) {
-        ret = (couchstore_error_t) sort_view_ids_ops_file(id_records_file, tmp_dir);
-        if (ret != COUCHSTORE_SUCCESS) {
-            char buf[1024];
-            snprintf(buf, sizeof(buf),
-                    "Error sorting records file: %s", id_records_file);
-            error_info->error_msg = strdup(buf);
-            error_info->view_name = (const char *) strdup("id_btree");
+    view_sort_share(num_threads, &sort_threads, &sort_budget);
+    for (i = 0; i < num_jobs; ++i) {
+        jobs[i].info = info;
+        jobs[i].source_file = (i == 0) ? id_records_file :
+                                         kv_records_files[i - 1];
+        jobs[i].dest_file = &index_file;
+        jobs[i].tmp_dir = tmp_dir;
+        jobs[i].is_sorted = is_sorted;
+        jobs[i].batch_size = batch_size;
+        jobs[i].view = i - 1;
+        jobs[i].sort_threads = sort_threads;
+        jobs[i].sort_budget = sort_budget;
+        jobs[i].root = (i == 0) ? header->id_btree_state :
+                                  header->view_states[i - 1];
+        /* Each job counts its own purges */
+        jobs[i].purge_ctx = purge_ctx;
+        jobs[i].ret = COUCHSTORE_SUCCESS;
+    }
+
+    /* The btrees are independent of each other, so they are updated at the
+     * same time, all appending their nodes to the index file. */
+    run_view_jobs(jobs, sizeof(*jobs), num_jobs, num_threads, run_update_job,
+                  &index_file);
+
+    /* Report the failure of the first btree that failed. Those not updated
+     * because of it come after it. */
+    for (i = 0; i < num_jobs; ++i) {
+        if (jobs[i].ret != COUCHSTORE_SUCCESS) {
+            ret = jobs[i].ret;
+            *error_info = jobs[i].error_info;
+            jobs[i].error_info.view_name = NULL;
+            jobs[i].error_info.error_msg = NULL;
             goto cleanup;
         }
     }
 
-    ret = update_id_btree(id_records_file, &index_file,
-                                           header->id_btree_state,
-                                           batch_size,
-                                           &purge_ctx,
-                                           &stats->ids_inserted,
-                                           &stats->ids_removed,
-                                           &id_root);
-    if (ret != COUCHSTORE_SUCCESS) {
-        goto cleanup;
-    }
-
-
-    if (header->id_btree_state != id_root) {
-        free(header->id_btree_state);
-    }
-
-    header->id_btree_state = id_root;
-    view_id_bitmask(id_root, &bm_cleanup);
-    id_root = NULL;
+    for (i = 0; i < num_jobs; ++i) {
+        node_pointer **state = (i == 0) ? &header->id_btree_state :
+                                          &header->view_states[i - 1];
 
-    for (i = 0; i < info->num_btrees; ++i) {
-        if (!is_sorted) {
-            ret = (couchstore_error_t) sort_view_kvs_ops_file(kv_records_files[i], tmp_dir);
-            if (ret != COUCHSTORE_SUCCESS) {
-                char buf[1024];
-                snprintf(buf, sizeof(buf),
-                        "Error sorting records file: %s", kv_records_files[i]);
-                set_error_info(&info->view_infos.btree[i], buf, ret, error_info);
-                goto cleanup;
-            }
-        }
-
-        ret = update_view_btree(kv_records_files[i],
-                                &info->view_infos.btree[i],
-                                &index_file,
-                                header->view_states[i],
-                                batch_size,
-                                &purge_ctx,
-                                &stats->kvs_inserted,
-                                &stats->kvs_removed,
-                                &view_roots[i],
-                                error_info);
-
-        if (ret != COUCHSTORE_SUCCESS) {
-            goto cleanup;
+        if (*state != jobs[i].new_root) {
+            free(*state);
         }
+        *state = jobs[i].new_root;
+        jobs[i].new_root = NULL;
 
-        if (header->view_states[i] != view_roots[i]) {
-            free(header->view_states[i]);
+        if (i == 0) {
+            stats->ids_inserted += jobs[i].inserted;
+            stats->ids_removed += jobs[i].removed;
+            view_id_bitmask(*state, &bm_cleanup);
+        } else {
+            stats->kvs_inserted += jobs[i].inserted;
+            stats->kvs_removed += jobs[i].removed;
+            view_bitmask(*state, &bm_cleanup);
         }
-
-        header->view_states[i] = view_roots[i];
-        view_bitmask(view_roots[i], &bm_cleanup);
-        view_roots[i] = NULL;
+        purge_ctx.count += jobs[i].purge_ctx.count;
     }
 
     /* Set resulting cleanup bitmask */
@@ -1569,20 +1796,83 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
     ret = COUCHSTORE_SUCCESS;
 
 cleanup:
-    free_index_header(header);
     close_view_group_file(info);
     tree_file_close(&index_file);
-    free(id_root);
-    if (view_roots != NULL) {
-        for (i = 0; i < info->num_btrees; ++i) {
-            free(view_roots[i]);
+    if (jobs != NULL) {
+        for (i = 0; i < num_jobs; ++i) {
+            /* An unchanged btree keeps the root it had in the header */
+            if (jobs[i].new_root != jobs[i].root) {
+                free(jobs[i].new_root);
+            }
+            free((void *) jobs[i].error_info.view_name);
+            free((void *) jobs[i].error_info.error_msg);
         }
-        free(view_roots);
+        free(jobs);
     }
+    free_index_header(header);
 
     return ret;
 }
 
+
+static couchstore_error_t run_update_job(void *arg)
+{
+    view_update_job_t *job = (view_update_job_t *) arg;
+    const view_group_info_t *info = job->info;
+    char buf[1024];
+
+    if (job->view < 0) {
+        if (!job->is_sorted) {
+            job->ret = (couchstore_error_t) sort_view_ids_ops_file_ex(
+                                                job->source_file, job->tmp_dir,
+                                                job->sort_threads,
+                                                job->sort_budget);
+            if (job->ret != COUCHSTORE_SUCCESS) {
+                snprintf(buf, sizeof(buf),
+                        "Error sorting records file: %s", job->source_file);
+                job->error_info.error_msg = strdup(buf);
+                job->error_info.view_name = (const char *) strdup("id_btree");
+                return job->ret;
+            }
+        }
+
+        job->ret = update_id_btree(job->source_file, job->dest_file,
+                                                     job->root,
+                                                     job->batch_size,
+                                                     &job->purge_ctx,
+                                                     &job->inserted,
+                                                     &job->removed,
+                                                     &job->new_root);
+    } else {
+        if (!job->is_sorted) {
+            job->ret = (couchstore_error_t) sort_view_kvs_ops_file_ex(
+                                                job->source_file, job->tmp_dir,
+                                                job->sort_threads,
+                                                job->sort_budget);
+            if (job->ret != COUCHSTORE_SUCCESS) {
+                snprintf(buf, sizeof(buf),
+                        "Error sorting records file: %s", job->source_file);
+                set_error_info(&info->view_infos.btree[job->view], buf,
+                               job->ret, &job->error_info);
+                return job->ret;
+            }
+        }
+
+        job->ret = update_view_btree(job->source_file,
+                                     &info->view_infos.btree[job->view],
+                                     job->dest_file,
+                                     job->root,
+                                     job->batch_size,
+                                     &job->purge_ctx,
+                                     &job->inserted,
+                                     &job->removed,
+                                     &job->new_root,
+                                     &job->error_info);
+    }
+
+    return job->ret;
+}
+
 /* Add the kv pair to modify result */
 static couchstore_error_t compact_view_fetchcb(couchfile_lookup_request *rq,
                                         const sized_buf *k,
@@ -1954,10 +2244,29 @@ static file_merger_error_t build_spatial_record_callback(void *buf, void *ctx)
 }
 
 
+/* For an initial spatial build in STR order, every tile is a leaf node */
+static int build_spatial_end_tile(void *ctx)
+{
+    couchstore_error_t ret;
+    view_file_merge_ctx_t *merge_ctx = (view_file_merge_ctx_t *) ctx;
+    view_spatial_builder_ctx_t *build_ctx =
+            (view_spatial_builder_ctx_t *) merge_ctx->user_ctx;
+
+    ret = spatial_flush_items(build_ctx->modify_result);
+    if (ret == COUCHSTORE_SUCCESS) {
+        arena_free_all(build_ctx->transient_arena);
+    }
+
+    return ret;
+}
+
+
 static couchstore_error_t build_view_spatial(const char *source_file,
                                              const view_spatial_info_t *info,
                                              tree_file *dest_file,
                                              const char *tmpdir,
+                                             unsigned sort_threads,
+                                             size_t sort_budget,
                                              node_pointer **out_root,
                                              view_error_t *error_info)
 {
@@ -1979,7 +2288,9 @@ static couchstore_error_t build_view_spatial(const char *source_file,
                         info->dimension,
                         info->mbb,
                         tmpdir,
-                        sort_spatial_kvs_file,
+                        info->load,
+                        sort_threads,
+                        sort_budget,
                         out_root);
 
     if (ret != COUCHSTORE_SUCCESS) {
@@ -2002,7 +2313,9 @@ static couchstore_error_t build_spatial(const char *source_file,
                                         const uint16_t dimension,
                                         const double *mbb,
                                         const char *tmpdir,
-                                        sort_record_fn sort_fun,
+                                        view_spatial_load_t load,
+                                        unsigned sort_threads,
+                                        size_t sort_budget,
                                         node_pointer **out_root)
 {
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
@@ -2035,14 +2348,33 @@ static couchstore_error_t build_spatial(const char *source_file,
 
     build_ctx.transient_arena = transient_arena;
     build_ctx.modify_result = mr;
-    build_ctx.scale_factor = spatial_scale_factor(mbb, dimension,
-                                                  ZCODE_MAX_VALUE);
-
-    ret = (couchstore_error_t) sort_fun(source_file,
-                                        tmpdir,
-                                        build_spatial_record_callback,
-                                        &build_ctx);
-    free_spatial_scale_factor(build_ctx.scale_factor);
+    build_ctx.scale_factor = NULL;
+
+    if (load == VIEW_SPATIAL_LOAD_ZORDER) {
+        /* Only the Z-order comparison scales the keys */
+        build_ctx.scale_factor = spatial_scale_factor(mbb, dimension,
+                                                      ZCODE_MAX_VALUE);
+        ret = (couchstore_error_t) sort_spatial_kvs_file_ex(
+            source_file,
+            tmpdir,
+            build_spatial_record_callback,
+            &build_ctx,
+            sort_threads,
+            sort_budget);
+        free_spatial_scale_factor(build_ctx.scale_factor);
+    } else {
+        /* A tile fills a leaf as much as the partial flushes of
+         * spatial_push_item() do */
+        ret = (couchstore_error_t) sort_spatial_kvs_file_str(
+            source_file,
+            tmpdir,
+            mr->rq->kv_chunk_threshold * 2 / 3,
+            build_spatial_record_callback,
+            build_spatial_end_tile,
+            &build_ctx,
+            sort_threads,
+            sort_budget);
+    }
     if (ret != COUCHSTORE_SUCCESS) {
         goto out;
     }
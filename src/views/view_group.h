@@ -49,11 +49,21 @@ extern "C" {
         const char  **reducers;
     } view_btree_info_t;
 
+    /* How the initial build of a spatial view loads the records into the
+     * r-tree */
+    typedef enum {
+        /* Sort-Tile-Recursive, every leaf node is a tile of its own */
+        VIEW_SPATIAL_LOAD_STR,
+        /* In Z-order of the centers of the records' MBBs */
+        VIEW_SPATIAL_LOAD_ZORDER
+    } view_spatial_load_t;
+
     typedef struct {
         /* Number of dimensions the multidimensional bounding box (MBB) has */
-        uint16_t  dimension;
+        uint16_t             dimension;
         /* The MBB that enclosed the whole spatial view*/
-        double   *mbb;
+        double              *mbb;
+        view_spatial_load_t  load;
     } view_spatial_info_t;
 
     typedef union {
@@ -108,6 +118,10 @@ extern "C" {
                                                uint64_t *pos,
                                                const index_header_t *header);
 
+    /* Builds and updates the B-trees of view groups on up to num_threads
+       threads at once, or on up to one per available CPU if 0. */
+    void view_group_set_job_threads(int num_threads);
+
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
                                                      uint64_t *header_pos,
@@ -59,6 +59,17 @@ class ChangeCountTest(unittest.TestCase):
         self.assertEqual(self.db.changesCount(50, 108), 58)
         self.assertEqual(self.db.changesCount(50, 109), 59)
 
+    def testMulti(self):
+        self.bulkSet("foo", 1000)
+        self.bulkSet("foo", 500)
+        ranges = [(0, 2000), (1, 500), (501, 1000), (1001, 1500),
+                  (1200, 1300), (750, 1250), (1300, 1200), (1400, 9999)]
+        self.assertEqual(self.db.changesCountMulti(ranges),
+                         [self.db.changesCount(lo, hi) for lo, hi in ranges])
+        self.assertEqual(self.db.changesCountMulti(ranges[:4]),
+                         [1000, 0, 500, 500])
+        self.assertEqual(self.db.changesCountMulti([]), [])
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -24,6 +24,8 @@
 #include <string.h>
 #include "macros.h"
 #include "../src/file_sorter.h"
+#include "../src/radix_sort.h"
+#include "../src/buffered_file.h"
 #include "file_tests.h"
 
 #define UNSORTED_FILE_PATH "unsorted_file.data"
@@ -158,6 +160,32 @@ static int read_record(FILE *f, void **buffer, void *ctx)
     return sizeof(int);
 }
 
+static int read_record_arena(FILE *f, void **buffer, arena *a, void *ctx)
+{
+    int *rec = (int *) arena_alloc(a, sizeof(int));
+    (void) ctx;
+
+    if (rec == NULL) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+
+    if (fread(rec, sizeof(int), 1, f) != 1) {
+        if (feof(f)) {
+            return 0;
+        } else {
+            return FILE_MERGER_ERROR_FILE_READ;
+        }
+    }
+
+    *buffer = rec;
+
+    return sizeof(int);
+}
+
+/* Records written out, by runs and merges alike */
+static unsigned long num_writes;
+static cb_mutex_t num_writes_mutex;
+
 static file_merger_error_t write_record(FILE *f, void *buffer, void *ctx)
 {
     (void) ctx;
@@ -166,6 +194,10 @@ static file_merger_error_t write_record(FILE *f, void *buffer, void *ctx)
         return FILE_MERGER_ERROR_FILE_WRITE;
     }
 
+    cb_mutex_enter(&num_writes_mutex);
+    num_writes++;
+    cb_mutex_exit(&num_writes_mutex);
+
     return FILE_MERGER_SUCCESS;
 }
 
@@ -176,6 +208,14 @@ static int compare_records(const void *rec1, const void *rec2, void *ctx)
     return *((const int *) rec1) - *((const int *) rec2);
 }
 
+/* Drops the low bits so that many records share a prefix */
+static uint64_t record_prefix(const void *rec, void *ctx)
+{
+    (void) ctx;
+
+    return ((uint64_t) *((const int *) rec) + 0x80000000u) >> 4;
+}
+
 static void free_record(void *rec, void *ctx)
 {
    (void) ctx;
@@ -239,26 +279,37 @@ static file_merger_error_t check_sorted_callback(void *buf, void *ctx)
     return FILE_MERGER_SUCCESS;
 }
 
-static void test_file_sort(unsigned buffer_size,
-                           unsigned temp_files,
-                           file_merger_feed_record_t callback,
-                           int skip_writeback)
+static void test_file_sort_ex(unsigned buffer_size,
+                              unsigned temp_files,
+                              unsigned num_threads,
+                              size_t memory_budget,
+                              int use_arena,
+                              int use_prefix,
+                              int tmp_file_flags,
+                              file_merger_feed_record_t callback,
+                              int skip_writeback)
 {
     file_sorter_error_t ret;
     int i = 0;
     create_file();
 
-    ret = sort_file(UNSORTED_FILE_PATH,
-                    SORT_TMP_DIR,
-                    temp_files,
-                    buffer_size,
-                    read_record,
-                    write_record,
-                    callback,
-                    compare_records,
-                    free_record,
-                    skip_writeback,
-                    &i);
+    ret = sort_file_ex(UNSORTED_FILE_PATH,
+                       SORT_TMP_DIR,
+                       temp_files,
+                       buffer_size,
+                       num_threads,
+                       memory_budget,
+                       read_record,
+                       use_arena ? read_record_arena : NULL,
+                       write_record,
+                       callback,
+                       compare_records,
+                       use_prefix ? record_prefix : NULL,
+                       NULL,
+                       free_record,
+                       tmp_file_flags,
+                       skip_writeback,
+                       &i);
 
     assert(ret == FILE_SORTER_SUCCESS);
 
@@ -272,6 +323,157 @@ static void test_file_sort(unsigned buffer_size,
 }
 
 
+static void test_file_sort(unsigned buffer_size,
+                           unsigned temp_files,
+                           file_merger_feed_record_t callback,
+                           int skip_writeback)
+{
+    test_file_sort_ex(buffer_size, temp_files, 0, 0, 0, 0, 0, callback,
+                      skip_writeback);
+}
+
+
+/*
+ * Sorts with many more runs than temporary files on as many threads as
+ * there can be merges at once, and returns how many times every record was
+ * written out on average. The final merge only feeds the records.
+ */
+static double test_file_sort_passes(unsigned buffer_size,
+                                    unsigned temp_files,
+                                    unsigned num_threads)
+{
+    unsigned long nrecords = (unsigned long) (sizeof(data) / sizeof(int));
+
+    num_writes = 0;
+    test_file_sort_ex(buffer_size, temp_files, num_threads,
+                      (size_t) buffer_size * (num_threads + 1), 0, 0, 0,
+                      check_sorted_callback, 1);
+
+    return (double) num_writes / nrecords;
+}
+
+
+static int key_cmp(const sized_buf *k1, const sized_buf *k2)
+{
+    size_t size = k1->size < k2->size ? k1->size : k2->size;
+    int cmp = memcmp(k1->buf, k2->buf, size);
+
+    if (cmp == 0) {
+        return (int) k1->size - (int) k2->size;
+    }
+    return cmp;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return key_cmp(&((const radix_sort_entry_t *) a)->key,
+                   &((const radix_sort_entry_t *) b)->key);
+}
+
+/* Radix sorts keys made of few distinct bytes, so that many of them share
+ * long prefixes or are prefixes of one another, and checks the result
+ * against qsort with the same byte order as ebin_cmp. */
+static void test_radix_sort(size_t n, unsigned max_len)
+{
+    radix_sort_entry_t *entries, *expected;
+    char *keys;
+    size_t i;
+    unsigned j;
+
+    entries = (radix_sort_entry_t *) malloc(n * sizeof(radix_sort_entry_t));
+    expected = (radix_sort_entry_t *) malloc(n * sizeof(radix_sort_entry_t));
+    keys = (char *) malloc(n * max_len);
+    assert(entries != NULL && expected != NULL && keys != NULL);
+
+    srand(n);
+    for (i = 0; i < n; ++i) {
+        entries[i].key.buf = keys + i * max_len;
+        entries[i].key.size = rand() % (max_len + 1);
+        for (j = 0; j < entries[i].key.size; ++j) {
+            /* 0x00 and 0xff check the bytes are taken as unsigned */
+            static const char alphabet[] = { 0x00, 'a', 'b', (char) 0xff };
+            entries[i].key.buf[j] = alphabet[rand() % 4];
+        }
+        entries[i].record = entries[i].key.buf;
+    }
+    memcpy(expected, entries, n * sizeof(radix_sort_entry_t));
+
+    assert(radix_sort(entries, n) == 0);
+    qsort(expected, n, sizeof(radix_sort_entry_t), entry_cmp);
+
+    for (i = 0; i < n; ++i) {
+        assert(key_cmp(&entries[i].key, &expected[i].key) == 0);
+        /* Each record still goes with its key */
+        assert(entries[i].record == entries[i].key.buf);
+    }
+
+    free(entries);
+    free(expected);
+    free(keys);
+}
+
+
+/* Writes enough to a file to span several buffers (and compressed blocks),
+ * then reads it back after a rewind, after rewriting it, and after appending
+ * a second stream to it. */
+static void test_buffered_file(int flags)
+{
+    const char *path = SORT_TMP_DIR "/buffered_file_test";
+    const size_t buffer_size = 8192;
+    const unsigned n = 100000;
+    unsigned i, v;
+    FILE *f;
+
+    remove(path);
+    f = buffered_fopen(path, "w+b", buffer_size, flags);
+    assert(f != NULL);
+    for (i = 0; i < n; ++i) {
+        assert(fwrite(&i, sizeof(i), 1, f) == 1);
+    }
+    assert(ftell(f) == (long) (n * sizeof(i)));
+    rewind(f);
+    for (i = 0; i < n; ++i) {
+        assert(fread(&v, sizeof(v), 1, f) == 1);
+        assert(v == i);
+    }
+    assert(fread(&v, sizeof(v), 1, f) != 1 && feof(f));
+
+    /* Writing after a rewind replaces the contents */
+    rewind(f);
+    for (i = 0; i < n / 2; ++i) {
+        v = n - i;
+        assert(fwrite(&v, sizeof(v), 1, f) == 1);
+    }
+    rewind(f);
+    for (i = 0; i < n / 2; ++i) {
+        assert(fread(&v, sizeof(v), 1, f) == 1);
+        assert(v == n - i);
+    }
+    assert(fread(&v, sizeof(v), 1, f) != 1 && feof(f));
+    assert(fclose(f) == 0);
+
+    f = buffered_fopen(path, "ab", buffer_size, flags);
+    assert(f != NULL);
+    assert(ftell(f) != 0);
+    for (i = n / 2; i < n; ++i) {
+        v = n - i;
+        assert(fwrite(&v, sizeof(v), 1, f) == 1);
+    }
+    assert(fclose(f) == 0);
+
+    f = buffered_fopen(path, "rb", buffer_size, flags);
+    assert(f != NULL);
+    for (i = 0; i < n; ++i) {
+        assert(fread(&v, sizeof(v), 1, f) == 1);
+        assert(v == n - i);
+    }
+    assert(fread(&v, sizeof(v), 1, f) != 1 && feof(f));
+    fclose(f);
+
+    remove(path);
+}
+
+
 static int int_cmp(const void *a, const void *b)
 {
     return *((const int *) a) - *((const int *) b);
@@ -296,6 +498,9 @@ void file_sorter_tests(void)
 
     unsigned i, j;
     unsigned long nrecords = (unsigned long) (sizeof(data) / sizeof(int));
+    double passes, parallel_passes;
+
+    cb_mutex_initialize(&num_writes_mutex);
 
     fprintf(stderr, "Running file sorter tests...\n");
 
@@ -339,5 +544,79 @@ void file_sorter_tests(void)
             nrecords, sizeof(int) * 50, 10);
     test_file_sort(sizeof(int) * 50, 10, check_sorted_callback, 1);
 
+    for (i = 1; i <= 8; i *= 2) {
+        fprintf(stderr,
+                "Testing file sort callback (%lu records) with %u threads,"
+                " memory budget of %lu bytes and %u temporary files\n",
+                nrecords, i, sizeof(int) * 64 * (i + 1), 16);
+        test_file_sort_ex(sizeof(int) * 1000000, 16, i, sizeof(int) * 64 * (i + 1),
+                          0, 0, 0, check_sorted_callback, 1);
+    }
+
+    fprintf(stderr,
+            "Testing file sort merge passes (%lu records) with %u threads,"
+            " buffer size of %lu bytes and %u temporary files\n",
+            nrecords, 15, sizeof(int) * 16, 16);
+    passes = test_file_sort_passes(sizeof(int) * 16, 16, 1);
+    parallel_passes = test_file_sort_passes(sizeof(int) * 16, 16, 15);
+    /* Concurrent merges may cost one extra pass, not one per split. */
+    assert(parallel_passes <= passes + 1.0);
+
+    for (i = 0; i < (sizeof(buffer_sizes) / sizeof(unsigned)); ++i) {
+        fprintf(stderr,
+                "Testing file sort with record arenas (%lu records) with"
+                " buffer size of %u bytes and %u temporary files\n",
+                nrecords, buffer_sizes[i], 4);
+        test_file_sort_ex(buffer_sizes[i], 4, 0, 0, 1, 0, 0, NULL, 0);
+    }
+
+    fprintf(stderr,
+            "Testing file sort callback with record arenas (%lu records)"
+            " with %u threads, memory budget of %lu bytes and %u temporary"
+            " files\n",
+            nrecords, 4, sizeof(int) * 64 * 5, 16);
+    test_file_sort_ex(sizeof(int) * 1000000, 16, 4, sizeof(int) * 64 * 5,
+                      1, 0, 0, check_sorted_callback, 1);
+
+    for (i = 0; i < (sizeof(buffer_sizes) / sizeof(unsigned)); ++i) {
+        fprintf(stderr,
+                "Testing file sort with key prefixes (%lu records) with"
+                " buffer size of %u bytes and %u temporary files\n",
+                nrecords, buffer_sizes[i], 4);
+        test_file_sort_ex(buffer_sizes[i], 4, 0, 0, i % 2, 1, 0, NULL, 0);
+    }
+
+    for (i = 0; i < (sizeof(buffer_sizes) / sizeof(unsigned)); ++i) {
+        fprintf(stderr,
+                "Testing file sort with compressed temporary files (%lu records)"
+                " with buffer size of %u bytes and %u temporary files\n",
+                nrecords, buffer_sizes[i], 4);
+        test_file_sort_ex(buffer_sizes[i], 4, 0, 0, 0, 0,
+                          BUFFERED_FILE_COMPRESSED, NULL, 0);
+        test_file_sort_ex(buffer_sizes[i], 4, 0, 0, 0, 0,
+                          BUFFERED_FILE_COMPRESSED, check_sorted_callback, 1);
+    }
+
+    fprintf(stderr,
+            "Testing file sort with direct I/O on temporary files (%lu records)"
+            " with buffer size of %u bytes and %u temporary files\n",
+            nrecords, buffer_sizes[0], 4);
+    test_file_sort_ex(buffer_sizes[0], 4, 0, 0, 0, 0,
+                      BUFFERED_FILE_COMPRESSED | BUFFERED_FILE_DIRECT, NULL, 0);
+
+    fprintf(stderr, "Testing buffered files\n");
+    test_buffered_file(0);
+    test_buffered_file(BUFFERED_FILE_READAHEAD);
+    test_buffered_file(BUFFERED_FILE_COMPRESSED);
+    test_buffered_file(BUFFERED_FILE_COMPRESSED | BUFFERED_FILE_READAHEAD);
+    test_buffered_file(BUFFERED_FILE_DIRECT | BUFFERED_FILE_READAHEAD);
+
+    fprintf(stderr, "Testing radix sort of byte keys\n");
+    test_radix_sort(0, 4);
+    test_radix_sort(20, 4);
+    test_radix_sort(5000, 6);
+    test_radix_sort(20000, 40);
+
+    cb_mutex_destroy(&num_writes_mutex);
     fprintf(stderr, "File sorter tests passed\n\n");
 }
@@ -19,6 +19,7 @@
  **/
 
 #include "mapreduce_tests.h"
+#include "../../src/views/mapreduce/mapreduce_testing.h"
 #include <string.h>
 
 #if __STDC_VERSION__ >=199901L
@@ -487,23 +488,433 @@ static void test_timeout(void)
     mapreduce_free_context(context);
 }
 
-void map_tests(void)
+#define NUM_POOL_DOCS 500
+
+/* docs {"value": i} with metas {"id":"doc<i>"}, except metas[50], which is
+   not a JSON object */
+static void make_docs(mapreduce_json_t *docs, mapreduce_json_t *metas, int num)
+{
+    int i;
+
+    for (i = 0; i < num; ++i) {
+        docs[i].json = (char *) malloc(32);
+        metas[i].json = (char *) malloc(32);
+        assert(docs[i].json != NULL);
+        assert(metas[i].json != NULL);
+        docs[i].length = sprintf(docs[i].json, "{\"value\": %d}", i);
+        metas[i].length = sprintf(metas[i].json, "{\"id\":\"doc%d\"}", i);
+    }
+    if (num > 50) {
+        metas[50].length = sprintf(metas[50].json, "\"doc50\"");
+    }
+}
+
+static void free_docs(mapreduce_json_t *docs, mapreduce_json_t *metas, int num)
+{
+    int i;
+
+    for (i = 0; i < num; ++i) {
+        free(docs[i].json);
+        free(metas[i].json);
+    }
+}
+
+/* checks the results of mapping make_docs() document i with the functions
+   of test_map_pool() */
+static void check_doc_results(int i,
+                              mapreduce_error_t error,
+                              const mapreduce_map_result_list_t *results)
+{
+    char expected[32];
+    int expected_len;
+
+    if (i == 50) {
+        assert(error == MAPREDUCE_INVALID_ARG);
+        return;
+    }
+    assert(error == MAPREDUCE_SUCCESS);
+    assert(results != NULL);
+    assert(results->length == 2);
+
+    if (i % 7 == 0) {
+        assert(results->list[0].error == MAPREDUCE_RUNTIME_ERROR);
+        assert(strcmp("foobar", results->list[0].result.error_msg) == 0);
+    } else {
+        assert(results->list[0].error == MAPREDUCE_SUCCESS);
+        assert(results->list[0].result.kvs.length == 1);
+        expected_len = sprintf(expected, "\"doc%d\"", i);
+        assert(results->list[0].result.kvs.kvs[0].key.length == expected_len);
+        assert(memcmp(results->list[0].result.kvs.kvs[0].key.json,
+                      expected, expected_len) == 0);
+    }
+
+    assert(results->list[1].error == MAPREDUCE_SUCCESS);
+    assert(results->list[1].result.kvs.length == 1);
+    expected_len = sprintf(expected, "%d", i);
+    assert(results->list[1].result.kvs.kvs[0].key.length == expected_len);
+    assert(memcmp(results->list[1].result.kvs.kvs[0].key.json,
+                  expected, expected_len) == 0);
+}
+
+static void test_map_pool(void)
+{
+    void *pool = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) {\n"
+        "  if (doc.value % 7 == 0) { throw('foobar'); } else { emit(meta.id, doc.value); }\n"
+        "}\n",
+        "function(doc, meta) { emit(doc.value, null); }"
+    };
+    mapreduce_json_t docs[NUM_POOL_DOCS];
+    mapreduce_json_t metas[NUM_POOL_DOCS];
+    mapreduce_map_result_list_t *results[NUM_POOL_DOCS];
+    mapreduce_error_t errors[NUM_POOL_DOCS];
+    int i;
+
+    ret = mapreduce_start_map_pool(functions, 2, 4, &pool, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(pool != NULL);
+
+    make_docs(docs, metas, NUM_POOL_DOCS);
+    ret = mapreduce_pool_map(pool, docs, metas, NUM_POOL_DOCS, results, errors);
+    assert(ret == MAPREDUCE_SUCCESS);
+
+    for (i = 0; i < NUM_POOL_DOCS; ++i) {
+        check_doc_results(i, errors[i], results[i]);
+        if (i == 50) {
+            assert(results[i] == NULL);
+        }
+        mapreduce_free_map_result_list(results[i]);
+    }
+
+    free_docs(docs, metas, NUM_POOL_DOCS);
+    mapreduce_free_map_pool(pool);
+}
+
+static void test_map_batch(void)
+{
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) {\n"
+        "  if (doc.value % 7 == 0) { throw('foobar'); } else { emit(meta.id, doc.value); }\n"
+        "}\n",
+        "function(doc, meta) { emit(doc.value, null); }"
+    };
+    mapreduce_json_t docs[NUM_POOL_DOCS];
+    mapreduce_json_t metas[NUM_POOL_DOCS];
+    mapreduce_map_batch_result_t *result = NULL;
+    int i;
+
+    ret = mapreduce_start_map_context(functions, 2, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(context != NULL);
+
+    make_docs(docs, metas, NUM_POOL_DOCS);
+
+    ret = mapreduce_map_batch(context, docs, metas, NUM_POOL_DOCS, &result);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(result != NULL);
+    assert(result->length == NUM_POOL_DOCS);
+    for (i = 0; i < NUM_POOL_DOCS; ++i) {
+        check_doc_results(i, result->errors[i], &result->results[i]);
+    }
+
+    /* the result of the previous batch is reused */
+    ret = mapreduce_map_batch(context, docs + 40, metas + 40, 20, &result);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(result->length == 20);
+    for (i = 0; i < 20; ++i) {
+        check_doc_results(40 + i, result->errors[i], &result->results[i]);
+    }
+
+    mapreduce_free_map_batch_result(result);
+    free_docs(docs, metas, NUM_POOL_DOCS);
+    mapreduce_free_context(context);
+}
+
+
+static void test_map_batch_timeout(void)
+{
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) {"
+        "  if (doc.value === 1) {"
+        "    while (true) { };"
+        "  } else {"
+        "    emit(meta.id, doc.value);"
+        "  }"
+        "}"
+    };
+    const mapreduce_json_t docs[] = { doc1, doc2, doc1, doc3 };
+    const mapreduce_json_t metas[] = { meta1, meta2, meta1, meta3 };
+    mapreduce_map_batch_result_t *result = NULL;
+
+    ret = mapreduce_start_map_context(functions, 1, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(context != NULL);
+
+    /* documents after one that times out are still mapped */
+    ret = mapreduce_map_batch(context, docs, metas, 4, &result);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(result->length == 4);
+    assert(result->errors[0] == MAPREDUCE_TIMEOUT);
+    assert(result->errors[1] == MAPREDUCE_SUCCESS);
+    assert(result->errors[2] == MAPREDUCE_TIMEOUT);
+    assert(result->errors[3] == MAPREDUCE_SUCCESS);
+
+    assert(result->results[1].length == 1);
+    assert(result->results[1].list[0].error == MAPREDUCE_SUCCESS);
+    assert(result->results[1].list[0].result.kvs.length == 1);
+    assert(memcmp(result->results[1].list[0].result.kvs.kvs[0].key.json,
+                  "\"doc2\"",
+                  (sizeof("\"doc2\"") - 1)) == 0);
+    assert(result->results[3].length == 1);
+    assert(memcmp(result->results[3].list[0].result.kvs.kvs[0].key.json,
+                  "\"doc3\"",
+                  (sizeof("\"doc3\"") - 1)) == 0);
+
+    mapreduce_free_map_batch_result(result);
+    mapreduce_free_context(context);
+}
+
+static void assert_same_map_results(const mapreduce_map_result_list_t *a,
+                                    const mapreduce_map_result_list_t *b)
 {
+    int i, j;
+
+    assert(a->length == b->length);
+    for (i = 0; i < a->length; ++i) {
+        const mapreduce_map_result_t *x = &a->list[i];
+        const mapreduce_map_result_t *y = &b->list[i];
+
+        assert(x->error == y->error);
+        if (x->error != MAPREDUCE_SUCCESS) {
+            assert(strcmp(x->result.error_msg, y->result.error_msg) == 0);
+            continue;
+        }
+        assert(x->result.kvs.length == y->result.kvs.length);
+        for (j = 0; j < x->result.kvs.length; ++j) {
+            const mapreduce_kv_t *p = &x->result.kvs.kvs[j];
+            const mapreduce_kv_t *q = &y->result.kvs.kvs[j];
+
+            assert(p->key.length == q->key.length);
+            assert(memcmp(p->key.json, q->key.json, p->key.length) == 0);
+            assert(p->value.length == q->value.length);
+            assert(memcmp(p->value.json, q->value.json, p->value.length) == 0);
+        }
+    }
+}
+
+
+static void test_native_map(void)
+{
+    void *native_context = NULL;
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret, native_ret;
+    int64_t mapped;
+    mapreduce_map_result_list_t *v8_result = NULL;
+    mapreduce_json_t v8_doc;
+    mapreduce_json_t v8_meta;
+    const char *functions[] = {
+        "function(doc, meta) { if (doc.type == \"user\") emit(doc.name, null); }",
+        "function(doc, meta) {\n"
+        "  if (meta.type === \"json\" && doc.age != 30) {\n"
+        "    emit(doc.age, meta.id);\n"
+        "  } else if (!doc.name) {\n"
+        "    emit(doc.address.city);\n"
+        "  }\n"
+        "}",
+        "function(doc) { emit(doc[\"type\"], doc.tags); }"
+    };
+    /* Calls a method, which the recognizer has to leave to V8 */
+    const char *v8_functions[] = {
+        "function(doc, meta) { emit(doc.name.toUpperCase(), null); }"
+    };
+    const char *docs[] = {
+        "{\"type\":\"user\",\"name\":\"joe\",\"age\":30}",
+        "{\"type\":\"user\",\"name\":\"j\\u00f6e\",\"age\":31.5}",
+        "{\"type\":\"admin\",\"age\":1e2,\"address\":{\"city\":\"Porto\"}}",
+        "{\"type\":\"user\",\"type\":\"other\",\"age\":30,\"address\":{}}",
+        "{\"name\":\"\",\"age\":30,\"address\":\"nowhere\"}",
+        " {\"type\" : \"user\", \"name\": \"ann\", \"tags\": [1, 2]}\n",
+        "{\"type\":\"user\",",
+        "[1,2,3]"
+    };
     int i;
 
+    mapreduce_set_native_maps(1);
+    ret = mapreduce_start_map_context(functions, 3, &native_context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(mapreduce_native_mapped_docs(native_context) == 0);
+
+    /* V8 is the reference, the results must be the same without it */
+    mapreduce_set_native_maps(0);
+    ret = mapreduce_start_map_context(functions, 3, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(mapreduce_native_mapped_docs(context) == -1);
+    mapreduce_set_native_maps(1);
+
+    for (i = 0; i < (int) (sizeof(docs) / sizeof(docs[0])); ++i) {
+        mapreduce_map_result_list_t *native_result = NULL;
+        mapreduce_map_result_list_t *result = NULL;
+        mapreduce_json_t doc;
+        mapreduce_json_t meta;
+        char meta_json[64];
+
+        doc.json = (char *) docs[i];
+        doc.length = (int) strlen(docs[i]);
+        meta.json = meta_json;
+        meta.length = sprintf(meta_json, "{\"id\":\"doc%d\",\"type\":\"json\"}", i);
+
+        mapped = mapreduce_native_mapped_docs(native_context);
+        native_ret = mapreduce_map(native_context, &doc, &meta, &native_result);
+        ret = mapreduce_map(context, &doc, &meta, &result);
+        assert(native_ret == ret);
+        /* Plain documents don't need V8 */
+        if (i == 0 || i == 3) {
+            assert(mapreduce_native_mapped_docs(native_context) == mapped + 1);
+        }
+        if (ret != MAPREDUCE_SUCCESS) {
+            continue;
+        }
+        assert_same_map_results(native_result, result);
+
+        if (i == 0) {
+            assert(native_result->list[0].result.kvs.length == 1);
+            assert(native_result->list[0].result.kvs.kvs[0].key.length == 5);
+            assert(memcmp(native_result->list[0].result.kvs.kvs[0].key.json,
+                          "\"joe\"", 5) == 0);
+            assert(native_result->list[0].result.kvs.kvs[0].value.length == 4);
+            assert(memcmp(native_result->list[0].result.kvs.kvs[0].value.json,
+                          "null", 4) == 0);
+            assert(native_result->list[1].result.kvs.length == 0);
+        }
+
+        mapreduce_free_map_result_list(native_result);
+        mapreduce_free_map_result_list(result);
+    }
+
+    mapreduce_free_context(native_context);
+    mapreduce_free_context(context);
+
+    /* One function the recognizer rejects and every document goes to V8 */
+    ret = mapreduce_start_map_context(v8_functions, 1, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(mapreduce_native_mapped_docs(context) == -1);
+    v8_doc.json = (char *) docs[0];
+    v8_doc.length = (int) strlen(docs[0]);
+    v8_meta.json = (char *) "{\"id\":\"doc0\"}";
+    v8_meta.length = (int) strlen(v8_meta.json);
+    ret = mapreduce_map(context, &v8_doc, &v8_meta, &v8_result);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(v8_result->list[0].result.kvs.length == 1);
+    assert(v8_result->list[0].result.kvs.kvs[0].key.length == 5);
+    assert(memcmp(v8_result->list[0].result.kvs.kvs[0].key.json,
+                  "\"JOE\"", 5) == 0);
+    mapreduce_free_map_result_list(v8_result);
+    mapreduce_free_context(context);
+}
+
+static void test_map_group(void)
+{
+    void *group = NULL;
+    void *contexts[2] = { NULL, NULL };
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) { emit(meta.id, doc.value); }",
+        "function(doc, meta) {\n"
+        "  if (doc.value % 2 == 0) { throw('even'); } else { emit(doc.value, null); }\n"
+        "}\n",
+        "function(doc, meta) { emit([doc.value, meta.id], doc); }"
+    };
+    const int group_sizes[] = { 2, 1 };
+    const mapreduce_json_t docs[] = { doc1, doc2, doc3 };
+    const mapreduce_json_t metas[] = { meta1, meta2, meta3 };
+    const mapreduce_json_t bad_meta = {
+        ASSIGN(.json) "\"doc4\"",
+        ASSIGN(.length) sizeof("\"doc4\"") - 1
+    };
+    mapreduce_map_result_list_t *results[2];
+    int i, g;
+
+    ret = mapreduce_start_map_group(functions, group_sizes, 2, &group, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(group != NULL);
+
+    ret = mapreduce_start_map_context(functions, 2, &contexts[0], &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    ret = mapreduce_start_map_context(functions + 2, 1, &contexts[1], &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+
+    /* same results as with a context per group */
+    for (i = 0; i < 3; ++i) {
+        ret = mapreduce_map_group(group, &docs[i], &metas[i], results);
+        assert(ret == MAPREDUCE_SUCCESS);
+        for (g = 0; g < 2; ++g) {
+            mapreduce_map_result_list_t *result = NULL;
+
+            ret = mapreduce_map(contexts[g], &docs[i], &metas[i], &result);
+            assert(ret == MAPREDUCE_SUCCESS);
+            assert(results[g]->length == group_sizes[g]);
+            assert_same_map_results(results[g], result);
+            mapreduce_free_map_result_list(result);
+            mapreduce_free_map_result_list(results[g]);
+        }
+    }
+
+    ret = mapreduce_map_group(group, &doc1, &bad_meta, results);
+    assert(ret == MAPREDUCE_INVALID_ARG);
+    assert(results[0] == NULL);
+    assert(results[1] == NULL);
+
+    mapreduce_free_context(contexts[0]);
+    mapreduce_free_context(contexts[1]);
+    mapreduce_free_map_group(group);
+}
+
+void map_tests(void)
+{
+    int i, native;
+
     fprintf(stderr, "Running map tests\n");
 
     mapreduce_set_timeout(1);
     test_timeout();
 
-    for (i = 0; i < 100; ++i) {
-        test_bad_syntax_functions();
-        test_runtime_exception();
-        test_runtime_error();
-        test_map_no_emit();
-        test_map_single_emit();
-        test_map_multiple_emits();
+    /* Once with every document mapped by V8, once natively where possible */
+    for (native = 0; native < 2; ++native) {
+        mapreduce_set_native_maps(native);
+        for (i = 0; i < 100; ++i) {
+            test_bad_syntax_functions();
+            test_runtime_exception();
+            test_runtime_error();
+            test_map_no_emit();
+            test_map_single_emit();
+            test_map_multiple_emits();
+        }
+
+        test_map_pool();
+        test_map_batch();
+        test_map_batch_timeout();
     }
 
+    test_native_map();
+    test_map_group();
+
     test_timeout();
 }
@@ -1,6 +1,7 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 #include <libcouchstore/couch_db.h>
+#include "../src/arena.h"
 #include "../src/fatbuf.h"
 #include "../src/internal.h"
 #include "../src/node_types.h"
@@ -99,6 +100,76 @@ static void test_raw_48(uint64_t value, const uint8_t expected[8])
     assert(decode_raw48(data.raw) == value);
 }
 
+static void test_arena(void)
+{
+    arena *a, *b;
+    arena_stats stats;
+    const arena_position *mark;
+    size_t recycled;
+    void *p;
+    int i;
+
+    fprintf(stderr, "arena... ");
+    a = new_arena_ex(0, 256 * 1024);
+    assert(a != NULL);
+    arena_get_stats(a, &stats);
+    assert(stats.bytes_allocated == 0 && stats.chunks == 0);
+
+    for (i = 0; i < 1000; ++i) {
+        p = arena_alloc(a, 100);
+        assert(p != NULL);
+        memset(p, i, 100);
+    }
+    arena_get_stats(a, &stats);
+    assert(stats.bytes_allocated >= 100000);
+    assert(stats.peak_bytes_allocated == stats.bytes_allocated);
+    /* Chunks grow from 32KB, so 100KB fits in the first three (or fewer, if
+     * the pool handed out bigger ones) */
+    assert(stats.chunks >= 1 && stats.chunks <= 3);
+    assert(stats.chunk_bytes >= stats.bytes_allocated);
+
+    mark = arena_mark(a);
+    for (i = 0; i < 1000; ++i) {
+        assert(arena_alloc(a, 100) != NULL);
+    }
+    arena_free_from_mark(a, mark);
+    arena_get_stats(a, &stats);
+    assert(stats.bytes_allocated >= 100000 && stats.bytes_allocated < 200000);
+
+    /* Aligned blocks, also when they need a new chunk */
+    mark = arena_mark(a);
+    for (i = 0; i < 1000; ++i) {
+        assert(arena_alloc_unaligned(a, 1 + i % 7) != NULL);
+        p = arena_alloc_aligned(a, 100 + i * 10, ARENA_MALLOC_ALIGNMENT);
+        assert(p != NULL);
+        assert((size_t) p % ARENA_MALLOC_ALIGNMENT == 0);
+        memset(p, i, 100 + i * 10);
+    }
+    p = arena_alloc_aligned(a, 1024 * 1024, 4096);
+    assert(p != NULL && (size_t) p % 4096 == 0);
+    memset(p, 0, 1024 * 1024);
+    arena_free_from_mark(a, mark);
+    assert(stats.peak_bytes_allocated >= 200000);
+
+    arena_free_all(a);
+    arena_get_stats(a, &stats);
+    assert(stats.bytes_allocated == 0 && stats.chunks == 0 && stats.chunk_bytes == 0);
+    recycled = stats.chunks_recycled;
+
+    /* The freed chunks are reused, by this arena and by others */
+    assert(arena_alloc(a, 100) != NULL);
+    arena_get_stats(a, &stats);
+    assert(stats.chunks_recycled == recycled + 1);
+    b = new_arena(0);
+    assert(b != NULL);
+    assert(arena_alloc(b, 100) != NULL);
+    arena_get_stats(b, &stats);
+    assert(stats.chunks_added == 1 && stats.chunks_recycled == 1);
+
+    delete_arena(a);
+    delete_arena(b);
+}
+
 static void test_bitfield_fns(void)
 {
     uint8_t expected1[8] = {0x12, 0x34, 0x56, 0x78, 0x90};
@@ -468,6 +539,69 @@ cleanup:
     assert(errcode == 0);
 }
 
+static void test_arena_reads(void)
+{
+    Db *db;
+    Doc *docptrs[2];
+    DocInfo *nfoptrs[2];
+    couchstore_arena *arena;
+    DocInfo *info;
+    Doc *doc;
+    int errcode = 0;
+    int i, round;
+
+    fprintf(stderr, "arena reads... ");
+    fflush(stderr);
+    docset_init(2);
+    SETDOC(0, "doc1", "{\"test_doc_index\":1, \"val\":\"blah blah blah blah blah blah\"}", zerometa);
+    SETDOC(1, "doc2", "{\"test_doc_index\":2, \"val\":\"blah blah blah blah blah blah\"}", zerometa);
+    docptrs[0] = &testdocset.docs[0];
+    docptrs[1] = &testdocset.docs[1];
+    nfoptrs[0] = &testdocset.infos[0];
+    nfoptrs[1] = &testdocset.infos[1];
+    testdocset.infos[1].content_meta = COUCH_DOC_IS_COMPRESSED;
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, nfoptrs, 2,
+                                      COMPRESS_DOC_BODIES));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+
+    try(couchstore_open_db(testfilepath, 0, &db));
+    arena = couchstore_new_arena(0);
+    assert(arena != NULL);
+    /* A second round reuses the arena's memory */
+    for (round = 0; round < 2; ++round) {
+        for (i = 0; i < 2; ++i) {
+            Doc *expected = &testdocset.docs[i];
+            try(couchstore_docinfo_by_id_arena(db, expected->id.buf, expected->id.size,
+                                               arena, &info));
+            assert(info->id.size == expected->id.size);
+            assert(memcmp(info->id.buf, expected->id.buf, info->id.size) == 0);
+            assert(info->db_seq == (uint64_t) (i + 1));
+            assert((size_t) info % ARENA_MALLOC_ALIGNMENT == 0);
+            try(couchstore_open_doc_with_docinfo_arena(db, info, arena, &doc,
+                                                       DECOMPRESS_DOC_BODIES));
+            assert((size_t) doc % ARENA_MALLOC_ALIGNMENT == 0);
+            assert(doc->data.size == expected->data.size);
+            assert(memcmp(doc->data.buf, expected->data.buf, doc->data.size) == 0);
+
+            try(couchstore_open_document_arena(db, expected->id.buf, expected->id.size,
+                                               arena, &doc, DECOMPRESS_DOC_BODIES));
+            assert(doc->id.buf == expected->id.buf);
+            assert(doc->data.size == expected->data.size);
+            assert(memcmp(doc->data.buf, expected->data.buf, doc->data.size) == 0);
+        }
+        assert(couchstore_open_document_arena(db, "nope", 4, arena, &doc, 0) ==
+               COUCHSTORE_ERROR_DOC_NOT_FOUND);
+        couchstore_arena_free_all(arena);
+    }
+    couchstore_free_arena(arena);
+    couchstore_close_db(db);
+cleanup:
+    assert(errcode == 0);
+}
+
 static void test_dump_empty_db(void)
 {
     Db *db;
@@ -858,6 +992,318 @@ cleanup:
    assert(errcode == COUCHSTORE_SUCCESS);
 }
 
+static void test_compact_catchup(void)
+{
+   Db *db = NULL;
+   Db *target = NULL;
+   Doc d;
+   DocInfo i;
+   Doc *rd;
+   DocInfo *ir;
+   char id[16];
+   int n;
+   uint64_t remaining;
+   const char *compactpath = "compact_catchup.couch";
+   couchstore_error_t errcode;
+
+   fprintf(stderr, "compact catchup.... ");
+   fflush(stderr);
+
+   remove(compactpath);
+   try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+   for (n = 0; n < 100; ++n) {
+       sprintf(id, "doc%d", n);
+       setdoc(&d, &i, id, strlen(id), "old", 3, NULL, 0);
+       try(couchstore_save_document(db, &d, &i, 0));
+   }
+   try(couchstore_commit(db));
+   try(couchstore_compact_db(db, compactpath));
+
+   /* Writes that land in the source while it's being compacted */
+   for (n = 50; n < 150; ++n) {
+       sprintf(id, "doc%d", n);
+       setdoc(&d, &i, id, strlen(id), "new", 3, NULL, 0);
+       try(couchstore_save_document(db, &d, &i, 0));
+   }
+   setdoc(&d, &i, "doc0", 4, NULL, 0, NULL, 0);
+   try(couchstore_save_document(db, NULL, &i, 0));
+   try(couchstore_commit(db));
+
+   try(couchstore_open_db(compactpath, 0, &target));
+   assert(target->header.update_seq == 100);
+   try(couchstore_compact_catchup(db, target, 60, &remaining));
+   assert(target->header.update_seq == 160);
+   assert(remaining == 41);
+   try(couchstore_compact_catchup(db, target, 0, &remaining));
+   assert(remaining == 0);
+   assert(target->header.update_seq == db->header.update_seq);
+
+   try(couchstore_open_document(target, "doc10", 5, &rd, 0));
+   assert(rd->data.size == 3 && memcmp(rd->data.buf, "old", 3) == 0);
+   couchstore_free_document(rd);
+   try(couchstore_open_document(target, "doc120", 6, &rd, 0));
+   assert(rd->data.size == 3 && memcmp(rd->data.buf, "new", 3) == 0);
+   couchstore_free_document(rd);
+   try(couchstore_docinfo_by_id(target, "doc0", 4, &ir));
+   assert(ir->deleted);
+   couchstore_free_docinfo(ir);
+   assert(dump_count(target) == 0);
+   assert(counters.totaldocs == 150);
+   assert(counters.deleted == 1);
+
+cleanup:
+   if (target != NULL) {
+       couchstore_close_db(target);
+   }
+   if (db != NULL) {
+       couchstore_close_db(db);
+   }
+   remove(compactpath);
+   assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_db_region_info(void)
+{
+   Db *db = NULL;
+   Doc d;
+   DocInfo i;
+   DbInfo dbinfo;
+   DbRegionInfo *regions = NULL;
+   size_t num_regions, r;
+   uint64_t live, total;
+   char id[16];
+   char body[512];
+   int n, pass;
+   couchstore_error_t errcode;
+
+   fprintf(stderr, "region info.... ");
+   fflush(stderr);
+
+   memset(body, 'x', sizeof(body));
+   try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+   for (pass = 0; pass < 3; ++pass) {
+       for (n = 0; n < 2000; ++n) {
+           sprintf(id, "doc%d", n);
+           setdoc(&d, &i, id, strlen(id), body, sizeof(body), NULL, 0);
+           try(couchstore_save_document(db, &d, &i, 0));
+       }
+       try(couchstore_commit(db));
+   }
+   try(couchstore_db_info(db, &dbinfo));
+
+   try(couchstore_db_region_info(db, 256 * 1024, 0, &regions, &num_regions));
+   assert(num_regions == (dbinfo.file_size + 256 * 1024 - 1) / (256 * 1024));
+   live = total = 0;
+   for (r = 0; r < num_regions; ++r) {
+       assert(regions[r].offset == (cs_off_t)(r * 256 * 1024));
+       assert(regions[r].live_bytes + regions[r].dead_bytes == regions[r].size);
+       live += regions[r].live_bytes;
+       total += regions[r].size;
+   }
+   assert(total == dbinfo.file_size);
+   assert(live == dbinfo.space_used);
+   /* Only the last pass is live, so the start of the file is all stale */
+   assert(regions[0].live_bytes == 0);
+   assert(regions[num_regions - 1].live_bytes > 0);
+   couchstore_free_db_region_info(regions);
+   regions = NULL;
+
+   try(couchstore_db_region_info(db, 256 * 1024, 8, &regions, &num_regions));
+   live = 0;
+   for (r = 0; r < num_regions; ++r) {
+       assert(regions[r].live_bytes + regions[r].dead_bytes == regions[r].size);
+       live += regions[r].live_bytes;
+   }
+   assert(live > dbinfo.space_used / 2 && live < dbinfo.space_used * 2);
+
+cleanup:
+   couchstore_free_db_region_info(regions);
+   if (db != NULL) {
+       couchstore_close_db(db);
+   }
+   assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+#define SNAPSHOT_READERS 4
+#define SNAPSHOT_DOCS 500
+
+typedef struct {
+    Db *snapshot;
+    int failures;
+} snapshot_reader;
+
+static void snapshot_reader_thread(void *arg)
+{
+    snapshot_reader *reader = arg;
+    char id[16];
+    int pass, n;
+    for (pass = 0; pass < 5; ++pass) {
+        for (n = 0; n < SNAPSHOT_DOCS; ++n) {
+            Doc *doc;
+            sprintf(id, "doc%d", n);
+            if (couchstore_open_document(reader->snapshot, id, strlen(id), &doc, 0)
+                    != COUCHSTORE_SUCCESS) {
+                reader->failures++;
+                continue;
+            }
+            if (doc->data.size != 3 || memcmp(doc->data.buf, "old", 3) != 0) {
+                reader->failures++;
+            }
+            couchstore_free_document(doc);
+        }
+    }
+}
+
+static void test_reader_snapshot(void)
+{
+   Db *db = NULL;
+   Db *snapshot = NULL;
+   Doc d;
+   DocInfo i;
+   Doc *rd;
+   char id[16];
+   int n;
+   snapshot_reader readers[SNAPSHOT_READERS];
+   cb_thread_t threads[SNAPSHOT_READERS];
+   couchstore_error_t errcode;
+
+   fprintf(stderr, "reader snapshot.... ");
+   fflush(stderr);
+
+   try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+   for (n = 0; n < SNAPSHOT_DOCS; ++n) {
+       sprintf(id, "doc%d", n);
+       setdoc(&d, &i, id, strlen(id), "old", 3, NULL, 0);
+       try(couchstore_save_document(db, &d, &i, 0));
+   }
+   try(couchstore_commit(db));
+
+   /* Uncommitted changes aren't part of the snapshot */
+   setdoc(&d, &i, "doc0", 4, "new", 3, NULL, 0);
+   try(couchstore_save_document(db, &d, &i, 0));
+   try(couchstore_open_reader_snapshot(db, &snapshot));
+   assert(snapshot->header.update_seq == SNAPSHOT_DOCS);
+
+   for (n = 0; n < SNAPSHOT_READERS; ++n) {
+       readers[n].snapshot = snapshot;
+       readers[n].failures = 0;
+       assert(cb_create_thread(&threads[n], snapshot_reader_thread, &readers[n], 0) == 0);
+   }
+   /* Keep writing and committing while the readers run */
+   for (n = 0; n < SNAPSHOT_DOCS; ++n) {
+       sprintf(id, "doc%d", n);
+       setdoc(&d, &i, id, strlen(id), "new", 3, NULL, 0);
+       try(couchstore_save_document(db, &d, &i, 0));
+       if (n % 50 == 0) {
+           try(couchstore_commit(db));
+       }
+   }
+   try(couchstore_commit(db));
+   for (n = 0; n < SNAPSHOT_READERS; ++n) {
+       assert(cb_join_thread(threads[n]) == 0);
+       assert(readers[n].failures == 0);
+   }
+
+   try(couchstore_open_document(snapshot, "doc7", 4, &rd, 0));
+   assert(rd->data.size == 3 && memcmp(rd->data.buf, "old", 3) == 0);
+   couchstore_free_document(rd);
+   try(couchstore_open_document(db, "doc7", 4, &rd, 0));
+   assert(rd->data.size == 3 && memcmp(rd->data.buf, "new", 3) == 0);
+   couchstore_free_document(rd);
+   setdoc(&d, &i, "doc7", 4, "bad", 3, NULL, 0);
+   assert(couchstore_save_document(snapshot, &d, &i, 0) != COUCHSTORE_SUCCESS);
+
+cleanup:
+   if (snapshot != NULL) {
+       couchstore_close_db(snapshot);
+   }
+   if (db != NULL) {
+       couchstore_close_db(db);
+   }
+   assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_open_snapshot(void)
+{
+   Db *db = NULL;
+   Db *snapshot = NULL;
+   Db *nested = NULL;
+   Db *bad = NULL;
+   Doc d;
+   DocInfo i;
+   Doc *rd;
+   char id[16];
+   char body[8];
+   int n, pass;
+   uint64_t positions[3];
+   couchstore_error_t errcode;
+
+   fprintf(stderr, "open snapshot.... ");
+   fflush(stderr);
+
+   try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+   for (pass = 0; pass < 3; ++pass) {
+       for (n = 0; n < 100; ++n) {
+           sprintf(id, "doc%d", n);
+           sprintf(body, "pass%d", pass);
+           setdoc(&d, &i, id, strlen(id), body, strlen(body), NULL, 0);
+           try(couchstore_save_document(db, &d, &i, 0));
+       }
+       try(couchstore_commit(db));
+       positions[pass] = couchstore_get_header_position(db);
+   }
+
+   for (pass = 0; pass < 3; ++pass) {
+       try(couchstore_open_snapshot(db, positions[pass], &snapshot));
+       assert(snapshot->header.update_seq == (uint64_t)(pass + 1) * 100);
+       sprintf(body, "pass%d", pass);
+       try(couchstore_open_document(snapshot, "doc42", 5, &rd, 0));
+       assert(rd->data.size == 5 && memcmp(rd->data.buf, body, 5) == 0);
+       couchstore_free_document(rd);
+       try(couchstore_close_db(snapshot));
+       snapshot = NULL;
+   }
+
+   /* A snapshot of a snapshot reads through the same cache, and sees no
+    * more than its parent does */
+   try(couchstore_open_snapshot(db, positions[1], &snapshot));
+   try(couchstore_open_reader_snapshot(snapshot, &nested));
+   assert(nested->header.update_seq == 200);
+   try(couchstore_close_db(nested));
+   nested = NULL;
+   try(couchstore_open_snapshot(snapshot, positions[0], &nested));
+   assert(nested->header.update_seq == 100);
+   try(couchstore_open_document(nested, "doc42", 5, &rd, 0));
+   assert(rd->data.size == 5 && memcmp(rd->data.buf, "pass0", 5) == 0);
+   couchstore_free_document(rd);
+   assert(couchstore_open_snapshot(snapshot, positions[2], &bad)
+          == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+   try(couchstore_close_db(nested));
+   nested = NULL;
+   try(couchstore_close_db(snapshot));
+   snapshot = NULL;
+
+   /* The handle itself is unaffected */
+   assert(db->header.update_seq == 300);
+   assert(couchstore_open_snapshot(db, positions[2] + COUCH_BLOCK_SIZE, &bad)
+          == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+   assert(couchstore_open_snapshot(db, positions[0] + 1, &bad)
+          == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+   assert(bad == NULL);
+
+cleanup:
+   if (nested != NULL) {
+       couchstore_close_db(nested);
+   }
+   if (snapshot != NULL) {
+       couchstore_close_db(snapshot);
+   }
+   if (db != NULL) {
+       couchstore_close_db(db);
+   }
+   assert(errcode == COUCHSTORE_SUCCESS);
+}
+
 int main(int argc, const char *argv[])
 {
     int doc_counts[] = { 4, 69, 666, 9090 };
@@ -887,6 +1333,8 @@ int main(int argc, const char *argv[])
     printf("Using test database at %s\n", testfilepath);
 
     test_bitfield_fns();
+    test_arena();
+    fprintf(stderr, " OK\n");
 
     test_open_file_error();
     fprintf(stderr, "OK \n");
@@ -904,6 +1352,8 @@ int main(int argc, const char *argv[])
     fprintf(stderr, " OK\n");
     test_compressed_doc_body();
     fprintf(stderr, " OK\n");
+    test_arena_reads();
+    fprintf(stderr, " OK\n");
     test_changes_no_dups();
     fprintf(stderr, " OK\n");
 
@@ -922,6 +1372,18 @@ int main(int argc, const char *argv[])
     test_dropped_handle();
     fprintf(stderr, " OK\n");
     remove(testfilepath);
+    test_compact_catchup();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_db_region_info();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_reader_snapshot();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_open_snapshot();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
 
     /* make sure os.c didn't accidentally call close(0): */
 #ifndef WIN32
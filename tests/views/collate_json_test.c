@@ -66,6 +66,10 @@ static void TestCollateScalars(void)
     assert_eq(collateStrs("123", "123", mode), 0);
     assert_eq(collateStrs("123", "1", mode), 1);
     assert_eq(collateStrs("123", "0123.0", mode), 0);
+    assert_eq(collateStrs("100", "1e2", mode), 0);
+    assert_eq(collateStrs("-0.5", "-0.25", mode), -1);
+    assert_eq(collateStrs("0", "-0", mode), 0);
+    assert_eq(collateStrs("12345678901234567890", "12345678901234567891", mode), 0);
     assert_eq(collateStrs("123", "\"123\"", mode), -1);
     assert_eq(collateStrs("\"1234\"", "\"123\"", mode), 1);
     assert_eq(collateStrs("\"1234\"", "\"1235\"", mode), -1);
@@ -76,6 +80,10 @@ static void TestCollateScalars(void)
     assert_eq(collateStrs("\"a\"", "\"A\"", mode), -1);
     assert_eq(collateStrs("\"A\"", "\"aa\"", mode), -1);
     assert_eq(collateStrs("\"B\"", "\"aa\"", mode), 1);
+    assert_eq(collateStrs("\"ab\"", "\"Ab\"", mode), -1);
+    assert_eq(collateStrs("\"Ab\"", "\"ac\"", mode), -1);
+    assert_eq(collateStrs("\"a-b\"", "\"ab\"", mode), -1);
+    assert_eq(collateStrs("\"a b\"", "\"a\\u0020b\"", mode), 0);
 }
 
 static void TestCollateASCII(void)
@@ -122,6 +130,7 @@ static void TestCollateArrays(void)
     assert_eq(collateStrs("[123]", "[45]", mode), 1);
     assert_eq(collateStrs("[123]", "[45,67]", mode), 1);
     assert_eq(collateStrs("[123.4,\"wow\"]", "[123.40,789]", mode), 1);
+    assert_eq(collateStrs("[1.5,2]", "[1.50,1]", mode), 1);
 }
 
 static void TestCollateNestedArrays(void)
@@ -147,6 +156,54 @@ static void TestCollateUnicodeStrings(void)
     assert_eq(collateStrs("\"法\"", "\"法、\"", mode), -1);
 }
 
+static int sign(int n)
+{
+    return n > 0 ? 1 : (n < 0 ? -1 : 0);
+}
+
+static void TestCollateEncodedKeys(void)
+{
+    static const char* values[] = {
+        "null", "false", "true", "0", "-0", "17", "17.0", "-3.5", "1e3",
+        "1000", "123456789", "\"\"", "\"a\"", "\"A\"", "\"aa\"",
+        "\"B\"", "\"a-b\"", "\"12\\/34\"", "\"12/34\"", "\"fréd\"",
+        "\"ømø\"", "\"omo\"", "\"法\"", "\"法、\"", "\"\001\"", "\" \"",
+        "[]", "[null]", "[false]", "[123]", "[45,67]", "[123.4,\"wow\"]",
+        "[123.40,789]", "[[]]", "[1,[2,3],4]", "[1,[2,3.1],4,5,6]",
+        "[\"b\"]", "[\"b\",\"c\",\"a\"]", "{}", "{\"a\":1}",
+        "{\"a\":1,\"b\":2}", "{\"a\":[]}", "{\"b\":null}"
+    };
+    const size_t n = sizeof(values) / sizeof(values[0]);
+    sized_buf keys[sizeof(values) / sizeof(values[0])];
+    size_t i, j, len;
+    int res;
+
+    fprintf(stderr, "encoded keys... ");
+    for (i = 0; i < n; ++i) {
+        sized_buf json;
+        json.buf = (char *) values[i];
+        json.size = strlen(values[i]);
+        assert_eq(CollateJSONEncodeKey(&json, &keys[i]), 0);
+    }
+
+    /* memcmp of the encoded keys must agree with CollateJSON */
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < n; ++j) {
+            len = keys[i].size < keys[j].size ? keys[i].size : keys[j].size;
+            res = memcmp(keys[i].buf, keys[j].buf, len);
+            if (res == 0 && keys[i].size != keys[j].size) {
+                res = keys[i].size < keys[j].size ? -1 : 1;
+            }
+            assert_eq(sign(res),
+                      collateStrs(values[i], values[j], kCollateJSON_Unicode));
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        free(keys[i].buf);
+    }
+}
+
 void test_collate_json(void)
 {
     fprintf(stderr, "JSON collation: ");
@@ -157,5 +214,6 @@ void test_collate_json(void)
     TestCollateArrays();
     TestCollateNestedArrays();
     TestCollateUnicodeStrings();
+    TestCollateEncodedKeys();
     fprintf(stderr, "OK\n");
 }
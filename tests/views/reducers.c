@@ -1524,6 +1524,145 @@ static void test_view_btree_no_reducers(void)
     free_node_list(nl);
 }
 
+static void test_view_btree_builtin_reducers(void)
+{
+    char *error_msg = NULL;
+    view_reducer_ctx_t *ctx = NULL;
+    const char *function_sources[] = { "_count", "_sum", "_stats" };
+    const char *numbers[] = { "1e3", "-0.25", "2.5E-1", " 4", "0.1" };
+    const char *count_reductions[] = { "3", "2" };
+    const char *sum_reductions[] = { "1.5e2", "-0.5" };
+    const char *stats_reductions[] = {
+        "{\"sum\":1.00002e+06,\"count\":3,\"min\":-1.5,\"max\":1e+06,\"sumsqr\":1e+12}",
+        "{\"sum\":4,\"count\":2,\"min\":1,\"max\":3,\"sumsqr\":10}"
+    };
+    const char *expected[] = {
+        "5",
+        "1004.1",
+        "{\"sum\":1004.1,\"count\":5,\"min\":-0.25,\"max\":1000,\"sumsqr\":1.00002e+06}"
+    };
+    const char *expected_rereduce[] = {
+        "5",
+        "149.5",
+        "{\"sum\":1.00002e+06,\"count\":5,\"min\":-1.5,\"max\":1e+06,\"sumsqr\":1e+12}"
+    };
+    view_btree_key_t key;
+    char *key_bin = NULL;
+    size_t key_bin_size = 0;
+    view_btree_value_t value;
+    char *value_bin = NULL;
+    size_t value_bin_size = 0;
+    view_btree_reduction_t reduction;
+    char reduction_bin[2][512];
+    size_t reduction_bin_size[2];
+    nodelist *nl = NULL, *nl2 = NULL;
+    view_btree_reduction_t *red = NULL;
+    char red_bin[512];
+    size_t red_bin_size = 0;
+    int i;
+
+    ctx = make_view_reducer_ctx(function_sources, 3, &error_msg);
+    assert(ctx != NULL);
+
+    key.json_key.buf = "\"foo\"";
+    key.json_key.size = sizeof("\"foo\"") - 1;
+    key.doc_id.buf = "doc_1";
+    key.doc_id.size = sizeof("doc_1") - 1;
+    assert(encode_view_btree_key(&key, &key_bin, &key_bin_size) == COUCHSTORE_SUCCESS);
+
+    /* Numbers in the forms the reducers read without strtod, and some they
+     * don't */
+    value.partition = 3;
+    value.num_values = 5;
+    value.values = (sized_buf *) malloc(sizeof(sized_buf) * 5);
+    assert(value.values != NULL);
+    for (i = 0; i < 5; ++i) {
+        value.values[i].buf = (char *) numbers[i];
+        value.values[i].size = strlen(numbers[i]);
+    }
+    assert(encode_view_btree_value(&value, &value_bin, &value_bin_size) == COUCHSTORE_SUCCESS);
+
+    nl = (nodelist *) calloc(1, sizeof(nodelist));
+    assert(nl != NULL);
+    nl->data.buf = value_bin;
+    nl->data.size = value_bin_size;
+    nl->key.buf = key_bin;
+    nl->key.size = key_bin_size;
+
+    assert(view_btree_reduce(red_bin, &red_bin_size, nl, 1, ctx) == COUCHSTORE_SUCCESS);
+    assert(decode_view_btree_reduction(red_bin, red_bin_size, &red) == COUCHSTORE_SUCCESS);
+    assert(red->kv_count == 5);
+    assert(red->num_values == 3);
+    assert(is_bit_set(&red->partitions_bitmap, 3));
+    for (i = 0; i < 3; ++i) {
+        assert(red->reduce_values[i].size == strlen(expected[i]));
+        assert(memcmp(red->reduce_values[i].buf, expected[i],
+                      red->reduce_values[i].size) == 0);
+    }
+    free_view_btree_reduction(red);
+    red = NULL;
+
+    /* A value that is not a number is reported as before */
+    value.values[2].buf = "[1]";
+    value.values[2].size = sizeof("[1]") - 1;
+    free(value_bin);
+    assert(encode_view_btree_value(&value, &value_bin, &value_bin_size) == COUCHSTORE_SUCCESS);
+    nl->data.buf = value_bin;
+    nl->data.size = value_bin_size;
+
+    assert(view_btree_reduce(red_bin, &red_bin_size, nl, 1, ctx) == COUCHSTORE_ERROR_REDUCER_FAILURE);
+    assert(ctx->error != NULL);
+    assert(strcmp(ctx->error, "Value is not a number (key \"foo\")") == 0);
+
+    /* Rereduce */
+    nl2 = (nodelist *) calloc(1, sizeof(nodelist));
+    assert(nl2 != NULL);
+    nl->next = nl2;
+    reduction.reduce_values = (sized_buf *) malloc(sizeof(sized_buf) * 3);
+    assert(reduction.reduce_values != NULL);
+    reduction.num_values = 3;
+    for (i = 0; i < 2; ++i) {
+        nodelist *n = (i == 0) ? nl : nl2;
+
+        reduction.kv_count = 3 - i;
+        memset(&reduction.partitions_bitmap, 0, sizeof(reduction.partitions_bitmap));
+        set_bit(&reduction.partitions_bitmap, 100 + i);
+        reduction.reduce_values[0].buf = (char *) count_reductions[i];
+        reduction.reduce_values[0].size = strlen(count_reductions[i]);
+        reduction.reduce_values[1].buf = (char *) sum_reductions[i];
+        reduction.reduce_values[1].size = strlen(sum_reductions[i]);
+        reduction.reduce_values[2].buf = (char *) stats_reductions[i];
+        reduction.reduce_values[2].size = strlen(stats_reductions[i]);
+        assert(encode_view_btree_reduction(&reduction, reduction_bin[i],
+                                           &reduction_bin_size[i]) == COUCHSTORE_SUCCESS);
+
+        n->pointer = (node_pointer *) calloc(1, sizeof(node_pointer));
+        assert(n->pointer != NULL);
+        n->pointer->reduce_value.buf = reduction_bin[i];
+        n->pointer->reduce_value.size = reduction_bin_size[i];
+    }
+
+    assert(view_btree_rereduce(red_bin, &red_bin_size, nl, 2, ctx) == COUCHSTORE_SUCCESS);
+    assert(decode_view_btree_reduction(red_bin, red_bin_size, &red) == COUCHSTORE_SUCCESS);
+    assert(red->kv_count == 5);
+    assert(red->num_values == 3);
+    assert(is_bit_set(&red->partitions_bitmap, 100));
+    assert(is_bit_set(&red->partitions_bitmap, 101));
+    for (i = 0; i < 3; ++i) {
+        assert(red->reduce_values[i].size == strlen(expected_rereduce[i]));
+        assert(memcmp(red->reduce_values[i].buf, expected_rereduce[i],
+                      red->reduce_values[i].size) == 0);
+    }
+
+    free_view_btree_reduction(red);
+    free_view_reduction(&reduction);
+    free_view_reducer_ctx(ctx);
+    free(key_bin);
+    free_view_value(&value);
+    free(value_bin);
+    free_node_list(nl);
+}
+
 void reducer_tests(void)
 {
     fprintf(stderr, "Running built-in reducer tests ... \n");
@@ -1535,6 +1674,8 @@ void reducer_tests(void)
     fprintf(stderr, "End of built-in view btree count reducer tests\n");
     test_view_btree_stats_reducer();
     fprintf(stderr, "End of built-in view btree stats reducer tests\n");
+    test_view_btree_builtin_reducers();
+    fprintf(stderr, "End of built-in only view btree reducer tests\n");
     test_view_btree_js_reducer();
     fprintf(stderr, "End of view btree js reducer tests\n");
     test_view_btree_multiple_reducers();
@@ -0,0 +1,179 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "view_tests.h"
+#include "../src/views/file_sorter.h"
+#include "../src/views/file_merger.h"
+
+#define KVS_FILE_PATH_1     "view_kvs_1.data"
+#define KVS_FILE_PATH_2     "view_kvs_2.data"
+#define KVS_MERGED_PATH     "view_kvs_merged.data"
+#define KVS_SORT_TMP_DIR    "."
+#define KVS_NUM_RECORDS     3000
+
+static const char *json_keys[] = {
+    "[\"b\",2]", "\"fréd\"", "17", "null", "\"A\"", "{\"a\":1}", "[]",
+    "\"a\"", "-3.5", "\"ømø\"", "true", "[\"b\"]", "\"omo\"", "17.0",
+    "\"aa\"", "false", "\"法\"", "[1,[2,3],4]", "\"12\\/34\"", "1e3",
+    "\"a-b\"", "[null]", "{}", "\"B\"", "[1,[2,3.1]]", "\"\""
+};
+
+
+static void write_kvs_record(FILE *f, int i, view_file_merge_ctx_t *ctx)
+{
+    const char *json = json_keys[i % (sizeof(json_keys) / sizeof(json_keys[0]))];
+    uint16_t json_len = (uint16_t) strlen(json);
+    char doc_id[32];
+    size_t doc_id_len = sprintf(doc_id, "doc_%05d", (i * 7919) % KVS_NUM_RECORDS);
+    view_file_merge_record_t *rec;
+
+    rec = malloc(sizeof(*rec) + sizeof(json_len) + json_len + doc_id_len + 1);
+    assert(rec != NULL);
+    rec->op = 1;
+    rec->ksize = (uint16_t) (sizeof(json_len) + json_len + doc_id_len);
+    rec->vsize = 1;
+    rec->sksize = 0;
+    rec->sort_key = NULL;
+    *((raw_16 *) VIEW_RECORD_KEY(rec)) = encode_raw16(json_len);
+    memcpy(VIEW_RECORD_KEY(rec) + sizeof(json_len), json, json_len);
+    memcpy(VIEW_RECORD_KEY(rec) + sizeof(json_len) + json_len, doc_id,
+           doc_id_len);
+    *VIEW_RECORD_VAL(rec) = 'v';
+
+    assert(write_view_record(f, rec, ctx) == FILE_MERGER_SUCCESS);
+    free_view_record(rec, ctx);
+}
+
+
+/* Checks the records are in view_key_cmp order and returns their number */
+static int check_kvs_file_sorted(const char *path, view_file_merge_ctx_t *ctx)
+{
+    FILE *f = fopen(path, "rb");
+    view_file_merge_record_t *prev = NULL;
+    view_file_merge_record_t *rec;
+    sized_buf k1, k2;
+    int count = 0;
+
+    assert(f != NULL);
+    while (read_view_record(f, (void **) &rec, ctx) > 0) {
+        if (prev != NULL) {
+            k1.buf = VIEW_RECORD_KEY(prev);
+            k1.size = prev->ksize;
+            k2.buf = VIEW_RECORD_KEY(rec);
+            k2.size = rec->ksize;
+            assert(view_key_cmp(&k1, &k2, NULL) < 0);
+            free_view_record(prev, ctx);
+        }
+        prev = rec;
+        count++;
+    }
+    free_view_record(prev, ctx);
+    fclose(f);
+
+    return count;
+}
+
+
+/* Checks that keys which aren't valid JSON sort by their bytes, and then by
+ * doc id, wherever their bytes end and the doc id starts */
+static void check_invalid_keys_order(view_file_merge_ctx_t *ctx)
+{
+    static const struct {
+        const char *key;
+        uint16_t    key_len;
+        const char *doc_id;
+    } records[] = {
+        { "a", 1, "z" },
+        { "a\0", 2, "a" },
+        { "a\1", 2, "a" },
+        { "ab", 2, "a" },
+        { "ab", 2, "b" }
+    };
+    int num_records = sizeof(records) / sizeof(records[0]);
+    view_file_merge_record_t *rec, *prev = NULL;
+    FILE *f = fopen(KVS_FILE_PATH_1, "wb");
+    int i;
+
+    assert(f != NULL);
+    for (i = 0; i < num_records; ++i) {
+        uint16_t doc_id_len = (uint16_t) strlen(records[i].doc_id);
+
+        rec = malloc(sizeof(*rec) + sizeof(uint16_t) + records[i].key_len +
+                     doc_id_len + 1);
+        assert(rec != NULL);
+        rec->op = 1;
+        rec->ksize = (uint16_t) (sizeof(uint16_t) + records[i].key_len +
+                                 doc_id_len);
+        rec->vsize = 1;
+        rec->sksize = 0;
+        rec->sort_key = NULL;
+        *((raw_16 *) VIEW_RECORD_KEY(rec)) = encode_raw16(records[i].key_len);
+        memcpy(VIEW_RECORD_KEY(rec) + sizeof(uint16_t), records[i].key,
+               records[i].key_len);
+        memcpy(VIEW_RECORD_KEY(rec) + sizeof(uint16_t) + records[i].key_len,
+               records[i].doc_id, doc_id_len);
+        *VIEW_RECORD_VAL(rec) = 'v';
+        assert(write_view_record(f, rec, ctx) == FILE_MERGER_SUCCESS);
+        free_view_record(rec, ctx);
+    }
+    fclose(f);
+
+    f = fopen(KVS_FILE_PATH_1, "rb");
+    assert(f != NULL);
+    for (i = 0; i < num_records; ++i) {
+        assert(read_view_record(f, (void **) &rec, ctx) > 0);
+        if (prev != NULL) {
+            assert(compare_view_records(prev, rec, ctx) < 0);
+            free_view_record(prev, ctx);
+        }
+        prev = rec;
+    }
+    free_view_record(prev, ctx);
+    fclose(f);
+    remove(KVS_FILE_PATH_1);
+}
+
+
+void test_view_kvs_sorting(void)
+{
+    view_file_merge_ctx_t ctx;
+    const char *source_files[2] = { KVS_FILE_PATH_1, KVS_FILE_PATH_2 };
+    FILE *f1, *f2;
+    int i;
+
+    fprintf(stderr, "Running view kvs sorting tests\n");
+
+    ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_prefix_fun = NULL;
+    ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
+    ctx.user_ctx = NULL;
+
+    check_invalid_keys_order(&ctx);
+
+    f1 = fopen(KVS_FILE_PATH_1, "wb");
+    f2 = fopen(KVS_FILE_PATH_2, "wb");
+    assert(f1 != NULL);
+    assert(f2 != NULL);
+    for (i = 0; i < KVS_NUM_RECORDS; ++i) {
+        write_kvs_record((i % 3) ? f1 : f2, i, &ctx);
+    }
+    fclose(f1);
+    fclose(f2);
+
+    assert(sort_view_kvs_ops_file(KVS_FILE_PATH_1, KVS_SORT_TMP_DIR) ==
+           FILE_SORTER_SUCCESS);
+    assert(sort_view_kvs_ops_file(KVS_FILE_PATH_2, KVS_SORT_TMP_DIR) ==
+           FILE_SORTER_SUCCESS);
+    assert_eq(check_kvs_file_sorted(KVS_FILE_PATH_1, &ctx),
+              KVS_NUM_RECORDS - (KVS_NUM_RECORDS + 2) / 3);
+    assert_eq(check_kvs_file_sorted(KVS_FILE_PATH_2, &ctx),
+              (KVS_NUM_RECORDS + 2) / 3);
+
+    assert(merge_view_kvs_ops_files(source_files, 2, KVS_MERGED_PATH) ==
+           FILE_MERGER_SUCCESS);
+    assert_eq(check_kvs_file_sorted(KVS_MERGED_PATH, &ctx), KVS_NUM_RECORDS);
+
+    remove(KVS_FILE_PATH_1);
+    remove(KVS_FILE_PATH_2);
+    remove(KVS_MERGED_PATH);
+    fprintf(stderr, "End of view kvs sorting tests\n");
+}
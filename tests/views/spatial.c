@@ -378,3 +378,275 @@ void test_expand_mbb()
     expand_mbb(&mbb_struct_a, &mbb_struct_b);
     assert(is_double_array_equal(mbb_struct_a.mbb, expected2_mbb, 6));
 }
+
+
+/* Checks that the key prefixes of the given MBBs order them the same way as
+ * spatial_key_cmp, wherever they differ */
+static void check_spatial_key_prefixes(const double *enclosing, uint16_t dim)
+{
+    double mbbs[32][6];
+    char keys[32][2 + sizeof(mbbs[0])];
+    sized_buf bufs[32];
+    sized_mbb_t mbb_struct;
+    view_spatial_builder_ctx_t ctx;
+    uint64_t prefix_i, prefix_j;
+    int i, j, d, cmp;
+
+    ctx.scale_factor = spatial_scale_factor(enclosing, dim, ZCODE_MAX_VALUE);
+
+    for (i = 0; i < 32; ++i) {
+        for (d = 0; d < dim; ++d) {
+            double lo = enclosing[d * 2];
+            double width = enclosing[d * 2 + 1] - lo;
+            mbbs[i][d * 2] = lo + width * ((i * 7 + d * 13) % 32) / 64;
+            mbbs[i][d * 2 + 1] = mbbs[i][d * 2] + width * ((i * 3 + d) % 16) / 32;
+        }
+        mbb_struct.mbb = mbbs[i];
+        mbb_struct.num = dim * 2;
+        encode_spatial_key(&mbb_struct, keys[i], sizeof(keys[i]));
+        bufs[i].buf = keys[i];
+        bufs[i].size = 2 + dim * 2 * sizeof(double);
+    }
+
+    for (i = 0; i < 32; ++i) {
+        prefix_i = spatial_key_prefix(&bufs[i], &ctx);
+        for (j = 0; j < 32; ++j) {
+            prefix_j = spatial_key_prefix(&bufs[j], &ctx);
+            cmp = spatial_key_cmp(&bufs[i], &bufs[j], &ctx);
+            if (prefix_i < prefix_j) {
+                assert(cmp < 0);
+            } else if (prefix_i > prefix_j) {
+                assert(cmp > 0);
+            } else if (dim * sizeof(uint32_t) <= sizeof(uint64_t)) {
+                /* The prefix holds the whole Z-code */
+                assert(cmp == 0);
+            }
+        }
+    }
+
+    free_spatial_scale_factor(ctx.scale_factor);
+}
+
+void test_spatial_key_prefix()
+{
+    double enclosing1[] = {-50.0, 1050.5};
+    double enclosing2[] = {1.0, 3.0, 30.33, 31.33};
+    double enclosing3[] = {1.0, 3.0, 30.33, 31.33, 15.4, 138.7};
+
+    fprintf(stderr, "Running spatial key prefix tests\n");
+
+    check_spatial_key_prefixes(enclosing1, 1);
+    check_spatial_key_prefixes(enclosing2, 2);
+    check_spatial_key_prefixes(enclosing3, 3);
+}
+
+
+#define STR_FILE_PATH       "spatial_kvs_str.data"
+#define STR_NUM_RECORDS     6000
+
+/* Tiles fed by a sort, as the builder would pack them into leaf nodes */
+typedef struct {
+    uint16_t dim;
+    /* Records per tile, for sorts that don't end tiles themselves */
+    int      tile_size;
+    int      max_tile_size;
+    int      num_records;
+    int      num_tiles;
+    int      tile_records;
+    /* Node item bytes of the tile, and the most a tile of more than one
+     * record had */
+    size_t   tile_bytes;
+    size_t   max_tile_bytes;
+    double   tile_mbb[6];
+    /* Sum over the tiles of the edge lengths of their MBBs */
+    double   margin;
+    char     seen[STR_NUM_RECORDS];
+} str_tiles_t;
+
+static str_tiles_t str_tiles;
+
+
+static void end_str_tile(void)
+{
+    int d;
+
+    if (str_tiles.tile_records > 0) {
+        for (d = 0; d < str_tiles.dim; ++d) {
+            str_tiles.margin += str_tiles.tile_mbb[d * 2 + 1] -
+                str_tiles.tile_mbb[d * 2];
+        }
+        if (str_tiles.tile_records > str_tiles.max_tile_size) {
+            str_tiles.max_tile_size = str_tiles.tile_records;
+        }
+        if (str_tiles.tile_records > 1 &&
+                str_tiles.tile_bytes > str_tiles.max_tile_bytes) {
+            str_tiles.max_tile_bytes = str_tiles.tile_bytes;
+        }
+        str_tiles.num_tiles++;
+    }
+    str_tiles.tile_records = 0;
+    str_tiles.tile_bytes = 0;
+}
+
+
+static int str_tiles_callback(void *buf, void *ctx)
+{
+    view_file_merge_record_t *rec = (view_file_merge_record_t *) buf;
+    double mbb[6];
+    int d, id;
+    (void) ctx;
+
+    memcpy(mbb, VIEW_RECORD_KEY(rec) + 2, str_tiles.dim * 2 * sizeof(double));
+    for (d = 0; d < str_tiles.dim * 2; ++d) {
+        if (str_tiles.tile_records == 0 ||
+                (d % 2 == 0 && mbb[d] < str_tiles.tile_mbb[d]) ||
+                (d % 2 == 1 && mbb[d] > str_tiles.tile_mbb[d])) {
+            str_tiles.tile_mbb[d] = mbb[d];
+        }
+    }
+    str_tiles.tile_records++;
+    str_tiles.tile_bytes += rec->ksize + rec->vsize + sizeof(raw_kv_length);
+
+    id = atoi(VIEW_RECORD_VAL(rec));
+    assert(id >= 0 && id < STR_NUM_RECORDS);
+    assert(!str_tiles.seen[id]);
+    str_tiles.seen[id] = 1;
+    str_tiles.num_records++;
+
+    if (str_tiles.tile_records == str_tiles.tile_size) {
+        end_str_tile();
+    }
+
+    return FILE_SORTER_SUCCESS;
+}
+
+
+static int str_tiles_end_tile(void *ctx)
+{
+    (void) ctx;
+
+    end_str_tile();
+    return FILE_SORTER_SUCCESS;
+}
+
+
+/* Writes records whose values are all 6 bytes, or if varied is set, between
+ * 6 and 54 bytes */
+static void write_str_records(uint16_t dim, int varied,
+                              view_file_merge_ctx_t *ctx)
+{
+    FILE *f = fopen(STR_FILE_PATH, "wb");
+    char buf[sizeof(view_file_merge_record_t) + 2 + 6 * sizeof(double) + 64];
+    view_file_merge_record_t *rec = (view_file_merge_record_t *) buf;
+    double mbb[6];
+    sized_mbb_t mbb_struct;
+    uint32_t seed = 42;
+    int i, d;
+
+    assert(f != NULL);
+    for (i = 0; i < STR_NUM_RECORDS; ++i) {
+        for (d = 0; d < dim; ++d) {
+            seed = seed * 1103515245 + 12345;
+            mbb[d * 2] = (seed >> 8) % 100000 / 100.0;
+            mbb[d * 2 + 1] = mbb[d * 2] + (i % 5);
+        }
+        mbb_struct.mbb = mbb;
+        mbb_struct.num = dim * 2;
+        rec->op = 0;
+        rec->ksize = 2 + dim * 2 * sizeof(double);
+        rec->sksize = 0;
+        rec->sort_key = NULL;
+        encode_spatial_key(&mbb_struct, VIEW_RECORD_KEY(rec), rec->ksize - 2);
+        rec->vsize = sprintf(VIEW_RECORD_VAL(rec), "%05d", i) + 1;
+        if (varied) {
+            memset(VIEW_RECORD_VAL(rec) + rec->vsize, 'x', (i % 7) * 8);
+            rec->vsize += (i % 7) * 8;
+        }
+        assert(write_view_record(f, rec, ctx) == FILE_MERGER_SUCCESS);
+    }
+    fclose(f);
+}
+
+
+/* Sorts records in STR order and checks that they are fed once each, in
+ * tiles that aren't bigger than a leaf and have a smaller margin than the
+ * same number of records in Z-order have */
+static void check_str_sorting(const double *enclosing, uint16_t dim)
+{
+    view_file_merge_ctx_t ctx;
+    view_spatial_builder_ctx_t build_ctx;
+    double str_margin;
+    int leaf_items;
+
+    ctx.type = INITIAL_BUILD_SPATIAL_RECORD;
+    write_str_records(dim, 0, &ctx);
+
+    build_ctx.transient_arena = NULL;
+    build_ctx.modify_result = NULL;
+    build_ctx.scale_factor = spatial_scale_factor(enclosing, dim,
+                                                  ZCODE_MAX_VALUE);
+    /* All records are the same size, as items of a node */
+    leaf_items = 682 /
+        (2 + dim * 2 * sizeof(double) + 6 + sizeof(raw_kv_length));
+
+    memset(&str_tiles, 0, sizeof(str_tiles));
+    str_tiles.dim = dim;
+    assert(sort_spatial_kvs_file_str(STR_FILE_PATH, ".", 682,
+                                     str_tiles_callback, str_tiles_end_tile,
+                                     NULL, 0, 0) == FILE_SORTER_SUCCESS);
+    assert_eq(str_tiles.num_records, STR_NUM_RECORDS);
+    assert_eq(str_tiles.tile_records, 0);
+    assert_eq(str_tiles.max_tile_size, leaf_items);
+    assert(str_tiles.num_tiles >= STR_NUM_RECORDS / leaf_items);
+    str_margin = str_tiles.margin;
+
+    memset(&str_tiles, 0, sizeof(str_tiles));
+    str_tiles.dim = dim;
+    str_tiles.tile_size = leaf_items;
+    assert(sort_spatial_kvs_file(STR_FILE_PATH, ".", str_tiles_callback,
+                                 &build_ctx) == FILE_SORTER_SUCCESS);
+    end_str_tile();
+    assert_eq(str_tiles.num_records, STR_NUM_RECORDS);
+    /* In one dimension both are just sorted by the center */
+    assert(dim == 1 || str_margin < str_tiles.margin);
+
+    free_spatial_scale_factor(build_ctx.scale_factor);
+    remove(STR_FILE_PATH);
+}
+
+/* Sorts records of different sizes in STR order and checks that no tile of
+ * them takes more than a leaf, though the tiles are cut for the average */
+static void check_str_tile_sizes(uint16_t dim)
+{
+    view_file_merge_ctx_t ctx;
+
+    ctx.type = INITIAL_BUILD_SPATIAL_RECORD;
+    write_str_records(dim, 1, &ctx);
+
+    memset(&str_tiles, 0, sizeof(str_tiles));
+    str_tiles.dim = dim;
+    assert(sort_spatial_kvs_file_str(STR_FILE_PATH, ".", 682,
+                                     str_tiles_callback, str_tiles_end_tile,
+                                     NULL, 0, 0) == FILE_SORTER_SUCCESS);
+    assert_eq(str_tiles.num_records, STR_NUM_RECORDS);
+    assert_eq(str_tiles.tile_records, 0);
+    assert(str_tiles.max_tile_bytes > 682 / 2);
+    assert(str_tiles.max_tile_bytes <= 682);
+
+    remove(STR_FILE_PATH);
+}
+
+void test_spatial_str_sorting()
+{
+    double enclosing1[] = {0.0, 1004.0};
+    double enclosing2[] = {0.0, 1004.0, 0.0, 1004.0};
+    double enclosing3[] = {0.0, 1004.0, 0.0, 1004.0, 0.0, 1004.0};
+
+    fprintf(stderr, "Running spatial STR sorting tests\n");
+
+    check_str_sorting(enclosing1, 1);
+    check_str_sorting(enclosing2, 2);
+    check_str_sorting(enclosing3, 3);
+    check_str_tile_sizes(2);
+    check_str_tile_sizes(3);
+}
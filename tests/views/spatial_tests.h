@@ -29,6 +29,8 @@
 #include "../macros.h"
 #include "../src/views/bitmap.h"
 #include "../src/views/spatial.h"
+#include "../src/views/file_sorter.h"
+#include "../src/node_types.h"
 
 /* Those functions are normaly static. They are declared here to prevent
  * compile time warning */
@@ -47,5 +49,7 @@ void test_set_bit_sized(void);
 void test_encode_spatial_key(void);
 void test_decode_spatial_key(void);
 void test_expand_mbb(void);
+void test_spatial_key_prefix(void);
+void test_spatial_str_sorting(void);
 
 #endif
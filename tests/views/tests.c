@@ -36,6 +36,10 @@ void view_tests()
     test_values();
     reducer_tests();
     cleanup_tests();
+    test_view_kvs_sorting();
+    test_view_group_build();
+    test_view_group_update();
+    test_view_group_build_spatial();
 
     /* spatial tests */
     test_interleaving();
@@ -46,4 +50,6 @@ void view_tests()
     test_encode_spatial_key();
     test_decode_spatial_key();
     test_expand_mbb();
+    test_spatial_key_prefix();
+    test_spatial_str_sorting();
 }
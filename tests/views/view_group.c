@@ -0,0 +1,776 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "view_tests.h"
+#include "spatial_tests.h"
+#include <fcntl.h>
+#include "../src/couch_btree.h"
+#include "../src/views/util.h"
+#include "../src/views/view_group.h"
+
+#define GROUP_FILE_PATH      "view_group_test.view"
+#define GROUP_DST_FILE_PATH  "view_group_test_%d.view"
+#define GROUP_IDS_FILE_PATH  "view_group_test_ids.spill"
+#define GROUP_KVS_FILE_PATH  "view_group_test_kvs_%d.spill"
+#define GROUP_NUM_VIEWS      3
+#define GROUP_NUM_DOCS       3000
+#define GROUP_NUM_PARTITIONS 64
+/* Coordinates of the spatial records are in [0, GROUP_SPATIAL_MAX] */
+#define GROUP_SPATIAL_MAX    1004.0
+
+typedef struct {
+    sized_buf *keys;
+    sized_buf *values;
+    int        count;
+    int        max;
+} btree_kvs_t;
+
+
+static const char *kvs_file_path(int view)
+{
+    static char path[GROUP_NUM_VIEWS][64];
+
+    sprintf(path[view], GROUP_KVS_FILE_PATH, view);
+    return path[view];
+}
+
+
+/* View i has i reducers, the last of them _sum, or none for view 0 */
+static view_group_info_t *make_group_info(const char *path, uint64_t pos)
+{
+    view_group_info_t *info = calloc(1, sizeof(*info));
+    int i, j;
+
+    assert(info != NULL);
+    info->filepath = strdup(path);
+    info->header_pos = pos;
+    info->num_btrees = GROUP_NUM_VIEWS;
+    info->type = VIEW_INDEX_TYPE_MAPREDUCE;
+    info->view_infos.btree = calloc(GROUP_NUM_VIEWS, sizeof(view_btree_info_t));
+    assert(info->view_infos.btree != NULL);
+
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        view_btree_info_t *bti = &info->view_infos.btree[i];
+
+        bti->view_id = i;
+        bti->num_reducers = i;
+        bti->names = calloc(i, sizeof(char *));
+        bti->reducers = calloc(i, sizeof(char *));
+        for (j = 0; j < i; ++j) {
+            bti->names[j] = strdup(j == i - 1 ? "sum" : "count");
+            bti->reducers[j] = strdup(j == i - 1 ? "_sum" : "_count");
+        }
+    }
+
+    return info;
+}
+
+
+/* Writes the header of an empty view group and returns its position */
+static uint64_t write_empty_group(const char *path)
+{
+    index_header_t *header = calloc(1, sizeof(*header));
+    tree_file file;
+    uint64_t pos;
+
+    assert(header != NULL);
+    header->version = 1;
+    header->num_views = GROUP_NUM_VIEWS;
+    header->num_partitions = GROUP_NUM_PARTITIONS;
+    header->seqs = sorted_list_create(NULL);
+    header->view_states = calloc(GROUP_NUM_VIEWS, sizeof(node_pointer *));
+    header->replicas_on_transfer = sorted_list_create(NULL);
+    header->pending_transition.active = sorted_list_create(NULL);
+    header->pending_transition.passive = sorted_list_create(NULL);
+    header->pending_transition.unindexable = sorted_list_create(NULL);
+    header->unindexable_seqs = sorted_list_create(NULL);
+
+    remove(path);
+    assert(tree_file_open(&file, path, O_RDWR | O_CREAT,
+                          couchstore_get_default_file_ops()) ==
+           COUCHSTORE_SUCCESS);
+    assert(write_view_group_header(&file, &pos, header) == COUCHSTORE_SUCCESS);
+    tree_file_close(&file);
+    free_index_header(header);
+
+    return pos;
+}
+
+
+static void write_record(FILE *f, const sized_buf *k, const sized_buf *v,
+                         uint8_t op, view_file_merge_ctx_t *ctx)
+{
+    view_file_merge_record_t *rec = malloc(sizeof(*rec) + k->size + v->size);
+
+    assert(rec != NULL);
+    rec->op = op;
+    rec->ksize = (uint16_t) k->size;
+    rec->vsize = (uint32_t) v->size;
+    rec->sksize = 0;
+    rec->sort_key = NULL;
+    memcpy(VIEW_RECORD_KEY(rec), k->buf, k->size);
+    memcpy(VIEW_RECORD_VAL(rec), v->buf, v->size);
+    assert(write_view_record(f, rec, ctx) == FILE_MERGER_SUCCESS);
+    free(rec);
+}
+
+
+/*
+ * Writes, or appends with mode "ab", the records files of every step-th
+ * document from first to last, in a scrambled order. View i maps a document
+ * to i + 1 rows, some documents share keys. op is 0 for the records of a
+ * build, otherwise the action of the records of an update.
+ */
+static void write_records_files(const char *mode, int first, int last,
+                                int step, uint8_t op)
+{
+    view_file_merge_ctx_t ctx;
+    FILE *ids, *kvs[GROUP_NUM_VIEWS];
+    int num_docs = (last - first) / step + 1;
+    int n, d, i, j;
+
+    ctx.type = op ? INCREMENTAL_UPDATE_VIEW_RECORD : INITIAL_BUILD_VIEW_RECORD;
+    ids = fopen(GROUP_IDS_FILE_PATH, mode);
+    assert(ids != NULL);
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        kvs[i] = fopen(kvs_file_path(i), mode);
+        assert(kvs[i] != NULL);
+    }
+
+    for (n = 0; n < num_docs; ++n) {
+        char doc_id[32];
+        char json_keys[GROUP_NUM_VIEWS][GROUP_NUM_VIEWS][16];
+        sized_buf keys[GROUP_NUM_VIEWS][GROUP_NUM_VIEWS];
+        view_keys_mapping_t maps[GROUP_NUM_VIEWS];
+        view_id_btree_key_t id_key;
+        view_id_btree_value_t id_value;
+        sized_buf k, v;
+
+        d = first + ((n * 7919) % num_docs) * step;
+        id_key.partition = (uint16_t) (d % GROUP_NUM_PARTITIONS);
+        id_key.doc_id.buf = doc_id;
+        id_key.doc_id.size = sprintf(doc_id, "doc_%05d", d);
+
+        for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+            maps[i].view_id = (uint8_t) i;
+            maps[i].num_keys = (uint16_t) (i + 1);
+            maps[i].json_keys = keys[i];
+
+            for (j = 0; j <= i; ++j) {
+                view_btree_key_t key;
+                view_btree_value_t value;
+                char json_value[16];
+                sized_buf value_buf;
+
+                keys[i][j].buf = json_keys[i][j];
+                keys[i][j].size = sprintf(json_keys[i][j], "%d",
+                                          (d * (i + 3) + j * 167) % 500);
+                key.json_key = keys[i][j];
+                key.doc_id = id_key.doc_id;
+                value_buf.buf = json_value;
+                value_buf.size = sprintf(json_value, "%d", d % 7);
+                value.partition = id_key.partition;
+                value.num_values = 1;
+                value.values = &value_buf;
+
+                assert(encode_view_btree_key(&key, &k.buf, &k.size) ==
+                       COUCHSTORE_SUCCESS);
+                assert(encode_view_btree_value(&value, &v.buf, &v.size) ==
+                       COUCHSTORE_SUCCESS);
+                write_record(kvs[i], &k, &v, op, &ctx);
+                free(k.buf);
+                free(v.buf);
+            }
+        }
+
+        id_value.partition = id_key.partition;
+        id_value.num_view_keys_map = GROUP_NUM_VIEWS;
+        id_value.view_keys_map = maps;
+        assert(encode_view_id_btree_key(&id_key, &k.buf, &k.size) ==
+               COUCHSTORE_SUCCESS);
+        assert(encode_view_id_btree_value(&id_value, &v.buf, &v.size) ==
+               COUCHSTORE_SUCCESS);
+        write_record(ids, &k, &v, op, &ctx);
+        free(k.buf);
+        free(v.buf);
+    }
+
+    fclose(ids);
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        fclose(kvs[i]);
+    }
+}
+
+
+/* Builds the view group of the documents from 0 to num_docs - 1 into path,
+ * with its B-trees built on num_threads threads */
+static index_header_t *build_group(const char *path, int num_docs,
+                                   int num_threads)
+{
+    const char *kvs_files[GROUP_NUM_VIEWS];
+    view_group_info_t *info;
+    index_header_t *header = NULL;
+    view_error_t error_info;
+    uint64_t pos;
+    int i;
+
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        kvs_files[i] = kvs_file_path(i);
+    }
+    write_records_files("wb", 0, num_docs - 1, 1, 0);
+    info = make_group_info(GROUP_FILE_PATH, write_empty_group(GROUP_FILE_PATH));
+
+    remove(path);
+    view_group_set_job_threads(num_threads);
+    assert(couchstore_build_view_group(info, GROUP_IDS_FILE_PATH, kvs_files,
+                                       path, ".", &pos, &error_info) ==
+           COUCHSTORE_SUCCESS);
+    view_group_set_job_threads(0);
+    couchstore_free_view_group_info(info);
+
+    /* Read back the header the build wrote */
+    info = make_group_info(path, pos);
+    assert(tree_file_open(&info->file, path, O_RDONLY,
+                          couchstore_get_default_file_ops()) ==
+           COUCHSTORE_SUCCESS);
+    assert(read_view_group_header(info, &header) == COUCHSTORE_SUCCESS);
+    couchstore_free_view_group_info(info);
+    remove(GROUP_FILE_PATH);
+
+    return header;
+}
+
+
+/*
+ * Updates the view group of path, whose header is header, with the records
+ * files on num_threads threads. Partitions 1 and 2 are being cleaned up, so
+ * the update purges what it comes across of them.
+ */
+static index_header_t *update_group(const char *path, index_header_t *header,
+                                    int num_threads,
+                                    view_group_update_stats_t *stats)
+{
+    const char *kvs_files[GROUP_NUM_VIEWS];
+    view_group_info_t *info = make_group_info(path, 0);
+    index_header_t *new_header = NULL;
+    view_error_t error_info;
+    sized_buf header_buf, new_header_buf;
+    int i;
+
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        kvs_files[i] = kvs_file_path(i);
+    }
+    set_bit(&header->cleanup_bitmask, 1);
+    set_bit(&header->cleanup_bitmask, 2);
+    assert(encode_index_header(header, &header_buf.buf, &header_buf.size) ==
+           COUCHSTORE_SUCCESS);
+
+    memset(stats, 0, sizeof(*stats));
+    view_group_set_job_threads(num_threads);
+    /* Small batches, so that the B-trees are modified many times */
+    assert(couchstore_update_view_group(info, GROUP_IDS_FILE_PATH, kvs_files,
+                                        64 * 1024, &header_buf, 0, ".", stats,
+                                        &new_header_buf, &error_info) ==
+           COUCHSTORE_SUCCESS);
+    view_group_set_job_threads(0);
+    couchstore_free_view_group_info(info);
+
+    assert(decode_index_header(new_header_buf.buf, new_header_buf.size,
+                               &new_header) == COUCHSTORE_SUCCESS);
+    free(header_buf.buf);
+    free(new_header_buf.buf);
+
+    return new_header;
+}
+
+
+static int fold_cmp(const sized_buf *key1, const sized_buf *key2)
+{
+    /* A fold from the empty key only compares keys to it */
+    return (key1->size > 0) - (key2->size > 0);
+}
+
+
+static couchstore_error_t fold_kv(couchfile_lookup_request *rq,
+                                  const sized_buf *k,
+                                  const sized_buf *v)
+{
+    btree_kvs_t *kvs = (btree_kvs_t *) rq->callback_ctx;
+
+    if (kvs->count == kvs->max) {
+        kvs->max = kvs->max ? kvs->max * 2 : 1024;
+        kvs->keys = realloc(kvs->keys, kvs->max * sizeof(sized_buf));
+        kvs->values = realloc(kvs->values, kvs->max * sizeof(sized_buf));
+        assert(kvs->keys != NULL && kvs->values != NULL);
+    }
+    kvs->keys[kvs->count].size = k->size;
+    kvs->keys[kvs->count].buf = malloc(k->size);
+    memcpy(kvs->keys[kvs->count].buf, k->buf, k->size);
+    kvs->values[kvs->count].size = v->size;
+    kvs->values[kvs->count].buf = malloc(v->size);
+    memcpy(kvs->values[kvs->count].buf, v->buf, v->size);
+    kvs->count++;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+static void read_btree(const char *path, const node_pointer *root,
+                       btree_kvs_t *kvs)
+{
+    couchfile_lookup_request rq;
+    tree_file file;
+    sized_buf k = { NULL, 0 };
+    sized_buf *keys = &k;
+
+    memset(kvs, 0, sizeof(*kvs));
+    if (root == NULL) {
+        return;
+    }
+
+    assert(tree_file_open(&file, path, O_RDONLY,
+                          couchstore_get_default_file_ops()) ==
+           COUCHSTORE_SUCCESS);
+    rq.cmp.compare = fold_cmp;
+    rq.file = &file;
+    rq.num_keys = 1;
+    rq.keys = &keys;
+    rq.callback_ctx = kvs;
+    rq.fetch_callback = fold_kv;
+    rq.node_callback = NULL;
+    rq.fold = 1;
+    assert(btree_lookup(&rq, root->pointer) == COUCHSTORE_SUCCESS);
+    tree_file_close(&file);
+}
+
+
+static void free_btree_kvs(btree_kvs_t *kvs)
+{
+    int i;
+
+    for (i = 0; i < kvs->count; ++i) {
+        free(kvs->keys[i].buf);
+        free(kvs->values[i].buf);
+    }
+    free(kvs->keys);
+    free(kvs->values);
+}
+
+
+static void assert_buf_eq(const sized_buf *b1, const sized_buf *b2)
+{
+    assert_eq(b1->size, b2->size);
+    assert(b1->size == 0 || memcmp(b1->buf, b2->buf, b1->size) == 0);
+}
+
+
+/*
+ * Checks that a B-tree of path1 has the same reduction and contents as one
+ * of path2, and returns the number of its KVs. The nodes are written in
+ * another order when several B-trees are built at once, so their positions,
+ * and with them the block boundaries counted by the subtree sizes, differ.
+ */
+static int check_same_btree(const char *path1, const node_pointer *root1,
+                            const char *path2, const node_pointer *root2)
+{
+    btree_kvs_t kvs1, kvs2;
+    int count;
+    int i;
+
+    assert(root1 != NULL && root2 != NULL);
+    assert_buf_eq(&root1->key, &root2->key);
+    assert_buf_eq(&root1->reduce_value, &root2->reduce_value);
+
+    read_btree(path1, root1, &kvs1);
+    read_btree(path2, root2, &kvs2);
+    assert_eq(kvs1.count, kvs2.count);
+    for (i = 0; i < kvs1.count; ++i) {
+        assert_buf_eq(&kvs1.keys[i], &kvs2.keys[i]);
+        assert_buf_eq(&kvs1.values[i], &kvs2.values[i]);
+    }
+    count = kvs1.count;
+    free_btree_kvs(&kvs1);
+    free_btree_kvs(&kvs2);
+
+    return count;
+}
+
+
+void test_view_group_build(void)
+{
+    char seq_path[64], par_path[64];
+    index_header_t *seq, *par;
+    int i;
+
+    fprintf(stderr, "Testing building a view group's B-trees at once\n");
+
+    sprintf(seq_path, GROUP_DST_FILE_PATH, 1);
+    sprintf(par_path, GROUP_DST_FILE_PATH, GROUP_NUM_VIEWS + 1);
+    seq = build_group(seq_path, GROUP_NUM_DOCS, 1);
+    par = build_group(par_path, GROUP_NUM_DOCS, GROUP_NUM_VIEWS + 1);
+
+    assert_eq(check_same_btree(seq_path, seq->id_btree_state,
+                               par_path, par->id_btree_state),
+              GROUP_NUM_DOCS);
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        assert_eq(check_same_btree(seq_path, seq->view_states[i],
+                                   par_path, par->view_states[i]),
+                  GROUP_NUM_DOCS * (i + 1));
+    }
+
+    free_index_header(seq);
+    free_index_header(par);
+    remove(seq_path);
+    remove(par_path);
+}
+
+
+/* Inserts new documents, removes some of the old ones and writes the update
+ * records of them to the records files */
+static void write_update_records(void)
+{
+    write_records_files("wb", GROUP_NUM_DOCS, GROUP_NUM_DOCS * 4 / 3 - 1, 1,
+                        ACTION_INSERT);
+    write_records_files("ab", 0, GROUP_NUM_DOCS - 1, 5, ACTION_REMOVE);
+}
+
+
+void test_view_group_update(void)
+{
+    char seq_path[64], par_path[64];
+    index_header_t *seq, *par, *seq_updated, *par_updated;
+    view_group_update_stats_t seq_stats, par_stats;
+    int num_inserted = GROUP_NUM_DOCS / 3;
+    int num_removed = GROUP_NUM_DOCS / 5;
+    int i;
+
+    fprintf(stderr, "Testing updating a view group's B-trees at once\n");
+
+    sprintf(seq_path, GROUP_DST_FILE_PATH, 1);
+    sprintf(par_path, GROUP_DST_FILE_PATH, GROUP_NUM_VIEWS + 1);
+    seq = build_group(seq_path, GROUP_NUM_DOCS, 1);
+    par = build_group(par_path, GROUP_NUM_DOCS, 1);
+
+    write_update_records();
+    seq_updated = update_group(seq_path, seq, 1, &seq_stats);
+    write_update_records();
+    par_updated = update_group(par_path, par, GROUP_NUM_VIEWS + 1,
+                               &par_stats);
+
+    /* Every B-tree's counts add up to the same totals */
+    assert_eq(seq_stats.ids_inserted, num_inserted);
+    assert_eq(seq_stats.ids_removed, num_removed);
+    assert_eq(seq_stats.kvs_inserted, num_inserted * 6);
+    assert_eq(seq_stats.kvs_removed, num_removed * 6);
+    assert(seq_stats.purged > 0);
+    assert_eq(par_stats.ids_inserted, seq_stats.ids_inserted);
+    assert_eq(par_stats.ids_removed, seq_stats.ids_removed);
+    assert_eq(par_stats.kvs_inserted, seq_stats.kvs_inserted);
+    assert_eq(par_stats.kvs_removed, seq_stats.kvs_removed);
+    assert_eq(par_stats.purged, seq_stats.purged);
+
+    assert(memcmp(&seq_updated->cleanup_bitmask, &par_updated->cleanup_bitmask,
+                  sizeof(bitmap_t)) == 0);
+    assert(check_same_btree(seq_path, seq_updated->id_btree_state,
+                            par_path, par_updated->id_btree_state) <
+           GROUP_NUM_DOCS + num_inserted - num_removed);
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        assert(check_same_btree(seq_path, seq_updated->view_states[i],
+                                par_path, par_updated->view_states[i]) <
+               (GROUP_NUM_DOCS + num_inserted - num_removed) * (i + 1));
+    }
+
+    free_index_header(seq);
+    free_index_header(par);
+    free_index_header(seq_updated);
+    free_index_header(par_updated);
+    remove(GROUP_IDS_FILE_PATH);
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        remove(kvs_file_path(i));
+    }
+    remove(seq_path);
+    remove(par_path);
+}
+
+
+/* Spatial view i has i + 1 dimensions */
+static view_group_info_t *make_spatial_group_info(const char *path,
+                                                  uint64_t pos,
+                                                  view_spatial_load_t load)
+{
+    view_group_info_t *info = calloc(1, sizeof(*info));
+    int i, d;
+
+    assert(info != NULL);
+    info->filepath = strdup(path);
+    info->header_pos = pos;
+    info->num_btrees = GROUP_NUM_VIEWS;
+    info->type = VIEW_INDEX_TYPE_SPATIAL;
+    info->view_infos.spatial = calloc(GROUP_NUM_VIEWS,
+                                      sizeof(view_spatial_info_t));
+    assert(info->view_infos.spatial != NULL);
+
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        view_spatial_info_t *si = &info->view_infos.spatial[i];
+
+        si->dimension = (uint16_t) (i + 1);
+        si->mbb = calloc(si->dimension * 2, sizeof(double));
+        assert(si->mbb != NULL);
+        for (d = 0; d < si->dimension; ++d) {
+            si->mbb[d * 2 + 1] = GROUP_SPATIAL_MAX;
+        }
+        si->load = load;
+    }
+
+    return info;
+}
+
+
+/* Writes the records files of spatial views, with random MBBs that are
+ * the same for every call */
+static void write_spatial_records_files(void)
+{
+    view_file_merge_ctx_t ctx;
+    char key_buf[2 + GROUP_NUM_VIEWS * 2 * sizeof(double)];
+    char value_buf[2 + 16];
+    double mbb[GROUP_NUM_VIEWS * 2];
+    sized_mbb_t mbb_struct;
+    sized_buf k, v;
+    uint32_t seed = 42;
+    raw_16 partition;
+    FILE *f;
+    int i, d, n;
+
+    /* The id records are the same as for a mapreduce view group */
+    write_records_files("wb", 0, GROUP_NUM_DOCS - 1, 1, 0);
+
+    ctx.type = INITIAL_BUILD_SPATIAL_RECORD;
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        f = fopen(kvs_file_path(i), "wb");
+        assert(f != NULL);
+        for (n = 0; n < GROUP_NUM_DOCS; ++n) {
+            for (d = 0; d <= i; ++d) {
+                seed = seed * 1103515245 + 12345;
+                mbb[d * 2] = (seed >> 8) % 100000 / 100.0;
+                mbb[d * 2 + 1] = mbb[d * 2] + (n % 5);
+            }
+            mbb_struct.mbb = mbb;
+            mbb_struct.num = (uint16_t) ((i + 1) * 2);
+            k.buf = key_buf;
+            k.size = 2 + mbb_struct.num * sizeof(double);
+            encode_spatial_key(&mbb_struct, key_buf, k.size - 2);
+
+            partition = encode_raw16((uint16_t) (n % GROUP_NUM_PARTITIONS));
+            memcpy(value_buf, &partition, 2);
+            v.buf = value_buf;
+            v.size = 2 + sprintf(value_buf + 2, "doc_%05d", n);
+            write_record(f, &k, &v, 0, &ctx);
+        }
+        fclose(f);
+    }
+}
+
+
+/* Builds the spatial view group of the records files into path, loading
+ * the records into the r-trees the given way */
+static index_header_t *build_spatial_group(const char *path,
+                                           view_spatial_load_t load)
+{
+    const char *kvs_files[GROUP_NUM_VIEWS];
+    view_group_info_t *info;
+    index_header_t *header = NULL;
+    view_error_t error_info;
+    uint64_t pos;
+    int i;
+
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        kvs_files[i] = kvs_file_path(i);
+    }
+    write_spatial_records_files();
+    info = make_spatial_group_info(GROUP_FILE_PATH,
+                                   write_empty_group(GROUP_FILE_PATH), load);
+
+    remove(path);
+    assert(couchstore_build_view_group(info, GROUP_IDS_FILE_PATH, kvs_files,
+                                       path, ".", &pos, &error_info) ==
+           COUCHSTORE_SUCCESS);
+    couchstore_free_view_group_info(info);
+
+    info = make_spatial_group_info(path, pos, load);
+    assert(tree_file_open(&info->file, path, O_RDONLY,
+                          couchstore_get_default_file_ops()) ==
+           COUCHSTORE_SUCCESS);
+    assert(read_view_group_header(info, &header) == COUCHSTORE_SUCCESS);
+    couchstore_free_view_group_info(info);
+    remove(GROUP_FILE_PATH);
+
+    return header;
+}
+
+
+/* The leaf nodes of an r-tree, as a fold comes across them */
+typedef struct {
+    btree_kvs_t kvs;
+    /* The MBB of the node the fold went into last, until its first KV or
+     * node shows whether it's a leaf */
+    sized_buf   pending;
+    int         num_leaves;
+    int         leaf_items;
+    int         max_leaf_items;
+    /* Sum over the leaves of the edge lengths of their MBBs */
+    double      margin;
+} rtree_leaves_t;
+
+
+static couchstore_error_t fold_rtree_node(couchfile_lookup_request *rq,
+                                          uint64_t subtree_size,
+                                          const sized_buf *reduce_value)
+{
+    rtree_leaves_t *leaves = (rtree_leaves_t *) rq->callback_ctx;
+    (void) subtree_size;
+
+    leaves->leaf_items = 0;
+    leaves->pending.buf = NULL;
+    if (reduce_value != NULL) {
+        leaves->pending = *reduce_value;
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+static couchstore_error_t fold_rtree_kv(couchfile_lookup_request *rq,
+                                        const sized_buf *k,
+                                        const sized_buf *v)
+{
+    rtree_leaves_t *leaves = (rtree_leaves_t *) rq->callback_ctx;
+    sized_mbb_t mbb;
+    int d;
+
+    if (leaves->pending.buf != NULL) {
+        assert(decode_spatial_key(leaves->pending.buf, &mbb) ==
+               COUCHSTORE_SUCCESS);
+        for (d = 0; d < mbb.num; d += 2) {
+            leaves->margin += mbb.mbb[d + 1] - mbb.mbb[d];
+        }
+        leaves->num_leaves++;
+        leaves->pending.buf = NULL;
+    }
+    leaves->leaf_items++;
+    if (leaves->leaf_items > leaves->max_leaf_items) {
+        leaves->max_leaf_items = leaves->leaf_items;
+    }
+
+    rq->callback_ctx = &leaves->kvs;
+    fold_kv(rq, k, v);
+    rq->callback_ctx = leaves;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+static void read_rtree(const char *path, const node_pointer *root,
+                       rtree_leaves_t *leaves)
+{
+    couchfile_lookup_request rq;
+    tree_file file;
+    sized_buf k = { NULL, 0 };
+    sized_buf *keys = &k;
+
+    memset(leaves, 0, sizeof(*leaves));
+    assert(root != NULL);
+    assert(tree_file_open(&file, path, O_RDONLY,
+                          couchstore_get_default_file_ops()) ==
+           COUCHSTORE_SUCCESS);
+    rq.cmp.compare = fold_cmp;
+    rq.file = &file;
+    rq.num_keys = 1;
+    rq.keys = &keys;
+    rq.callback_ctx = leaves;
+    rq.fetch_callback = fold_rtree_kv;
+    rq.node_callback = fold_rtree_node;
+    rq.fold = 1;
+    assert(btree_lookup(&rq, root->pointer) == COUCHSTORE_SUCCESS);
+    tree_file_close(&file);
+}
+
+
+/* Orders the KVs of an r-tree by their values, which are unique */
+static int cmp_kv_values(const void *a, const void *b)
+{
+    const sized_buf *v1 = ((const sized_buf *) a) + 1;
+    const sized_buf *v2 = ((const sized_buf *) b) + 1;
+
+    assert(v1->size == v2->size);
+    return memcmp(v1->buf, v2->buf, v1->size);
+}
+
+
+/* Returns the KVs of an r-tree as key/value pairs, ordered by value */
+static sized_buf *sorted_rtree_kvs(const btree_kvs_t *kvs)
+{
+    sized_buf *pairs = malloc(kvs->count * 2 * sizeof(sized_buf));
+    int i;
+
+    assert(pairs != NULL);
+    for (i = 0; i < kvs->count; ++i) {
+        pairs[i * 2] = kvs->keys[i];
+        pairs[i * 2 + 1] = kvs->values[i];
+    }
+    qsort(pairs, kvs->count, 2 * sizeof(sized_buf), cmp_kv_values);
+
+    return pairs;
+}
+
+
+void test_view_group_build_spatial(void)
+{
+    char str_path[64], zorder_path[64];
+    index_header_t *str, *zorder;
+    rtree_leaves_t str_leaves, zorder_leaves;
+    sized_buf *str_kvs, *zorder_kvs;
+    int i, j;
+
+    fprintf(stderr, "Testing building a spatial view group\n");
+
+    sprintf(str_path, GROUP_DST_FILE_PATH, 1);
+    sprintf(zorder_path, GROUP_DST_FILE_PATH, 2);
+    str = build_spatial_group(str_path, VIEW_SPATIAL_LOAD_STR);
+    zorder = build_spatial_group(zorder_path, VIEW_SPATIAL_LOAD_ZORDER);
+
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        /* Both r-trees enclose the same records */
+        assert_buf_eq(&str->view_states[i]->reduce_value,
+                      &zorder->view_states[i]->reduce_value);
+
+        read_rtree(str_path, str->view_states[i], &str_leaves);
+        read_rtree(zorder_path, zorder->view_states[i], &zorder_leaves);
+        assert_eq(str_leaves.kvs.count, GROUP_NUM_DOCS);
+        assert_eq(zorder_leaves.kvs.count, GROUP_NUM_DOCS);
+        str_kvs = sorted_rtree_kvs(&str_leaves.kvs);
+        zorder_kvs = sorted_rtree_kvs(&zorder_leaves.kvs);
+        for (j = 0; j < GROUP_NUM_DOCS * 2; ++j) {
+            assert_buf_eq(&str_kvs[j], &zorder_kvs[j]);
+        }
+
+        /* Every STR tile is a leaf of its own, none of them bigger than
+         * the leaves of the Z-order build. In one dimension both are just
+         * sorted by the center. */
+        assert(str_leaves.num_leaves > 1);
+        assert(str_leaves.max_leaf_items <= zorder_leaves.max_leaf_items);
+        assert(i == 0 || str_leaves.margin < zorder_leaves.margin);
+
+        free(str_kvs);
+        free(zorder_kvs);
+        free_btree_kvs(&str_leaves.kvs);
+        free_btree_kvs(&zorder_leaves.kvs);
+    }
+
+    free_index_header(str);
+    free_index_header(zorder);
+    remove(GROUP_IDS_FILE_PATH);
+    for (i = 0; i < GROUP_NUM_VIEWS; ++i) {
+        remove(kvs_file_path(i));
+    }
+    remove(str_path);
+    remove(zorder_path);
+}
@@ -46,5 +46,9 @@ void test_keys(void);
 void test_values(void);
 void reducer_tests(void);
 void cleanup_tests(void);
+void test_view_kvs_sorting(void);
+void test_view_group_build(void);
+void test_view_group_update(void);
+void test_view_group_build_spatial(void);
 
 #endif